@@ -1,7 +1,12 @@
 #include <gflags/gflags.h>
 
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 
+#include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/core/vecmath/Vector2i.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/camera_wrappers/PoseStream.h"
@@ -9,11 +14,14 @@
 #include "src/rgbd_camera_parameters.h"
 #include "src/rgbd_input.h"
 #include "src/input_buffer.h"
+#include "src/perf_collector.h"
+#include "src/thread_pool.h"
 
 #include "src/aruco/aruco_pose_estimator.h"
 #include "src/aruco/cube_fiducial.h"
 #include "src/aruco/single_marker_fiducial.h"
 
+using libcgt::core::arrayutils::copy;
 using libcgt::camera_wrappers::PoseInputStream;
 using libcgt::camera_wrappers::PoseOutputStream;
 using libcgt::camera_wrappers::PoseStreamFormat;
@@ -29,10 +37,87 @@ DEFINE_string(calibration_dir, "",
 
 DEFINE_string(output_file, "", "output .pose file.");
 
+DEFINE_int32(detector_workers, 4, "Number of color frames to detect "
+  "markers in concurrently. With 1, frames are processed one at a time on "
+  "the main thread.");
+
+DEFINE_bool(aruco_roi_tracking, true, "With --detector_workers=1, look for "
+  "markers near where they were in the previous frame first, and only "
+  "search the whole frame if that fails.");
+
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_output, "", "With --collect_perf, write per-stage latency "
+  "percentiles and counters to this file on exit: CSV if it ends in .csv, "
+  "JSON otherwise.");
 
 const char* kArucoDetectorParamsFilename = "../res/detector_params.yaml";
 
+namespace {
+
+// Writes pose estimates to a PoseOutputStream in the order the frames were
+// read, regardless of the order in which they finish. Estimates that arrive
+// early wait in a reorder buffer until every earlier frame has been
+// written.
+class OrderedPoseWriter {
+ public:
+
+  explicit OrderedPoseWriter(PoseOutputStream* output_stream) :
+    output_stream_(output_stream) {
+  }
+
+  // Add the estimate for the sequence_number-th frame read, counting from
+  // 0. Thread safe.
+  void Write(int64_t sequence_number, int frame_index, int64_t timestamp_ns,
+    const ArucoPoseEstimator::Result& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_[sequence_number] = Estimate{ frame_index, timestamp_ns, result };
+    auto itr = pending_.begin();
+    while (itr != pending_.end() && itr->first == num_written_) {
+      const Estimate& estimate = itr->second;
+      if (estimate.result.valid) {
+        auto cfw = inverse(estimate.result.world_from_camera);
+        output_stream_->write(
+          estimate.frame_index,
+          estimate.timestamp_ns,
+          cfw.rotation,
+          cfw.translation
+        );
+      } else {
+        printf("Failed to find pose. idx = %d\n", estimate.frame_index);
+      }
+      itr = pending_.erase(itr);
+      ++num_written_;
+    }
+    written_cv_.notify_all();
+  }
+
+  // Block until fewer than max_in_flight of the first num_submitted frames
+  // are waiting to be written.
+  void WaitForCapacity(int64_t num_submitted, int max_in_flight) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    written_cv_.wait(lock, [&] {
+      return num_submitted - num_written_ < max_in_flight;
+    });
+  }
+
+ private:
+
+  struct Estimate {
+    int frame_index;
+    int64_t timestamp_ns;
+    ArucoPoseEstimator::Result result;
+  };
+
+  PoseOutputStream* output_stream_;
+
+  std::mutex mutex_;
+  std::condition_variable written_cv_;
+  std::map<int64_t, Estimate> pending_;
+  int64_t num_written_ = 0;
+};
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   if (FLAGS_input_file == "") {
@@ -47,6 +132,14 @@ int main(int argc, char* argv[]) {
     printf("output_file is required.\n");
     return 1;
   }
+  if (FLAGS_detector_workers < 1) {
+    printf("detector_workers must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_perf_output != "" && !FLAGS_collect_perf) {
+    printf("perf_output requires collect_perf.\n");
+    return 1;
+  }
 
   // TODO: tweak this so that it can fail.
   RGBDCameraParameters camera_params;
@@ -59,7 +152,8 @@ int main(int argc, char* argv[]) {
 
   bool rgb_updated;
   bool depth_updated;
-  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_file.c_str());
+  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_file.c_str(),
+    camera_params.depth.depth_range);
 
   InputBuffer input_buffer(
     camera_params.color.resolution,
@@ -83,6 +177,21 @@ int main(int argc, char* argv[]) {
 
   PoseOutputStream output_stream(metadata, FLAGS_output_file.c_str());
 
+  OrderedPoseWriter writer(&output_stream);
+
+  // The main thread reads and decodes frames. Each color frame is converted
+  // to grayscale, copied, and handed to a worker. EstimatePose() is const,
+  // so the workers share pose_estimator.
+  std::unique_ptr<ThreadPool> workers;
+  if (FLAGS_detector_workers > 1) {
+    workers.reset(new ThreadPool(FLAGS_detector_workers));
+  }
+  // Bound the number of frames in memory: a few per worker.
+  const int max_in_flight = 2 * FLAGS_detector_workers;
+  int64_t num_submitted = 0;
+  // The previous frame's estimate, for tracking on the main thread.
+  ArucoPoseEstimator::Result previous;
+
   // Read initial frame.
   rgbd_input.read(&input_buffer, &rgb_updated, &depth_updated);
   while (rgb_updated || depth_updated) {
@@ -90,21 +199,42 @@ int main(int argc, char* argv[]) {
       printf("Processing frame. idx = %d, timestamp = %lld\n",
         input_buffer.color_frame_index,
         input_buffer.color_timestamp_ns);
-      auto result = pose_estimator.EstimatePose(input_buffer.color_bgr_ydown);
-      if (result.valid) {
-        auto cfw = inverse(result.world_from_camera);
-        output_stream.write(
-          input_buffer.color_frame_index,
-          input_buffer.color_timestamp_ns,
-          cfw.rotation,
-          cfw.translation
-        );
+      int64_t sequence_number = num_submitted++;
+      int frame_index = input_buffer.color_frame_index;
+      int64_t timestamp_ns = input_buffer.color_timestamp_ns;
+      if (workers == nullptr) {
+        previous = FLAGS_aruco_roi_tracking ?
+          pose_estimator.TrackPose(input_buffer.ColorGrayYDown(), previous) :
+          pose_estimator.EstimatePose(input_buffer.ColorGrayYDown());
+        writer.Write(sequence_number, frame_index, timestamp_ns, previous);
       } else {
-        printf("Failed to find pose.\n");
+        writer.WaitForCapacity(sequence_number, max_in_flight);
+        // std::function must be copyable, so share the frame. Only the
+        // grayscale image is needed, a third the size of the color one.
+        Array2DReadView<uint8_t> gray_view = input_buffer.ColorGrayYDown();
+        std::shared_ptr<Array2D<uint8_t>> gray =
+          std::make_shared<Array2D<uint8_t>>(gray_view.size());
+        copy(gray_view, gray->writeView());
+        workers->Enqueue([&pose_estimator, &writer, sequence_number,
+          frame_index, timestamp_ns, gray] {
+          writer.Write(sequence_number, frame_index, timestamp_ns,
+            pose_estimator.EstimatePose(gray->readView()));
+        });
       }
     }
 
     // Read next frame.
     rgbd_input.read(&input_buffer, &rgb_updated, &depth_updated);
   }
+  if (workers != nullptr) {
+    workers->Wait();
+  }
+
+  if (FLAGS_collect_perf) {
+    PerfCollector::Instance().Print();
+    if (FLAGS_perf_output != "" &&
+      !PerfCollector::Instance().Write(FLAGS_perf_output)) {
+      return 1;
+    }
+  }
 }
@@ -13,18 +13,17 @@
 // limitations under the License.
 #include "aruco_pose_estimator.h"
 
-#include <chrono>
-
-#include <gflags/gflags.h>
+#include <algorithm>
 
 #include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
 
 #include "libcgt/core/common/ArrayUtils.h"
-#include "libcgt/core/time/TimeUtils.h"
 #include "libcgt/opencv_interop/ArrayUtils.h"
 #include "libcgt/opencv_interop/VecmathUtils.h"
 #include "libcgt/opencv_interop/Calib3d.h"
 
+#include "src/perf_collector.h"
 #include "src/rgbd_camera_parameters.h"
 
 using libcgt::core::arrayutils::copy;
@@ -35,7 +34,23 @@ using libcgt::opencv_interop::cvMatAsArray2DView;
 using libcgt::opencv_interop::fromCV3x3;
 using libcgt::opencv_interop::makeCameraMatrix;
 
-DECLARE_bool(collect_perf);
+namespace {
+
+// The region of interest around the predicted fiducial is padded by this
+// fraction of its larger side, and at least kMinROIPaddingPixels, to allow
+// for motion between frames.
+constexpr float kROIPaddingFraction = 0.5f;
+constexpr int kMinROIPaddingPixels = 16;
+
+// Regions covering more than this fraction of the image are not worth
+// tracking: detect in the full image instead.
+constexpr float kMaxROIAreaFraction = 0.5f;
+
+// Regions whose smaller side is at least this many pixels are searched at
+// half resolution first.
+constexpr int kMinDownscaledROISize = 160;
+
+}  // namespace
 
 bool ReadDetectorParameters(const std::string& filename,
   cv::aruco::DetectorParameters& params) {
@@ -98,33 +113,68 @@ ArucoPoseEstimator::ArucoPoseEstimator(const cv::aruco::Board& fiducial,
 ArucoPoseEstimator::Result ArucoPoseEstimator::EstimatePose(
   Array2DReadView<uint8x3> input,
   Array2DWriteView<uint8x3> vis) const {
+  ArucoPoseEstimator::Detection detection;
+  ArucoPoseEstimator::Result result = DetectAndEstimatePose(
+    array2DViewAsCvMat(input), nullptr, &detection);
+  Visualize(input, detection, result, vis);
+  return result;
+}
 
-  std::chrono::high_resolution_clock::time_point t0;
-  std::chrono::high_resolution_clock::time_point t1;
+ArucoPoseEstimator::Result ArucoPoseEstimator::TrackPose(
+  Array2DReadView<uint8x3> input, const Result& previous,
+  Array2DWriteView<uint8x3> vis) const {
+  ArucoPoseEstimator::Detection detection;
+  ArucoPoseEstimator::Result result = DetectAndEstimatePose(
+    array2DViewAsCvMat(input), &previous, &detection);
+  Visualize(input, detection, result, vis);
+  return result;
+}
 
-  if (FLAGS_collect_perf) {
-    t0 = std::chrono::high_resolution_clock::now();
-  }
+ArucoPoseEstimator::Result ArucoPoseEstimator::EstimatePose(
+  Array2DReadView<uint8_t> input) const {
+  ArucoPoseEstimator::Detection detection;
+  return DetectAndEstimatePose(array2DViewAsCvMat(input), nullptr,
+    &detection);
+}
 
-  cv::Mat bgr_mat = array2DViewAsCvMat(input);
-  ArucoPoseEstimator::Detection detection = Detect(bgr_mat);
-  Refine(bgr_mat, &detection);
-  ArucoPoseEstimator::Result result = EstimatePose(detection);
+ArucoPoseEstimator::Result ArucoPoseEstimator::TrackPose(
+  Array2DReadView<uint8_t> input, const Result& previous) const {
+  ArucoPoseEstimator::Detection detection;
+  return DetectAndEstimatePose(array2DViewAsCvMat(input), &previous,
+    &detection);
+}
 
-  if (FLAGS_collect_perf) {
-    t1 = std::chrono::high_resolution_clock::now();
-    printf("ArUco: pose estimation took %lld ms\n",
-      libcgt::core::time::dtMS(t0, t1));
+ArucoPoseEstimator::Result ArucoPoseEstimator::DetectAndEstimatePose(
+  cv::Mat image, const Result* previous,
+  ArucoPoseEstimator::Detection* detection) const {
+  if (previous == nullptr) {
+    ScopedPerfTimer timer("ArucoPoseEstimator::EstimatePose");
+    *detection = Detect(image);
+    Refine(image, detection);
+    return EstimatePose(*detection);
   }
 
-  if (vis.notNull()) {
-    if (copy(input, vis)) {
-      //VisualizeDetections(detection, true, vis);
-      VisualizeDetections(detection, false, vis);
-      VisualizePoseEstimate(result, vis);
-    }
+  ScopedPerfTimer timer("ArucoPoseEstimator::TrackPose");
+  ArucoPoseEstimator::Result result;
+  cv::Rect roi;
+  bool tracked = previous->valid &&
+    PredictROI(*previous, image.size(), &roi) &&
+    DetectInROI(image, roi, detection);
+  if (tracked) {
+    Refine(image, detection);
+    result = EstimatePose(*detection);
+    tracked = result.valid;
+  }
+  if (!tracked) {
+    *detection = Detect(image);
+    Refine(image, detection);
+    result = EstimatePose(*detection);
   }
 
+  if (PerfCollector::Enabled()) {
+    PerfCollector::Instance().AddCount(tracked ?
+      "aruco_roi_detections" : "aruco_full_image_detections", 1);
+  }
   return result;
 }
 
@@ -136,6 +186,90 @@ ArucoPoseEstimator::Detect(cv::Mat image) const {
   return result;
 }
 
+bool ArucoPoseEstimator::PredictROI(const Result& previous,
+  cv::Size image_size, cv::Rect* roi) const {
+  // camera_from_board is in CV conventions: z points into the screen.
+  if (previous.camera_from_board_translation(2) <= 0) {
+    return false;
+  }
+
+  std::vector<cv::Point3f> board_points;
+  for (const auto& marker_points : board_.objPoints) {
+    board_points.insert(board_points.end(),
+      marker_points.begin(), marker_points.end());
+  }
+  std::vector<cv::Point2f> image_points;
+  cv::projectPoints(board_points, previous.camera_from_board_rotation,
+    previous.camera_from_board_translation, camera_intrinsics_,
+    camera_dist_coeffs_, image_points);
+
+  cv::Rect bounds = cv::boundingRect(image_points);
+  int padding = std::max(kMinROIPaddingPixels, static_cast<int>(
+    kROIPaddingFraction * std::max(bounds.width, bounds.height)));
+  cv::Rect padded(bounds.x - padding, bounds.y - padding,
+    bounds.width + 2 * padding, bounds.height + 2 * padding);
+  *roi = padded & cv::Rect(cv::Point(0, 0), image_size);
+
+  return roi->area() > 0 &&
+    roi->area() < kMaxROIAreaFraction * image_size.area();
+}
+
+bool ArucoPoseEstimator::DetectInROI(cv::Mat image, const cv::Rect& roi,
+  ArucoPoseEstimator::Detection* detection) const {
+  cv::Mat roi_image = image(roi);
+
+  // Markers large enough to fill a big region are still detectable at half
+  // resolution, at a quarter of the cost.
+  bool downscaled = false;
+  if (std::min(roi.width, roi.height) >= kMinDownscaledROISize) {
+    cv::Mat half;
+    cv::resize(roi_image, half, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+    *detection = Detect(half);
+    downscaled = !detection->ids.empty();
+  }
+  if (!downscaled) {
+    *detection = Detect(roi_image);
+    if (detection->ids.empty()) {
+      return false;
+    }
+  }
+
+  if (downscaled) {
+    // Pixel centers: x_full + 0.5 = 2 * (x_half + 0.5).
+    for (auto* candidates : { &detection->corners, &detection->rejected }) {
+      for (auto& quad : *candidates) {
+        for (cv::Point2f& p : quad) {
+          p = 2.0f * p + cv::Point2f(0.5f, 0.5f);
+        }
+      }
+    }
+
+    cv::Mat gray = roi_image;
+    if (roi_image.channels() == 3) {
+      cv::cvtColor(roi_image, gray, cv::COLOR_BGR2GRAY);
+    }
+    int window = detector_params_.cornerRefinementWinSize;
+    cv::TermCriteria criteria(
+      cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS,
+      detector_params_.cornerRefinementMaxIterations,
+      detector_params_.cornerRefinementMinAccuracy);
+    for (auto& quad : detection->corners) {
+      cv::cornerSubPix(gray, quad, cv::Size(window, window),
+        cv::Size(-1, -1), criteria);
+    }
+  }
+
+  cv::Point2f offset(static_cast<float>(roi.x), static_cast<float>(roi.y));
+  for (auto* candidates : { &detection->corners, &detection->rejected }) {
+    for (auto& quad : *candidates) {
+      for (cv::Point2f& p : quad) {
+        p += offset;
+      }
+    }
+  }
+  return true;
+}
+
 void ArucoPoseEstimator::Refine(cv::Mat image,
   ArucoPoseEstimator::Detection* result) const {
     cv::aruco::refineDetectedMarkers(image, board_,
@@ -212,3 +346,16 @@ void ArucoPoseEstimator::VisualizePoseEstimate(
       axis_length_meters_);
   }
 }
+
+void ArucoPoseEstimator::Visualize(Array2DReadView<uint8x3> input,
+  const ArucoPoseEstimator::Detection& detection,
+  const ArucoPoseEstimator::Result& pose_estimate,
+  Array2DWriteView<uint8x3> vis) const {
+  if (vis.notNull()) {
+    if (copy(input, vis)) {
+      //VisualizeDetections(detection, true, vis);
+      VisualizeDetections(detection, false, vis);
+      VisualizePoseEstimate(pose_estimate, vis);
+    }
+  }
+}
@@ -76,6 +76,22 @@ class ArucoPoseEstimator {
   Result EstimatePose(Array2DReadView<uint8x3> input,
     Array2DWriteView<uint8x3> vis = Array2DWriteView<uint8x3>()) const;
 
+  // Same as EstimatePose(), but if previous is valid, first looks for the
+  // markers only in a padded region of interest around where previous
+  // projects the fiducial. If the region is large, it is searched at half
+  // resolution and the corners are refined at full resolution. Falls back
+  // to the full image if no pose is found there.
+  //
+  // Pass the result of the previous frame as previous.
+  Result TrackPose(Array2DReadView<uint8x3> input, const Result& previous,
+    Array2DWriteView<uint8x3> vis = Array2DWriteView<uint8x3>()) const;
+
+  // Same as above, but on a grayscale (y-down) input, which is what the
+  // detector thresholds anyway. No visualization.
+  Result EstimatePose(Array2DReadView<uint8_t> input) const;
+  Result TrackPose(Array2DReadView<uint8_t> input,
+    const Result& previous) const;
+
 private:
 
   struct Detection {
@@ -86,6 +102,23 @@ private:
 
   Detection Detect(cv::Mat image) const;
 
+  // Detect, refine, and estimate the pose in image, which may be BGR or
+  // grayscale. If previous is not null, track as in TrackPose().
+  Result DetectAndEstimatePose(cv::Mat image, const Result* previous,
+    Detection* detection) const;
+
+  // The bounding box of the fiducial's markers projected with previous,
+  // padded and clipped to the image. Returns false if the fiducial is
+  // behind the camera or the region covers most of the image.
+  bool PredictROI(const Result& previous, cv::Size image_size,
+    cv::Rect* roi) const;
+
+  // Detect markers within roi of image, which may be BGR or grayscale.
+  // Corners are in image coordinates.
+  // Returns false if none are found.
+  bool DetectInROI(cv::Mat image, const cv::Rect& roi,
+    Detection* detection) const;
+
   // Refine the markers returned by Detect().
   // image must be the same as the one used in Detect().
   // detection is modified in place.
@@ -112,6 +145,11 @@ private:
 
   void VisualizePoseEstimate(const Result& pose_estimate,
     Array2DWriteView<uint8x3> output) const;
+
+  // If vis is not null, copy input into it and draw detection and
+  // pose_estimate on top.
+  void Visualize(Array2DReadView<uint8x3> input, const Detection& detection,
+    const Result& pose_estimate, Array2DWriteView<uint8x3> vis) const;
 };
 
 bool ReadDetectorParameters(const std::string& filename,
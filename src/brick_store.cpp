@@ -0,0 +1,473 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "brick_store.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+#include <third_party/pystring/pystring.h>
+
+#include "perf_collector.h"
+
+namespace {
+  constexpr int kKeyBits = 21;
+  constexpr uint64_t kKeyMask = (uint64_t(1) << kKeyBits) - 1;
+
+  // The data file is a header followed by records. Each record is the brick
+  // subscript as 3 int32s, then kBrickVolume voxels.
+  //
+  // Header: 'bricks', int32 version, int32 distance bits, int32 weight bits.
+  constexpr char kDataFilename[] = "bricks.dat";
+  constexpr int32_t kBricksVersion = 1;
+
+  constexpr size_t kBrickBytes = BrickStore::kBrickVolume * sizeof(TSDF);
+  constexpr size_t kRecordBytes = 3 * sizeof(int32_t) + kBrickBytes;
+
+  // Compact the data file once superseded copies outnumber live bricks, but
+  // not before there are this many of them.
+  constexpr int64_t kMinDeadRecordsToCompact = 4096;
+
+  // Sign-extend the low kKeyBits of x.
+  int SignExtend(uint64_t x) {
+    const uint64_t kSignBit = uint64_t(1) << (kKeyBits - 1);
+    uint64_t v = x & kKeyMask;
+    return static_cast<int>(static_cast<int64_t>((v ^ kSignBit) - kSignBit));
+  }
+
+  template <typename T>
+  void WriteValue(std::fstream& file, const T& value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void WriteHeader(std::fstream& file) {
+    file.write("bricks", 6);
+    WriteValue<int32_t>(file, kBricksVersion);
+    WriteValue<int32_t>(file, 8 * sizeof(TSDF::DistanceType));
+    WriteValue<int32_t>(file, 8 * sizeof(TSDF::WeightType));
+  }
+}
+
+BrickStore::BrickStore(const std::string& directory,
+  size_t cache_budget_bytes) :
+  directory_(directory),
+  cache_budget_bricks_(std::max(cache_budget_bytes / kBrickBytes,
+    size_t(1))) {
+  {
+    std::lock_guard<std::mutex> file_lock(file_mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_valid_ = Truncate();
+  }
+  prefetch_thread_ = std::thread(&BrickStore::PrefetchLoop, this);
+}
+
+BrickStore::~BrickStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  prefetch_cv_.notify_one();
+  prefetch_thread_.join();
+}
+
+const std::string& BrickStore::Directory() const {
+  return directory_;
+}
+
+bool BrickStore::IsValid() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_valid_;
+}
+
+int BrickStore::NumBricks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(index_.size());
+}
+
+std::vector<Vector3i> BrickStore::Bricks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Vector3i> bricks;
+  bricks.reserve(index_.size());
+  for (const auto& entry : index_) {
+    bricks.push_back(Unkey(entry.first));
+  }
+  return bricks;
+}
+
+bool BrickStore::Contains(const Vector3i& brick) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_.find(Key(brick)) != index_.end();
+}
+
+bool BrickStore::Write(const Vector3i& brick, const TSDF* voxels) {
+  const uint64_t key = Key(brick);
+  const uint64_t hash = Hash(voxels);
+
+  // Writes are serialized by file_mutex_, so index_ cannot change under us
+  // while mutex_ is released.
+  std::lock_guard<std::mutex> file_lock(file_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_valid_) {
+      return false;
+    }
+    auto index_itr = index_.find(key);
+    if (index_itr != index_.end() && index_itr->second.hash == hash) {
+      // Unchanged since it was stored: keep the existing copy.
+      InsertIntoCache(key, voxels);
+      if (PerfCollector::Enabled()) {
+        PerfCollector::Instance().AddCount("bricks_unchanged", 1);
+      }
+      return true;
+    }
+  }
+
+  file_.seekp(0, std::ios::end);
+  int64_t offset = static_cast<int64_t>(file_.tellp());
+  WriteValue<int32_t>(file_, brick.x);
+  WriteValue<int32_t>(file_, brick.y);
+  WriteValue<int32_t>(file_, brick.z);
+  file_.write(reinterpret_cast<const char*>(voxels), kBrickBytes);
+  if (!file_) {
+    fprintf(stderr, "Failed to write brick to %s.\n", directory_.c_str());
+    file_.clear();
+    return false;
+  }
+
+  bool compact;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto result = index_.emplace(key, IndexEntry{ offset, hash });
+    if (!result.second) {
+      result.first->second = IndexEntry{ offset, hash };
+      ++num_dead_records_;
+    }
+    InsertIntoCache(key, voxels);
+    compact = num_dead_records_ >= kMinDeadRecordsToCompact &&
+      num_dead_records_ > static_cast<int64_t>(index_.size());
+  }
+
+  // The brick is already written: a failed compaction leaves the old file
+  // in place.
+  if (compact) {
+    Compact();
+  }
+  return true;
+}
+
+bool BrickStore::Read(const Vector3i& brick, TSDF* voxels) {
+  const uint64_t key = Key(brick);
+  bool missed = false;
+  while (true) {
+    int64_t offset;
+    int64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto index_itr = index_.find(key);
+      if (index_itr == index_.end()) {
+        return false;
+      }
+
+      auto cache_itr = cache_.find(key);
+      if (cache_itr != cache_.end()) {
+        CacheEntry* entry = &(cache_itr->second);
+        lru_.splice(lru_.begin(), lru_, entry->lru_position);
+        std::copy(entry->voxels.begin(), entry->voxels.end(), voxels);
+        if (!missed) {
+          ++num_cache_hits_;
+          if (PerfCollector::Enabled()) {
+            PerfCollector::Instance().AddCount("brick_cache_hits", 1);
+          }
+        }
+        return true;
+      }
+
+      if (!missed) {
+        missed = true;
+        ++num_cache_misses_;
+        if (PerfCollector::Enabled()) {
+          PerfCollector::Instance().AddCount("brick_cache_misses", 1);
+        }
+      }
+      offset = index_itr->second.offset;
+      generation = file_generation_;
+    }
+
+    {
+      std::lock_guard<std::mutex> file_lock(file_mutex_);
+      if (generation != file_generation_) {
+        // Compacted in between: look up the new offset.
+        continue;
+      }
+      if (!ReadRecord(offset, voxels)) {
+        return false;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto index_itr = index_.find(key);
+    if (index_itr == index_.end()) {
+      return false;
+    }
+    if (index_itr->second.offset == offset &&
+      generation == file_generation_) {
+      InsertIntoCache(key, voxels);
+      return true;
+    }
+    // Rewritten in between: the new copy is cached.
+  }
+}
+
+void BrickStore::Prefetch(const std::vector<Vector3i>& bricks) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prefetch_queue_.clear();
+    for (const Vector3i& brick : bricks) {
+      uint64_t key = Key(brick);
+      if (index_.find(key) != index_.end() &&
+        cache_.find(key) == cache_.end()) {
+        prefetch_queue_.push_back(key);
+      }
+    }
+    // Service the bricks in the order given.
+    std::reverse(prefetch_queue_.begin(), prefetch_queue_.end());
+  }
+  prefetch_cv_.notify_one();
+}
+
+void BrickStore::Clear() {
+  std::lock_guard<std::mutex> file_lock(file_mutex_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  index_.clear();
+  num_dead_records_ = 0;
+  lru_.clear();
+  cache_.clear();
+  prefetch_queue_.clear();
+  num_cache_hits_ = 0;
+  num_cache_misses_ = 0;
+  num_prefetched_ = 0;
+  is_valid_ = Truncate();
+}
+
+int64_t BrickStore::NumCacheHits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_cache_hits_;
+}
+
+int64_t BrickStore::NumCacheMisses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_cache_misses_;
+}
+
+int64_t BrickStore::NumPrefetched() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_prefetched_;
+}
+
+int64_t BrickStore::NumDeadRecords() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_dead_records_;
+}
+
+// static
+uint64_t BrickStore::Key(const Vector3i& brick) {
+  return ((static_cast<uint64_t>(brick.x) & kKeyMask) << (2 * kKeyBits)) |
+    ((static_cast<uint64_t>(brick.y) & kKeyMask) << kKeyBits) |
+    (static_cast<uint64_t>(brick.z) & kKeyMask);
+}
+
+// static
+Vector3i BrickStore::Unkey(uint64_t key) {
+  return{ SignExtend(key >> (2 * kKeyBits)),
+    SignExtend(key >> kKeyBits),
+    SignExtend(key) };
+}
+
+// static
+uint64_t BrickStore::Hash(const TSDF* voxels) {
+  // 64-bit FNV-1a.
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(voxels);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < kBrickBytes; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+std::string BrickStore::DataFilename() const {
+  return pystring::os::path::join(directory_, kDataFilename);
+}
+
+bool BrickStore::Truncate() {
+  std::string filename = DataFilename();
+  if (file_.is_open()) {
+    file_.close();
+  }
+  file_.open(filename, std::ios::in | std::ios::out | std::ios::binary |
+    std::ios::trunc);
+  ++file_generation_;
+
+  WriteHeader(file_);
+  file_.flush();
+  if (!file_) {
+    fprintf(stderr, "Failed to create brick store %s.\n", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool BrickStore::Compact() {
+  std::vector<std::pair<uint64_t, int64_t>> records;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records.reserve(index_.size());
+    for (const auto& entry : index_) {
+      records.emplace_back(entry.first, entry.second.offset);
+    }
+  }
+  // Read the old file sequentially.
+  std::sort(records.begin(), records.end(),
+    [](const std::pair<uint64_t, int64_t>& a,
+      const std::pair<uint64_t, int64_t>& b) {
+    return a.second < b.second;
+  });
+
+  // Copy the live records to a new file. Readers can still hit the cache
+  // meanwhile.
+  std::string filename = DataFilename();
+  std::string compacted_filename = filename + ".compact";
+  std::fstream compacted(compacted_filename, std::ios::in | std::ios::out |
+    std::ios::binary | std::ios::trunc);
+  WriteHeader(compacted);
+  std::vector<char> record(kRecordBytes);
+  std::vector<int64_t> new_offsets(records.size());
+  for (size_t i = 0; i < records.size() && compacted; ++i) {
+    file_.seekg(records[i].second);
+    file_.read(record.data(), kRecordBytes);
+    if (!file_) {
+      file_.clear();
+      compacted.setstate(std::ios::failbit);
+      break;
+    }
+    new_offsets[i] = static_cast<int64_t>(compacted.tellp());
+    compacted.write(record.data(), kRecordBytes);
+  }
+  compacted.flush();
+  if (!compacted) {
+    fprintf(stderr, "Failed to compact brick store %s.\n", filename.c_str());
+    compacted.close();
+    std::remove(compacted_filename.c_str());
+    return false;
+  }
+  compacted.close();
+
+  file_.close();
+  bool replaced = std::remove(filename.c_str()) == 0 &&
+    std::rename(compacted_filename.c_str(), filename.c_str()) == 0;
+  file_.open(filename, std::ios::in | std::ios::out | std::ios::binary);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++file_generation_;
+  if (!replaced || !file_) {
+    fprintf(stderr, "Failed to replace brick store %s.\n",
+      filename.c_str());
+    is_valid_ = false;
+    return false;
+  }
+  for (size_t i = 0; i < records.size(); ++i) {
+    index_[records[i].first].offset = new_offsets[i];
+  }
+  num_dead_records_ = 0;
+  if (PerfCollector::Enabled()) {
+    PerfCollector::Instance().AddCount("brick_store_compactions", 1);
+  }
+  return true;
+}
+
+bool BrickStore::ReadRecord(int64_t offset, TSDF* voxels) {
+  file_.seekg(offset + 3 * sizeof(int32_t));
+  file_.read(reinterpret_cast<char*>(voxels), kBrickBytes);
+  if (!file_) {
+    fprintf(stderr, "Failed to read brick from %s.\n", directory_.c_str());
+    file_.clear();
+    return false;
+  }
+  return true;
+}
+
+BrickStore::CacheEntry* BrickStore::InsertIntoCache(uint64_t key,
+  const TSDF* voxels) {
+  auto itr = cache_.find(key);
+  if (itr == cache_.end()) {
+    while (cache_.size() >= cache_budget_bricks_) {
+      cache_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(key);
+    itr = cache_.emplace(key, CacheEntry{ lru_.begin(),
+      std::vector<TSDF>(kBrickVolume) }).first;
+  } else {
+    lru_.splice(lru_.begin(), lru_, itr->second.lru_position);
+  }
+  std::copy(voxels, voxels + kBrickVolume, itr->second.voxels.begin());
+  return &(itr->second);
+}
+
+void BrickStore::PrefetchLoop() {
+  std::vector<TSDF> voxels(kBrickVolume);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    prefetch_cv_.wait(lock, [this] {
+      return stopping_ || !prefetch_queue_.empty();
+    });
+    if (stopping_) {
+      return;
+    }
+
+    uint64_t key = prefetch_queue_.back();
+    prefetch_queue_.pop_back();
+    auto index_itr = index_.find(key);
+    if (index_itr != index_.end() && cache_.find(key) == cache_.end()) {
+      int64_t offset = index_itr->second.offset;
+      int64_t generation = file_generation_;
+
+      // Read without blocking the fusion thread's cache hits.
+      lock.unlock();
+      bool read = false;
+      {
+        std::lock_guard<std::mutex> file_lock(file_mutex_);
+        read = generation == file_generation_ &&
+          ReadRecord(offset, voxels.data());
+      }
+      lock.lock();
+
+      // Drop the brick if it was rewritten or read in between.
+      index_itr = index_.find(key);
+      if (read && index_itr != index_.end() &&
+        index_itr->second.offset == offset &&
+        generation == file_generation_ && cache_.find(key) == cache_.end()) {
+        InsertIntoCache(key, voxels.data());
+        ++num_prefetched_;
+        if (PerfCollector::Enabled()) {
+          PerfCollector::Instance().AddCount("bricks_prefetched", 1);
+        }
+      }
+    }
+
+    // Let the fusion thread in between bricks.
+    lock.unlock();
+    std::this_thread::yield();
+    lock.lock();
+  }
+}
@@ -0,0 +1,175 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef BRICK_STORE_H
+#define BRICK_STORE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "libcgt/core/vecmath/Vector3i.h"
+
+#include "tsdf.h"
+#include "voxel_layout.h"
+
+// An out-of-core store of TSDF bricks, for volumes larger than memory.
+//
+// A brick is an 8^3 block of voxels, stored x-fastest regardless of the
+// grid's VoxelLayout. It is keyed by its subscript in an unbounded grid of
+// bricks: brick b covers voxels [8 * b, 8 * b + 8) of the volume.
+//
+// Bricks are appended to a single file, bricks.dat, in directory, which
+// must exist. Rewriting a brick appends a new copy and points the in-memory
+// index at it, unless the brick is unchanged since it was last written, in
+// which case the write is skipped. Once most of the file is superseded
+// copies, it is compacted. Recently used bricks are kept in an LRU cache
+// whose size is bounded by cache_budget_bytes. A background thread reads
+// bricks into the cache ahead of time when asked to with Prefetch().
+//
+// Disk reads do not block cache hits: they happen outside of the lock that
+// guards the index and the cache.
+//
+// The store starts out empty: an existing bricks.dat is truncated.
+//
+// All methods are thread safe.
+class BrickStore {
+public:
+
+  static constexpr int kBrickSize = BrickVoxelLayout::kBrickSize;
+  static constexpr int kBrickVolume = BrickVoxelLayout::kBrickVolume;
+
+  BrickStore(const std::string& directory, size_t cache_budget_bytes);
+  ~BrickStore();
+
+  BrickStore(const BrickStore& copy) = delete;
+  BrickStore& operator = (const BrickStore& copy) = delete;
+
+  const std::string& Directory() const;
+
+  // Whether the data file was opened successfully.
+  bool IsValid() const;
+
+  // The number of bricks in the store.
+  int NumBricks() const;
+
+  // The subscripts of every brick in the store, in no particular order.
+  std::vector<Vector3i> Bricks() const;
+
+  bool Contains(const Vector3i& brick) const;
+
+  // Write kBrickVolume voxels to the store, replacing the brick if it is
+  // already there.
+  bool Write(const Vector3i& brick, const TSDF* voxels);
+
+  // Read kBrickVolume voxels from the store. Returns false if the brick is
+  // not in the store or could not be read.
+  bool Read(const Vector3i& brick, TSDF* voxels);
+
+  // Ask the background thread to read bricks into the cache. Bricks that
+  // are not in the store or already cached are skipped. Replaces any
+  // requests that have not been serviced yet.
+  void Prefetch(const std::vector<Vector3i>& bricks);
+
+  // Deletes every brick in the store.
+  void Clear();
+
+  // Cache statistics since construction or the last Clear().
+  int64_t NumCacheHits() const;
+  int64_t NumCacheMisses() const;
+  int64_t NumPrefetched() const;
+
+  // The number of superseded copies of bricks in the data file.
+  int64_t NumDeadRecords() const;
+
+private:
+
+  struct IndexEntry {
+    // Offset of the brick's latest copy in the data file.
+    int64_t offset;
+    // Hash of its voxels, to detect unchanged bricks.
+    uint64_t hash;
+  };
+
+  struct CacheEntry {
+    // Position in lru_.
+    std::list<uint64_t>::iterator lru_position;
+    std::vector<TSDF> voxels;
+  };
+
+  // Packs a brick subscript into 21 bits per axis.
+  static uint64_t Key(const Vector3i& brick);
+  static Vector3i Unkey(uint64_t key);
+
+  static uint64_t Hash(const TSDF* voxels);
+
+  std::string DataFilename() const;
+
+  // (Re)create the data file with just a header. Requires file_mutex_ and
+  // mutex_.
+  bool Truncate();
+
+  // Rewrite the data file with only the latest copy of each brick. Requires
+  // file_mutex_ but not mutex_.
+  bool Compact();
+
+  // Read the voxels of the record at offset. Returns false on failure.
+  // Requires file_mutex_.
+  bool ReadRecord(int64_t offset, TSDF* voxels);
+
+  // Copy voxels into the cache, evicting the least recently used bricks if
+  // over budget. Returns the cache entry. Requires mutex_.
+  CacheEntry* InsertIntoCache(uint64_t key, const TSDF* voxels);
+
+  void PrefetchLoop();
+
+  std::string directory_;
+  size_t cache_budget_bricks_;
+
+  // Guards file_. When both are needed, lock it before mutex_.
+  std::mutex file_mutex_;
+  // Guards everything else.
+  mutable std::mutex mutex_;
+
+  std::fstream file_;
+  // Incremented, with both mutexes held, whenever the data file is
+  // rewritten and offsets read from index_ before then are invalid.
+  int64_t file_generation_ = 0;
+  bool is_valid_ = false;
+
+  // Brick key --> its latest copy in the data file.
+  std::unordered_map<uint64_t, IndexEntry> index_;
+  int64_t num_dead_records_ = 0;
+
+  // Most recently used first.
+  std::list<uint64_t> lru_;
+  std::unordered_map<uint64_t, CacheEntry> cache_;
+
+  int64_t num_cache_hits_ = 0;
+  int64_t num_cache_misses_ = 0;
+  int64_t num_prefetched_ = 0;
+
+  // Bricks to prefetch, serviced last first.
+  std::vector<uint64_t> prefetch_queue_;
+  std::condition_variable prefetch_cv_;
+  bool stopping_ = false;
+  std::thread prefetch_thread_;
+};
+
+#endif  // BRICK_STORE_H
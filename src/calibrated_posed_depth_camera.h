@@ -19,10 +19,13 @@
 #include "libcgt/cuda/float4x4.h"
 #include "libcgt/cuda/KernelArray2D.h"
 
+#include "depth_noise_model.h"
+
 struct CalibratedPosedDepthCamera {
   float4 flpp;
   float2 depth_min_max;
   float4x4 camera_from_world;
+  DepthNoiseModel noise_model;
 };
 
 #endif  // CALIBRATED_POSED_DEPTH_CAMERA_H
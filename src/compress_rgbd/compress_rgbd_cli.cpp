@@ -0,0 +1,161 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Transcodes a .rgbd capture into a compressed .rgbdz stream, which
+// RgbdInput reads directly. Depth is compressed losslessly with RVL; color
+// is stored raw or, optionally, as JPEG.
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include "libcgt/camera_wrappers/PixelFormat.h"
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+#include "../compressed_rgbd_stream.h"
+
+DEFINE_string(input_file, "", "Input RGBD stream file (.rgbd).");
+DEFINE_string(output_file, "", "Output compressed stream file (.rgbdz).");
+DEFINE_string(color_codec, "raw", "Codec for color streams: \"raw\" "
+  "(lossless) or \"jpeg\".");
+DEFINE_int32(jpeg_quality, 95, "With --color_codec=jpeg, the JPEG quality "
+  "in [0, 100].");
+DEFINE_int32(decode_threads, 2, "With --verify, the number of threads that "
+  "decode the output.");
+DEFINE_bool(verify, true, "Read the output back and check that every "
+  "losslessly compressed frame matches the input.");
+
+using libcgt::camera_wrappers::PixelFormat;
+using libcgt::camera_wrappers::RGBDInputStream;
+using libcgt::camera_wrappers::StreamMetadata;
+
+namespace {
+
+bool Verify(const std::vector<FrameCodec>& codecs) {
+  RGBDInputStream expected_stream(FLAGS_input_file.c_str());
+  CompressedRgbdInputStream actual_stream(FLAGS_output_file,
+    FLAGS_decode_threads);
+  if (!actual_stream.IsValid()) {
+    fprintf(stderr, "Failed to open %s.\n", FLAGS_output_file.c_str());
+    return false;
+  }
+
+  uint32_t stream_id;
+  int32_t frame_index;
+  int64_t timestamp_ns;
+  CompressedRgbdInputStream::Frame actual;
+  int64_t num_frames = 0;
+  Array1DReadView<uint8_t> expected = expected_stream.read(
+    stream_id, frame_index, timestamp_ns);
+  while (expected.notNull()) {
+    if (!actual_stream.Read(&actual)) {
+      fprintf(stderr, "Output ends after %lld frames.\n",
+        static_cast<long long>(num_frames));
+      return false;
+    }
+    bool matches = actual.stream_id == stream_id &&
+      actual.frame_index == frame_index &&
+      actual.timestamp_ns == timestamp_ns &&
+      actual.data.size() == expected.size();
+    if (matches && codecs[stream_id] != FrameCodec::JPEG) {
+      matches = memcmp(actual.data.data(), expected.pointer(),
+        expected.size()) == 0;
+    }
+    if (!matches) {
+      fprintf(stderr, "Frame %d of stream %u does not match the input.\n",
+        frame_index, stream_id);
+      return false;
+    }
+    ++num_frames;
+    expected = expected_stream.read(stream_id, frame_index, timestamp_ns);
+  }
+  if (actual_stream.Read(&actual)) {
+    fprintf(stderr, "Output has more than %lld frames.\n",
+      static_cast<long long>(num_frames));
+    return false;
+  }
+  printf("Verified %lld frames.\n", static_cast<long long>(num_frames));
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_input_file == "" || FLAGS_output_file == "") {
+    fprintf(stderr, "input_file and output_file are required.\n");
+    return 1;
+  }
+  if (FLAGS_color_codec != "raw" && FLAGS_color_codec != "jpeg") {
+    fprintf(stderr, "color_codec must be \"raw\" or \"jpeg\".\n");
+    return 1;
+  }
+
+  RGBDInputStream input_stream(FLAGS_input_file.c_str());
+  const std::vector<StreamMetadata>& metadata = input_stream.metadata();
+  std::vector<FrameCodec> codecs;
+  for (const StreamMetadata& stream : metadata) {
+    if (stream.format == PixelFormat::DEPTH_MM_U16) {
+      codecs.push_back(FrameCodec::RVL);
+    } else if (stream.format == PixelFormat::RGB_U888 &&
+      FLAGS_color_codec == "jpeg") {
+      codecs.push_back(FrameCodec::JPEG);
+    } else {
+      codecs.push_back(FrameCodec::RAW);
+    }
+  }
+
+  int64_t num_input_bytes = 0;
+  int64_t num_frames = 0;
+  {
+    CompressedRgbdOutputStream output_stream(metadata, codecs,
+      FLAGS_output_file, FLAGS_jpeg_quality);
+    if (!output_stream.IsValid()) {
+      fprintf(stderr, "Failed to open %s for writing.\n",
+        FLAGS_output_file.c_str());
+      return 1;
+    }
+
+    uint32_t stream_id;
+    int32_t frame_index;
+    int64_t timestamp_ns;
+    Array1DReadView<uint8_t> src = input_stream.read(
+      stream_id, frame_index, timestamp_ns);
+    while (src.notNull()) {
+      if (!output_stream.Write(stream_id, frame_index, timestamp_ns, src)) {
+        fprintf(stderr, "Failed to write frame %d of stream %u.\n",
+          frame_index, stream_id);
+        return 1;
+      }
+      num_input_bytes += src.size();
+      ++num_frames;
+      src = input_stream.read(stream_id, frame_index, timestamp_ns);
+    }
+
+    printf("Wrote %lld frames: %lld bytes of frame data compressed to %lld "
+      "bytes (%.2fx).\n", static_cast<long long>(num_frames),
+      static_cast<long long>(num_input_bytes),
+      static_cast<long long>(output_stream.NumBytesWritten()),
+      output_stream.NumBytesWritten() > 0 ?
+        static_cast<double>(num_input_bytes) /
+          output_stream.NumBytesWritten() : 0.0);
+  }
+
+  if (FLAGS_verify && !Verify(codecs)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,358 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "compressed_rgbd_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "libcgt/camera_wrappers/PixelFormat.h"
+
+#include "rvl_codec.h"
+#include "thread_pool.h"
+
+using libcgt::camera_wrappers::PixelFormat;
+
+namespace {
+
+constexpr char kMagic[8] = { 'R', 'G', 'B', 'D', 'R', 'V', 'L', '1' };
+
+// Sanity limit for a frame header read from disk.
+constexpr uint32_t kMaxFrameBytes = 1u << 30;
+
+template <typename T>
+bool WriteValue(FILE* fp, T value) {
+  return fwrite(&value, sizeof(T), 1, fp) == 1;
+}
+
+template <typename T>
+bool ReadValue(FILE* fp, T* value) {
+  return fread(value, sizeof(T), 1, fp) == 1;
+}
+
+bool CodecSupportsFormat(FrameCodec codec, PixelFormat format) {
+  switch (codec) {
+  case FrameCodec::RAW:
+    return true;
+  case FrameCodec::RVL:
+    return format == PixelFormat::DEPTH_MM_U16;
+  case FrameCodec::JPEG:
+    return format == PixelFormat::RGB_U888;
+  default:
+    return false;
+  }
+}
+
+}  // namespace
+
+CompressedRgbdOutputStream::CompressedRgbdOutputStream(
+  const std::vector<StreamMetadata>& metadata,
+  const std::vector<FrameCodec>& codecs, const std::string& filename,
+  int jpeg_quality) :
+  metadata_(metadata),
+  codecs_(codecs),
+  jpeg_quality_(jpeg_quality) {
+  if (metadata_.size() != codecs_.size()) {
+    return;
+  }
+  for (size_t i = 0; i < metadata_.size(); ++i) {
+    if (!CodecSupportsFormat(codecs_[i], metadata_[i].format)) {
+      return;
+    }
+  }
+
+  fp_ = fopen(filename.c_str(), "wb");
+  if (fp_ == nullptr) {
+    return;
+  }
+  bool ok = fwrite(kMagic, sizeof(kMagic), 1, fp_) == 1 &&
+    WriteValue(fp_, static_cast<uint32_t>(metadata_.size()));
+  for (size_t i = 0; ok && i < metadata_.size(); ++i) {
+    ok = WriteValue(fp_, static_cast<int32_t>(metadata_[i].type)) &&
+      WriteValue(fp_, static_cast<int32_t>(metadata_[i].format)) &&
+      WriteValue(fp_, static_cast<int32_t>(metadata_[i].size.x)) &&
+      WriteValue(fp_, static_cast<int32_t>(metadata_[i].size.y)) &&
+      WriteValue(fp_, static_cast<int32_t>(codecs_[i]));
+  }
+  if (!ok) {
+    fclose(fp_);
+    fp_ = nullptr;
+    return;
+  }
+  num_bytes_written_ = ftell(fp_);
+}
+
+CompressedRgbdOutputStream::~CompressedRgbdOutputStream() {
+  if (fp_ != nullptr) {
+    fclose(fp_);
+  }
+}
+
+bool CompressedRgbdOutputStream::IsValid() const {
+  return fp_ != nullptr;
+}
+
+bool CompressedRgbdOutputStream::Write(uint32_t stream_id,
+  int32_t frame_index, int64_t timestamp_ns, Array1DReadView<uint8_t> data) {
+  if (fp_ == nullptr || stream_id >= metadata_.size()) {
+    return false;
+  }
+  const StreamMetadata& metadata = metadata_[stream_id];
+  const Vector2i size = metadata.size;
+
+  const uint8_t* payload = data.pointer();
+  size_t num_bytes = data.size();
+  switch (codecs_[stream_id]) {
+  case FrameCodec::RAW:
+    break;
+  case FrameCodec::RVL:
+  {
+    if (num_bytes != size.x * size.y * sizeof(uint16_t)) {
+      return false;
+    }
+    RvlEncode(Array2DReadView<uint16_t>(data.pointer(), size), &payload_);
+    payload = payload_.data();
+    num_bytes = payload_.size();
+    break;
+  }
+  case FrameCodec::JPEG:
+  {
+    if (num_bytes != size.x * size.y * 3) {
+      return false;
+    }
+    // OpenCV encodes BGR.
+    cv::Mat rgb(size.y, size.x, CV_8UC3,
+      const_cast<uint8_t*>(data.pointer()));
+    cv::Mat bgr;
+    cv::cvtColor(rgb, bgr, cv::COLOR_RGB2BGR);
+    if (!cv::imencode(".jpg", bgr, payload_,
+      { cv::IMWRITE_JPEG_QUALITY, jpeg_quality_ })) {
+      return false;
+    }
+    payload = payload_.data();
+    num_bytes = payload_.size();
+    break;
+  }
+  }
+
+  bool ok = WriteValue(fp_, stream_id) &&
+    WriteValue(fp_, frame_index) &&
+    WriteValue(fp_, timestamp_ns) &&
+    WriteValue(fp_, static_cast<uint32_t>(num_bytes)) &&
+    (num_bytes == 0 || fwrite(payload, num_bytes, 1, fp_) == 1);
+  if (ok) {
+    num_bytes_written_ += sizeof(uint32_t) + sizeof(int32_t) +
+      sizeof(int64_t) + sizeof(uint32_t) + num_bytes;
+  }
+  return ok;
+}
+
+int64_t CompressedRgbdOutputStream::NumBytesWritten() const {
+  return num_bytes_written_;
+}
+
+CompressedRgbdInputStream::CompressedRgbdInputStream(
+  const std::string& filename, int num_decode_threads,
+  int max_frames_ahead) :
+  max_frames_ahead_(std::max(max_frames_ahead, 1)) {
+  fp_ = fopen(filename.c_str(), "rb");
+  if (fp_ == nullptr) {
+    return;
+  }
+  if (!ReadHeader()) {
+    fclose(fp_);
+    fp_ = nullptr;
+    return;
+  }
+  decoders_.reset(new ThreadPool(std::max(num_decode_threads, 1)));
+  reader_ = std::thread(&CompressedRgbdInputStream::ReadLoop, this);
+}
+
+CompressedRgbdInputStream::~CompressedRgbdInputStream() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  if (reader_.joinable()) {
+    reader_.join();
+  }
+  // Finishes the frames in flight, which notify cv_.
+  decoders_.reset();
+  if (fp_ != nullptr) {
+    fclose(fp_);
+  }
+}
+
+// static
+bool CompressedRgbdInputStream::IsCompressedRgbd(
+  const std::string& filename) {
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  char magic[sizeof(kMagic)];
+  bool matches = fread(magic, sizeof(magic), 1, fp) == 1 &&
+    memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+  fclose(fp);
+  return matches;
+}
+
+bool CompressedRgbdInputStream::IsValid() const {
+  return fp_ != nullptr;
+}
+
+const std::vector<CompressedRgbdInputStream::StreamMetadata>&
+CompressedRgbdInputStream::Metadata() const {
+  return metadata_;
+}
+
+bool CompressedRgbdInputStream::Read(Frame* frame) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] {
+    return (!pending_.empty() && pending_.front()->done) ||
+      (pending_.empty() && end_of_stream_);
+  });
+  if (pending_.empty()) {
+    return false;
+  }
+
+  std::shared_ptr<PendingFrame> pending = pending_.front();
+  pending_.pop_front();
+  lock.unlock();
+  cv_.notify_all();
+
+  if (!pending->succeeded) {
+    fprintf(stderr, "Failed to decode frame %d of stream %u.\n",
+      pending->frame.frame_index, pending->frame.stream_id);
+    return false;
+  }
+  *frame = std::move(pending->frame);
+  return true;
+}
+
+bool CompressedRgbdInputStream::ReadHeader() {
+  char magic[sizeof(kMagic)];
+  uint32_t num_streams;
+  if (fread(magic, sizeof(magic), 1, fp_) != 1 ||
+    memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+    !ReadValue(fp_, &num_streams)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < num_streams; ++i) {
+    int32_t type;
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    int32_t codec;
+    if (!ReadValue(fp_, &type) || !ReadValue(fp_, &format) ||
+      !ReadValue(fp_, &width) || !ReadValue(fp_, &height) ||
+      !ReadValue(fp_, &codec)) {
+      return false;
+    }
+    StreamMetadata metadata;
+    metadata.type = static_cast<libcgt::camera_wrappers::StreamType>(type);
+    metadata.format = static_cast<PixelFormat>(format);
+    metadata.size = Vector2i{ width, height };
+    metadata_.push_back(metadata);
+    codecs_.push_back(static_cast<FrameCodec>(codec));
+  }
+  return true;
+}
+
+void CompressedRgbdInputStream::ReadLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] {
+        return stopping_ ||
+          static_cast<int>(pending_.size()) < max_frames_ahead_;
+      });
+      if (stopping_) {
+        break;
+      }
+    }
+
+    // Read outside of the lock so that the consumer is not blocked on I/O.
+    std::shared_ptr<PendingFrame> pending = std::make_shared<PendingFrame>();
+    Frame& frame = pending->frame;
+    uint32_t num_bytes;
+    bool ok = ReadValue(fp_, &frame.stream_id) &&
+      ReadValue(fp_, &frame.frame_index) &&
+      ReadValue(fp_, &frame.timestamp_ns) &&
+      ReadValue(fp_, &num_bytes) &&
+      frame.stream_id < metadata_.size() &&
+      num_bytes <= kMaxFrameBytes;
+    if (ok) {
+      pending->payload.resize(num_bytes);
+      ok = num_bytes == 0 ||
+        fread(pending->payload.data(), num_bytes, 1, fp_) == 1;
+    }
+    if (!ok) {
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(pending);
+    }
+    decoders_->Enqueue([this, pending] {
+      bool succeeded = Decode(pending.get());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending->succeeded = succeeded;
+        pending->done = true;
+      }
+      cv_.notify_all();
+    });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    end_of_stream_ = true;
+  }
+  cv_.notify_all();
+}
+
+bool CompressedRgbdInputStream::Decode(PendingFrame* pending) const {
+  const StreamMetadata& metadata = metadata_[pending->frame.stream_id];
+  const Vector2i size = metadata.size;
+  std::vector<uint8_t>& payload = pending->payload;
+  std::vector<uint8_t>& data = pending->frame.data;
+
+  switch (codecs_[pending->frame.stream_id]) {
+  case FrameCodec::RAW:
+    data.swap(payload);
+    return true;
+  case FrameCodec::RVL:
+    data.resize(size.x * size.y * sizeof(uint16_t));
+    return RvlDecode(payload.data(), payload.size(),
+      Array2DWriteView<uint16_t>(data.data(), size));
+  case FrameCodec::JPEG:
+  {
+    cv::Mat bgr = cv::imdecode(payload, cv::IMREAD_COLOR);
+    if (bgr.cols != size.x || bgr.rows != size.y) {
+      return false;
+    }
+    data.resize(size.x * size.y * 3);
+    cv::Mat rgb(size.y, size.x, CV_8UC3, data.data());
+    cv::cvtColor(bgr, rgb, cv::COLOR_BGR2RGB);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
@@ -0,0 +1,157 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef COMPRESSED_RGBD_STREAM_H
+#define COMPRESSED_RGBD_STREAM_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libcgt/core/common/Array1D.h"
+#include "libcgt/camera_wrappers/RGBDStream.h"
+
+class ThreadPool;
+
+// The same streams and frames as a .rgbd file, but with each frame
+// compressed independently. By convention, these files end in ".rgbdz".
+//
+// File layout (little endian):
+//   magic: 8 bytes, "RGBDRVL1"
+//   num_streams: uint32
+//   for each stream: type, format, width, height, codec: int32 each
+//   for each frame, until the end of the file:
+//     stream_id: uint32, frame_index: int32, timestamp_ns: int64,
+//     num_bytes: uint32, then num_bytes of compressed payload
+
+enum class FrameCodec : int32_t {
+  // Uncompressed, as in .rgbd.
+  RAW = 0,
+
+  // Lossless. For DEPTH_MM_U16 streams only. See rvl_codec.h.
+  RVL = 1,
+
+  // Lossy. For RGB_U888 streams only.
+  JPEG = 2
+};
+
+class CompressedRgbdOutputStream {
+ public:
+
+  using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
+
+  // codecs[i] compresses stream i. jpeg_quality is in [0, 100].
+  CompressedRgbdOutputStream(const std::vector<StreamMetadata>& metadata,
+    const std::vector<FrameCodec>& codecs, const std::string& filename,
+    int jpeg_quality = 95);
+  ~CompressedRgbdOutputStream();
+
+  CompressedRgbdOutputStream(const CompressedRgbdOutputStream& copy) = delete;
+  CompressedRgbdOutputStream& operator = (
+    const CompressedRgbdOutputStream& copy) = delete;
+
+  // False if the file could not be opened or the codecs do not match the
+  // streams' formats.
+  bool IsValid() const;
+
+  // data is one uncompressed frame, as returned by RGBDInputStream::read().
+  bool Write(uint32_t stream_id, int32_t frame_index, int64_t timestamp_ns,
+    Array1DReadView<uint8_t> data);
+
+  int64_t NumBytesWritten() const;
+
+ private:
+
+  std::vector<StreamMetadata> metadata_;
+  std::vector<FrameCodec> codecs_;
+  const int jpeg_quality_;
+
+  FILE* fp_ = nullptr;
+  int64_t num_bytes_written_ = 0;
+  // Reused between frames.
+  std::vector<uint8_t> payload_;
+};
+
+// Reads a compressed stream, decoding frames on worker threads ahead of the
+// consumer. A reader thread pulls compressed frames off the disk in order
+// and hands each to a decoder; Read() returns them in file order.
+class CompressedRgbdInputStream {
+ public:
+
+  using StreamMetadata = libcgt::camera_wrappers::StreamMetadata;
+
+  struct Frame {
+    uint32_t stream_id = 0;
+    int32_t frame_index = 0;
+    int64_t timestamp_ns = 0;
+    // Uncompressed, in the same layout as a .rgbd frame.
+    std::vector<uint8_t> data;
+  };
+
+  // Up to max_frames_ahead frames are read and decoded before they are
+  // requested.
+  explicit CompressedRgbdInputStream(const std::string& filename,
+    int num_decode_threads = 2, int max_frames_ahead = 8);
+  ~CompressedRgbdInputStream();
+
+  CompressedRgbdInputStream(const CompressedRgbdInputStream& copy) = delete;
+  CompressedRgbdInputStream& operator = (
+    const CompressedRgbdInputStream& copy) = delete;
+
+  // Whether filename starts with the compressed stream magic.
+  static bool IsCompressedRgbd(const std::string& filename);
+
+  bool IsValid() const;
+
+  const std::vector<StreamMetadata>& Metadata() const;
+
+  // Returns false at the end of the stream or if a frame fails to decode.
+  bool Read(Frame* frame);
+
+ private:
+
+  struct PendingFrame {
+    Frame frame;
+    std::vector<uint8_t> payload;
+    bool done = false;
+    bool succeeded = false;
+  };
+
+  bool ReadHeader();
+  void ReadLoop();
+  bool Decode(PendingFrame* pending) const;
+
+  FILE* fp_ = nullptr;
+  std::vector<StreamMetadata> metadata_;
+  std::vector<FrameCodec> codecs_;
+  const int max_frames_ahead_;
+
+  std::mutex mutex_;
+  // Signaled when a frame is queued or decoded, when one is consumed, and
+  // at the end of the stream.
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<PendingFrame>> pending_;
+  bool end_of_stream_ = false;
+  bool stopping_ = false;
+
+  std::unique_ptr<ThreadPool> decoders_;
+  std::thread reader_;
+};
+
+#endif  // COMPRESSED_RGBD_STREAM_H
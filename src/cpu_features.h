@@ -0,0 +1,85 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// Runtime dispatch of host SIMD code, so that AVX2 paths are used on CPUs
+// that have it without compiling all host code for AVX2 (see
+// DEPTH_FUSION_ENABLE_AVX2 in CMakeLists.txt).
+//
+// If DEPTH_FUSION_HOST_AVX2 is defined, functions marked
+// DEPTH_FUSION_TARGET_AVX2 may use AVX2 and FMA intrinsics, and must only be
+// called if HostSupportsAVX2() returns true.
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+// Everything is compiled for AVX2 already.
+#include <immintrin.h>
+#define DEPTH_FUSION_HOST_AVX2
+#define DEPTH_FUSION_TARGET_AVX2
+
+inline bool HostSupportsAVX2() {
+  return true;
+}
+
+#elif (defined(__GNUC__) || defined(__clang__)) && \
+  (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+#define DEPTH_FUSION_HOST_AVX2
+#define DEPTH_FUSION_TARGET_AVX2 __attribute__((target("avx2,fma")))
+
+inline bool HostSupportsAVX2() {
+  static const bool supported =
+    __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return supported;
+}
+
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+
+// MSVC allows AVX2 intrinsics in any function.
+#include <immintrin.h>
+#include <intrin.h>
+#define DEPTH_FUSION_HOST_AVX2
+#define DEPTH_FUSION_TARGET_AVX2
+
+inline bool HostSupportsAVX2() {
+  static const bool supported = [] {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+      return false;
+    }
+    // FMA, and the OS saving the AVX registers (XMM and YMM state).
+    __cpuid(info, 1);
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!fma || !osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+      return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+  }();
+  return supported;
+}
+
+#else
+
+inline bool HostSupportsAVX2() {
+  return false;
+}
+
+#endif
+
+#endif  // CPU_FEATURES_H
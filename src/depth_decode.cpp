@@ -0,0 +1,140 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "depth_decode.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr float kMetersPerMillimeter = 0.001f;
+
+// dst[x] = z if z is in [z_min, z_max], otherwise 0, for z = src[x] in
+// meters.
+void DecodeRow(const uint16_t* src, int width, float z_min, float z_max,
+  float* dst) {
+  int x = 0;
+#if defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(kMetersPerMillimeter);
+  const __m256 min = _mm256_set1_ps(z_min);
+  const __m256 max = _mm256_set1_ps(z_max);
+  for (; x + 8 <= width; x += 8) {
+    __m256i raw = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)));
+    __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(raw), scale);
+    __m256 valid = _mm256_and_ps(
+      _mm256_cmp_ps(z, min, _CMP_GE_OQ),
+      _mm256_cmp_ps(z, max, _CMP_LE_OQ));
+    _mm256_storeu_ps(dst + x, _mm256_and_ps(z, valid));
+  }
+#endif
+  for (; x < width; ++x) {
+    float z = kMetersPerMillimeter * src[x];
+    dst[x] = (z >= z_min && z <= z_max) ? z : 0.0f;
+  }
+}
+
+void DecodeRow(const float* src, int width, float z_min, float z_max,
+  float* dst) {
+  int x = 0;
+#if defined(__AVX2__)
+  const __m256 min = _mm256_set1_ps(z_min);
+  const __m256 max = _mm256_set1_ps(z_max);
+  for (; x + 8 <= width; x += 8) {
+    __m256 z = _mm256_loadu_ps(src + x);
+    // NaN fails both comparisons and is also masked.
+    __m256 valid = _mm256_and_ps(
+      _mm256_cmp_ps(z, min, _CMP_GE_OQ),
+      _mm256_cmp_ps(z, max, _CMP_LE_OQ));
+    _mm256_storeu_ps(dst + x, _mm256_and_ps(z, valid));
+  }
+#endif
+  for (; x < width; ++x) {
+    float z = src[x];
+    dst[x] = (z >= z_min && z <= z_max) ? z : 0.0f;
+  }
+}
+
+// The rows have already been masked, so valid samples are nonzero.
+void DownsampleRow(const float* row0, const float* row1, int half_width,
+  float* dst) {
+  for (int x = 0; x < half_width; ++x) {
+    float sum = 0.0f;
+    int count = 0;
+    for (float z : { row0[2 * x], row0[2 * x + 1], row1[2 * x],
+      row1[2 * x + 1] }) {
+      if (z != 0.0f) {
+        sum += z;
+        ++count;
+      }
+    }
+    dst[x] = count > 0 ? sum / count : 0.0f;
+  }
+}
+
+// Decode src into depth_meters one row at a time. Calls
+// visit_row(src_row, y) with the source of output row y while it is hot.
+template <typename T, typename RowVisitor>
+void Decode(Array2DReadView<T> src, bool flip_y, const Range1f& depth_range,
+  Array2DWriteView<float> depth_meters,
+  Array2DWriteView<float> half_res_depth_meters, RowVisitor visit_row) {
+  assert(src.size() == depth_meters.size());
+  assert(half_res_depth_meters.isNull() ||
+    (half_res_depth_meters.width() == src.width() / 2 &&
+     half_res_depth_meters.height() == src.height() / 2));
+
+  const int width = src.width();
+  const int height = src.height();
+  const float z_min = depth_range.left();
+  const float z_max = depth_range.right();
+  for (int y = 0; y < height; ++y) {
+    const T* src_row = src.rowPointer(flip_y ? height - 1 - y : y);
+    float* dst = depth_meters.rowPointer(y);
+    DecodeRow(src_row, width, z_min, z_max, dst);
+    visit_row(src_row, y);
+    if (y % 2 == 1 && half_res_depth_meters.notNull() &&
+      y / 2 < half_res_depth_meters.height()) {
+      DownsampleRow(depth_meters.rowPointer(y - 1), dst,
+        half_res_depth_meters.width(),
+        half_res_depth_meters.rowPointer(y / 2));
+    }
+  }
+}
+
+}  // namespace
+
+void DecodeDepthMillimeters(Array2DReadView<uint16_t> src, bool flip_y,
+  const Range1f& depth_range, Array2DWriteView<float> depth_meters,
+  Array2DWriteView<uint16_t> depth_mm,
+  Array2DWriteView<float> half_res_depth_meters) {
+  assert(depth_mm.isNull() || depth_mm.size() == src.size());
+  const int width = src.width();
+  Decode(src, flip_y, depth_range, depth_meters, half_res_depth_meters,
+    [&](const uint16_t* src_row, int y) {
+      if (depth_mm.notNull()) {
+        std::copy(src_row, src_row + width, depth_mm.rowPointer(y));
+      }
+    });
+}
+
+void DecodeDepthMeters(Array2DReadView<float> src, bool flip_y,
+  const Range1f& depth_range, Array2DWriteView<float> depth_meters,
+  Array2DWriteView<float> half_res_depth_meters) {
+  Decode(src, flip_y, depth_range, depth_meters, half_res_depth_meters,
+    [](const float* src_row, int y) {});
+}
@@ -0,0 +1,45 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef DEPTH_DECODE_H
+#define DEPTH_DECODE_H
+
+#include <cstdint>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/Range1f.h"
+
+// Host routines that turn a depth frame, as delivered by a camera or a file,
+// into the y-up depth maps in InputBuffer in a single pass over the input.
+//
+// Samples outside of depth_range are set to 0, which every consumer treats
+// as invalid. Pass a range that includes everything to disable masking.
+//
+// If half_res_depth_meters is not null, it must be half the size of src
+// (rounded down) and receives the mean of the valid samples in each 2x2
+// block of the output, or 0 if there are none, as in
+// DepthProcessor::Preprocess().
+
+// Raw depth in millimeters. If depth_mm is not null, also copies src into it
+// with the same orientation as depth_meters, unmasked.
+void DecodeDepthMillimeters(Array2DReadView<uint16_t> src, bool flip_y,
+  const Range1f& depth_range, Array2DWriteView<float> depth_meters,
+  Array2DWriteView<uint16_t> depth_mm = Array2DWriteView<uint16_t>(),
+  Array2DWriteView<float> half_res_depth_meters = Array2DWriteView<float>());
+
+// Depth already in meters.
+void DecodeDepthMeters(Array2DReadView<float> src, bool flip_y,
+  const Range1f& depth_range, Array2DWriteView<float> depth_meters,
+  Array2DWriteView<float> half_res_depth_meters = Array2DWriteView<float>());
+
+#endif  // DEPTH_DECODE_H
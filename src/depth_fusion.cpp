@@ -22,21 +22,90 @@
 #include "libcgt/core/vecmath/SimilarityTransform.h"
 
 #include "control_widget.h"
+#include "frame_synchronizer.h"
 #include "input_buffer.h"
 #include "main_widget.h"
 #include "main_controller.h"
+#include "perf_collector.h"
 #include "pose_utils.h"
 #include "regular_grid_fusion_pipeline.h"
 #include "rgbd_camera_parameters.h"
 #include "rgbd_input.h"
+#include "trace_recorder.h"
+#include "tsdf_volume_spec.h"
+#include "undistort_remap.h"
+#include "volume_bounds_estimator.h"
 
 using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_output, "", "With --collect_perf, write per-stage latency "
+  "percentiles and counters to this file on exit: CSV if it ends in .csv, "
+  "JSON otherwise.");
+DEFINE_string(trace_output, "", "If non-empty, record a timeline of pipeline "
+  "stages, tagged with frame indices and timestamps, and write it to this "
+  "file on exit as a Chrome trace (.json), viewable in chrome://tracing or "
+  "ui.perfetto.dev. GPU stages synchronize at their end while tracing.");
 DEFINE_bool(adaptive_raycast, true, "Use signed distance values themselves "
   " during raycasting rather than one voxel at a time. Much faster, slightly "
   " less accurate.");
+DEFINE_bool(fused_depth_preprocessing, true, "When the input provides raw "
+  "depth in millimeters, convert, smooth, and estimate normals in a single "
+  "fused pass.");
+DEFINE_string(normal_estimator, "forward_difference", "How to estimate "
+  "normals of incoming depth frames for ICP. Either \"forward_difference\" "
+  "or \"covariance\" (slower, less noisy, and ICP weights each sample by "
+  "the planarity of its neighborhood).");
+DEFINE_int32(tsdf_cascade_levels, 1, "Number of TSDF grids of doubling "
+  "voxel size, centered on the same point. Each level only fuses depth its "
+  "voxels can resolve, so coarse levels hold the far field. 1 for a single "
+  "grid.");
+DEFINE_string(rolling_volume_dir, "", "If non-empty, the TSDF grid becomes a "
+  "rolling window that follows the camera. Bricks that scroll out of it are "
+  "written to this directory, which must exist, and read back when the "
+  "camera returns.");
+DEFINE_int32(brick_cache_mb, 1024, "Memory budget, in MB, for bricks of the "
+  "rolling TSDF grid cached in host memory.");
+DEFINE_bool(pose_graph, false, "With depth ICP tracking, optimize a pose "
+  "graph of keyframes on a background thread and re-fuse frames whose poses "
+  "it corrects. Keeps keyframes and the most recent depth frames in host "
+  "memory.");
+DEFINE_int32(submap_resolution, 0, "If positive, fuse into submaps of this "
+  "resolution, each anchored to the camera pose it was started from, instead "
+  "of one TSDF grid. Submaps fuse concurrently and are merged into the grid "
+  "for output. With --pose_graph, optimized poses move submaps instead of "
+  "re-fusing frames.");
+DEFINE_int32(fusion_workers, 4, "Number of submaps that can fuse "
+  "concurrently.");
+DEFINE_int32(max_submaps, 64, "Maximum number of submaps. Once there are "
+  "this many, frames are fused into the nearest one instead of a new one.");
+DEFINE_string(volume_config, "", "Optional .yaml file describing the TSDF "
+  "grid, with keys resolution, voxel_size, origin, and max_tsdf_value. "
+  "The --volume_* flags override it.");
+DEFINE_string(volume_resolution, "", "TSDF grid resolution: \"n\" or "
+  "\"nx,ny,nz\". Defaults to 512.");
+DEFINE_double(volume_voxel_size, 0, "If positive, the TSDF voxel size in "
+  "meters. Defaults to 2 m / 512.");
+DEFINE_string(volume_origin, "", "World coordinates of the TSDF grid's "
+  "corner: \"x,y,z\", in meters. By default, the grid is placed relative "
+  "to the initial pose, depending on the mode and pose estimator.");
+DEFINE_double(volume_truncation, 0, "If positive, the representable range "
+  "of the TSDF, in meters. Defaults to 4 voxels, or 32 voxels in "
+  "multi_static mode.");
+DEFINE_bool(volume_auto_bounds, false, "Before fusing, unproject depth "
+  "frames with known poses and fit the TSDF grid, which need not be a cube, "
+  "to the observed surfaces. Its resolution, voxel size and origin replace "
+  "those of the --volume_* flags. In single_moving mode, requires file "
+  "input and a precomputed pose estimator.");
+DEFINE_int32(volume_bounds_frames, 0, "With --volume_auto_bounds, only use "
+  "this many depth frames from the start of each input. 0 means all of "
+  "them.");
+DEFINE_int32(volume_memory_mb, 512, "With --volume_auto_bounds, the largest "
+  "TSDF grid, in MB. The voxels are as fine as this allows.");
+DEFINE_bool(aruco_roi_tracking, true, "Look for ArUco markers near where "
+  "they were in the previous color frame first, and only search the whole "
+  "frame if that fails.");
 DEFINE_string(mode, "single_moving",
   "Mode to run the app in. Either \"single_moving\" or \"multi_static\"." );
 
@@ -65,6 +134,14 @@ DEFINE_string(sm_pose_file, "",
 // Multi static mode flags.
 DEFINE_bool(ms_use_gui, true,
   "Set true to visualize with GUI, false to run in batch mode.");
+DEFINE_double(ms_sync_tolerance_ms, 10.0,
+  "Depth frames from different cameras are fused together only if their "
+  "timestamps are within this many milliseconds of each other.");
+DEFINE_int32(ms_max_frames_ahead, 4,
+  "Number of depth frames that each camera is read ahead of fusion.");
+DEFINE_int32(ms_preprocessing_threads, 0,
+  "Number of threads that convert and undistort depth frames, which are "
+  "preprocessed concurrently across cameras. 0 means one per camera.");
 
 int SingleMovingCameraMain(int argc, char* argv[]) {
 
@@ -90,6 +167,14 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     }
   }
 
+  if (FLAGS_volume_auto_bounds && (FLAGS_sm_input_type != "file" ||
+    (FLAGS_sm_pose_estimator != "precomputed" &&
+      FLAGS_sm_pose_estimator != "precomputed_refine_with_depth_icp"))) {
+    printf("volume_auto_bounds requires file input and a precomputed pose "
+      "estimator.\n");
+    return 1;
+  }
+
   QApplication app(argc, argv);
 
   RGBDCameraParameters camera_params;
@@ -100,12 +185,14 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     return 1;
   }
 
-  const Vector3i kRegularGridResolution(512); // ~2m^3
-  const float kRegularGridSideLength = 2.0f;
-  const float kRegularGridVoxelSize =
-    kRegularGridSideLength / kRegularGridResolution.x;
+  TSDFVolumeSpec volume;
+  bool has_origin;
+  if (!GetTSDFVolumeSpecFromFlags(&volume, &has_origin)) {
+    return 1;
+  }
 
-  RgbdInput rgbd_input(input_type, FLAGS_sm_input_args.c_str());
+  RgbdInput rgbd_input(input_type, FLAGS_sm_input_args.c_str(),
+    camera_params.depth.depth_range);
 
   std::unique_ptr<RegularGridFusionPipeline> pipeline;
 
@@ -114,10 +201,9 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
   if (FLAGS_sm_pose_estimator == "color_aruco" ||
     FLAGS_sm_pose_estimator == "color_aruco_and_depth_icp") {
     // Put the origin at the center of the cube.
-    const SimilarityTransform kInitialWorldFromGrid =
-      SimilarityTransform(kRegularGridVoxelSize) *
-      SimilarityTransform(Vector3f(-0.5f * kRegularGridResolution.x,
-        -0.5f * kRegularGridResolution.y, -0.5f * kRegularGridResolution.z));
+    if (!has_origin) {
+      volume.Place(Vector3f{ 0 }, Vector3f{ 0.5f, 0.5f, 0.5f });
+    }
 
     if (FLAGS_sm_pose_estimator == "color_aruco") {
       pose_options.method = PoseEstimationMethod::COLOR_ARUCO;
@@ -126,14 +212,13 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
     }
 
     pipeline = std::make_unique<RegularGridFusionPipeline>(camera_params,
-      kRegularGridResolution, kInitialWorldFromGrid, pose_options);
+      volume, pose_options);
   } else if (FLAGS_sm_pose_estimator == "depth_icp") {
 
     // Put the camera at the center of the front face of the cube.
-    const SimilarityTransform kInitialWorldFromGrid =
-      SimilarityTransform(kRegularGridVoxelSize) *
-      SimilarityTransform(Vector3f(-0.5f * kRegularGridResolution.x,
-        -0.5f * kRegularGridResolution.y, -kRegularGridResolution.z));
+    if (!has_origin) {
+      volume.Place(Vector3f{ 0 }, Vector3f{ 0.5f, 0.5f, 1.0f });
+    }
 
     // y up
     const EuclideanTransform kInitialDepthCameraFromWorld =
@@ -152,15 +237,9 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
         kInitialDepthCameraFromWorld);
 
     pipeline = std::make_unique<RegularGridFusionPipeline>(camera_params,
-      kRegularGridResolution, kInitialWorldFromGrid,
-      pose_options);
+      volume, pose_options);
   } else if (FLAGS_sm_pose_estimator == "precomputed" ||
     FLAGS_sm_pose_estimator == "precomputed_refine_with_depth_icp") {
-    // Put the origin at the bottom in y, centered in x and z.
-    const SimilarityTransform kInitialWorldFromGrid =
-      SimilarityTransform(Vector3f(-0.5f * kRegularGridSideLength, 0.0f, -0.5f * kRegularGridSideLength)) *
-      SimilarityTransform(kRegularGridVoxelSize);
-
     if (FLAGS_sm_pose_estimator == "precomputed") {
       pose_options.method = PoseEstimationMethod::PRECOMPUTED;
     } else {
@@ -174,8 +253,25 @@ int SingleMovingCameraMain(int argc, char* argv[]) {
       return 1;
     }
 
+    if (FLAGS_volume_auto_bounds) {
+      // Match frames to poses by timestamp, as the pipeline does.
+      VolumeBoundsEstimator estimator;
+      AddRgbdFileToVolumeBounds(FLAGS_sm_input_args, camera_params.depth,
+        pose_options.precomputed_path,
+        pose_options.method ==
+          PoseEstimationMethod::PRECOMPUTED_REFINE_WITH_DEPTH_ICP,
+        FLAGS_volume_bounds_frames, &estimator);
+      if (!estimator.Estimate(
+        static_cast<size_t>(FLAGS_volume_memory_mb) << 20, &volume)) {
+        return 1;
+      }
+    } else if (!has_origin) {
+      // Put the origin at the bottom in y, centered in x and z.
+      volume.Place(Vector3f{ 0 }, Vector3f{ 0.5f, 0.0f, 0.5f });
+    }
+
     pipeline = std::make_unique<RegularGridFusionPipeline>(camera_params,
-      kRegularGridResolution, kInitialWorldFromGrid, pose_options);
+      volume, pose_options);
   }
 
   ControlWidget control_widget;
@@ -235,31 +331,22 @@ RGBDCameraParameters makeRGBDCameraParameters(double focalLength,
   params.depth.undistortion_map = undistortRectifyMap(
     cvCameraMatrix, dist_coeffs, cv::Mat(),
     cvCameraMatrix, cvImageSize);
+  params.depth.undistortion_remap = CompileUndistortRemap(
+    params.depth.undistortion_map.readView(), params.depth.resolution);
 
   return params;
 }
 
-SimilarityTransform MakeWorldFromGrid(const Vector3f& center,
-  float side_length, int resolution) {
-  // Input grid coordinate p: [0, resolution]
-  // Position relative to corner of the grid: q = p * voxel_size.
-  // Position relative to the world: r = corner + q.
-  Vector3f corner = center - Vector3f{0.5f * side_length};
-  float voxel_size = side_length / resolution;
-
-  auto s0 = SimilarityTransform(voxel_size);
-  auto s1 = SimilarityTransform(corner);
-  auto s2 = s1 * s0;
-
-  auto t1 = SimilarityTransform(corner) * SimilarityTransform(voxel_size);
-
-  return t1;
-}
-
 #include "libcgt/core/io/NumberedFilenameBuilder.h"
 
 
 int MultiStaticCameraMain(int argc, char* argv[]) {
+  TSDFVolumeSpec volume;
+  bool has_origin;
+  if (!GetTSDFVolumeSpecFromFlags(&volume, &has_origin)) {
+    return 1;
+  }
+
   QApplication app(argc, argv);
 
   std::vector<std::string> rgbd_stream_filenames = {
@@ -305,32 +392,61 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
     camera_poses[i] = rot180 * camera_poses[i] * rot180;
   }
 
-  // HACK: where to place grid.
-  // Pick a pixel from camera 1.
-  const Vector2f xy0{
-    camera_params[1].depth.resolution.x / 2.0f,
-    camera_params[1].depth.resolution.x / 4.0f};
-  const float z0 = 2.5f;
-  PerspectiveCamera center_camera(
-    camera_poses[1],
-    camera_params[1].depth.intrinsics,
-    Vector2f(camera_params[1].depth.resolution),
-    camera_params[1].depth.depth_range.left(),
-    camera_params[1].depth.depth_range.right()
-  );
-  Vector4f p0 = center_camera.worldFromScreen(xy0,
-    z0, Vector2f(camera_params[1].depth.resolution));
-
-  constexpr int kRegularGridResolution = 512;
-  constexpr float kRegularGridSideLength = 2.0f;
-  constexpr float kVoxelSize = kRegularGridSideLength / kRegularGridResolution;
-  constexpr float kMaxTSDFValue = 32 * kVoxelSize;
-  const SimilarityTransform initial_world_from_grid =
-    MakeWorldFromGrid(p0.xyz, kRegularGridSideLength, kRegularGridResolution);
+  if (FLAGS_volume_auto_bounds) {
+    // The cameras are static, so every frame of a camera has its pose.
+    VolumeBoundsEstimator estimator;
+    for (int i = 0; i < kNumCameras; ++i) {
+      AddRgbdFileToVolumeBounds(rgbd_stream_filenames[i],
+        camera_params[i].depth,
+        [&](const InputBuffer& frame,
+          EuclideanTransform* depth_camera_from_world) {
+          *depth_camera_from_world = camera_poses[i];
+          return true;
+        }, FLAGS_volume_bounds_frames, &estimator);
+    }
+    if (!estimator.Estimate(
+      static_cast<size_t>(FLAGS_volume_memory_mb) << 20, &volume)) {
+      return 1;
+    }
+  } else if (!has_origin) {
+    // HACK: where to place grid.
+    // Pick a pixel from camera 1.
+    const Vector2f xy0{
+      camera_params[1].depth.resolution.x / 2.0f,
+      camera_params[1].depth.resolution.x / 4.0f};
+    const float z0 = 2.5f;
+    PerspectiveCamera center_camera(
+      camera_poses[1],
+      camera_params[1].depth.intrinsics,
+      Vector2f(camera_params[1].depth.resolution),
+      camera_params[1].depth.depth_range.left(),
+      camera_params[1].depth.depth_range.right()
+    );
+    Vector4f p0 = center_camera.worldFromScreen(xy0,
+      z0, Vector2f(camera_params[1].depth.resolution));
+    volume.Place(p0.xyz, Vector3f{ 0.5f });
+  }
+  // Static cameras see the same surfaces every frame, so fusion can afford
+  // a wider truncation band.
+  if (volume.max_tsdf_value <= 0) {
+    volume.max_tsdf_value = 32 * volume.voxel_size;
+  }
 
   MultiStaticCameraPipeline pipeline(camera_params, camera_poses,
-                                     Vector3i{kRegularGridResolution},
-                                     initial_world_from_grid, kMaxTSDFValue);
+                                     volume.resolution,
+                                     volume.WorldFromGrid(),
+                                     volume.MaxTSDFValue(),
+                                     FLAGS_ms_preprocessing_threads);
+
+  std::vector<RgbdInput> inputs;
+  for (size_t i = 0; i < rgbd_stream_filenames.size(); ++i) {
+    inputs.emplace_back(RgbdInput::InputType::FILE,
+      rgbd_stream_filenames[i].c_str(), camera_params[i].depth.depth_range);
+  }
+  FrameSynchronizer synchronizer(&inputs, camera_params,
+    static_cast<int64_t>(FLAGS_ms_sync_tolerance_ms * 1e6),
+    FLAGS_ms_max_frames_ahead);
+
   if (FLAGS_ms_use_gui) {
     ControlWidget control_widget;
     control_widget.setGeometry(50, 50, 150, 150);
@@ -351,46 +467,34 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
     // GUI version, non-gui version
     MainController controller(nullptr, nullptr,
                               &control_widget, &main_widget);
-    for(size_t i = 0; i < rgbd_stream_filenames.size(); ++i) {
-      controller.inputs_.emplace_back(RgbdInput::InputType::FILE,
-                                      rgbd_stream_filenames[i].c_str());
-    }
+    controller.frame_synchronizer_ = &synchronizer;
     controller.msc_pipeline_ = &pipeline;
     return app.exec();
   } else {
-    std::vector<RgbdInput> inputs;
-    for(size_t i = 0; i < rgbd_stream_filenames.size(); ++i) {
-      inputs.emplace_back(RgbdInput::InputType::FILE,
-        rgbd_stream_filenames[i].c_str());
+    std::vector<InputBuffer*> buffers;
+    for (int i = 0; i < pipeline.NumCameras(); ++i) {
+      buffers.push_back(&pipeline.GetInputBuffer(i));
     }
+    std::vector<bool> color_updated;
 
     NumberedFilenameBuilder nfb("c:/tmp/multicam/meshes/frame_", ".obj");
 
+    const int kMaxFramesets = 1800;
     int frame_index = 0;
-    while (true) {
-      bool rgb_updated;
-      bool depth_updated;
-      for(int i = 0; i < static_cast<int>(inputs.size()); ++i) {
-        printf("Processing frame %d of %zu\n", i, inputs.size());
-        pipeline.Reset();
-
-        inputs[i].read(&pipeline.GetInputBuffer(i),
-          &rgb_updated, &depth_updated);
-        if (!depth_updated) {
-          break;
-        }
-
-        pipeline.NotifyInputUpdated(i, rgb_updated, depth_updated);
+    while (frame_index < kMaxFramesets &&
+      synchronizer.Next(buffers, &color_updated)) {
+      printf("Processing frameset %d\n", frame_index);
+      pipeline.Reset();
+      for (int i = 0; i < pipeline.NumCameras(); ++i) {
+        pipeline.NotifyInputUpdated(i, color_updated[i], true);
       }
       // TODO: shouldn't have to call this.
       pipeline.Fuse();
       pipeline.Triangulate(rot180.asMatrix()).saveOBJ(
       nfb.filenameForNumber(frame_index));
       ++frame_index;
-      if (frame_index > 1799) {
-        break;
-      }
     }
+    synchronizer.PrintStats();
 
     return 0;
   }
@@ -399,15 +503,68 @@ int MultiStaticCameraMain(int argc, char* argv[]) {
 
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_normal_estimator != "forward_difference" &&
+    FLAGS_normal_estimator != "covariance") {
+    printf("Invalid normal estimator: %s.\n", FLAGS_normal_estimator.c_str());
+    return 1;
+  }
+  if (FLAGS_tsdf_cascade_levels < 1) {
+    printf("tsdf_cascade_levels must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_submap_resolution > 0 &&
+    (FLAGS_tsdf_cascade_levels > 1 || FLAGS_rolling_volume_dir != "")) {
+    printf("submap_resolution cannot be combined with tsdf_cascade_levels "
+      "or rolling_volume_dir.\n");
+    return 1;
+  }
+  if (FLAGS_fusion_workers < 1) {
+    printf("fusion_workers must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_max_submaps < 1) {
+    printf("max_submaps must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_perf_output != "" && !FLAGS_collect_perf) {
+    printf("perf_output requires collect_perf.\n");
+    return 1;
+  }
+  if (FLAGS_volume_auto_bounds && FLAGS_volume_memory_mb < 1) {
+    printf("volume_memory_mb must be at least 1.\n");
+    return 1;
+  }
+
+  if (FLAGS_trace_output != "") {
+    TraceRecorder::Instance().SetThreadName("main");
+    TraceRecorder::Instance().Start();
+  }
+
+  int exit_code;
   if (FLAGS_mode == "single_moving") {
-    return SingleMovingCameraMain(argc, argv);
+    exit_code = SingleMovingCameraMain(argc, argv);
   } else if (FLAGS_mode == "multi_static") {
-    return MultiStaticCameraMain(argc, argv);
+    exit_code = MultiStaticCameraMain(argc, argv);
   } else {
     printf("Invalid mode: %s.\n"
       "mode must be \"single_moving\" or \"multi_static\"\n",
       FLAGS_mode.c_str());
     return 1;
   }
+
+  if (FLAGS_trace_output != "") {
+    TraceRecorder::Instance().Stop();
+    if (!TraceRecorder::Instance().WriteChromeTrace(FLAGS_trace_output)) {
+      return 1;
+    }
+  }
+  if (FLAGS_collect_perf) {
+    PerfCollector::Instance().Print();
+    if (FLAGS_perf_output != "" &&
+      !PerfCollector::Instance().Write(FLAGS_perf_output)) {
+      return 1;
+    }
+  }
+  return exit_code;
 }
 
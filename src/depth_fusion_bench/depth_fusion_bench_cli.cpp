@@ -0,0 +1,843 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the stages of the fusion pipeline on the CPU with deterministic
+// synthetic input, and measures the accuracy of the result against ground
+// truth.
+//
+// Depth frames are rendered by sphere tracing an analytic signed distance
+// function along a scripted camera path (see synthetic_scene.h) and
+// quantized to millimeters, like a depth camera's. Depth noise is drawn from
+// a seeded generator, so every run sees identical input.
+//
+// Each frame is preprocessed by the host path of DepthProcessor. Fusion,
+// raycasting and ICP call the same per-voxel and per-pixel functions as
+// FuseKernel, AdaptiveRaycastKernel / RaycastKernel and ICPKernel
+// (FuseVoxel(), RaycastPixel() and ICPPixel()), including the depth noise
+// model, so that regressions in accuracy show up here too.
+//
+// The micro benchmarks time preprocessing (fused, and the standalone
+// Smooth() and EstimateNormals() it replaces), fusion, raycasting, ICP,
+// marching cubes and file I/O separately, at ground truth poses. The
+// tracking benchmark runs the whole loop: raycast the volume from the
+// previous pose estimate, align the incoming frame to it with ICP, and fuse
+// the frame at the estimated pose. Timings are summarized as percentiles
+// and, with --output, written as JSON along with the trajectory error and
+// the mesh error: the distance from each mesh vertex to the true surface.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <helper_math.h>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "../depth_noise_model.h"
+#include "../depth_processor.h"
+#include "../fuse_voxel.cuh"
+#include "../icp_least_squares_data.h"
+#include "../icp_pixel.cuh"
+#include "../marching_cubes.h"
+#include "../perf_collector.h"
+#include "../raycast_pixel.cuh"
+#include "../synthetic_scene.h"
+#include "../tsdf.h"
+#include "../voxel_layout.h"
+
+using libcgt::core::vecmath::SimilarityTransform;
+
+DEFINE_string(scene, "all",
+  "Synthetic scene to benchmark: spheres, boxes, room, or all.");
+DEFINE_int32(resolution, 128,
+  "Grid resolution along each axis. Must be a multiple of 8.");
+DEFINE_int32(num_frames, 40, "Number of synthetic depth frames per scene.");
+DEFINE_int32(image_width, 160, "Width of the synthetic depth frames.");
+DEFINE_int32(image_height, 120, "Height of the synthetic depth frames.");
+DEFINE_double(depth_noise, 0.0015,
+  "Standard deviation of the depth noise at 1 meter, in meters. It grows "
+  "with depth squared. 0 disables noise.");
+DEFINE_string(depth_noise_model, "kinect_v1",
+  "Noise model used to truncate and weight depth samples during fusion: "
+  "constant or kinect_v1.");
+DEFINE_bool(adaptive_raycast, true, "Use signed distance values themselves "
+  "during raycasting rather than one voxel at a time, as in depth_fusion.");
+DEFINE_int32(seed, 1, "Seed for the depth noise.");
+DEFINE_int32(repetitions, 3,
+  "Number of times to repeat each micro benchmark.");
+DEFINE_string(output, "",
+  "If set, write timings and accuracy to this file as JSON.");
+DEFINE_string(io_dir, "",
+  "If set, also benchmark writing and reading the volume and writing the "
+  "mesh, to files in this directory.");
+DEFINE_bool(collect_perf, false,
+  "Print every recorded stage at exit, in addition to the summary.");
+
+namespace {
+
+constexpr float kMinDepth = 0.3f;
+constexpr float kMaxDepth = 5.0f;
+
+// Same as RegularGridTSDF.
+constexpr float kMinTruncationVoxels = 2.0f;
+
+// Same as ProjectivePointPlaneICP.
+constexpr int kICPNumIterations = 15;
+constexpr int kICPMinNumSamples = 300;
+constexpr int kICPImageGuardBand = 16;
+constexpr float kICPMaxDistanceForMatch = 0.1f;
+constexpr float kICPMinDotProductForMatch = 0.7f;
+constexpr float kICPMaxTranslation = 0.15f;
+constexpr float kICPMaxRotationRadians = 0.1745f;
+
+const char* kSceneNames[] = { "spheres", "boxes", "room" };
+
+// Every stage recorded per scene, in the order they are reported.
+const char* kStageNames[] = {
+  "synthesize", "preprocess", "smooth", "normals", "fuse", "raycast", "icp",
+  "marching_cubes", "write_volume", "read_volume", "write_mesh",
+  "tracking_raycast", "tracking_icp", "tracking_fuse", "tracking_frame"
+};
+
+// Re-orthonormalize the rotation after accumulating rounding error.
+RigidTransform Orthonormalize(const RigidTransform& t) {
+  float3 z_axis = normalize(t.z_axis);
+  float3 x_axis = normalize(cross(t.y_axis, z_axis));
+  return{ x_axis, cross(z_axis, x_axis), z_axis, t.origin };
+}
+
+// The rigid transformation from ICP's linearized solution, as in
+// rigidTransformationFromApprox(): T(x[3..5]) * Rz(x[2]) * Ry(x[1]) *
+// Rx(x[0]).
+RigidTransform RigidTransformFromApprox(const float x[6]) {
+  float ca = cosf(x[0]);
+  float sa = sinf(x[0]);
+  float cb = cosf(x[1]);
+  float sb = sinf(x[1]);
+  float cg = cosf(x[2]);
+  float sg = sinf(x[2]);
+  // Columns of Rz * Ry * Rx.
+  return{
+    make_float3(cg * cb, sg * cb, -sb),
+    make_float3(cg * sb * sa - sg * ca, sg * sb * sa + cg * ca, cb * sa),
+    make_float3(cg * sb * ca + sg * sa, sg * sb * ca - cg * sa, cb * ca),
+    make_float3(x[3], x[4], x[5]) };
+}
+
+float4x4 AsFloat4x4(const RigidTransform& t) {
+  return make_float4x4(t.AsMatrix());
+}
+
+float2 DepthMinMax() {
+  return make_float2(kMinDepth, kMaxDepth);
+}
+
+SyntheticCamera MakeCamera(const RigidTransform& world_from_camera) {
+  return MakeSyntheticCamera(world_from_camera, FLAGS_image_width,
+    FLAGS_image_height);
+}
+
+// Returns false if name is not a known model.
+bool MakeDepthNoiseModel(const std::string& name, DepthNoiseModel* model) {
+  if (name == "constant") {
+    *model = DepthNoiseModel();
+  } else if (name == "kinect_v1") {
+    *model = DepthNoiseModel::KinectV1();
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Depth in millimeters, as read from a depth camera, 0 where invalid.
+Array2D<uint16_t> ToMillimeters(Array2DReadView<float> depth_meters) {
+  Array2D<uint16_t> depth_mm(depth_meters.size());
+  for (int y = 0; y < depth_meters.height(); ++y) {
+    for (int x = 0; x < depth_meters.width(); ++x) {
+      float mm = std::round(1000.0f * depth_meters[{ x, y }]);
+      depth_mm[{ x, y }] =
+        static_cast<uint16_t>(std::min(std::max(mm, 0.0f), 65535.0f));
+    }
+  }
+  return depth_mm;
+}
+
+// The outputs of DepthProcessor::Preprocess() for one frame.
+struct Frame {
+  explicit Frame(const Vector2i& size) :
+    depth_meters(size),
+    smoothed_depth(size),
+    normals(size) {
+  }
+
+  // What is fused.
+  Array2D<float> depth_meters;
+  // What ICP aligns to the model.
+  Array2D<float> smoothed_depth;
+  Array2D<Vector4f> normals;
+};
+
+void Preprocess(const DepthProcessor& depth_processor,
+  Array2DReadView<uint16_t> depth_mm, Frame* frame) {
+  DepthProcessor::HostPreprocessBuffers outputs;
+  outputs.depth_meters = frame->depth_meters.writeView();
+  outputs.smoothed_depth = frame->smoothed_depth.writeView();
+  outputs.normals = frame->normals.writeView();
+  depth_processor.Preprocess(depth_mm, Array2DReadView<uint32_t>(), outputs);
+}
+
+template <typename Layout>
+using HostTSDFGridWriteView =
+  VoxelGridView<TSDF, Layout, Array3DWriteView<TSDF>>;
+
+// A TSDF grid on the host, in the pipeline's VoxelLayout, covering a
+// scene's grid bounds.
+struct HostGrid {
+  HostGrid(const SyntheticScene& scene, int resolution) :
+    resolution(make_int3(resolution)),
+    voxel_size(2.0f * scene.grid_half_extent / resolution),
+    max_tsdf_value(4.0f * voxel_size),
+    origin(scene.grid_center - make_float3(scene.grid_half_extent)),
+    storage(VoxelLayout::StorageSize(Vector3i{ resolution })) {
+    Clear();
+  }
+
+  void Clear() {
+    storage.fill(TSDF(0, 0, max_tsdf_value));
+  }
+
+  HostTSDFGridWriteView<VoxelLayout> WriteView() {
+    return HostTSDFGridWriteView<VoxelLayout>(storage.writeView(),
+      resolution);
+  }
+
+  HostTSDFGridView<VoxelLayout> ReadView() const {
+    return HostTSDFGridView<VoxelLayout>(storage.readView(), resolution);
+  }
+
+  // Voxel centers are at half-integer grid coordinates.
+  SimilarityTransform WorldFromGrid() const {
+    return SimilarityTransform(Vector3f(origin.x, origin.y, origin.z)) *
+      SimilarityTransform(voxel_size);
+  }
+
+  SimilarityTransform GridFromWorld() const {
+    return SimilarityTransform(1.0f / voxel_size) *
+      SimilarityTransform(Vector3f(-origin.x, -origin.y, -origin.z));
+  }
+
+  // For MarchingCubes(), which places voxel xyz at integer coordinates.
+  SimilarityTransform WorldFromVoxelIndex() const {
+    return WorldFromGrid() * SimilarityTransform(Vector3f(0.5f));
+  }
+
+  int3 resolution;
+  float voxel_size;
+  float max_tsdf_value;
+  float3 origin;
+  Array3D<TSDF> storage;
+};
+
+// RegularGridTSDF::Fuse() on the host.
+void Fuse(HostGrid& grid, const SyntheticCamera& camera,
+  const DepthNoiseModel& noise_model, const Frame& frame) {
+  HostTSDFGridWriteView<VoxelLayout> view = grid.WriteView();
+  const float4x4 world_from_grid =
+    make_float4x4(grid.WorldFromGrid().asMatrix());
+  const float4x4 camera_from_world =
+    AsFloat4x4(camera.world_from_camera.Inverse());
+  const float4 flpp = make_float4(camera.Flpp());
+  const float min_truncation = kMinTruncationVoxels * grid.voxel_size;
+  Array2DReadView<float> depth = frame.depth_meters.readView();
+  Array2DReadView<Vector4f> normals = frame.normals.readView();
+  for (int k = 0; k < view.depth(); ++k) {
+    for (int j = 0; j < view.height(); ++j) {
+      for (int i = 0; i < view.width(); ++i) {
+        float3 voxel_center_camera = transformPoint(camera_from_world,
+          transformPoint(world_from_grid,
+            make_float3(i + 0.5f, j + 0.5f, k + 0.5f)));
+        float dz;
+        float weight;
+        if (FuseVoxel(voxel_center_camera, flpp, DepthMinMax(),
+          min_truncation, grid.max_tsdf_value, noise_model, depth, normals,
+          &dz, &weight)) {
+          view[make_int3(i, j, k)].Update(dz, weight, grid.max_tsdf_value);
+        }
+      }
+    }
+  }
+}
+
+// RegularGridTSDF::AdaptiveRaycast() (or Raycast() without
+// --adaptive_raycast) on the host. Returns the number of hits.
+int Raycast(const HostGrid& grid, const SyntheticCamera& camera,
+  Array2DWriteView<float4> world_points,
+  Array2DWriteView<float4> world_normals) {
+  HostTSDFGridView<VoxelLayout> view = grid.ReadView();
+  const float4x4 grid_from_world =
+    make_float4x4(grid.GridFromWorld().asMatrix());
+  const float4x4 world_from_grid =
+    make_float4x4(grid.WorldFromGrid().asMatrix());
+  const float voxels_per_meter =
+    FLAGS_adaptive_raycast ? 1.0f / grid.voxel_size : 0.0f;
+  const float4 flpp = make_float4(camera.Flpp());
+  const float4x4 world_from_camera = AsFloat4x4(camera.world_from_camera);
+  const float3 eye_world = camera.world_from_camera.origin;
+  int num_hits = 0;
+  for (int y = 0; y < world_points.height(); ++y) {
+    for (int x = 0; x < world_points.width(); ++x) {
+      float4 world_point;
+      float4 world_normal;
+      if (RaycastPixel(view, grid_from_world, world_from_grid,
+        grid.max_tsdf_value, voxels_per_meter, flpp, world_from_camera,
+        eye_world, make_int2(x, y), &world_point, &world_normal)) {
+        ++num_hits;
+      }
+      world_points[{ x, y }] = world_point;
+      world_normals[{ x, y }] = world_normal;
+    }
+  }
+  return num_hits;
+}
+
+// Same as the Plus reduction in ProjectivePointPlaneICP.
+void Accumulate(const ICPLeastSquaresData& sample, ICPLeastSquaresData* sum) {
+  for (int i = 0; i < 21; ++i) {
+    sum->a[i] += sample.a[i];
+  }
+  for (int i = 0; i < 6; ++i) {
+    sum->b[i] += sample.b[i];
+  }
+  sum->num_samples += sample.num_samples;
+  sum->squared_residual += sample.squared_residual;
+}
+
+struct ICPResult {
+  bool valid = false;
+  int num_samples = 0;
+  RigidTransform world_from_camera;
+};
+
+// ProjectivePointPlaneICP::EstimatePose() on the host: estimate the pose of
+// the incoming frame by point-to-plane ICP against a raycast of the volume
+// from model_camera, starting from model_camera's pose.
+ICPResult EstimatePose(const SyntheticCamera& model_camera,
+  const Frame& incoming, Array2DReadView<float4> world_points,
+  Array2DReadView<float4> world_normals) {
+  ICPResult result;
+  const float4 flpp = make_float4(model_camera.Flpp());
+  const float4x4 model_from_world =
+    AsFloat4x4(model_camera.world_from_camera.Inverse());
+  Array2DReadView<float> depth = incoming.smoothed_depth.readView();
+  Array2DReadView<Vector4f> normals = incoming.normals.readView();
+  RigidTransform model_from_current = RigidTransform::Identity();
+
+  for (int iteration = 0; iteration < kICPNumIterations; ++iteration) {
+    const float4x4 model_from_current4 = AsFloat4x4(model_from_current);
+    const float4x4 current_from_model4 =
+      AsFloat4x4(model_from_current.Inverse());
+    ICPLeastSquaresData sum = {};
+
+    for (int y = 0; y < world_points.height(); ++y) {
+      for (int x = 0; x < world_points.width(); ++x) {
+        ICPLeastSquaresData sample = {};
+        if (ICPPixel(flpp, DepthMinMax(), model_from_world,
+          model_from_current4, current_from_model4, depth, normals,
+          world_points[{ x, y }], world_normals[{ x, y }],
+          kICPImageGuardBand, kICPMaxDistanceForMatch,
+          kICPMinDotProductForMatch, &sample) == ICPPixelResult::MATCHED) {
+          Accumulate(sample, &sum);
+        }
+      }
+    }
+
+    result.num_samples = sum.num_samples;
+    if (sum.num_samples < kICPMinNumSamples) {
+      return result;
+    }
+
+    float x[6];
+    Solve(sum, x);
+    model_from_current = RigidTransformFromApprox(x) * model_from_current;
+  }
+
+  if (length(model_from_current.origin) > kICPMaxTranslation ||
+    model_from_current.Angle() > kICPMaxRotationRadians) {
+    return result;
+  }
+
+  result.valid = true;
+  result.world_from_camera = Orthonormalize(
+    model_camera.world_from_camera * model_from_current);
+  return result;
+}
+
+// The distance from each vertex of a mesh to the true surface.
+struct MeshError {
+  int64_t num_vertices = 0;
+  double mean_m = 0.0;
+  double rms_m = 0.0;
+  double max_m = 0.0;
+};
+
+MeshError ComputeMeshError(const SyntheticScene& scene,
+  const std::vector<Vector3f>& positions) {
+  MeshError error;
+  double sum = 0.0;
+  double sum_squared = 0.0;
+  for (const Vector3f& p : positions) {
+    double d = fabs(scene.Distance(make_float3(p.x, p.y, p.z)));
+    sum += d;
+    sum_squared += d * d;
+    error.max_m = std::max(error.max_m, d);
+  }
+  error.num_vertices = static_cast<int64_t>(positions.size());
+  if (error.num_vertices > 0) {
+    error.mean_m = sum / error.num_vertices;
+    error.rms_m = sqrt(sum_squared / error.num_vertices);
+  }
+  return error;
+}
+
+// The error of estimated poses against ground truth. There is no alignment
+// step: tracking starts at the ground truth pose.
+struct TrajectoryError {
+  int num_frames = 0;
+  int num_failures = 0;
+  double translation_rmse_m = 0.0;
+  double max_translation_m = 0.0;
+  double mean_rotation_deg = 0.0;
+  double max_rotation_deg = 0.0;
+};
+
+TrajectoryError ComputeTrajectoryError(
+  const std::vector<RigidTransform>& estimated,
+  const std::vector<RigidTransform>& ground_truth) {
+  TrajectoryError error;
+  error.num_frames = static_cast<int>(estimated.size());
+  double sum_squared = 0.0;
+  double sum_degrees = 0.0;
+  for (size_t i = 0; i < estimated.size(); ++i) {
+    double translation =
+      length(estimated[i].origin - ground_truth[i].origin);
+    double degrees = 180.0 / M_PI *
+      (estimated[i].Inverse() * ground_truth[i]).Angle();
+    sum_squared += translation * translation;
+    sum_degrees += degrees;
+    error.max_translation_m = std::max(error.max_translation_m, translation);
+    error.max_rotation_deg = std::max(error.max_rotation_deg, degrees);
+  }
+  if (error.num_frames > 0) {
+    error.translation_rmse_m = sqrt(sum_squared / error.num_frames);
+    error.mean_rotation_deg = sum_degrees / error.num_frames;
+  }
+  return error;
+}
+
+struct SceneResult {
+  std::string name;
+  int64_t num_hits = 0;
+  MeshError fusion_mesh;
+  MeshError tracking_mesh;
+  TrajectoryError tracking;
+};
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+void Record(const SyntheticScene& scene, const char* stage,
+  std::chrono::steady_clock::time_point start) {
+  PerfCollector::Instance().RecordLatency(scene.name + "/" + stage,
+    MillisecondsSince(start));
+}
+
+// Returns false on an I/O error.
+bool RunIOBenchmarks(const SyntheticScene& scene, HostGrid& grid,
+  const std::vector<Vector3f>& positions,
+  const std::vector<Vector3f>& normals) {
+  std::string volume_filename =
+    FLAGS_io_dir + "/depth_fusion_bench_" + scene.name + ".tsdf";
+  std::string mesh_filename =
+    FLAGS_io_dir + "/depth_fusion_bench_" + scene.name + ".obj";
+  size_t num_voxels = grid.storage.numElements();
+
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    auto start = std::chrono::steady_clock::now();
+    FILE* fp = fopen(volume_filename.c_str(), "wb");
+    if (fp == nullptr) {
+      fprintf(stderr, "Failed to open %s for writing.\n",
+        volume_filename.c_str());
+      return false;
+    }
+    bool ok = fwrite(grid.storage.pointer(), sizeof(TSDF), num_voxels, fp) ==
+      num_voxels;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+      fprintf(stderr, "Failed to write %s.\n", volume_filename.c_str());
+      return false;
+    }
+    Record(scene, "write_volume", start);
+
+    start = std::chrono::steady_clock::now();
+    fp = fopen(volume_filename.c_str(), "rb");
+    if (fp == nullptr) {
+      fprintf(stderr, "Failed to open %s for reading.\n",
+        volume_filename.c_str());
+      return false;
+    }
+    ok = fread(grid.storage.pointer(), sizeof(TSDF), num_voxels, fp) ==
+      num_voxels;
+    fclose(fp);
+    if (!ok) {
+      fprintf(stderr, "Failed to read %s.\n", volume_filename.c_str());
+      return false;
+    }
+    Record(scene, "read_volume", start);
+
+    start = std::chrono::steady_clock::now();
+    if (!ConstructMarchingCubesMesh(positions, normals).saveOBJ(
+      mesh_filename)) {
+      fprintf(stderr, "Failed to write %s.\n", mesh_filename.c_str());
+      return false;
+    }
+    Record(scene, "write_mesh", start);
+  }
+  return true;
+}
+
+// Returns false on an I/O error.
+bool RunScene(const SyntheticScene& scene,
+  const DepthNoiseModel& noise_model, SceneResult* result) {
+  result->name = scene.name;
+
+  const Vector2i image_size{ FLAGS_image_width, FLAGS_image_height };
+  const Range1f depth_range = Range1f::fromMinMax(kMinDepth, kMaxDepth);
+  const SyntheticCamera intrinsics_camera =
+    MakeCamera(RigidTransform::Identity());
+  DepthProcessor::Intrinsics intrinsics;
+  intrinsics.focalLength = Vector2f{ intrinsics_camera.focal_length,
+    intrinsics_camera.focal_length };
+  intrinsics.principalPoint = Vector2f{ intrinsics_camera.principal_point.x,
+    intrinsics_camera.principal_point.y };
+  DepthProcessor depth_processor(intrinsics, depth_range);
+
+  std::vector<RigidTransform> ground_truth;
+  std::vector<SyntheticCamera> cameras;
+  std::vector<Array2D<uint16_t>> depth_maps_mm;
+  GaussianNoise noise(static_cast<uint32_t>(FLAGS_seed));
+  for (int i = 0; i < FLAGS_num_frames; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    ground_truth.push_back(scene.Pose(i));
+    cameras.push_back(MakeCamera(ground_truth.back()));
+    Array2D<float> depth = RenderDepth(scene, cameras.back(),
+      FLAGS_image_width, FLAGS_image_height, depth_range,
+      static_cast<float>(FLAGS_depth_noise), &noise);
+    depth_maps_mm.push_back(ToMillimeters(depth.readView()));
+    Record(scene, "synthesize", start);
+  }
+
+  std::vector<Frame> frames;
+  for (int i = 0; i < FLAGS_num_frames; ++i) {
+    frames.emplace_back(image_size);
+  }
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    for (int i = 0; i < FLAGS_num_frames; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      Preprocess(depth_processor, depth_maps_mm[i].readView(), &frames[i]);
+      Record(scene, "preprocess", start);
+    }
+  }
+
+  // The unfused host paths, on the converted depth.
+  Array2D<float> unfused_smoothed_depth(image_size);
+  Array2D<Vector4f> unfused_normals(image_size);
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    for (int i = 0; i < FLAGS_num_frames; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      depth_processor.Smooth(frames[i].depth_meters.readView(),
+        unfused_smoothed_depth.writeView());
+      Record(scene, "smooth", start);
+
+      start = std::chrono::steady_clock::now();
+      depth_processor.EstimateNormals(unfused_smoothed_depth.readView(),
+        unfused_normals.writeView());
+      Record(scene, "normals", start);
+    }
+  }
+
+  HostGrid grid(scene, FLAGS_resolution);
+  Array2D<float4> world_points(image_size);
+  Array2D<float4> world_normals(image_size);
+
+  // Micro benchmarks, at ground truth poses.
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    grid.Clear();
+    for (int i = 0; i < FLAGS_num_frames; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      Fuse(grid, cameras[i], noise_model, frames[i]);
+      Record(scene, "fuse", start);
+    }
+  }
+
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    result->num_hits = 0;
+    for (int i = 0; i < FLAGS_num_frames; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      result->num_hits += Raycast(grid, cameras[i], world_points.writeView(),
+        world_normals.writeView());
+      Record(scene, "raycast", start);
+    }
+  }
+
+  for (int i = 1; i < FLAGS_num_frames; ++i) {
+    Raycast(grid, cameras[i - 1], world_points.writeView(),
+      world_normals.writeView());
+    for (int r = 0; r < FLAGS_repetitions; ++r) {
+      auto start = std::chrono::steady_clock::now();
+      EstimatePose(cameras[i - 1], frames[i], world_points.readView(),
+        world_normals.readView());
+      Record(scene, "icp", start);
+    }
+  }
+
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+  for (int r = 0; r < FLAGS_repetitions; ++r) {
+    positions.clear();
+    normals.clear();
+    auto start = std::chrono::steady_clock::now();
+    MarchingCubes(grid.ReadView(), grid.max_tsdf_value,
+      grid.WorldFromVoxelIndex(), positions, normals, false);
+    Record(scene, "marching_cubes", start);
+  }
+  result->fusion_mesh = ComputeMeshError(scene, positions);
+
+  if (!FLAGS_io_dir.empty() &&
+    !RunIOBenchmarks(scene, grid, positions, normals)) {
+    return false;
+  }
+
+  // The tracking loop. The first frame is fused at its ground truth pose.
+  grid.Clear();
+  std::vector<RigidTransform> estimated;
+  estimated.push_back(ground_truth[0]);
+  Fuse(grid, cameras[0], noise_model, frames[0]);
+  for (int i = 1; i < FLAGS_num_frames; ++i) {
+    auto frame_start = std::chrono::steady_clock::now();
+    SyntheticCamera previous = MakeCamera(estimated.back());
+
+    auto start = std::chrono::steady_clock::now();
+    Raycast(grid, previous, world_points.writeView(),
+      world_normals.writeView());
+    Record(scene, "tracking_raycast", start);
+
+    start = std::chrono::steady_clock::now();
+    ICPResult icp = EstimatePose(previous, frames[i],
+      world_points.readView(), world_normals.readView());
+    Record(scene, "tracking_icp", start);
+
+    // Like the pipeline, keep the previous pose if ICP fails.
+    if (icp.valid) {
+      estimated.push_back(icp.world_from_camera);
+    } else {
+      estimated.push_back(estimated.back());
+      ++result->tracking.num_failures;
+    }
+
+    start = std::chrono::steady_clock::now();
+    Fuse(grid, MakeCamera(estimated.back()), noise_model, frames[i]);
+    Record(scene, "tracking_fuse", start);
+    Record(scene, "tracking_frame", frame_start);
+  }
+  int num_failures = result->tracking.num_failures;
+  result->tracking = ComputeTrajectoryError(estimated, ground_truth);
+  result->tracking.num_failures = num_failures;
+
+  positions.clear();
+  normals.clear();
+  MarchingCubes(grid.ReadView(), grid.max_tsdf_value,
+    grid.WorldFromVoxelIndex(), positions, normals, false);
+  result->tracking_mesh = ComputeMeshError(scene, positions);
+
+  return true;
+}
+
+void PrintMeshError(const char* label, const MeshError& error) {
+  printf("  %-8s mesh error: %lld vertices, mean %.2f mm, rms %.2f mm, "
+    "max %.2f mm\n", label, static_cast<long long>(error.num_vertices),
+    1000 * error.mean_m, 1000 * error.rms_m, 1000 * error.max_m);
+}
+
+void PrintSceneResult(const SceneResult& result) {
+  printf("%s\n", result.name.c_str());
+  for (const char* stage : kStageNames) {
+    PerfCollector::StageStats stats;
+    if (!PerfCollector::Instance().Stats(result.name + "/" + stage,
+      &stats)) {
+      continue;
+    }
+    printf("  %-16s n = %5lld, mean = %9.3f ms, p50 = %9.3f ms, "
+      "p95 = %9.3f ms, max = %9.3f ms\n", stage,
+      static_cast<long long>(stats.count), stats.mean_ms, stats.p50_ms,
+      stats.p95_ms, stats.max_ms);
+  }
+  PrintMeshError("fusion", result.fusion_mesh);
+  PrintMeshError("tracking", result.tracking_mesh);
+  printf("  tracking: %d / %d frames failed, translation rmse %.2f mm, "
+    "max %.2f mm, rotation mean %.3f deg, max %.3f deg\n",
+    result.tracking.num_failures, result.tracking.num_frames - 1,
+    1000 * result.tracking.translation_rmse_m,
+    1000 * result.tracking.max_translation_m,
+    result.tracking.mean_rotation_deg, result.tracking.max_rotation_deg);
+}
+
+void WriteMeshErrorJSON(FILE* fp, const MeshError& error) {
+  fprintf(fp, "{ \"num_vertices\": %lld, \"mean_m\": %g, \"rms_m\": %g, "
+    "\"max_m\": %g }", static_cast<long long>(error.num_vertices),
+    error.mean_m, error.rms_m, error.max_m);
+}
+
+// Returns false on failure.
+bool WriteJSON(const std::string& filename,
+  const std::vector<SceneResult>& results) {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing.\n", filename.c_str());
+    return false;
+  }
+
+  fprintf(fp, "{\n  \"config\": { \"resolution\": %d, \"num_frames\": %d, "
+    "\"image_width\": %d, \"image_height\": %d, \"depth_noise\": %g, "
+    "\"depth_noise_model\": \"%s\", \"adaptive_raycast\": %s, "
+    "\"seed\": %d, \"repetitions\": %d, \"voxel_layout\": \"%s\", "
+    "\"voxel_bytes\": %zu },\n",
+    FLAGS_resolution, FLAGS_num_frames, FLAGS_image_width,
+    FLAGS_image_height, FLAGS_depth_noise, FLAGS_depth_noise_model.c_str(),
+    FLAGS_adaptive_raycast ? "true" : "false", FLAGS_seed, FLAGS_repetitions,
+    VoxelLayout::Name(), sizeof(TSDF));
+  fprintf(fp, "  \"scenes\": {");
+  const char* scene_separator = "\n";
+  for (const SceneResult& result : results) {
+    fprintf(fp, "%s    \"%s\": {\n      \"stages\": {", scene_separator,
+      result.name.c_str());
+    scene_separator = ",\n";
+
+    const char* separator = "\n";
+    for (const char* stage : kStageNames) {
+      PerfCollector::StageStats stats;
+      if (!PerfCollector::Instance().Stats(result.name + "/" + stage,
+        &stats)) {
+        continue;
+      }
+      fprintf(fp, "%s        \"%s\": { \"count\": %lld, \"mean_ms\": %f, "
+        "\"min_ms\": %f, \"p50_ms\": %f, \"p95_ms\": %f, \"p99_ms\": %f, "
+        "\"max_ms\": %f }", separator, stage,
+        static_cast<long long>(stats.count), stats.mean_ms, stats.min_ms,
+        stats.p50_ms, stats.p95_ms, stats.p99_ms, stats.max_ms);
+      separator = ",\n";
+    }
+    fprintf(fp, "\n      },\n      \"raycast_hits\": %lld,\n",
+      static_cast<long long>(result.num_hits));
+    fprintf(fp, "      \"fusion_mesh_error\": ");
+    WriteMeshErrorJSON(fp, result.fusion_mesh);
+    fprintf(fp, ",\n      \"tracking_mesh_error\": ");
+    WriteMeshErrorJSON(fp, result.tracking_mesh);
+    fprintf(fp, ",\n      \"tracking_error\": { \"num_frames\": %d, "
+      "\"num_failures\": %d, \"translation_rmse_m\": %g, "
+      "\"max_translation_m\": %g, \"mean_rotation_deg\": %g, "
+      "\"max_rotation_deg\": %g }\n    }",
+      result.tracking.num_frames, result.tracking.num_failures,
+      result.tracking.translation_rmse_m, result.tracking.max_translation_m,
+      result.tracking.mean_rotation_deg, result.tracking.max_rotation_deg);
+  }
+  fprintf(fp, "\n  }\n}\n");
+
+  bool succeeded = !ferror(fp);
+  fclose(fp);
+  return succeeded;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::vector<std::string> scene_names;
+  for (const char* name : kSceneNames) {
+    if (FLAGS_scene == "all" || FLAGS_scene == name) {
+      scene_names.push_back(name);
+    }
+  }
+  if (scene_names.empty()) {
+    fprintf(stderr, "scene must be one of spheres, boxes, room, or all.\n");
+    return 1;
+  }
+  if (!BrickVoxelLayout::IsValidResolution(Vector3i{ FLAGS_resolution })) {
+    fprintf(stderr, "resolution must be a positive multiple of %d.\n",
+      BrickVoxelLayout::kBrickSize);
+    return 1;
+  }
+  if (FLAGS_num_frames < 2 || FLAGS_repetitions < 1 ||
+    FLAGS_image_width <= 2 * kICPImageGuardBand ||
+    FLAGS_image_height <= 2 * kICPImageGuardBand) {
+    fprintf(stderr, "num_frames must be at least 2, repetitions at least "
+      "1, and the image must be larger than %d x %d.\n",
+      2 * kICPImageGuardBand, 2 * kICPImageGuardBand);
+    return 1;
+  }
+  if (FLAGS_depth_noise < 0) {
+    fprintf(stderr, "depth_noise must be non-negative.\n");
+    return 1;
+  }
+  DepthNoiseModel noise_model;
+  if (!MakeDepthNoiseModel(FLAGS_depth_noise_model, &noise_model)) {
+    fprintf(stderr, "depth_noise_model must be constant or kinect_v1.\n");
+    return 1;
+  }
+
+  printf("%d^3 voxels of %zu bytes (%s layout), %d frames of %d x %d, "
+    "%d repetitions\n", FLAGS_resolution, sizeof(TSDF), VoxelLayout::Name(),
+    FLAGS_num_frames, FLAGS_image_width, FLAGS_image_height,
+    FLAGS_repetitions);
+
+  std::vector<SceneResult> results;
+  for (const std::string& name : scene_names) {
+    SceneResult result;
+    SyntheticScene scene;
+    MakeSyntheticScene(name, &scene);
+    if (!RunScene(scene, noise_model, &result)) {
+      return 1;
+    }
+    PrintSceneResult(result);
+    results.push_back(result);
+  }
+
+  if (FLAGS_collect_perf) {
+    PerfCollector::Instance().Print();
+  }
+  if (!FLAGS_output.empty() && !WriteJSON(FLAGS_output, results)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef DEPTH_NOISE_MODEL_H
+#define DEPTH_NOISE_MODEL_H
+
+#include <cmath>
+
+#include <cuda_runtime.h>
+
+// Axial noise model of a depth sensor: the standard deviation of a depth
+// sample as a function of its depth and the angle between the surface
+// normal and the viewing ray.
+//
+// During fusion, sigma determines each sample's truncation width and
+// its weight. The model is a POD so that it can be passed by value to
+// kernels.
+struct DepthNoiseModel {
+  enum class Type : int {
+    // sigma is independent of depth and angle. Every sample is truncated at
+    // the TSDF's max_tsdf_value and has weight 1.
+    CONSTANT = 0,
+
+    // sigma(z, theta) =
+    //   sigma_0 + sigma_1 * (z - z_0)^2 +
+    //   sigma_angle / sqrt(z) * theta^2 / (pi / 2 - theta)^2
+    //
+    // [Nguyen et al. 2012, "Modeling Kinect Sensor Noise for Improved 3D
+    // Reconstruction and Tracking"].
+    QUADRATIC = 1
+  };
+
+  Type type = Type::CONSTANT;
+
+  // In meters.
+  float sigma_0 = 0.0012f;
+  // In meters^-1.
+  float sigma_1 = 0.0019f;
+  // In meters.
+  float z_0 = 0.4f;
+  // In meters^1.5.
+  float sigma_angle = 0.0001f;
+
+  // A sample is truncated at truncation_sigmas * sigma.
+  float truncation_sigmas = 3.0f;
+
+  // The weight of a sample with the smallest possible sigma (sigma_0). All
+  // other samples have weight (sigma_0 / sigma)^2 relative to it, rounded
+  // to an integer in [1, max_sample_weight] since the TSDF stores integer
+  // weights.
+  int max_sample_weight = 8;
+
+  // The model from Nguyen et al. 2012, fit to a Kinect v1.
+  __inline__ __host__
+  static DepthNoiseModel KinectV1() {
+    DepthNoiseModel model;
+    model.type = Type::QUADRATIC;
+    return model;
+  }
+
+  // z: depth, in meters.
+  // cos_theta: cosine of the angle between the surface normal and the
+  //   direction towards the camera. Pass 1 if the normal is unknown.
+  __inline__ __host__ __device__
+  float Sigma(float z, float cos_theta) const {
+    if (type == Type::CONSTANT) {
+      return sigma_0;
+    }
+
+    const float kHalfPi = 0.5f * static_cast<float>(M_PI);
+    // Keep theta strictly below pi / 2, where sigma is infinite.
+    const float kMaxTheta = kHalfPi - 0.01f;
+
+    float dz = z - z_0;
+    float sigma = sigma_0 + sigma_1 * dz * dz;
+    float theta = fminf(acosf(fminf(fmaxf(cos_theta, 0.0f), 1.0f)), kMaxTheta);
+    float t = theta / (kHalfPi - theta);
+    return sigma + sigma_angle / sqrtf(z) * t * t;
+  }
+
+  // Half-width of the truncation band of a sample with standard deviation
+  // sigma. It is at least min_truncation so that a thin band is still
+  // resolved by the grid, and at most max_truncation, the TSDF's
+  // representable range.
+  __inline__ __host__ __device__
+  float Truncation(float sigma, float min_truncation,
+    float max_truncation) const {
+    if (type == Type::CONSTANT) {
+      return max_truncation;
+    }
+    return fminf(fmaxf(truncation_sigmas * sigma, min_truncation),
+      max_truncation);
+  }
+
+  // Fusion weight of a sample with standard deviation sigma.
+  __inline__ __host__ __device__
+  float Weight(float sigma) const {
+    if (type == Type::CONSTANT) {
+      return 1.0f;
+    }
+    float r = sigma_0 / sigma;
+    float w = roundf(max_sample_weight * r * r);
+    return fminf(fmaxf(w, 1.0f), static_cast<float>(max_sample_weight));
+  }
+};
+
+#endif  // DEPTH_NOISE_MODEL_H
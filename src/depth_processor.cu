@@ -13,6 +13,8 @@
 // limitations under the License.
 #include "depth_processor.h"
 
+#include <cassert>
+
 #include "libcgt/cuda/Event.h"
 #include "libcgt/cuda/MathUtils.h"
 #include "libcgt/cuda/Rect2i.h"
@@ -20,6 +22,9 @@
 #include "libcgt/cuda/VecmathConversions.h"
 
 #include "camera_math.cuh"
+#include "perf_collector.h"
+#include "trace_recorder.h"
+#include "undistort_remap.h"
 
 using libcgt::cuda::Event;
 using libcgt::cuda::threadmath::threadSubscript2DGlobal;
@@ -27,11 +32,31 @@ using libcgt::cuda::contains;
 using libcgt::cuda::inset;
 using libcgt::cuda::math::numBins2D;
 
+// Weight of the neighbor at offset (dx, dy) whose squared depth difference
+// from the center is delta_z_squared. See DepthProcessor::BilateralKernel.
+__inline__ __device__
+float BilateralWeight(int dx, int dy, float delta_z_squared,
+  float delta_z_squared_threshold, bool gaussian,
+  float inv_two_spatial_sigma_squared, float inv_two_range_sigma_squared) {
+  float dr2 = dx * dx + dy * dy;
+  if (gaussian) {
+    return __expf(-dr2 * inv_two_spatial_sigma_squared -
+      delta_z_squared * inv_two_range_sigma_squared);
+  } else {
+    float spatial_weight = 1.0f / (1.0f + sqrt(dr2));
+    float range_weight = delta_z_squared_threshold - delta_z_squared;
+    return spatial_weight * range_weight;
+  }
+}
+
 __global__
 void SmoothDepthMapKernel(KernelArray2D<const float> input,
   float2 depth_min_max,
   int kernel_radius,
   float delta_z_squared_threshold,
+  bool gaussian,
+  float inv_two_spatial_sigma_squared,
+  float inv_two_range_sigma_squared,
   KernelArray2D<float> smoothed) {
   int2 xy = threadSubscript2DGlobal();
   libcgt::cuda::Rect2i valid_rect = inset(libcgt::cuda::Rect2i(input.size()),
@@ -50,12 +75,9 @@ void SmoothDepthMapKernel(KernelArray2D<const float> input,
         float delta_z = z2 - z;
         float delta_z_squared = delta_z * delta_z;
         if (z2 != 0 && delta_z_squared < delta_z_squared_threshold) {
-          float dr2 = dx * dx + dy * dy;
-          float dr = sqrt(dr2);
-          // TODO(jiawen): Hacky bilateral filter without exp().
-          float spatial_weight = 1.0f / (1.0f + dr);
-          float range_weight = delta_z_squared_threshold - delta_z_squared;
-          float weight = spatial_weight * range_weight;
+          float weight = BilateralWeight(dx, dy, delta_z_squared,
+            delta_z_squared_threshold, gaussian,
+            inv_two_spatial_sigma_squared, inv_two_range_sigma_squared);
           sum += weight * z2;
           sum_weights += weight;
         }
@@ -69,21 +91,23 @@ void SmoothDepthMapKernel(KernelArray2D<const float> input,
   smoothed[xy] = smoothed_z;
 }
 
+// Decode an entry of a CompileUndistortRemap() table. Returns false if the
+// source is outside of the input.
+__inline__ __device__
+bool RemapSource(uint32_t entry, int2* src_xy) {
+  *src_xy = make_int2(entry & 0xffff, entry >> 16);
+  return entry != kInvalidRemapEntry;
+}
+
 __global__
-void UndistortKernel(cudaTextureObject_t raw_depth,
-  cudaTextureObject_t undistort_map,
+void UndistortKernel(KernelArray2D<const float> raw_depth,
+  KernelArray2D<const uint32_t> undistort_remap,
   KernelArray2D<float> undistorted) {
   int2 xy = threadSubscript2DGlobal();
   if (contains(libcgt::cuda::Rect2i(undistorted.size()), xy)) {
-    // TODO: make a function to go from xy to [0,1]
-
-    float u = xy.x + 0.5f;
-    float v = xy.y + 0.5f;
-
-    // Fetch from undistort_map[uv] to get xy2.
-    float2 xy2 = tex2D<float2>(undistort_map, u, v);
-
-    undistorted[xy] = tex2D<float>(raw_depth, xy2.x, xy2.y);
+    int2 src_xy;
+    undistorted[xy] = RemapSource(undistort_remap[xy], &src_xy) ?
+      raw_depth[src_xy] : 0.0f;
   }
 }
 
@@ -124,93 +148,437 @@ void EstimateNormalsKernel(KernelArray2D<const float> depth_map,
   normals[xy] = normal;
 }
 
-DepthProcessor::DepthProcessor(const Intrinsics& depth_intrinsics,
-  const Range1f& depth_range) :
-  depth_intrinsics_flpp_{ depth_intrinsics.focalLength,
-    depth_intrinsics.principalPoint },
-  depth_range_(depth_range) {
+// Write the moments of each valid pixel of depth_map, shifted by one row and
+// column, into integral_moments, which is one row and column larger. Row
+// and column 0 are zero.
+__global__
+void PointMomentsKernel(KernelArray2D<const float> depth_map,
+  float4 flpp, float2 depth_min_max,
+  KernelArray2D<PointMoments> integral_moments) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(libcgt::cuda::Rect2i(integral_moments.size()), xy)) {
+    return;
+  }
+
+  PointMoments moments = {};
+  if (xy.x > 0 && xy.y > 0) {
+    int2 depth_xy{ xy.x - 1, xy.y - 1 };
+    float z = depth_map[depth_xy];
+    if (z >= depth_min_max.x && z <= depth_min_max.y) {
+      float3 p = CameraFromPixel(depth_xy, z, flpp);
+      moments = MakePointMoments(p.x, p.y, p.z);
+    }
+  }
+  integral_moments[xy] = moments;
+}
+
+// In-place inclusive prefix sum of each row (if rows is true) or each column
+// of a. One thread per row or column.
+__global__
+void PrefixSumMomentsKernel(KernelArray2D<PointMoments> a, bool rows) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  int num_lines = rows ? a.height() : a.width();
+  int line_length = rows ? a.width() : a.height();
+  if (i >= num_lines) {
+    return;
+  }
 
+  PointMoments sum = {};
+  for (int j = 0; j < line_length; ++j) {
+    int2 xy = rows ? int2{ j, i } : int2{ i, j };
+    PointMoments& moments = a[xy];
+    for (int k = 0; k < PointMoments::kNumMoments; ++k) {
+      sum.m[k] += moments.m[k];
+      moments.m[k] = sum.m[k];
+    }
+  }
 }
 
-void DepthProcessor::Undistort(DeviceArray2D<float>& raw_depth,
-  DeviceArray2D<float2>& undistort_map,
-  DeviceArray2D<float>& undistorted_depth) {
-  // Bind raw_depth and undistort_map to texture objects.
+__global__
+void CovarianceNormalsKernel(KernelArray2D<const float> depth_map,
+  float2 depth_min_max, int window_radius, int min_count,
+  KernelArray2D<const PointMoments> integral_moments,
+  KernelArray2D<float4> normals) {
+  int2 xy = threadSubscript2DGlobal();
+  if (!contains(libcgt::cuda::Rect2i(depth_map.size()), xy)) {
+    return;
+  }
 
-  cudaResourceDesc raw_depth_res_desc = raw_depth.resourceDesc();
-  cudaResourceDesc undistort_map_res_desc = undistort_map.resourceDesc();
+  float4 normal = {};
+  float z = depth_map[xy];
+  if (z >= depth_min_max.x && z <= depth_min_max.y) {
+    int x0 = max(xy.x - window_radius, 0);
+    int y0 = max(xy.y - window_radius, 0);
+    int x1 = min(xy.x + window_radius + 1, depth_map.width());
+    int y1 = min(xy.y + window_radius + 1, depth_map.height());
+    const PointMoments& i00 = integral_moments[int2{ x0, y0 }];
+    const PointMoments& i10 = integral_moments[int2{ x1, y0 }];
+    const PointMoments& i01 = integral_moments[int2{ x0, y1 }];
+    const PointMoments& i11 = integral_moments[int2{ x1, y1 }];
+    PointMoments window;
+    for (int k = 0; k < PointMoments::kNumMoments; ++k) {
+      window.m[k] = (i11.m[k] + i00.m[k]) - (i10.m[k] + i01.m[k]);
+    }
+
+    float n[3];
+    float confidence;
+    if (NormalFromMoments(window, min_count, n, &confidence)) {
+      normal = make_float4(n[0], n[1], n[2], confidence);
+    }
+  }
+  normals[xy] = normal;
+}
+
+// Fused Undistort + Smooth + EstimateNormals + 2x downsample. See
+// DepthProcessor::Preprocess().
+//
+// Each block computes blockDim outputs. It first stages converted (and
+// undistorted) depth for its tile, plus one extra row and column for
+// normals, plus a kernel_radius apron, into shared memory, then smooths the
+// tile (plus the extra row and column) into shared memory. blockDim must be
+// even so that 2x2 blocks for the half resolution output do not straddle
+// thread blocks.
+//
+// Outputs whose write_* flag is false are not touched.
+__global__
+void PreprocessKernel(KernelArray2D<const uint16_t> raw_depth_mm,
+  KernelArray2D<const uint32_t> undistort_remap, bool undistort,
+  float2 depth_min_max,
+  int kernel_radius,
+  float delta_z_squared_threshold,
+  bool gaussian,
+  float inv_two_spatial_sigma_squared,
+  float inv_two_range_sigma_squared,
+  float4 flpp,
+  KernelArray2D<float> depth_meters, bool write_depth_meters,
+  KernelArray2D<float> smoothed, bool write_smoothed,
+  KernelArray2D<float4> normals, bool write_normals,
+  KernelArray2D<float> half_res_smoothed, bool write_half_res_smoothed) {
+  extern __shared__ float shared[];
+
+  const int2 size = raw_depth_mm.size();
+  const int smoothed_tile_width = blockDim.x + 1;
+  const int smoothed_tile_height = blockDim.y + 1;
+  const int meters_tile_width = smoothed_tile_width + 2 * kernel_radius;
+  const int meters_tile_height = smoothed_tile_height + 2 * kernel_radius;
+  float* meters_tile = shared;
+  float* smoothed_tile = shared + meters_tile_width * meters_tile_height;
+
+  const int2 block_origin = make_int2(blockIdx.x * blockDim.x,
+    blockIdx.y * blockDim.y);
+  const int thread_index = threadIdx.y * blockDim.x + threadIdx.x;
+  const int num_threads = blockDim.x * blockDim.y;
+  const libcgt::cuda::Rect2i image_rect(size);
+
+  // Convert and undistort the tile plus apron.
+  for (int i = thread_index; i < meters_tile_width * meters_tile_height;
+    i += num_threads) {
+    int2 tile_xy = make_int2(i % meters_tile_width, i / meters_tile_width);
+    int2 xy = block_origin + tile_xy -
+      make_int2(kernel_radius, kernel_radius);
+    float z = 0.0f;
+    if (contains(image_rect, xy)) {
+      int2 src_xy = xy;
+      bool valid = true;
+      if (undistort) {
+        valid = RemapSource(undistort_remap[xy], &src_xy);
+      }
+      if (valid) {
+        z = 0.001f * raw_depth_mm[src_xy];
+      }
+    }
+    meters_tile[i] = z;
+  }
+  __syncthreads();
 
-  cudaTextureDesc point_normalized_tex_desc = {};
-  point_normalized_tex_desc.addressMode[0] = cudaAddressModeClamp;
-  point_normalized_tex_desc.addressMode[1] = cudaAddressModeClamp;
-  point_normalized_tex_desc.filterMode = cudaFilterModePoint;
-  point_normalized_tex_desc.readMode = cudaReadModeElementType;
-  point_normalized_tex_desc.normalizedCoords = true;
+  // Smooth the tile plus one extra row and column, unless only depth_meters
+  // was requested. The condition is uniform across the block.
+  const bool need_smoothed = write_smoothed || write_normals ||
+    write_half_res_smoothed;
+  const libcgt::cuda::Rect2i valid_rect = inset(image_rect,
+    { kernel_radius, kernel_radius });
+  for (int i = thread_index;
+    need_smoothed && i < smoothed_tile_width * smoothed_tile_height;
+    i += num_threads) {
+    int2 tile_xy = make_int2(i % smoothed_tile_width, i / smoothed_tile_width);
+    int2 xy = block_origin + tile_xy;
+    const float* center =
+      &(meters_tile[(tile_xy.y + kernel_radius) * meters_tile_width +
+        tile_xy.x + kernel_radius]);
+    float z = *center;
+    float smoothed_z = 0.0f;
+    if (contains(valid_rect, xy) &&
+      z >= depth_min_max.x && z <= depth_min_max.y) {
+      float sum = 0.0f;
+      float sum_weights = 0.0f;
+      for (int dy = -kernel_radius; dy <= kernel_radius; ++dy) {
+        for (int dx = -kernel_radius; dx <= kernel_radius; ++dx) {
+          float z2 = center[dy * meters_tile_width + dx];
+          float delta_z = z2 - z;
+          float delta_z_squared = delta_z * delta_z;
+          if (z2 != 0 && delta_z_squared < delta_z_squared_threshold) {
+            float weight = BilateralWeight(dx, dy, delta_z_squared,
+              delta_z_squared_threshold, gaussian,
+              inv_two_spatial_sigma_squared, inv_two_range_sigma_squared);
+            sum += weight * z2;
+            sum_weights += weight;
+          }
+        }
+      }
+      if (sum_weights > 0.0f) {
+        smoothed_z = sum / sum_weights;
+      }
+    }
+    smoothed_tile[i] = smoothed_z;
+  }
+  __syncthreads();
 
-  cudaTextureDesc point_unnormalized_tex_desc = {};
-  point_unnormalized_tex_desc.addressMode[0] = cudaAddressModeClamp;
-  point_unnormalized_tex_desc.addressMode[1] = cudaAddressModeClamp;
-  point_unnormalized_tex_desc.filterMode = cudaFilterModePoint;
-  point_unnormalized_tex_desc.readMode = cudaReadModeElementType;
-  point_unnormalized_tex_desc.normalizedCoords = false;
+  int2 xy = threadSubscript2DGlobal();
+  int2 tile_xy = make_int2(threadIdx.x, threadIdx.y);
+  if (!contains(image_rect, xy)) {
+    return;
+  }
 
-  cudaError err;
+  float depth0 = smoothed_tile[tile_xy.y * smoothed_tile_width + tile_xy.x];
+  if (write_depth_meters) {
+    depth_meters[xy] = meters_tile[(tile_xy.y + kernel_radius) *
+      meters_tile_width + tile_xy.x + kernel_radius];
+  }
+  if (write_smoothed) {
+    smoothed[xy] = depth0;
+  }
 
-  cudaTextureObject_t raw_depth_tex_obj;
-  err = cudaCreateTextureObject(&raw_depth_tex_obj, &raw_depth_res_desc,
-      &point_normalized_tex_desc, nullptr);
+  if (write_normals) {
+    float4 normal = {};
+    if (xy.x < size.x - 1 && xy.y < size.y - 1) {
+      int2 xy1{ xy.x + 1, xy.y };
+      int2 xy2{ xy.x, xy.y + 1 };
+      float depth1 =
+        smoothed_tile[tile_xy.y * smoothed_tile_width + tile_xy.x + 1];
+      float depth2 =
+        smoothed_tile[(tile_xy.y + 1) * smoothed_tile_width + tile_xy.x];
+      if (depth0 >= depth_min_max.x && depth0 <= depth_min_max.y &&
+        depth1 >= depth_min_max.x && depth1 <= depth_min_max.y &&
+        depth2 >= depth_min_max.x && depth2 <= depth_min_max.y) {
+        float3 p0 = CameraFromPixel(xy, depth0, flpp);
+        float3 dx = CameraFromPixel(xy1, depth1, flpp) - p0;
+        float3 dy = CameraFromPixel(xy2, depth2, flpp) - p0;
+        float3 n = cross(dx, dy);
+        float lenSquared = lengthSquared(n);
+        if (lenSquared > 0.0f) {
+          normal = make_float4(n / sqrt(lenSquared), 1.0f);
+        }
+      }
+    }
+    normals[xy] = normal;
+  }
 
-  cudaTextureObject_t undistort_map_tex_obj;
-  err = cudaCreateTextureObject(&undistort_map_tex_obj, &undistort_map_res_desc,
-      &point_unnormalized_tex_desc, nullptr);
+  if (write_half_res_smoothed && tile_xy.x % 2 == 0 && tile_xy.y % 2 == 0) {
+    int2 half_xy{ xy.x / 2, xy.y / 2 };
+    if (contains(libcgt::cuda::Rect2i(half_res_smoothed.size()), half_xy)) {
+      float sum = 0.0f;
+      int count = 0;
+      for (int dy = 0; dy < 2; ++dy) {
+        for (int dx = 0; dx < 2; ++dx) {
+          float z = smoothed_tile[(tile_xy.y + dy) * smoothed_tile_width +
+            tile_xy.x + dx];
+          if (z >= depth_min_max.x && z <= depth_min_max.y) {
+            sum += z;
+            ++count;
+          }
+        }
+      }
+      half_res_smoothed[half_xy] = count > 0 ? sum / count : 0.0f;
+    }
+  }
+}
 
+void DepthProcessor::Undistort(DeviceArray2D<float>& raw_depth,
+  const DeviceArray2D<uint32_t>& undistort_remap,
+  DeviceArray2D<float>& undistorted_depth) {
+  ScopedTrace trace("DepthProcessor::Undistort", true);
   dim3 block(16, 16);
   dim3 grid = numBins2D(make_int2(raw_depth.size()), block);
 
+  const bool collect_perf = PerfCollector::Enabled();
   Event e;
-  e.recordStart();
+  if (collect_perf) {
+    e.recordStart();
+  }
   UndistortKernel<<<grid, block>>>(
-    raw_depth_tex_obj,
-    undistort_map_tex_obj,
+    raw_depth.readView(),
+    undistort_remap.readView(),
     undistorted_depth.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::Undistort took %f ms\n", dtMS);
-
-  // TODO: don't destroy the texture every time.
-  cudaDestroyTextureObject(undistort_map_tex_obj);
-  cudaDestroyTextureObject(raw_depth_tex_obj);
+  if (collect_perf) {
+    PerfCollector::Instance().RecordLatency("DepthProcessor::Undistort",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+  }
 }
 
 void DepthProcessor::Smooth(DeviceArray2D<float>& raw_depth,
   DeviceArray2D<float>& smoothed_depth) {
+  ScopedTrace trace("DepthProcessor::Smooth", true);
 
   dim3 block(16, 16);
   dim3 grid = numBins2D(make_int2(raw_depth.size()), block);
 
+  const bool collect_perf = PerfCollector::Enabled();
   Event e;
-  e.recordStart();
+  if (collect_perf) {
+    e.recordStart();
+  }
   SmoothDepthMapKernel<<<grid, block>>>(
     raw_depth.readView(),
     make_float2(depth_range_.leftRight()),
     kernel_radius_,
     delta_z_squared_threshold_,
+    bilateral_kernel_ == BilateralKernel::GAUSSIAN,
+    1.0f / (2.0f * spatial_sigma_pixels_ * spatial_sigma_pixels_),
+    1.0f / (2.0f * range_sigma_meters_ * range_sigma_meters_),
     smoothed_depth.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::Smooth took %f ms\n", dtMS);
+  if (collect_perf) {
+    PerfCollector::Instance().RecordLatency("DepthProcessor::Smooth",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+  }
 }
 
 void DepthProcessor::EstimateNormals(DeviceArray2D<float>& smoothed_depth,
   DeviceArray2D<float4>& normals) {
+  ScopedTrace trace("DepthProcessor::EstimateNormals", true);
+  if (normal_estimator_ == NormalEstimator::COVARIANCE) {
+    EstimateCovarianceNormals(smoothed_depth, normals);
+    return;
+  }
+
   dim3 block(16, 16);
   dim3 grid = numBins2D(make_int2(smoothed_depth.size()), block);
 
+  const bool collect_perf = PerfCollector::Enabled();
   Event e;
-  e.recordStart();
+  if (collect_perf) {
+    e.recordStart();
+  }
   EstimateNormalsKernel<<<grid, block>>>(
     smoothed_depth.readView(),
     make_float4(depth_intrinsics_flpp_),
     make_float2(depth_range_.leftRight()),
     normals.writeView());
-  float dtMS = e.recordStopSyncAndGetMillisecondsElapsed();
-  printf("DepthProcessor::EstimateNormals took %f ms\n", dtMS);
+  if (collect_perf) {
+    PerfCollector::Instance().RecordLatency("DepthProcessor::EstimateNormals",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+  }
+}
+
+void DepthProcessor::Preprocess(const DeviceArray2D<uint16_t>& raw_depth_mm,
+  const DeviceArray2D<uint32_t>* undistort_remap,
+  const PreprocessBuffers& outputs) {
+  ScopedTrace trace("DepthProcessor::Preprocess", true);
+  // Outputs that are not requested are passed as empty views.
+  KernelArray2D<float> depth_meters;
+  KernelArray2D<float> smoothed;
+  KernelArray2D<float4> normals;
+  KernelArray2D<float> half_res_smoothed;
+  KernelArray2D<const uint32_t> undistort_remap_view;
+  if (outputs.depth_meters != nullptr) {
+    depth_meters = outputs.depth_meters->writeView();
+  }
+  if (outputs.smoothed_depth != nullptr) {
+    smoothed = outputs.smoothed_depth->writeView();
+  }
+  if (outputs.normals != nullptr) {
+    normals = outputs.normals->writeView();
+  }
+  if (outputs.half_res_smoothed_depth != nullptr) {
+    half_res_smoothed = outputs.half_res_smoothed_depth->writeView();
+  }
+  if (undistort_remap != nullptr) {
+    undistort_remap_view = undistort_remap->readView();
+  }
+
+  // Covariance normals need the whole smoothed image; they are estimated in a
+  // second pass.
+  const bool write_normals_in_kernel = outputs.normals != nullptr &&
+    normal_estimator_ == NormalEstimator::FORWARD_DIFFERENCE;
+
+  dim3 block(16, 16);
+  dim3 grid = numBins2D(make_int2(raw_depth_mm.size()), block);
+  int meters_tile_size = (block.x + 1 + 2 * kernel_radius_) *
+    (block.y + 1 + 2 * kernel_radius_);
+  int smoothed_tile_size = (block.x + 1) * (block.y + 1);
+  size_t shared_memory_bytes =
+    (meters_tile_size + smoothed_tile_size) * sizeof(float);
+
+  const bool collect_perf = PerfCollector::Enabled();
+  Event e;
+  if (collect_perf) {
+    e.recordStart();
+  }
+  PreprocessKernel<<<grid, block, shared_memory_bytes>>>(
+    raw_depth_mm.readView(),
+    undistort_remap_view, undistort_remap != nullptr,
+    make_float2(depth_range_.leftRight()),
+    kernel_radius_,
+    delta_z_squared_threshold_,
+    bilateral_kernel_ == BilateralKernel::GAUSSIAN,
+    1.0f / (2.0f * spatial_sigma_pixels_ * spatial_sigma_pixels_),
+    1.0f / (2.0f * range_sigma_meters_ * range_sigma_meters_),
+    make_float4(depth_intrinsics_flpp_),
+    depth_meters, outputs.depth_meters != nullptr,
+    smoothed, outputs.smoothed_depth != nullptr,
+    normals, write_normals_in_kernel,
+    half_res_smoothed, outputs.half_res_smoothed_depth != nullptr);
+  if (collect_perf) {
+    PerfCollector::Instance().RecordLatency("DepthProcessor::Preprocess",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+  }
+
+  if (outputs.normals != nullptr &&
+    normal_estimator_ == NormalEstimator::COVARIANCE) {
+    assert(outputs.smoothed_depth != nullptr);
+    EstimateCovarianceNormals(*outputs.smoothed_depth, *outputs.normals);
+  }
+}
+
+void DepthProcessor::EstimateCovarianceNormals(
+  DeviceArray2D<float>& smoothed_depth, DeviceArray2D<float4>& normals) {
+  ScopedTrace trace("DepthProcessor::EstimateCovarianceNormals", true);
+  Vector2i integral_size{ smoothed_depth.width() + 1,
+    smoothed_depth.height() + 1 };
+  if (integral_moments_.size() != integral_size) {
+    integral_moments_.resize(integral_size);
+  }
+
+  dim3 block(16, 16);
+  dim3 integral_grid = numBins2D(make_int2(integral_size), block);
+  dim3 grid = numBins2D(make_int2(smoothed_depth.size()), block);
+  const int kScanBlockSize = 64;
+
+  const bool collect_perf = PerfCollector::Enabled();
+  Event e;
+  if (collect_perf) {
+    e.recordStart();
+  }
+  PointMomentsKernel<<<integral_grid, block>>>(
+    smoothed_depth.readView(),
+    make_float4(depth_intrinsics_flpp_),
+    make_float2(depth_range_.leftRight()),
+    integral_moments_.writeView());
+  PrefixSumMomentsKernel<<<
+    (integral_size.y + kScanBlockSize - 1) / kScanBlockSize,
+    kScanBlockSize>>>(integral_moments_.writeView(), true);
+  PrefixSumMomentsKernel<<<
+    (integral_size.x + kScanBlockSize - 1) / kScanBlockSize,
+    kScanBlockSize>>>(integral_moments_.writeView(), false);
+  CovarianceNormalsKernel<<<grid, block>>>(
+    smoothed_depth.readView(),
+    make_float2(depth_range_.leftRight()),
+    normal_window_radius_,
+    MinNormalWindowCount(),
+    integral_moments_.readView(),
+    normals.writeView());
+  if (collect_perf) {
+    PerfCollector::Instance().RecordLatency(
+      "DepthProcessor::EstimateCovarianceNormals",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+  }
 }
@@ -14,41 +14,243 @@
 #ifndef DEPTH_PROCESSOR_H
 #define DEPTH_PROCESSOR_H
 
+#include <cstdint>
+#include <vector>
+
 #include "libcgt/core/cameras/Camera.h"
 #include "libcgt/core/cameras/Intrinsics.h"
+#include "libcgt/core/common/Array2D.h"
 #include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/Vector2f.h"
 #include "libcgt/core/vecmath/Vector4f.h"
 #include "libcgt/cuda/DeviceArray2D.h"
 
+#include "point_moments.h"
+
 class DepthProcessor {
  public:
 
   using Intrinsics = libcgt::core::cameras::Intrinsics;
 
+  // The weights used by Smooth(). In both cases, neighbors that are 0 or
+  // whose squared depth difference from the center is at least
+  // delta_z_squared_threshold_ are rejected.
+  enum class BilateralKernel {
+    // Spatial weight 1 / (1 + r), range weight
+    // delta_z_squared_threshold_ - delta_z^2. Cheap, but not a Gaussian.
+    FAST_APPROXIMATE,
+
+    // Spatial weight exp(-r^2 / (2 spatial_sigma_pixels_^2)), range weight
+    // exp(-delta_z^2 / (2 range_sigma_meters_^2)).
+    GAUSSIAN
+  };
+
+  // How EstimateNormals() computes normals. In both cases, normals are
+  // camera-space unit vectors pointing towards the camera, stored in xyz.
+  // w holds a confidence in (0, 1], and is 0 where there is no normal.
+  enum class NormalEstimator {
+    // Cross product of forward differences to the right and top neighbors.
+    // Cheap but noisy. Confidence is always 1.
+    FORWARD_DIFFERENCE,
+
+    // PCA of the points in a (2 * normal_window_radius_ + 1)^2 window,
+    // using integral images of point moments so that the cost per pixel
+    // does not depend on the window size. Confidence is the planarity of the
+    // window (see NormalFromMoments()).
+    COVARIANCE
+  };
+
   DepthProcessor(const Intrinsics& depth_intrinsics,
-    const Range1f& depth_range);
+    const Range1f& depth_range,
+    BilateralKernel bilateral_kernel = BilateralKernel::FAST_APPROXIMATE,
+    NormalEstimator normal_estimator = NormalEstimator::FORWARD_DIFFERENCE);
 
   // TODO: document which direction is up.
-  // Correct lens distortion in raw_depth using undistort_map.
-  // TODO: switch interface to use textures as inputs.
+  // Correct lens distortion in raw_depth using undistort_remap, compiled by
+  // CompileUndistortRemap() (see undistort_remap.h). Pixels whose source is
+  // outside of raw_depth are set to 0.
   // TODO: switch interface to use surfaces as outputs.
   void Undistort(DeviceArray2D<float>& raw_depth,
-    DeviceArray2D<float2>& undistort_map,
+    const DeviceArray2D<uint32_t>& undistort_remap,
     DeviceArray2D<float>& undistorted_depth);
 
+  // Host version of Undistort(). When compiled with AVX2, eight pixels are
+  // gathered at a time.
+  //
+  // raw_depth and undistorted_depth must not alias.
+  void Undistort(Array2DReadView<float> raw_depth,
+    Array2DReadView<uint32_t> undistort_remap,
+    Array2DWriteView<float> undistorted_depth) const;
+
   // Smooth raw_depth with a bilateral filter.
-  // TODO: replace hack with an actual bilateral filter.
   void Smooth(DeviceArray2D<float>& raw_depth,
     DeviceArray2D<float>& smoothed_depth);
 
+  // Host version of Smooth(), on a single core.
+  //
+  // Spatial weights come from a precomputed table. Columns are processed in
+  // tiles narrow enough that the 2 * kernel_radius_ + 1 input rows of a tile
+  // stay in L1, and on CPUs with AVX2 (detected at run time), 16 output
+  // pixels are filtered at a time.
+  //
+  // With BilateralKernel::GAUSSIAN, range weights are quantized to
+  // kRangeWeightTableSize entries, so the output is close to, but not bit
+  // for bit the same as, the device Smooth()'s, which evaluates them per
+  // tap. FAST_APPROXIMATE range weights are computed as on the device.
+  //
+  // raw_depth and smoothed_depth must have the same size and must not alias.
+  void Smooth(Array2DReadView<float> raw_depth,
+    Array2DWriteView<float> smoothed_depth) const;
+
   void EstimateNormals(DeviceArray2D<float>& smoothed_depth,
     DeviceArray2D<float4>& normals);
 
+  // Host version of EstimateNormals(), on a single core. On CPUs with AVX2,
+  // forward difference normals are estimated eight at a time, and covariance
+  // normals accumulate their integral image in vector registers and solve
+  // for eight normals at a time in single precision. Covariance normals are
+  // still more than ten times as expensive as forward differences.
+  void EstimateNormals(Array2DReadView<float> smoothed_depth,
+    Array2DWriteView<Vector4f> normals) const;
+
+  // The outputs of Preprocess(). Any of them may be null, in which case it
+  // is not written. All but half_res_smoothed_depth have the resolution of
+  // the input.
+  struct PreprocessBuffers {
+    // Converted to meters and undistorted, but not smoothed. This is what
+    // should be fused.
+    DeviceArray2D<float>* depth_meters = nullptr;
+
+    // Equivalent to Smooth() then EstimateNormals(). These are used for
+    // pose estimation. With NormalEstimator::COVARIANCE, normals are
+    // estimated in a second pass from smoothed_depth, which must then be
+    // non-null.
+    DeviceArray2D<float>* smoothed_depth = nullptr;
+    DeviceArray2D<float4>* normals = nullptr;
+
+    // The next level of a depth pyramid: each pixel is the average of the
+    // valid samples in the corresponding 2x2 block of smoothed_depth.
+    DeviceArray2D<float>* half_res_smoothed_depth = nullptr;
+  };
+
+  // Host analogue of PreprocessBuffers. Null views are not written.
+  struct HostPreprocessBuffers {
+    Array2DWriteView<float> depth_meters;
+    Array2DWriteView<float> smoothed_depth;
+    Array2DWriteView<Vector4f> normals;
+    Array2DWriteView<float> half_res_smoothed_depth;
+  };
+
+  // Fused preprocessing of a raw depth frame, in millimeters (0 is invalid):
+  // convert to meters, resample through undistort_remap (if not null), then
+  // smooth, estimate normals, and downsample.
+  //
+  // Unlike calling Undistort(), Smooth() and EstimateNormals() in sequence,
+  // this is a single kernel launch: each thread block stages its input tile
+  // (plus apron) and the smoothed tile in shared memory, and only the
+  // requested outputs are written to global memory.
+  //
+  // undistort_remap is the same as in Undistort().
+  void Preprocess(const DeviceArray2D<uint16_t>& raw_depth_mm,
+    const DeviceArray2D<uint32_t>* undistort_remap,
+    const PreprocessBuffers& outputs);
+
+  // Host version of Preprocess(), on a single core. Rows are processed in
+  // one top-to-bottom sweep, keeping only the 2 * kernel_radius_ + 1
+  // converted rows and two smoothed rows that are still needed, so no
+  // full-frame intermediates are allocated.
+  void Preprocess(Array2DReadView<uint16_t> raw_depth_mm,
+    Array2DReadView<uint32_t> undistort_remap,
+    const HostPreprocessBuffers& outputs) const;
+
   const Vector4f depth_intrinsics_flpp_;
   const Range1f depth_range_;
   const int kernel_radius_ = 2;
   const float delta_z_squared_threshold_ = 0.04f;  // 40 mm for Kinect.
 
+  const BilateralKernel bilateral_kernel_;
+  const float spatial_sigma_pixels_ = 1.5f;
+  const float range_sigma_meters_ = 0.03f;
+
+  const NormalEstimator normal_estimator_;
+  const int normal_window_radius_ = 3;
+  // With NormalEstimator::COVARIANCE, the fraction of the window that must
+  // have valid depth for a normal to be estimated.
+  const float min_normal_window_coverage_ = 0.5f;
+
+ private:
+
+  // Number of entries in range_weights_, spanning
+  // [0, delta_z_squared_threshold_). Only BilateralKernel::GAUSSIAN uses
+  // the table.
+  static constexpr int kRangeWeightTableSize = 1024;
+
+  // Width, in pixels, of the column tiles used by the host Smooth().
+  static constexpr int kSmoothTileWidth = 256;
+
+  // Host lookup tables for Smooth(), built once at construction.
+  // (2 * kernel_radius_ + 1)^2 spatial weights, row major.
+  std::vector<float> spatial_weights_;
+  // Range weight indexed by delta_z^2 * range_weight_table_scale_, or empty
+  // with BilateralKernel::FAST_APPROXIMATE.
+  std::vector<float> range_weights_;
+  float range_weight_table_scale_;
+
+  // Populate spatial_weights_ and range_weights_.
+  void BuildWeightTables();
+
+  int MinNormalWindowCount() const;
+
+  // Device implementation of NormalEstimator::COVARIANCE.
+  void EstimateCovarianceNormals(DeviceArray2D<float>& smoothed_depth,
+    DeviceArray2D<float4>& normals);
+
+  // Device integral image of point moments, with one more row and column
+  // than the depth map. Allocated on first use.
+  DeviceArray2D<PointMoments> integral_moments_;
+
+  // Host implementation of NormalEstimator::COVARIANCE.
+  void EstimateCovarianceNormals(Array2DReadView<float> smoothed_depth,
+    Array2DWriteView<Vector4f> normals) const;
+
+  // The moments of the window [x0, x1) x [y0, y1) from the integral image
+  // entries at its four corners: i11 - i10 - i01 + i00.
+  static void SumWindow(const PointMoments& i00, const PointMoments& i10,
+    const PointMoments& i01, const PointMoments& i11,
+    PointMoments* window_moments);
+
+  // Filter columns [x_begin, x_end) of one row with the scalar path.
+  // rows holds 2 * kernel_radius_ + 1 input row pointers, top to bottom in
+  // memory order, with the row being filtered at rows[kernel_radius_].
+  void SmoothSpan(const float* const* rows, int x_begin, int x_end,
+    float* dst) const;
+
+  // Same as SmoothSpan(), but vectorized, if the CPU supports it. Returns
+  // the first column that was not processed (the remainder is left for
+  // SmoothSpan()).
+  int SmoothSpanSIMD(const float* const* rows, int x_begin, int x_end,
+    float* dst) const;
+
+  // Filter one full row: columns within kernel_radius_ of the border are set
+  // to 0.
+  void SmoothRow(const float* const* rows, int width, float* dst) const;
+
+  // Write the normals of one row given smoothed rows y and y + 1.
+  void EstimateNormalsRow(const float* smoothed_row,
+    const float* next_smoothed_row, int width, int y, Vector4f* dst) const;
+
+  // Write integral image row y + 1 of EstimateCovarianceNormals() given
+  // row y and depth row y.
+  void IntegrateMomentsRow(const float* depth_row, int y, int width,
+    const PointMoments* previous_row, PointMoments* row) const;
+
+  // Write the covariance normals of one row given its depth and the
+  // integral image rows at the top and bottom of its windows. windows is
+  // scratch space for width PointMoments. The eigen solve is vectorized
+  // over pixels if the CPU supports it.
+  void EstimateCovarianceNormalsRow(const float* depth_row,
+    const PointMoments* integral_row0, const PointMoments* integral_row1,
+    int width, PointMoments* windows, Vector4f* dst) const;
 };
 
 #endif  // DEPTH_PROCESSOR_H
@@ -0,0 +1,1013 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host (CPU) implementations of DepthProcessor methods, and the
+// constructor, so that the host paths can be used without the device code.
+// The device implementations are in depth_processor.cu.
+
+#include "depth_processor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "libcgt/core/vecmath/Vector3f.h"
+
+#include "cpu_features.h"
+#include "undistort_remap.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Same as CameraFromPixel() in camera_math.cuh, with pixel centers at
+// half-integers.
+Vector3f CameraFromPixel(const Vector4f& flpp, int x, int y, float z) {
+  return Vector3f{
+    z * (x + 0.5f - flpp.z) / flpp.x,
+    z * (y + 0.5f - flpp.w) / flpp.y,
+    -z
+  };
+}
+
+// dst = a + b.
+inline void AddMoments(const PointMoments& a, const PointMoments& b,
+  PointMoments* dst) {
+#if defined(__AVX2__)
+  for (int i = 0; i < PointMoments::kPaddedNumMoments; i += 4) {
+    _mm256_storeu_pd(dst->m + i, _mm256_add_pd(
+      _mm256_loadu_pd(a.m + i), _mm256_loadu_pd(b.m + i)));
+  }
+#else
+  for (int i = 0; i < PointMoments::kPaddedNumMoments; ++i) {
+    dst->m[i] = a.m[i] + b.m[i];
+  }
+#endif
+}
+
+}  // namespace
+
+DepthProcessor::DepthProcessor(const Intrinsics& depth_intrinsics,
+  const Range1f& depth_range, BilateralKernel bilateral_kernel,
+  NormalEstimator normal_estimator) :
+  depth_intrinsics_flpp_{ depth_intrinsics.focalLength,
+    depth_intrinsics.principalPoint },
+  depth_range_(depth_range),
+  bilateral_kernel_(bilateral_kernel),
+  normal_estimator_(normal_estimator) {
+  BuildWeightTables();
+}
+
+void DepthProcessor::BuildWeightTables() {
+  const int kernel_width = 2 * kernel_radius_ + 1;
+  spatial_weights_.resize(kernel_width * kernel_width);
+  for (int dy = -kernel_radius_; dy <= kernel_radius_; ++dy) {
+    for (int dx = -kernel_radius_; dx <= kernel_radius_; ++dx) {
+      float dr2 = static_cast<float>(dx * dx + dy * dy);
+      float weight;
+      if (bilateral_kernel_ == BilateralKernel::GAUSSIAN) {
+        weight = std::exp(
+          -dr2 / (2.0f * spatial_sigma_pixels_ * spatial_sigma_pixels_));
+      } else {
+        weight = 1.0f / (1.0f + std::sqrt(dr2));
+      }
+      spatial_weights_[(dy + kernel_radius_) * kernel_width +
+        (dx + kernel_radius_)] = weight;
+    }
+  }
+
+  // The FAST_APPROXIMATE range weight is cheaper to compute than to look up.
+  range_weight_table_scale_ =
+    kRangeWeightTableSize / delta_z_squared_threshold_;
+  if (bilateral_kernel_ != BilateralKernel::GAUSSIAN) {
+    return;
+  }
+
+  // Entry i covers delta_z^2 in [i, i + 1) / range_weight_table_scale_ and is
+  // evaluated at the center of that interval.
+  range_weights_.resize(kRangeWeightTableSize);
+  for (int i = 0; i < kRangeWeightTableSize; ++i) {
+    float delta_z_squared = (i + 0.5f) / range_weight_table_scale_;
+    range_weights_[i] = std::exp(-delta_z_squared /
+      (2.0f * range_sigma_meters_ * range_sigma_meters_));
+  }
+}
+
+int DepthProcessor::MinNormalWindowCount() const {
+  int window_width = 2 * normal_window_radius_ + 1;
+  return static_cast<int>(std::ceil(
+    min_normal_window_coverage_ * window_width * window_width));
+}
+
+void DepthProcessor::SumWindow(const PointMoments& i00,
+  const PointMoments& i10, const PointMoments& i01, const PointMoments& i11,
+  PointMoments* window_moments) {
+#if defined(__AVX2__)
+  for (int i = 0; i < PointMoments::kPaddedNumMoments; i += 4) {
+    __m256d sum = _mm256_sub_pd(
+      _mm256_add_pd(_mm256_loadu_pd(i11.m + i), _mm256_loadu_pd(i00.m + i)),
+      _mm256_add_pd(_mm256_loadu_pd(i10.m + i), _mm256_loadu_pd(i01.m + i)));
+    _mm256_storeu_pd(window_moments->m + i, sum);
+  }
+#else
+  for (int i = 0; i < PointMoments::kPaddedNumMoments; ++i) {
+    window_moments->m[i] = (i11.m[i] + i00.m[i]) - (i10.m[i] + i01.m[i]);
+  }
+#endif
+}
+
+void DepthProcessor::EstimateNormals(Array2DReadView<float> smoothed_depth,
+  Array2DWriteView<Vector4f> normals) const {
+  assert(smoothed_depth.size() == normals.size());
+  if (normal_estimator_ == NormalEstimator::COVARIANCE) {
+    EstimateCovarianceNormals(smoothed_depth, normals);
+    return;
+  }
+
+  const int width = smoothed_depth.width();
+  const int height = smoothed_depth.height();
+  for (int y = 0; y < height - 1; ++y) {
+    EstimateNormalsRow(smoothed_depth.rowPointer(y),
+      smoothed_depth.rowPointer(y + 1), width, y, normals.rowPointer(y));
+  }
+  if (height > 0) {
+    Vector4f* dst = normals.rowPointer(height - 1);
+    std::fill(dst, dst + width, Vector4f(0, 0, 0, 0));
+  }
+}
+
+void DepthProcessor::EstimateCovarianceNormals(
+  Array2DReadView<float> smoothed_depth,
+  Array2DWriteView<Vector4f> normals) const {
+  const int width = smoothed_depth.width();
+  const int height = smoothed_depth.height();
+
+  // Integral image row j holds, at x, the moments of all valid points in
+  // [0, x) x [0, j). Output row y only needs integral rows
+  // y - normal_window_radius_ and y + normal_window_radius_ + 1, so only a
+  // ring of the last 2 * normal_window_radius_ + 2 rows is kept.
+  const int num_ring_rows = 2 * normal_window_radius_ + 2;
+  Array2D<PointMoments> integral_rows({ width + 1, num_ring_rows });
+  auto integral_row = [&](int j) {
+    return integral_rows.rowPointer(j % num_ring_rows);
+  };
+
+  // Scratch space for the moments of each pixel's window in an output row.
+  std::vector<PointMoments> windows(width, PointMoments{});
+  for (int j = 0; j <= height; ++j) {
+    PointMoments* row = integral_row(j);
+    if (j == 0) {
+      std::fill(row, row + width + 1, PointMoments{});
+    } else {
+      IntegrateMomentsRow(smoothed_depth.rowPointer(j - 1), j - 1, width,
+        integral_row(j - 1), row);
+    }
+
+    // Integral row j completes the window of output row
+    // j - normal_window_radius_ - 1. The last integral row completes all
+    // remaining windows, which are clamped to the bottom of the image.
+    int y = std::max(j - normal_window_radius_ - 1, 0);
+    int y_end = (j == height) ? height : j - normal_window_radius_;
+    for (; y < y_end; ++y) {
+      EstimateCovarianceNormalsRow(smoothed_depth.rowPointer(y),
+        integral_row(std::max(y - normal_window_radius_, 0)),
+        integral_row(std::min(y + normal_window_radius_ + 1, height)),
+        width, windows.data(), normals.rowPointer(y));
+    }
+  }
+}
+
+void DepthProcessor::Smooth(Array2DReadView<float> raw_depth,
+  Array2DWriteView<float> smoothed_depth) const {
+  assert(raw_depth.size() == smoothed_depth.size());
+
+  const int width = raw_depth.width();
+  const int height = raw_depth.height();
+  const int kernel_width = 2 * kernel_radius_ + 1;
+
+  // Same boundary conditions as the device version: pixels within
+  // kernel_radius_ of the border are set to 0.
+  for (int y = 0; y < height; ++y) {
+    float* dst = smoothed_depth.rowPointer(y);
+    if (y < kernel_radius_ || y >= height - kernel_radius_) {
+      std::fill(dst, dst + width, 0.0f);
+    } else {
+      std::fill(dst, dst + std::min(kernel_radius_, width), 0.0f);
+      std::fill(dst + std::max(width - kernel_radius_, 0), dst + width, 0.0f);
+    }
+  }
+
+  std::vector<const float*> rows(kernel_width);
+  const int x_begin = kernel_radius_;
+  const int x_end = width - kernel_radius_;
+  for (int tile_x = x_begin; tile_x < x_end; tile_x += kSmoothTileWidth) {
+    int tile_x_end = std::min(tile_x + kSmoothTileWidth, x_end);
+    for (int y = kernel_radius_; y < height - kernel_radius_; ++y) {
+      for (int i = 0; i < kernel_width; ++i) {
+        rows[i] = raw_depth.rowPointer(y - kernel_radius_ + i);
+      }
+      float* dst = smoothed_depth.rowPointer(y);
+      int x = SmoothSpanSIMD(rows.data(), tile_x, tile_x_end, dst);
+      SmoothSpan(rows.data(), x, tile_x_end, dst);
+    }
+  }
+}
+
+void DepthProcessor::Undistort(Array2DReadView<float> raw_depth,
+  Array2DReadView<uint32_t> undistort_remap,
+  Array2DWriteView<float> undistorted_depth) const {
+  assert(undistort_remap.size() == undistorted_depth.size());
+  for (int y = 0; y < undistorted_depth.height(); ++y) {
+    RemapRow(raw_depth, undistort_remap.rowPointer(y),
+      undistorted_depth.width(), undistorted_depth.rowPointer(y));
+  }
+}
+
+void DepthProcessor::Preprocess(Array2DReadView<uint16_t> raw_depth_mm,
+  Array2DReadView<uint32_t> undistort_remap,
+  const HostPreprocessBuffers& outputs) const {
+  const int width = raw_depth_mm.width();
+  const int height = raw_depth_mm.height();
+  const int kernel_width = 2 * kernel_radius_ + 1;
+  const bool undistort = undistort_remap.notNull();
+  assert(!undistort || undistort_remap.size() == raw_depth_mm.size());
+  const bool forward_difference_normals = outputs.normals.notNull() &&
+    normal_estimator_ == NormalEstimator::FORWARD_DIFFERENCE;
+
+  // Ring buffers: converted rows y - kernel_radius_ ... y + kernel_radius_
+  // and smoothed rows y - 1 and y.
+  std::vector<float> meters_rows(kernel_width * width);
+  std::vector<float> smoothed_rows(2 * width);
+  std::vector<const float*> rows(kernel_width);
+
+  // y is the row being smoothed. Converted rows are kernel_radius_ ahead.
+  for (int y = -kernel_radius_; y < height; ++y) {
+    int y_in = y + kernel_radius_;
+    if (y_in < height) {
+      float* meters = &(meters_rows[(y_in % kernel_width) * width]);
+      const uint16_t* src = raw_depth_mm.rowPointer(y_in);
+      if (undistort) {
+        RemapRow(raw_depth_mm, undistort_remap.rowPointer(y_in), width,
+          0.001f, meters);
+      } else {
+        for (int x = 0; x < width; ++x) {
+          meters[x] = 0.001f * src[x];
+        }
+      }
+      if (outputs.depth_meters.notNull()) {
+        std::copy(meters, meters + width,
+          outputs.depth_meters.rowPointer(y_in));
+      }
+    }
+    if (y < 0) {
+      continue;
+    }
+
+    float* smoothed = &(smoothed_rows[(y % 2) * width]);
+    if (y < kernel_radius_ || y >= height - kernel_radius_) {
+      std::fill(smoothed, smoothed + width, 0.0f);
+    } else {
+      for (int i = 0; i < kernel_width; ++i) {
+        rows[i] = &(meters_rows[((y - kernel_radius_ + i) % kernel_width) *
+          width]);
+      }
+      SmoothRow(rows.data(), width, smoothed);
+    }
+    if (outputs.smoothed_depth.notNull()) {
+      std::copy(smoothed, smoothed + width,
+        outputs.smoothed_depth.rowPointer(y));
+    }
+
+    if (y > 0) {
+      const float* previous_smoothed = &(smoothed_rows[((y - 1) % 2) * width]);
+      if (forward_difference_normals) {
+        EstimateNormalsRow(previous_smoothed, smoothed, width, y - 1,
+          outputs.normals.rowPointer(y - 1));
+      }
+
+      int half_y = y / 2;
+      if (y % 2 == 1 && outputs.half_res_smoothed_depth.notNull() &&
+        half_y < outputs.half_res_smoothed_depth.height()) {
+        float* dst = outputs.half_res_smoothed_depth.rowPointer(half_y);
+        for (int x = 0; x < outputs.half_res_smoothed_depth.width(); ++x) {
+          float sum = 0.0f;
+          int count = 0;
+          for (float z : { previous_smoothed[2 * x],
+            previous_smoothed[2 * x + 1], smoothed[2 * x],
+            smoothed[2 * x + 1] }) {
+            if (z >= depth_range_.left() && z <= depth_range_.right()) {
+              sum += z;
+              ++count;
+            }
+          }
+          dst[x] = count > 0 ? sum / count : 0.0f;
+        }
+      }
+    }
+  }
+
+  // The last row has no row below it.
+  if (forward_difference_normals && height > 0) {
+    Vector4f* dst = outputs.normals.rowPointer(height - 1);
+    std::fill(dst, dst + width, Vector4f(0, 0, 0, 0));
+  }
+
+  if (outputs.normals.notNull() &&
+    normal_estimator_ == NormalEstimator::COVARIANCE) {
+    assert(outputs.smoothed_depth.notNull());
+    EstimateCovarianceNormals(outputs.smoothed_depth, outputs.normals);
+  }
+}
+
+namespace {
+
+// The parameters of the host bilateral filter, for the SIMD paths. These are
+// free functions so that they can be compiled for instruction sets the rest
+// of this file is not (see cpu_features.h).
+struct SmoothParams {
+  int kernel_radius;
+  // (2 * kernel_radius + 1)^2 spatial weights, row major.
+  const float* spatial_weights;
+  float z_min;
+  float z_max;
+  float delta_z_squared_threshold;
+  // True if every valid center is farther than the threshold from 0, so
+  // that samples without depth are rejected without testing for them.
+  bool zero_fails_threshold;
+  // BilateralKernel::GAUSSIAN only.
+  const float* range_weights;
+  float range_weight_table_scale;
+  int range_weight_table_size;
+};
+
+#if defined(DEPTH_FUSION_HOST_AVX2)
+
+// Adds the sample z2 to the filter of center z with
+// BilateralKernel::FAST_APPROXIMATE weights. The range weight is
+// threshold - delta_z^2, clamped to 0 (and so rejecting delta_z^2 at or
+// above the threshold), computed with one FMA instead of a table lookup.
+template <bool kTestZero>
+DEPTH_FUSION_TARGET_AVX2
+inline void AccumulateFastAVX2(__m256 z, __m256 z2, __m256 spatial_weight,
+  __m256 threshold, __m256* sum, __m256* sum_weights) {
+  const __m256 zero = _mm256_setzero_ps();
+  __m256 delta_z = _mm256_sub_ps(z2, z);
+  __m256 range_weight = _mm256_max_ps(
+    _mm256_fnmadd_ps(delta_z, delta_z, threshold), zero);
+  if (kTestZero) {
+    range_weight = _mm256_and_ps(range_weight,
+      _mm256_cmp_ps(z2, zero, _CMP_NEQ_OQ));
+  }
+  __m256 weight = _mm256_mul_ps(spatial_weight, range_weight);
+  *sum = _mm256_fmadd_ps(weight, z2, *sum);
+  *sum_weights = _mm256_add_ps(*sum_weights, weight);
+}
+
+// sum / sum_weights where z is in [z_min, z_max] and sum_weights > 0, and 0
+// elsewhere.
+DEPTH_FUSION_TARGET_AVX2
+inline __m256 FinishSmoothAVX2(const SmoothParams& params, __m256 z,
+  __m256 sum, __m256 sum_weights) {
+  __m256 output_valid = _mm256_and_ps(
+    _mm256_and_ps(
+      _mm256_cmp_ps(z, _mm256_set1_ps(params.z_min), _CMP_GE_OQ),
+      _mm256_cmp_ps(z, _mm256_set1_ps(params.z_max), _CMP_LE_OQ)),
+    _mm256_cmp_ps(sum_weights, _mm256_setzero_ps(), _CMP_GT_OQ));
+  return _mm256_and_ps(_mm256_div_ps(sum, sum_weights), output_valid);
+}
+
+// kKernelRadius is params.kernel_radius, if known at compile time (so that
+// the loops over the kernel are unrolled), or 0.
+template <bool kTestZero, int kKernelRadius>
+DEPTH_FUSION_TARGET_AVX2
+int SmoothSpanFastAVX2(const SmoothParams& params, const float* const* rows,
+  int x_begin, int x_end, float* dst) {
+  constexpr int kLanes = 8;
+  const int kernel_radius =
+    kKernelRadius > 0 ? kKernelRadius : params.kernel_radius;
+  const int kernel_width = 2 * kernel_radius + 1;
+  const __m256 threshold = _mm256_set1_ps(params.delta_z_squared_threshold);
+  const float* center_row = rows[kernel_radius];
+
+  // Two vectors at a time: interleaving independent accumulators hides the
+  // latency of the FMAs.
+  int x = x_begin;
+  for (; x + 2 * kLanes <= x_end; x += 2 * kLanes) {
+    __m256 z0 = _mm256_loadu_ps(center_row + x);
+    __m256 z1 = _mm256_loadu_ps(center_row + x + kLanes);
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum_weights0 = _mm256_setzero_ps();
+    __m256 sum_weights1 = _mm256_setzero_ps();
+    for (int i = 0; i < kernel_width; ++i) {
+      const float* row = rows[i] + x - kernel_radius;
+      const float* spatial_row = params.spatial_weights + i * kernel_width;
+      for (int j = 0; j < kernel_width; ++j) {
+        __m256 spatial_weight = _mm256_set1_ps(spatial_row[j]);
+        AccumulateFastAVX2<kTestZero>(z0, _mm256_loadu_ps(row + j),
+          spatial_weight, threshold, &sum0, &sum_weights0);
+        AccumulateFastAVX2<kTestZero>(z1, _mm256_loadu_ps(row + j + kLanes),
+          spatial_weight, threshold, &sum1, &sum_weights1);
+      }
+    }
+    _mm256_storeu_ps(dst + x,
+      FinishSmoothAVX2(params, z0, sum0, sum_weights0));
+    _mm256_storeu_ps(dst + x + kLanes,
+      FinishSmoothAVX2(params, z1, sum1, sum_weights1));
+  }
+
+  for (; x + kLanes <= x_end; x += kLanes) {
+    __m256 z = _mm256_loadu_ps(center_row + x);
+    __m256 sum = _mm256_setzero_ps();
+    __m256 sum_weights = _mm256_setzero_ps();
+    for (int i = 0; i < kernel_width; ++i) {
+      const float* row = rows[i] + x - kernel_radius;
+      const float* spatial_row = params.spatial_weights + i * kernel_width;
+      for (int j = 0; j < kernel_width; ++j) {
+        AccumulateFastAVX2<kTestZero>(z, _mm256_loadu_ps(row + j),
+          _mm256_set1_ps(spatial_row[j]), threshold, &sum, &sum_weights);
+      }
+    }
+    _mm256_storeu_ps(dst + x, FinishSmoothAVX2(params, z, sum, sum_weights));
+  }
+  return x;
+}
+
+// BilateralKernel::GAUSSIAN: range weights are gathered from the table.
+DEPTH_FUSION_TARGET_AVX2
+int SmoothSpanGaussianAVX2(const SmoothParams& params,
+  const float* const* rows, int x_begin, int x_end, float* dst) {
+  constexpr int kLanes = 8;
+  const int kernel_width = 2 * params.kernel_radius + 1;
+  const __m256 z_min = _mm256_set1_ps(params.z_min);
+  const __m256 z_max = _mm256_set1_ps(params.z_max);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 threshold = _mm256_set1_ps(params.delta_z_squared_threshold);
+  const __m256 table_scale = _mm256_set1_ps(params.range_weight_table_scale);
+  const __m256i max_table_index =
+    _mm256_set1_epi32(params.range_weight_table_size - 1);
+  const float* center_row = rows[params.kernel_radius];
+
+  int x = x_begin;
+  for (; x + kLanes <= x_end; x += kLanes) {
+    __m256 z = _mm256_loadu_ps(center_row + x);
+    __m256 center_valid = _mm256_and_ps(
+      _mm256_cmp_ps(z, z_min, _CMP_GE_OQ),
+      _mm256_cmp_ps(z, z_max, _CMP_LE_OQ));
+
+    __m256 sum = zero;
+    __m256 sum_weights = zero;
+    for (int i = 0; i < kernel_width; ++i) {
+      const float* row = rows[i] + x - params.kernel_radius;
+      const float* spatial_row = params.spatial_weights + i * kernel_width;
+      for (int j = 0; j < kernel_width; ++j) {
+        __m256 z2 = _mm256_loadu_ps(row + j);
+        __m256 delta_z = _mm256_sub_ps(z2, z);
+        __m256 delta_z_squared = _mm256_mul_ps(delta_z, delta_z);
+        __m256 valid = _mm256_and_ps(
+          _mm256_cmp_ps(z2, zero, _CMP_NEQ_OQ),
+          _mm256_cmp_ps(delta_z_squared, threshold, _CMP_LT_OQ));
+
+        // Rejected lanes may index past the table: clamp, then mask.
+        __m256i t = _mm256_min_epi32(
+          _mm256_cvttps_epi32(_mm256_mul_ps(delta_z_squared, table_scale)),
+          max_table_index);
+        __m256 range_weight = _mm256_mask_i32gather_ps(zero,
+          params.range_weights, t, valid, sizeof(float));
+        __m256 weight = _mm256_mul_ps(_mm256_set1_ps(spatial_row[j]),
+          range_weight);
+
+        sum = _mm256_fmadd_ps(weight, z2, sum);
+        sum_weights = _mm256_add_ps(sum_weights, weight);
+      }
+    }
+
+    __m256 output_valid = _mm256_and_ps(center_valid,
+      _mm256_cmp_ps(sum_weights, zero, _CMP_GT_OQ));
+    __m256 smoothed_z = _mm256_div_ps(sum, sum_weights);
+    _mm256_storeu_ps(dst + x, _mm256_and_ps(smoothed_z, output_valid));
+  }
+  return x;
+}
+
+// Transposes 8 normals, one per lane, to (x, y, z, w) and stores them.
+DEPTH_FUSION_TARGET_AVX2
+inline void StoreNormalsAVX2(__m256 n_x, __m256 n_y, __m256 n_z, __m256 n_w,
+  Vector4f* dst) {
+  __m256 t0 = _mm256_unpacklo_ps(n_x, n_y);
+  __m256 t1 = _mm256_unpackhi_ps(n_x, n_y);
+  __m256 t2 = _mm256_unpacklo_ps(n_z, n_w);
+  __m256 t3 = _mm256_unpackhi_ps(n_z, n_w);
+  __m256 n04 = _mm256_shuffle_ps(t0, t2, 0x44);
+  __m256 n15 = _mm256_shuffle_ps(t0, t2, 0xEE);
+  __m256 n26 = _mm256_shuffle_ps(t1, t3, 0x44);
+  __m256 n37 = _mm256_shuffle_ps(t1, t3, 0xEE);
+  float* out = reinterpret_cast<float*>(dst);
+  _mm256_storeu_ps(out, _mm256_permute2f128_ps(n04, n15, 0x20));
+  _mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(n26, n37, 0x20));
+  _mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(n04, n15, 0x31));
+  _mm256_storeu_ps(out + 24, _mm256_permute2f128_ps(n26, n37, 0x31));
+}
+
+// Forward difference normals of columns [x_begin, x_end) of row y, as
+// EstimateNormalsRow(). x_end must be at most width - 1. Returns the first
+// column that was not processed.
+DEPTH_FUSION_TARGET_AVX2
+int EstimateNormalsSpanAVX2(const Vector4f& flpp, float z_min, float z_max,
+  const float* smoothed_row, const float* next_smoothed_row, int x_begin,
+  int x_end, int y, Vector4f* dst) {
+  constexpr int kLanes = 8;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 z_min8 = _mm256_set1_ps(z_min);
+  const __m256 z_max8 = _mm256_set1_ps(z_max);
+  const __m256 lane_x = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256 inv_fx = _mm256_set1_ps(1.0f / flpp.x);
+  const __m256 step_u = inv_fx;
+  // Camera space x / z and y / z of the pixel centers of columns x and rows
+  // y and y + 1.
+  const __m256 v0 = _mm256_set1_ps((y + 0.5f - flpp.w) / flpp.y);
+  const __m256 v1 = _mm256_set1_ps((y + 1.5f - flpp.w) / flpp.y);
+
+  int x = x_begin;
+  for (; x + kLanes <= x_end; x += kLanes) {
+    __m256 depth0 = _mm256_loadu_ps(smoothed_row + x);
+    __m256 depth1 = _mm256_loadu_ps(smoothed_row + x + 1);
+    __m256 depth2 = _mm256_loadu_ps(next_smoothed_row + x);
+    __m256 valid = _mm256_and_ps(
+      _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(depth0, z_min8, _CMP_GE_OQ),
+          _mm256_cmp_ps(depth0, z_max8, _CMP_LE_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(depth1, z_min8, _CMP_GE_OQ),
+          _mm256_cmp_ps(depth1, z_max8, _CMP_LE_OQ))),
+      _mm256_and_ps(_mm256_cmp_ps(depth2, z_min8, _CMP_GE_OQ),
+        _mm256_cmp_ps(depth2, z_max8, _CMP_LE_OQ)));
+
+    __m256 u0 = _mm256_mul_ps(_mm256_sub_ps(
+      _mm256_add_ps(_mm256_set1_ps(x + 0.5f), lane_x),
+      _mm256_set1_ps(flpp.z)), inv_fx);
+    __m256 u1 = _mm256_add_ps(u0, step_u);
+
+    // dx = p1 - p0 and dy = p2 - p0, where z = -depth.
+    __m256 dx_x = _mm256_fmsub_ps(depth1, u1, _mm256_mul_ps(depth0, u0));
+    __m256 dx_y = _mm256_mul_ps(_mm256_sub_ps(depth1, depth0), v0);
+    __m256 dx_z = _mm256_sub_ps(depth0, depth1);
+    __m256 dy_x = _mm256_mul_ps(_mm256_sub_ps(depth2, depth0), u0);
+    __m256 dy_y = _mm256_fmsub_ps(depth2, v1, _mm256_mul_ps(depth0, v0));
+    __m256 dy_z = _mm256_sub_ps(depth0, depth2);
+
+    // n = cross(dx, dy).
+    __m256 n_x = _mm256_fmsub_ps(dx_y, dy_z, _mm256_mul_ps(dx_z, dy_y));
+    __m256 n_y = _mm256_fmsub_ps(dx_z, dy_x, _mm256_mul_ps(dx_x, dy_z));
+    __m256 n_z = _mm256_fmsub_ps(dx_x, dy_y, _mm256_mul_ps(dx_y, dy_x));
+    __m256 len_squared = _mm256_fmadd_ps(n_x, n_x,
+      _mm256_fmadd_ps(n_y, n_y, _mm256_mul_ps(n_z, n_z)));
+    valid = _mm256_and_ps(valid,
+      _mm256_cmp_ps(len_squared, zero, _CMP_GT_OQ));
+    __m256 inv_len = _mm256_and_ps(
+      _mm256_div_ps(one, _mm256_sqrt_ps(len_squared)), valid);
+    n_x = _mm256_mul_ps(n_x, inv_len);
+    n_y = _mm256_mul_ps(n_y, inv_len);
+    n_z = _mm256_mul_ps(n_z, inv_len);
+    __m256 n_w = _mm256_and_ps(one, valid);
+
+    StoreNormalsAVX2(n_x, n_y, n_z, n_w, dst + x);
+  }
+  return x;
+}
+
+// DepthProcessor::IntegrateMomentsRow(), with the running sum of the row in
+// registers.
+DEPTH_FUSION_TARGET_AVX2
+void IntegrateMomentsRowAVX2(const Vector4f& flpp, float z_min, float z_max,
+  const float* depth_row, int y, int width, const PointMoments* previous_row,
+  PointMoments* row) {
+  static_assert(PointMoments::kPaddedNumMoments == 12,
+    "PointMoments must be 3 vectors of 4 doubles.");
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  __m256d sum2 = _mm256_setzero_pd();
+  _mm256_storeu_pd(row[0].m, sum0);
+  _mm256_storeu_pd(row[0].m + 4, sum1);
+  _mm256_storeu_pd(row[0].m + 8, sum2);
+  for (int x = 0; x < width; ++x) {
+    float z = depth_row[x];
+    if (z >= z_min && z <= z_max) {
+      // MakePointMoments(), in registers: (1, x, y, z), (xx, xy, xz, yy),
+      // and (yz, zz, 0, 0). The products of floats are exact in double.
+      Vector3f p = CameraFromPixel(flpp, x, y, z);
+      __m256d m0 = _mm256_cvtps_pd(_mm_setr_ps(1.0f, p.x, p.y, p.z));
+      __m256d m1 = _mm256_mul_pd(
+        _mm256_permute4x64_pd(m0, _MM_SHUFFLE(2, 1, 1, 1)),
+        _mm256_permute4x64_pd(m0, _MM_SHUFFLE(2, 3, 2, 1)));
+      __m256d m2 = _mm256_blend_pd(_mm256_mul_pd(
+        _mm256_permute4x64_pd(m0, _MM_SHUFFLE(0, 0, 3, 2)),
+        _mm256_permute4x64_pd(m0, _MM_SHUFFLE(0, 0, 3, 3))),
+        _mm256_setzero_pd(), 0xC);
+      sum0 = _mm256_add_pd(sum0, m0);
+      sum1 = _mm256_add_pd(sum1, m1);
+      sum2 = _mm256_add_pd(sum2, m2);
+    }
+    const double* above = previous_row[x + 1].m;
+    double* dst = row[x + 1].m;
+    _mm256_storeu_pd(dst, _mm256_add_pd(_mm256_loadu_pd(above), sum0));
+    _mm256_storeu_pd(dst + 4,
+      _mm256_add_pd(_mm256_loadu_pd(above + 4), sum1));
+    _mm256_storeu_pd(dst + 8,
+      _mm256_add_pd(_mm256_loadu_pd(above + 8), sum2));
+  }
+}
+
+// acos(x) for x in [-1, 1], to within about 1e-7 radians
+// [Abramowitz and Stegun 1964, 4.4.46].
+DEPTH_FUSION_TARGET_AVX2
+inline __m256 AcosAVX2(__m256 x) {
+  const __m256 abs_x = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+  __m256 poly = _mm256_set1_ps(-0.0012624911f);
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(0.0066700901f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(-0.0170881256f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(0.0308918810f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(-0.0501743046f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(0.0889789874f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(-0.2145988016f));
+  poly = _mm256_fmadd_ps(poly, abs_x, _mm256_set1_ps(1.5707963050f));
+  __m256 acos_abs_x = _mm256_mul_ps(poly,
+    _mm256_sqrt_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), abs_x)));
+  // acos(-x) = pi - acos(x).
+  return _mm256_blendv_ps(acos_abs_x,
+    _mm256_sub_ps(_mm256_set1_ps(static_cast<float>(M_PI)), acos_abs_x),
+    _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+}
+
+// cos(x) for x in [0, pi / 3], to within about 1e-8, by its Taylor series.
+DEPTH_FUSION_TARGET_AVX2
+inline __m256 CosSmallAVX2(__m256 x) {
+  const __m256 x2 = _mm256_mul_ps(x, x);
+  __m256 poly = _mm256_set1_ps(-1.0f / 3628800.0f);
+  poly = _mm256_fmadd_ps(poly, x2, _mm256_set1_ps(1.0f / 40320.0f));
+  poly = _mm256_fmadd_ps(poly, x2, _mm256_set1_ps(-1.0f / 720.0f));
+  poly = _mm256_fmadd_ps(poly, x2, _mm256_set1_ps(1.0f / 24.0f));
+  poly = _mm256_fmadd_ps(poly, x2, _mm256_set1_ps(-0.5f));
+  return _mm256_fmadd_ps(poly, x2, _mm256_set1_ps(1.0f));
+}
+
+// The first part of NormalFromMoments() for 4 windows: writes their point
+// count, mean, and the 6 unique entries of their covariance, in that order.
+// The subtraction is done in double precision, and the results rounded to
+// single precision.
+DEPTH_FUSION_TARGET_AVX2
+inline void CovarianceAVX2(const PointMoments* windows, __m128 out[10]) {
+  // Transpose the moments to one window per lane, 4 at a time.
+  __m256d m[PointMoments::kPaddedNumMoments];
+  for (int i = 0; i < PointMoments::kPaddedNumMoments; i += 4) {
+    __m256d t0 = _mm256_unpacklo_pd(_mm256_loadu_pd(windows[0].m + i),
+      _mm256_loadu_pd(windows[1].m + i));
+    __m256d t1 = _mm256_unpackhi_pd(_mm256_loadu_pd(windows[0].m + i),
+      _mm256_loadu_pd(windows[1].m + i));
+    __m256d t2 = _mm256_unpacklo_pd(_mm256_loadu_pd(windows[2].m + i),
+      _mm256_loadu_pd(windows[3].m + i));
+    __m256d t3 = _mm256_unpackhi_pd(_mm256_loadu_pd(windows[2].m + i),
+      _mm256_loadu_pd(windows[3].m + i));
+    m[i] = _mm256_permute2f128_pd(t0, t2, 0x20);
+    m[i + 1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+    m[i + 2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+    m[i + 3] = _mm256_permute2f128_pd(t1, t3, 0x31);
+  }
+  // Windows without points are rejected later: keep them finite.
+  __m256d inv_n = _mm256_div_pd(_mm256_set1_pd(1.0),
+    _mm256_max_pd(m[0], _mm256_set1_pd(1.0)));
+  __m256d mean_x = _mm256_mul_pd(m[1], inv_n);
+  __m256d mean_y = _mm256_mul_pd(m[2], inv_n);
+  __m256d mean_z = _mm256_mul_pd(m[3], inv_n);
+  out[0] = _mm256_cvtpd_ps(m[0]);
+  out[1] = _mm256_cvtpd_ps(mean_x);
+  out[2] = _mm256_cvtpd_ps(mean_y);
+  out[3] = _mm256_cvtpd_ps(mean_z);
+  out[4] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[4], inv_n), _mm256_mul_pd(mean_x, mean_x)));
+  out[5] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[5], inv_n), _mm256_mul_pd(mean_x, mean_y)));
+  out[6] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[6], inv_n), _mm256_mul_pd(mean_x, mean_z)));
+  out[7] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[7], inv_n), _mm256_mul_pd(mean_y, mean_y)));
+  out[8] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[8], inv_n), _mm256_mul_pd(mean_y, mean_z)));
+  out[9] = _mm256_cvtpd_ps(_mm256_sub_pd(
+    _mm256_mul_pd(m[9], inv_n), _mm256_mul_pd(mean_z, mean_z)));
+}
+
+// c = cross(a, b), one vector per lane.
+DEPTH_FUSION_TARGET_AVX2
+inline void CrossAVX2(const __m256 a[3], const __m256 b[3], __m256 c[3]) {
+  c[0] = _mm256_fmsub_ps(a[1], b[2], _mm256_mul_ps(a[2], b[1]));
+  c[1] = _mm256_fmsub_ps(a[2], b[0], _mm256_mul_ps(a[0], b[2]));
+  c[2] = _mm256_fmsub_ps(a[0], b[1], _mm256_mul_ps(a[1], b[0]));
+}
+
+// |c|^2, one vector per lane.
+DEPTH_FUSION_TARGET_AVX2
+inline __m256 NormSquaredAVX2(const __m256 c[3]) {
+  return _mm256_fmadd_ps(c[0], c[0],
+    _mm256_fmadd_ps(c[1], c[1], _mm256_mul_ps(c[2], c[2])));
+}
+
+// NormalFromMoments() of windows [0, count), 8 at a time, writing (normal,
+// confidence), or 0 where it would return false. The eigen solve is in
+// single precision, with polynomial acos and cos. Returns the first window
+// that was not processed.
+DEPTH_FUSION_TARGET_AVX2
+int NormalsFromMomentsAVX2(const PointMoments* windows, int count,
+  int min_count, Vector4f* dst) {
+  constexpr int kLanes = 8;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 min_count8 =
+    _mm256_set1_ps(static_cast<float>(std::max(min_count, 3)));
+
+  int x = 0;
+  for (; x + kLanes <= count; x += kLanes) {
+    __m128 lo[10];
+    __m128 hi[10];
+    CovarianceAVX2(windows + x, lo);
+    CovarianceAVX2(windows + x + kLanes / 2, hi);
+    __m256 v[10];
+    for (int i = 0; i < 10; ++i) {
+      v[i] = _mm256_insertf128_ps(_mm256_castps128_ps256(lo[i]), hi[i], 1);
+    }
+    const __m256 n = v[0];
+    const __m256 a00 = v[4];
+    const __m256 a01 = v[5];
+    const __m256 a02 = v[6];
+    const __m256 a11 = v[7];
+    const __m256 a12 = v[8];
+    const __m256 a22 = v[9];
+
+    // Smallest eigenvalue.
+    __m256 p1 = _mm256_fmadd_ps(a01, a01,
+      _mm256_fmadd_ps(a02, a02, _mm256_mul_ps(a12, a12)));
+    __m256 q = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(a00, a11), a22),
+      _mm256_set1_ps(1.0f / 3.0f));
+    __m256 b00 = _mm256_sub_ps(a00, q);
+    __m256 b11 = _mm256_sub_ps(a11, q);
+    __m256 b22 = _mm256_sub_ps(a22, q);
+    __m256 p2 = _mm256_fmadd_ps(b00, b00, _mm256_fmadd_ps(b11, b11,
+      _mm256_fmadd_ps(b22, b22, _mm256_add_ps(p1, p1))));
+    __m256 valid = _mm256_and_ps(
+      _mm256_cmp_ps(n, min_count8, _CMP_GE_OQ),
+      _mm256_and_ps(_mm256_cmp_ps(p2, zero, _CMP_GT_OQ),
+        _mm256_cmp_ps(q, zero, _CMP_GT_OQ)));
+    __m256 p = _mm256_sqrt_ps(_mm256_mul_ps(p2, _mm256_set1_ps(1.0f / 6.0f)));
+    __m256 det_b = _mm256_fmsub_ps(b00,
+      _mm256_fmsub_ps(b11, b22, _mm256_mul_ps(a12, a12)),
+      _mm256_mul_ps(a01,
+        _mm256_fmsub_ps(a01, b22, _mm256_mul_ps(a12, a02))));
+    det_b = _mm256_fmadd_ps(a02,
+      _mm256_fmsub_ps(a01, a12, _mm256_mul_ps(b11, a02)), det_b);
+    __m256 r = _mm256_div_ps(det_b,
+      _mm256_mul_ps(_mm256_add_ps(p, p), _mm256_mul_ps(p, p)));
+    r = _mm256_min_ps(_mm256_max_ps(r, _mm256_set1_ps(-1.0f)), one);
+    // cos(phi + 2 pi / 3) = -cos(pi / 3 - phi), with phi in [0, pi / 3].
+    __m256 phi = _mm256_mul_ps(AcosAVX2(r), _mm256_set1_ps(1.0f / 3.0f));
+    __m256 cos_phi = CosSmallAVX2(_mm256_sub_ps(
+      _mm256_set1_ps(static_cast<float>(M_PI / 3)), phi));
+    __m256 lambda_0 = _mm256_fnmadd_ps(_mm256_add_ps(p, p), cos_phi, q);
+
+    // Best conditioned cross product of two rows of A - lambda_0 I.
+    const __m256 r0[3] = { _mm256_sub_ps(a00, lambda_0), a01, a02 };
+    const __m256 r1[3] = { a01, _mm256_sub_ps(a11, lambda_0), a12 };
+    const __m256 r2[3] = { a02, a12, _mm256_sub_ps(a22, lambda_0) };
+    __m256 c[3];
+    __m256 c02[3];
+    __m256 c12[3];
+    CrossAVX2(r0, r1, c);
+    CrossAVX2(r0, r2, c02);
+    CrossAVX2(r1, r2, c12);
+    __m256 d = NormSquaredAVX2(c);
+    __m256 d02 = NormSquaredAVX2(c02);
+    __m256 d12 = NormSquaredAVX2(c12);
+    __m256 use_02 = _mm256_cmp_ps(d02, d, _CMP_GT_OQ);
+    d = _mm256_blendv_ps(d, d02, use_02);
+    __m256 use_12 = _mm256_cmp_ps(d12, d, _CMP_GT_OQ);
+    d = _mm256_blendv_ps(d, d12, use_12);
+    for (int i = 0; i < 3; ++i) {
+      c[i] = _mm256_blendv_ps(_mm256_blendv_ps(c[i], c02[i], use_02),
+        c12[i], use_12);
+    }
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(d, zero, _CMP_GT_OQ));
+
+    // Orient towards the camera: dot(normal, mean) < 0.
+    __m256 scale = _mm256_div_ps(one, _mm256_sqrt_ps(d));
+    __m256 dot = _mm256_fmadd_ps(c[0], v[1],
+      _mm256_fmadd_ps(c[1], v[2], _mm256_mul_ps(c[2], v[3])));
+    scale = _mm256_xor_ps(scale, _mm256_and_ps(_mm256_set1_ps(-0.0f),
+      _mm256_cmp_ps(dot, zero, _CMP_GT_OQ)));
+
+    __m256 planarity = _mm256_sub_ps(one,
+      _mm256_div_ps(_mm256_max_ps(lambda_0, zero), q));
+    valid = _mm256_and_ps(valid,
+      _mm256_cmp_ps(planarity, zero, _CMP_GT_OQ));
+    scale = _mm256_and_ps(scale, valid);
+    StoreNormalsAVX2(_mm256_mul_ps(c[0], scale),
+      _mm256_mul_ps(c[1], scale), _mm256_mul_ps(c[2], scale),
+      _mm256_and_ps(_mm256_min_ps(planarity, one), valid), dst + x);
+  }
+  return x;
+}
+
+#endif  // DEPTH_FUSION_HOST_AVX2
+
+}  // namespace
+
+void DepthProcessor::SmoothRow(const float* const* rows, int width,
+  float* dst) const {
+  std::fill(dst, dst + std::min(kernel_radius_, width), 0.0f);
+  std::fill(dst + std::max(width - kernel_radius_, 0), dst + width, 0.0f);
+  const int x_end = width - kernel_radius_;
+  for (int tile_x = kernel_radius_; tile_x < x_end;
+    tile_x += kSmoothTileWidth) {
+    int tile_x_end = std::min(tile_x + kSmoothTileWidth, x_end);
+    int x = SmoothSpanSIMD(rows, tile_x, tile_x_end, dst);
+    SmoothSpan(rows, x, tile_x_end, dst);
+  }
+}
+
+void DepthProcessor::EstimateNormalsRow(const float* smoothed_row,
+  const float* next_smoothed_row, int width, int y, Vector4f* dst) const {
+  const float z_min = depth_range_.left();
+  const float z_max = depth_range_.right();
+
+  // Same as EstimateNormalsKernel.
+  int x = 0;
+#if defined(DEPTH_FUSION_HOST_AVX2)
+  if (HostSupportsAVX2()) {
+    x = EstimateNormalsSpanAVX2(depth_intrinsics_flpp_, z_min, z_max,
+      smoothed_row, next_smoothed_row, 0, width - 1, y, dst);
+  }
+#endif
+  for (; x < width; ++x) {
+    Vector4f normal(0, 0, 0, 0);
+    if (x < width - 1) {
+      float depth0 = smoothed_row[x];
+      float depth1 = smoothed_row[x + 1];
+      float depth2 = next_smoothed_row[x];
+      if (depth0 >= z_min && depth0 <= z_max &&
+        depth1 >= z_min && depth1 <= z_max &&
+        depth2 >= z_min && depth2 <= z_max) {
+        Vector3f p0 = CameraFromPixel(depth_intrinsics_flpp_, x, y, depth0);
+        Vector3f dx =
+          CameraFromPixel(depth_intrinsics_flpp_, x + 1, y, depth1) - p0;
+        Vector3f dy =
+          CameraFromPixel(depth_intrinsics_flpp_, x, y + 1, depth2) - p0;
+        Vector3f n = Vector3f::cross(dx, dy);
+        float len_squared = n.normSquared();
+        if (len_squared > 0.0f) {
+          normal = Vector4f(n / std::sqrt(len_squared), 1.0f);
+        }
+      }
+    }
+    dst[x] = normal;
+  }
+}
+
+void DepthProcessor::IntegrateMomentsRow(const float* depth_row, int y,
+  int width, const PointMoments* previous_row, PointMoments* row) const {
+  const float z_min = depth_range_.left();
+  const float z_max = depth_range_.right();
+#if defined(DEPTH_FUSION_HOST_AVX2)
+  if (HostSupportsAVX2()) {
+    IntegrateMomentsRowAVX2(depth_intrinsics_flpp_, z_min, z_max, depth_row,
+      y, width, previous_row, row);
+    return;
+  }
+#endif
+  PointMoments row_sum = {};
+  row[0] = row_sum;
+  for (int x = 0; x < width; ++x) {
+    float z = depth_row[x];
+    if (z >= z_min && z <= z_max) {
+      Vector3f p = CameraFromPixel(depth_intrinsics_flpp_, x, y, z);
+      AddMoments(row_sum, MakePointMoments(p.x, p.y, p.z), &row_sum);
+    }
+    AddMoments(previous_row[x + 1], row_sum, &(row[x + 1]));
+  }
+}
+
+void DepthProcessor::EstimateCovarianceNormalsRow(const float* depth_row,
+  const PointMoments* integral_row0, const PointMoments* integral_row1,
+  int width, PointMoments* windows, Vector4f* dst) const {
+  const float z_min = depth_range_.left();
+  const float z_max = depth_range_.right();
+  for (int x = 0; x < width; ++x) {
+    float z = depth_row[x];
+    if (z >= z_min && z <= z_max) {
+      int x0 = std::max(x - normal_window_radius_, 0);
+      int x1 = std::min(x + normal_window_radius_ + 1, width);
+      SumWindow(integral_row0[x0], integral_row0[x1], integral_row1[x0],
+        integral_row1[x1], &(windows[x]));
+    } else {
+      windows[x].m[0] = 0.0;
+    }
+  }
+
+  const int min_count = MinNormalWindowCount();
+  int x = 0;
+#if defined(DEPTH_FUSION_HOST_AVX2)
+  if (HostSupportsAVX2()) {
+    x = NormalsFromMomentsAVX2(windows, width, min_count, dst);
+  }
+#endif
+  for (; x < width; ++x) {
+    Vector4f normal(0, 0, 0, 0);
+    float n[3];
+    float confidence;
+    if (NormalFromMoments(windows[x], min_count, n, &confidence)) {
+      normal = Vector4f(n[0], n[1], n[2], confidence);
+    }
+    dst[x] = normal;
+  }
+}
+
+void DepthProcessor::SmoothSpan(const float* const* rows, int x_begin,
+  int x_end, float* dst) const {
+  const int kernel_width = 2 * kernel_radius_ + 1;
+  const float z_min = depth_range_.left();
+  const float z_max = depth_range_.right();
+  const float* center_row = rows[kernel_radius_];
+
+  for (int x = x_begin; x < x_end; ++x) {
+    float z = center_row[x];
+    float smoothed_z = 0.0f;
+    if (z >= z_min && z <= z_max) {
+      float sum = 0.0f;
+      float sum_weights = 0.0f;
+      for (int i = 0; i < kernel_width; ++i) {
+        const float* row = rows[i];
+        const float* spatial_row = &(spatial_weights_[i * kernel_width]);
+        for (int dx = -kernel_radius_; dx <= kernel_radius_; ++dx) {
+          float z2 = row[x + dx];
+          float delta_z = z2 - z;
+          float delta_z_squared = delta_z * delta_z;
+          if (z2 != 0 && delta_z_squared < delta_z_squared_threshold_) {
+            float range_weight;
+            if (bilateral_kernel_ == BilateralKernel::GAUSSIAN) {
+              int t = std::min(static_cast<int>(
+                delta_z_squared * range_weight_table_scale_),
+                kRangeWeightTableSize - 1);
+              range_weight = range_weights_[t];
+            } else {
+              range_weight = delta_z_squared_threshold_ - delta_z_squared;
+            }
+            float weight = spatial_row[dx + kernel_radius_] * range_weight;
+            sum += weight * z2;
+            sum_weights += weight;
+          }
+        }
+      }
+      if (sum_weights > 0.0f) {
+        smoothed_z = sum / sum_weights;
+      }
+    }
+    dst[x] = smoothed_z;
+  }
+}
+
+int DepthProcessor::SmoothSpanSIMD(const float* const* rows, int x_begin,
+  int x_end, float* dst) const {
+#if defined(DEPTH_FUSION_HOST_AVX2)
+  if (HostSupportsAVX2()) {
+    SmoothParams params;
+    params.kernel_radius = kernel_radius_;
+    params.spatial_weights = spatial_weights_.data();
+    params.z_min = depth_range_.left();
+    params.z_max = depth_range_.right();
+    params.delta_z_squared_threshold = delta_z_squared_threshold_;
+    params.zero_fails_threshold = params.z_min > 0 &&
+      params.z_min * params.z_min >= delta_z_squared_threshold_;
+    params.range_weights = range_weights_.data();
+    params.range_weight_table_scale = range_weight_table_scale_;
+    params.range_weight_table_size = kRangeWeightTableSize;
+    if (bilateral_kernel_ == BilateralKernel::GAUSSIAN) {
+      return SmoothSpanGaussianAVX2(params, rows, x_begin, x_end, dst);
+    }
+    if (kernel_radius_ == 2 && params.zero_fails_threshold) {
+      return SmoothSpanFastAVX2<false, 2>(params, rows, x_begin, x_end, dst);
+    }
+    return SmoothSpanFastAVX2<true, 0>(params, rows, x_begin, x_end, dst);
+  }
+#endif
+  return x_begin;
+}
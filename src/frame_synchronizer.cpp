@@ -0,0 +1,240 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "frame_synchronizer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+#include "perf_collector.h"
+#include "rgbd_input.h"
+#include "trace_recorder.h"
+
+FrameSynchronizer::FrameSynchronizer(std::vector<RgbdInput>* inputs,
+  const std::vector<RGBDCameraParameters>& camera_params,
+  int64_t tolerance_ns, int max_frames_ahead) :
+  inputs_(inputs),
+  camera_params_(camera_params),
+  tolerance_ns_(tolerance_ns),
+  max_frames_ahead_(std::max(max_frames_ahead, 1)),
+  cameras_(inputs->size()) {
+  assert(inputs->size() == camera_params.size());
+  stats_.num_frames_read.resize(inputs->size(), 0);
+  stats_.num_frames_dropped.resize(inputs->size(), 0);
+  for (int i = 0; i < NumCameras(); ++i) {
+    readers_.emplace_back(&FrameSynchronizer::ReadLoop, this, i);
+  }
+}
+
+FrameSynchronizer::~FrameSynchronizer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread& reader : readers_) {
+    reader.join();
+  }
+}
+
+int FrameSynchronizer::NumCameras() const {
+  return static_cast<int>(cameras_.size());
+}
+
+bool FrameSynchronizer::Next(const std::vector<InputBuffer*>& buffers,
+  std::vector<bool>* color_updated) {
+  assert(static_cast<int>(buffers.size()) == NumCameras());
+  ScopedPerfTimer timer("FrameSynchronizer::Next");
+  ScopedTrace trace("FrameSynchronizer::Next");
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    bool ended = false;
+    cv_.wait(lock, [&] {
+      bool all_ready = true;
+      for (const Camera& camera : cameras_) {
+        if (camera.frames.empty()) {
+          all_ready = false;
+          ended = ended || camera.end_of_stream;
+        }
+      }
+      return all_ready || ended;
+    });
+    if (ended) {
+      return false;
+    }
+    bool aligned = AlignFronts();
+    // Dropped frames free up room for the readers.
+    cv_.notify_all();
+    if (aligned) {
+      break;
+    }
+  }
+
+  int64_t min_timestamp = FrontTimestamp(0);
+  int64_t max_timestamp = min_timestamp;
+  color_updated->resize(NumCameras());
+  for (int i = 0; i < NumCameras(); ++i) {
+    min_timestamp = std::min(min_timestamp, FrontTimestamp(i));
+    max_timestamp = std::max(max_timestamp, FrontTimestamp(i));
+
+    Camera& camera = cameras_[i];
+    Frame frame = std::move(camera.frames.front());
+    camera.frames.pop_front();
+    std::swap(*(buffers[i]), *(frame.buffer));
+    (*color_updated)[i] = frame.color_updated;
+    camera.free_buffers.push_back(std::move(frame.buffer));
+  }
+  ++stats_.num_framesets;
+  stats_.max_spread_ns = std::max(stats_.max_spread_ns,
+    max_timestamp - min_timestamp);
+
+  lock.unlock();
+  cv_.notify_all();
+  return true;
+}
+
+FrameSynchronizer::Stats FrameSynchronizer::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void FrameSynchronizer::PrintStats() const {
+  Stats stats = GetStats();
+  printf("Frame synchronizer: %lld framesets, max spread = %f ms\n",
+    static_cast<long long>(stats.num_framesets),
+    stats.max_spread_ns * 1e-6);
+  for (int i = 0; i < NumCameras(); ++i) {
+    printf("  camera %d: %lld depth frames read, %lld dropped\n", i,
+      static_cast<long long>(stats.num_frames_read[i]),
+      static_cast<long long>(stats.num_frames_dropped[i]));
+  }
+}
+
+void FrameSynchronizer::ReadLoop(int camera_index) {
+  RgbdInput& input = (*inputs_)[camera_index];
+  Camera& camera = cameras_[camera_index];
+  const RGBDCameraParameters& params = camera_params_[camera_index];
+
+  if (TraceRecorder::Enabled()) {
+    TraceRecorder::Instance().SetThreadName(
+      "camera " + std::to_string(camera_index) + " reader");
+  }
+
+  std::unique_ptr<InputBuffer> buffer(new InputBuffer(
+    params.color.resolution, params.depth.resolution));
+  bool color_updated = false;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&] {
+        return stopping_ ||
+          static_cast<int>(camera.frames.size()) < max_frames_ahead_;
+      });
+      if (stopping_) {
+        return;
+      }
+    }
+
+    bool rgb_updated;
+    bool depth_updated;
+    {
+      ScopedTrace trace("RgbdInput::read");
+      input.read(buffer.get(), &rgb_updated, &depth_updated);
+    }
+    if (!rgb_updated && !depth_updated) {
+      break;
+    }
+    color_updated = color_updated || rgb_updated;
+    if (!depth_updated) {
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++stats_.num_frames_read[camera_index];
+      Frame frame;
+      frame.buffer = std::move(buffer);
+      frame.color_updated = color_updated;
+      camera.frames.push_back(std::move(frame));
+      if (!camera.free_buffers.empty()) {
+        buffer = std::move(camera.free_buffers.back());
+        camera.free_buffers.pop_back();
+      }
+    }
+    cv_.notify_all();
+
+    if (buffer == nullptr) {
+      buffer.reset(new InputBuffer(
+        params.color.resolution, params.depth.resolution));
+    }
+    color_updated = false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    camera.end_of_stream = true;
+  }
+  cv_.notify_all();
+}
+
+bool FrameSynchronizer::AlignFronts() {
+  int64_t latest = FrontTimestamp(0);
+  for (int i = 1; i < NumCameras(); ++i) {
+    latest = std::max(latest, FrontTimestamp(i));
+  }
+
+  auto drop_front = [&](int i) {
+    Camera& camera = cameras_[i];
+    camera.free_buffers.push_back(std::move(camera.frames.front().buffer));
+    camera.frames.pop_front();
+    ++stats_.num_frames_dropped[i];
+    if (PerfCollector::Enabled()) {
+      PerfCollector::Instance().AddCount("frame_sync_dropped_frames", 1);
+    }
+  };
+
+  for (int i = 0; i < NumCameras(); ++i) {
+    Camera& camera = cameras_[i];
+    // Too old to match the latest camera.
+    while (!camera.frames.empty() &&
+      FrontTimestamp(i) < latest - tolerance_ns_) {
+      drop_front(i);
+    }
+    // A later frame that is already buffered is a closer match.
+    while (camera.frames.size() >= 2 &&
+      std::llabs(camera.frames[1].buffer->depth_timestamp_ns - latest) <=
+      std::llabs(FrontTimestamp(i) - latest)) {
+      drop_front(i);
+    }
+    if (camera.frames.empty()) {
+      return false;
+    }
+  }
+
+  int64_t earliest = FrontTimestamp(0);
+  latest = earliest;
+  for (int i = 1; i < NumCameras(); ++i) {
+    earliest = std::min(earliest, FrontTimestamp(i));
+    latest = std::max(latest, FrontTimestamp(i));
+  }
+  return latest - earliest <= tolerance_ns_;
+}
+
+int64_t FrameSynchronizer::FrontTimestamp(int camera_index) const {
+  return cameras_[camera_index].frames.front().buffer->depth_timestamp_ns;
+}
@@ -0,0 +1,116 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FRAME_SYNCHRONIZER_H
+#define FRAME_SYNCHRONIZER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "input_buffer.h"
+#include "rgbd_camera_parameters.h"
+
+class RgbdInput;
+
+// Assembles framesets, one depth frame per camera, whose depth timestamps
+// are within a tolerance of each other, from several RgbdInputs.
+//
+// Each input is read on its own thread, up to a few depth frames ahead, so
+// that I/O and decoding overlap across cameras and with the consumer.
+// Frames that cannot be matched within the tolerance are dropped. The
+// timestamps of all inputs must be on the same clock.
+class FrameSynchronizer {
+ public:
+
+  struct Stats {
+    int64_t num_framesets = 0;
+    // Largest difference between depth timestamps within a frameset.
+    int64_t max_spread_ns = 0;
+
+    // Per camera.
+    std::vector<int64_t> num_frames_read;
+    // Frames skipped because no other camera had a frame close enough in
+    // time.
+    std::vector<int64_t> num_frames_dropped;
+  };
+
+  // inputs must outlive this and must not be read by anyone else.
+  // camera_params sizes the buffers, as in MultiStaticCameraPipeline.
+  FrameSynchronizer(std::vector<RgbdInput>* inputs,
+    const std::vector<RGBDCameraParameters>& camera_params,
+    int64_t tolerance_ns, int max_frames_ahead = 4);
+  ~FrameSynchronizer();
+
+  FrameSynchronizer(const FrameSynchronizer& copy) = delete;
+  FrameSynchronizer& operator = (const FrameSynchronizer& copy) = delete;
+
+  int NumCameras() const;
+
+  // Blocks until the next frameset is ready and swaps it into buffers, one
+  // per camera. color_updated[i] is set if buffers[i] also holds a color
+  // frame that arrived since camera i's previous frameset.
+  //
+  // Returns false once any input runs out of frames.
+  bool Next(const std::vector<InputBuffer*>& buffers,
+    std::vector<bool>* color_updated);
+
+  Stats GetStats() const;
+
+  // Print GetStats() to stdout.
+  void PrintStats() const;
+
+ private:
+
+  struct Frame {
+    std::unique_ptr<InputBuffer> buffer;
+    bool color_updated = false;
+  };
+
+  struct Camera {
+    std::deque<Frame> frames;
+    // Buffers handed back by Next(), for reuse.
+    std::vector<std::unique_ptr<InputBuffer>> free_buffers;
+    bool end_of_stream = false;
+  };
+
+  void ReadLoop(int camera_index);
+
+  // Drops frames until the fronts of all queues are within tolerance_ns_.
+  // Returns true if a frameset is ready, false if more frames are needed.
+  // Requires mutex_ to be held and every queue to be nonempty.
+  bool AlignFronts();
+
+  int64_t FrontTimestamp(int camera_index) const;
+
+  std::vector<RgbdInput>* inputs_;
+  const std::vector<RGBDCameraParameters> camera_params_;
+  const int64_t tolerance_ns_;
+  const int max_frames_ahead_;
+
+  mutable std::mutex mutex_;
+  // Signaled when a frame is queued or consumed, at the end of a stream,
+  // and when stopping.
+  std::condition_variable cv_;
+  std::vector<Camera> cameras_;
+  Stats stats_;
+  bool stopping_ = false;
+
+  std::vector<std::thread> readers_;
+};
+
+#endif  // FRAME_SYNCHRONIZER_H
@@ -18,22 +18,33 @@
 #include "libcgt/cuda/ThreadMath.cuh"
 
 #include "camera_math.cuh"
+#include "fuse_voxel.cuh"
 
 using libcgt::cuda::threadmath::threadSubscript2DGlobal;
 using libcgt::cuda::contains;
+using libcgt::cuda::math::floorToInt;
 using libcgt::cuda::math::roundToInt;
 
 __global__
 void FuseKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
+  float min_truncation,
   float4 flpp,
   float2 depth_min_max,
   float4x4 camera_from_world,
+  DepthNoiseModel noise_model,
   KernelArray2D<const float> depth_map,
-  KernelArray3D<TSDF> regular_grid) {
+  KernelArray2D<const float4> normal_map,
+  bool deintegrate,
+  unsigned long long* num_voxels_updated,
+  TSDFGridView regular_grid) {
 
   int2 ij = threadSubscript2DGlobal();
+  if (ij.x >= regular_grid.width() || ij.y >= regular_grid.height()) {
+    return;
+  }
+  unsigned long long num_updated = 0;
 
   // Sweep over the entire volume.
   for (int k = 0; k < regular_grid.depth(); ++k) {
@@ -49,81 +60,75 @@ void FuseKernel(
     // so depth is a negative number if it's in front of the camera.
     float4 voxel_center_camera =
       camera_from_world * voxel_center_world;
-    float2 uv = make_float2(PixelFromCamera(make_float3(voxel_center_camera),
-      flpp));
-    int2 uv_int = roundToInt(uv - float2{ 0.5f, 0.5f });
-
-    if (voxel_center_camera.z > 0 ||
-      !contains(depth_map.size(), uv_int)) {
-      continue;
-    }
 
-    float image_depth = depth_map[uv_int];
-    if (image_depth < depth_min_max.x || image_depth > depth_min_max.y) {
+    float dz;
+    float weight;
+    if (!FuseVoxel(make_float3(voxel_center_camera), flpp, depth_min_max,
+      min_truncation, max_tsdf_value, noise_model, depth_map, normal_map,
+      &dz, &weight)) {
       continue;
     }
 
-    // Compute dz, the signed distance between the voxel center and the
-    // surface observation.
-    //
-    // Note that we flip the sign on z to get "depth", where positive numbers
-    // are in front of the camera.
-    //
-    // The sign convention of the distance field is so that voxels in front of
-    // the surface is positive (and voxels behind are negative).
-    float voxel_center_depth = -voxel_center_camera.z;
-    float dz = image_depth - voxel_center_depth;
-
-    // Now integrate data in carefully:
-    // Consider 3 cases:
-    // dz < -max_tsdf_value: the voxel is behind the observation and out of the
-    //   truncation region. Therefore, do nothing.
-    // dz \in [-max_tsdf_value, 0]: the voxel is behind the observation and
-    //   within the truncation region. Integrate.
-    // dz > 0: the voxel is in front of the observation. Integrate... but if
-    //   the voxel is really far in front, we don't want to put in a large
-    //   value. Instead, clamp it to max_tsdf_value.
-    if (dz >= -max_tsdf_value) {
-      // Ignore the voxel when it is far behind.
-      // Clamp to the TSDF range.
-      dz = min(dz, max_tsdf_value);
-      const float weight = 1.0f;
-
+    if (deintegrate) {
+      regular_grid[{ij.x, ij.y, k}].Remove(dz, weight, max_tsdf_value);
+    } else {
       regular_grid[{ij.x, ij.y, k}].Update(dz, weight, max_tsdf_value);
     }
+    ++num_updated;
+  }
+
+  if (num_voxels_updated != nullptr && num_updated > 0) {
+    atomicAdd(num_voxels_updated, num_updated);
   }
 }
 
-namespace {
-  constexpr int kNumDepthMaps = 3;
+__global__
+void FuseGridKernel(
+  float4x4 source_from_grid,
+  float source_max_tsdf_value,
+  ConstTSDFGridView source,
+  float max_tsdf_value,
+  TSDFGridView regular_grid) {
+
+  int2 ij = threadSubscript2DGlobal();
+  if (ij.x >= regular_grid.width() || ij.y >= regular_grid.height()) {
+    return;
+  }
+
+  for (int k = 0; k < regular_grid.depth(); ++k) {
+    int3 source_xyz = floorToInt(transformPoint(source_from_grid,
+      float3{ ij.x + 0.5f, ij.y + 0.5f, k + 0.5f }));
+    if (source_xyz.x < 0 || source_xyz.y < 0 || source_xyz.z < 0 ||
+      source_xyz.x >= source.width() || source_xyz.y >= source.height() ||
+      source_xyz.z >= source.depth()) {
+      continue;
+    }
+
+    TSDF sample = source[source_xyz];
+    if (sample.Weight() > 0) {
+      regular_grid[{ij.x, ij.y, k}].Update(
+        sample.Distance(source_max_tsdf_value), sample.Weight(),
+        max_tsdf_value);
+    }
+  }
 }
 
 __global__
 void FuseMultipleKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
-  CalibratedPosedDepthCamera depth_camera0,
-  CalibratedPosedDepthCamera depth_camera1,
-  CalibratedPosedDepthCamera depth_camera2,
-  KernelArray2D<const float> depth_map0,
-  KernelArray2D<const float> depth_map1,
-  KernelArray2D<const float> depth_map2,
-  KernelArray3D<TSDF> regular_grid) {
-
-  CalibratedPosedDepthCamera depth_camera[] =
-  {
-    depth_camera0,
-    depth_camera1,
-    depth_camera2
-  };
-  KernelArray2D<const float> depth_maps[] =
-  {
-    depth_map0,
-    depth_map1,
-    depth_map2
-  };
+  float min_truncation,
+  FuseMultipleCameras cameras,
+  unsigned long long* num_voxels_updated,
+  TSDFGridView regular_grid) {
+  const CalibratedPosedDepthCamera* depth_camera = cameras.depth_cameras;
+  const KernelArray2D<const float>* depth_maps = cameras.depth_maps;
 
   int2 ij = threadSubscript2DGlobal();
+  if (ij.x >= regular_grid.width() || ij.y >= regular_grid.height()) {
+    return;
+  }
+  unsigned long long num_updated = 0;
 
   // Sweep over the entire volume.
   for (int k = 0; k < regular_grid.depth(); ++k) {
@@ -134,7 +139,7 @@ void FuseMultipleKernel(
         world_from_grid, float3{ij.x + 0.5f, ij.y + 0.5f, k + 0.5f}),
       1.0f);
 
-    for (int c = 0; c < kNumDepthMaps; ++c) {
+    for (int c = 0; c < cameras.num_cameras; ++c) {
       // Project it into camera coordinates.
       // camera_from_world uses OpenGL conventions,
       // so depth is a negative number if it's in front of the camera.
@@ -166,23 +171,34 @@ void FuseMultipleKernel(
       float voxel_center_depth = -voxel_center_camera.z;
       float dz = image_depth - voxel_center_depth;
 
+      // No normals are available here: assume the surface faces the camera.
+      const DepthNoiseModel& noise_model = depth_camera[c].noise_model;
+      float sigma = noise_model.Sigma(image_depth, 1.0f);
+      float truncation = noise_model.Truncation(sigma, min_truncation,
+        max_tsdf_value);
+
       // Now integrate data in carefully:
       // Consider 3 cases:
-      // dz < -max_tsdf_value: the voxel is behind the observation and out of the
+      // dz < -truncation: the voxel is behind the observation and out of the
       //   truncation region. Therefore, do nothing.
-      // dz \in [-max_tsdf_value, 0]: the voxel is behind the observation and
+      // dz \in [-truncation, 0]: the voxel is behind the observation and
       //   within the truncation region. Integrate.
       // dz > 0: the voxel is in front of the observation. Integrate... but if
       //   the voxel is really far in front, we don't want to put in a large
-      //   value. Instead, clamp it to max_tsdf_value.
-      if (dz >= -max_tsdf_value) {
+      //   value. Instead, clamp it to truncation.
+      if (dz >= -truncation) {
         // Ignore the voxel when it is far behind.
         // Clamp to the TSDF range.
-        dz = min(dz, max_tsdf_value);
-        const float weight = 1.0f;
+        dz = min(dz, truncation);
+        const float weight = noise_model.Weight(sigma);
 
         regular_grid[{ij.x, ij.y, k}].Update(dz, weight, max_tsdf_value);
+        ++num_updated;
       }
     }
   }
+
+  if (num_voxels_updated != nullptr && num_updated > 0) {
+    atomicAdd(num_voxels_updated, num_updated);
+  }
 }
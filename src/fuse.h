@@ -21,30 +21,69 @@
 #include "libcgt/cuda/KernelArray3D.h"
 
 #include "calibrated_posed_depth_camera.h"
+#include "depth_noise_model.h"
 #include "regular_grid_tsdf.h"
 
+// Each depth sample is truncated and weighted according to noise_model.
+// Truncation widths are clamped to [min_truncation, max_tsdf_value].
+//
+// normal_map: optional camera-space normals of depth_map, used by
+//   noise_model for the angle between the surface and the viewing ray. Pass
+//   an empty array to treat every surface as facing the camera.
+// deintegrate: remove the samples from the grid instead of adding them. The
+//   other arguments must match the ones they were fused with.
+// num_voxels_updated: if not null, incremented by the number of voxels
+//   updated.
 __global__
 void FuseKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
+  float min_truncation,
   float4 flpp,
   float2 depth_min_max,
   float4x4 camera_from_world,
+  DepthNoiseModel noise_model,
   KernelArray2D<const float> depth_map,
-  KernelArray3D<TSDF> regular_grid);
+  KernelArray2D<const float4> normal_map,
+  bool deintegrate,
+  unsigned long long* num_voxels_updated,
+  TSDFGridView regular_grid);
 
-// TODO: replace CalibratedPosedDepthCamera with something in __constant__
-// memory.
+// Blends every observed voxel of source into regular_grid, as if it were a
+// depth sample with the voxel's distance and weight. Each voxel of
+// regular_grid takes the nearest voxel of source.
+//
+// source_from_grid: maps regular_grid's grid coordinates to source's.
+__global__
+void FuseGridKernel(
+  float4x4 source_from_grid,
+  float source_max_tsdf_value,
+  ConstTSDFGridView source,
+  float max_tsdf_value,
+  TSDFGridView regular_grid);
+
+// The depth cameras of FuseMultipleKernel, and their depth maps. Only the
+// first num_cameras entries are used.
+struct FuseMultipleCameras {
+  int num_cameras;
+  CalibratedPosedDepthCamera
+    depth_cameras[RegularGridTSDF::kMaxFuseMultipleCameras];
+  KernelArray2D<const float>
+    depth_maps[RegularGridTSDF::kMaxFuseMultipleCameras];
+};
+
+// Fuses the depth maps of several cameras in one sweep over the grid. Each
+// voxel is updated with the cameras in order, as FuseKernel would in
+// num_cameras passes, but without normals.
+//
+// TODO: replace FuseMultipleCameras with something in __constant__ memory.
 __global__
 void FuseMultipleKernel(
   float4x4 world_from_grid,
   float max_tsdf_value,
-  CalibratedPosedDepthCamera depth_camera0,
-  CalibratedPosedDepthCamera depth_camera1,
-  CalibratedPosedDepthCamera depth_camera2,
-  KernelArray2D<const float> depth_map0,
-  KernelArray2D<const float> depth_map1,
-  KernelArray2D<const float> depth_map2,
-  KernelArray3D<TSDF> regular_grid);
+  float min_truncation,
+  FuseMultipleCameras cameras,
+  unsigned long long* num_voxels_updated,
+  TSDFGridView regular_grid);
 
 #endif // FUSE_H
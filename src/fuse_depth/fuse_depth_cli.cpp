@@ -16,16 +16,18 @@
 #include <gflags/gflags.h>
 #include "libcgt/camera_wrappers/StreamConfig.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
-#include "libcgt/core/vecmath/SimilarityTransform.h"
 
 #include "../input_buffer.h"
+#include "../perf_collector.h"
 #include "../pose_utils.h"
 #include "../regular_grid_fusion_pipeline.h"
 #include "../rgbd_camera_parameters.h"
 #include "../rgbd_input.h"
+#include "../trace_recorder.h"
+#include "../tsdf_volume_spec.h"
+#include "../volume_bounds_estimator.h"
 
 using libcgt::core::vecmath::EuclideanTransform;
-using libcgt::core::vecmath::SimilarityTransform;
 
 // Inputs.
 DEFINE_string(calibration_dir, "",
@@ -51,33 +53,100 @@ DEFINE_string(output_tsdf3d, "",
 
 // Options.
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_output, "", "With --collect_perf, write per-stage latency "
+  "percentiles and counters to this file on exit: CSV if it ends in .csv, "
+  "JSON otherwise.");
+DEFINE_string(trace_output, "", "If non-empty, record a timeline of pipeline "
+  "stages, tagged with frame indices and timestamps, and write it to this "
+  "file on exit as a Chrome trace (.json), viewable in chrome://tracing or "
+  "ui.perfetto.dev. GPU stages synchronize at their end while tracing.");
+DEFINE_bool(fused_depth_preprocessing, true, "When the input provides raw "
+  "depth in millimeters, convert, smooth, and estimate normals in a single "
+  "fused pass.");
+DEFINE_string(normal_estimator, "forward_difference", "How to estimate "
+  "normals of incoming depth frames for ICP. Either \"forward_difference\" "
+  "or \"covariance\" (slower, less noisy, and ICP weights each sample by "
+  "the planarity of its neighborhood).");
 DEFINE_bool(adaptive_raycast, true, "Use signed distance values themselves "
   "during raycasting rather than one voxel at a time. Much faster, slightly "
   "less accurate.");
+DEFINE_int32(tsdf_cascade_levels, 1, "Number of TSDF grids of doubling "
+  "voxel size, centered on the same point. Each level only fuses depth its "
+  "voxels can resolve, so coarse levels hold the far field. 1 for a single "
+  "grid.");
+DEFINE_string(rolling_volume_dir, "", "If non-empty, the TSDF grid becomes a "
+  "rolling window that follows the camera. Bricks that scroll out of it are "
+  "written to this directory, which must exist, and read back when the "
+  "camera returns. --output_mesh covers the whole scan, but --output_tsdf3d "
+  "only covers the final window.");
+DEFINE_int32(brick_cache_mb, 1024, "Memory budget, in MB, for bricks of the "
+  "rolling TSDF grid cached in host memory.");
+DEFINE_bool(pose_graph, false, "With depth ICP tracking, optimize a pose "
+  "graph of keyframes on a background thread and re-fuse frames whose poses "
+  "it corrects. Keeps keyframes and the most recent depth frames in host "
+  "memory.");
+DEFINE_int32(submap_resolution, 0, "If positive, fuse into submaps of this "
+  "resolution, each anchored to the camera pose it was started from, instead "
+  "of one TSDF grid. Submaps fuse concurrently and are merged into the grid "
+  "for output. With --pose_graph, optimized poses move submaps instead of "
+  "re-fusing frames.");
+DEFINE_int32(fusion_workers, 4, "Number of submaps that can fuse "
+  "concurrently.");
+DEFINE_int32(max_submaps, 64, "Maximum number of submaps. Once there are "
+  "this many, frames are fused into the nearest one instead of a new one.");
+DEFINE_bool(aruco_roi_tracking, true, "Look for ArUco markers near where "
+  "they were in the previous color frame first, and only search the whole "
+  "frame if that fails.");
+DEFINE_string(volume_config, "", "[Optional] .yaml file describing the TSDF "
+  "grid, with keys resolution, voxel_size, origin, and max_tsdf_value. "
+  "The --volume_* flags override it.");
+DEFINE_string(volume_resolution, "", "[Optional] TSDF grid resolution: "
+  "\"n\" or \"nx,ny,nz\". Defaults to 512.");
+DEFINE_double(volume_voxel_size, 0, "[Optional] If positive, the TSDF voxel "
+  "size in meters. Defaults to 2 m / 512.");
+DEFINE_string(volume_origin, "", "[Optional] World coordinates of the TSDF "
+  "grid's corner: \"x,y,z\", in meters. By default, the grid is placed "
+  "relative to the initial pose, depending on the pose estimator.");
+DEFINE_double(volume_truncation, 0, "[Optional] If positive, the "
+  "representable range of the TSDF, in meters. Defaults to 4 voxels.");
+DEFINE_bool(volume_auto_bounds, false, "[Optional] Before fusing, unproject "
+  "the depth frames of --input_rgbd with their precomputed poses and fit "
+  "the TSDF grid, which need not be a cube, to the observed surfaces. Its "
+  "resolution, voxel size and origin replace those of the --volume_* "
+  "flags. Requires a precomputed pose estimator.");
+DEFINE_int32(volume_bounds_frames, 0, "[Optional] With --volume_auto_bounds, "
+  "only use this many depth frames from the start of --input_rgbd. 0 means "
+  "all of them.");
+DEFINE_int32(volume_memory_mb, 512, "[Optional] With --volume_auto_bounds, "
+  "the largest TSDF grid, in MB. The voxels are as fine as this allows.");
 
-// TODO: specify these as flags.
-constexpr int kRegularGridResolution = 512;
-constexpr float kRegularGridSideLength = 2.0f;
-constexpr float kRegularGridVoxelSize =
-  kRegularGridSideLength / kRegularGridResolution;
-
-SimilarityTransform GetInitialWorldFromGrid() {
+// Place the grid when --volume_config and --volume_origin do not.
+void PlaceInitialVolume(TSDFVolumeSpec* volume) {
   // TODO: consider initializing the camera to be at the origin.
   if (FLAGS_pose_estimator == "depth_icp") {
     // Put the camera at the center of the front face of the cube.
-    return SimilarityTransform(kRegularGridVoxelSize) *
-           SimilarityTransform(Vector3f(-0.5f * kRegularGridResolution,
-                                        -0.5f * kRegularGridResolution,
-                                        -kRegularGridResolution));
+    volume->Place(Vector3f{ 0 }, Vector3f{ 0.5f, 0.5f, 1.0f });
   } else {
     // Put the origin at the bottom in y, centered in x and z.
-    return SimilarityTransform(Vector3f(-0.5f * kRegularGridSideLength,
-                                        0.0f,
-                                        -0.5f * kRegularGridSideLength)) *
-           SimilarityTransform(kRegularGridVoxelSize);
+    volume->Place(Vector3f{ 0 }, Vector3f{ 0.5f, 0.0f, 0.5f });
   }
 }
 
+// Fit volume to the depth frames of --input_rgbd that have a precomputed
+// pose.
+bool EstimateVolumeBounds(const RGBDCameraParameters& camera_params,
+  const PoseEstimatorOptions& pose_options, TSDFVolumeSpec* volume) {
+  // Match frames to poses by timestamp, as the pipeline does.
+  VolumeBoundsEstimator estimator;
+  AddRgbdFileToVolumeBounds(FLAGS_input_rgbd, camera_params.depth,
+    pose_options.precomputed_path,
+    pose_options.method ==
+      PoseEstimationMethod::PRECOMPUTED_REFINE_WITH_DEPTH_ICP,
+    FLAGS_volume_bounds_frames, &estimator);
+  return estimator.Estimate(
+    static_cast<size_t>(FLAGS_volume_memory_mb) << 20, volume);
+}
+
 bool GetPoseEstimatorOptions(const RGBDCameraParameters& camera_params,
   PoseEstimatorOptions* options) {
   if (FLAGS_pose_estimator == "color_aruco" ||
@@ -142,6 +211,56 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (FLAGS_normal_estimator != "forward_difference" &&
+    FLAGS_normal_estimator != "covariance") {
+    fprintf(stderr, "Invalid normal estimator: %s.\n",
+      FLAGS_normal_estimator.c_str());
+    return 1;
+  }
+
+  if (FLAGS_tsdf_cascade_levels < 1) {
+    fprintf(stderr, "tsdf_cascade_levels must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_submap_resolution > 0 &&
+    (FLAGS_tsdf_cascade_levels > 1 || FLAGS_rolling_volume_dir != "")) {
+    fprintf(stderr, "submap_resolution cannot be combined with "
+      "tsdf_cascade_levels or rolling_volume_dir.\n");
+    return 1;
+  }
+  if (FLAGS_fusion_workers < 1) {
+    fprintf(stderr, "fusion_workers must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_max_submaps < 1) {
+    fprintf(stderr, "max_submaps must be at least 1.\n");
+    return 1;
+  }
+  if (FLAGS_perf_output != "" && !FLAGS_collect_perf) {
+    fprintf(stderr, "perf_output requires collect_perf.\n");
+    return 1;
+  }
+  if (FLAGS_volume_auto_bounds &&
+    FLAGS_pose_estimator != "precomputed" &&
+    FLAGS_pose_estimator != "precomputed_refine_with_depth_icp") {
+    fprintf(stderr, "volume_auto_bounds requires a precomputed pose "
+      "estimator.\n");
+    return 1;
+  }
+  if (FLAGS_volume_auto_bounds && FLAGS_volume_memory_mb < 1) {
+    fprintf(stderr, "volume_memory_mb must be at least 1.\n");
+    return 1;
+  }
+
+  TSDFVolumeSpec volume;
+  bool has_origin;
+  if (!GetTSDFVolumeSpecFromFlags(&volume, &has_origin)) {
+    return 1;
+  }
+  if (!has_origin) {
+    PlaceInitialVolume(&volume);
+  }
+
   bool ok;
 
   RGBDCameraParameters camera_params;
@@ -154,7 +273,8 @@ int main(int argc, char* argv[]) {
 
   // TODO: validate rgbd input size with camera calibration size.
   // It may not have a color stream.
-  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_rgbd.c_str());
+  RgbdInput rgbd_input(RgbdInput::InputType::FILE, FLAGS_input_rgbd.c_str(),
+    camera_params.depth.depth_range);
 
   PoseEstimatorOptions pose_options;
   ok = GetPoseEstimatorOptions(camera_params, &pose_options);
@@ -164,10 +284,18 @@ int main(int argc, char* argv[]) {
   }
   fprintf(stderr, "Using pose estimator: %s\n", FLAGS_pose_estimator.c_str());
 
-  RegularGridFusionPipeline pipeline(camera_params,
-    Vector3i(kRegularGridResolution),
-    GetInitialWorldFromGrid(),
-    pose_options);
+  if (FLAGS_volume_auto_bounds &&
+    !EstimateVolumeBounds(camera_params, pose_options, &volume)) {
+    fprintf(stderr, "Failed to estimate volume bounds.\n");
+    return 2;
+  }
+
+  RegularGridFusionPipeline pipeline(camera_params, volume, pose_options);
+
+  if (FLAGS_trace_output != "") {
+    TraceRecorder::Instance().SetThreadName("main");
+    TraceRecorder::Instance().Start();
+  }
 
   bool color_updated;
   bool depth_updated;
@@ -186,6 +314,20 @@ int main(int argc, char* argv[]) {
   }
 
   // Fusion finished, save outputs.
+  pipeline.FlushBrickStore();
+  pipeline.MergeSubmaps();
+
+  if (FLAGS_trace_output != "") {
+    TraceRecorder::Instance().Stop();
+    fprintf(stderr, "Saving trace to %s...", FLAGS_trace_output.c_str());
+    ok = TraceRecorder::Instance().WriteChromeTrace(FLAGS_trace_output);
+    if (ok) {
+      fprintf(stderr, "done.\n");
+    } else {
+      fprintf(stderr, "FAILED.\n");
+    }
+  }
+
   if (FLAGS_output_mesh != "") {
     TriangleMesh mesh = pipeline.Triangulate();
     fprintf(stderr, "Saving mesh to %s...", FLAGS_output_mesh.c_str());
@@ -216,4 +358,18 @@ int main(int argc, char* argv[]) {
       fprintf(stderr, "FAILED.\n");
     }
   }
+
+  if (FLAGS_collect_perf) {
+    PerfCollector::Instance().Print();
+    if (FLAGS_perf_output != "") {
+      fprintf(stderr, "Saving performance statistics to %s...",
+        FLAGS_perf_output.c_str());
+      ok = PerfCollector::Instance().Write(FLAGS_perf_output);
+      if (ok) {
+        fprintf(stderr, "done.\n");
+      } else {
+        fprintf(stderr, "FAILED.\n");
+      }
+    }
+  }
 }
@@ -0,0 +1,99 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FUSE_VOXEL_CUH
+#define FUSE_VOXEL_CUH
+
+#include <cmath>
+
+#include <helper_math.h>
+
+#include "camera_math.cuh"
+#include "depth_noise_model.h"
+
+// The work FuseKernel does for one voxel, also called by the host benchmark
+// so that both fuse identically: find the depth sample that the voxel
+// projects to, and the truncated signed distance and weight to update the
+// voxel with.
+//
+// voxel_center_camera: the voxel center in camera coordinates, which follow
+//   OpenGL conventions: z is negative in front of the camera.
+// depth_map, normal_map: indexed by { x, y } with width() and height(), e.g.
+//   KernelArray2D on the device and Array2DReadView on the host. Normals
+//   must have x, y, z and w members. normal_map may be empty, in which case
+//   every surface is treated as facing the camera.
+//
+// Returns false if the voxel should not be updated.
+template <typename DepthMap, typename NormalMap>
+__inline__ __device__ __host__
+bool FuseVoxel(float3 voxel_center_camera, float4 flpp, float2 depth_min_max,
+  float min_truncation, float max_tsdf_value,
+  const DepthNoiseModel& noise_model, const DepthMap& depth_map,
+  const NormalMap& normal_map, float* dz, float* weight) {
+  float3 uv = PixelFromCamera(voxel_center_camera, flpp);
+  int x = static_cast<int>(floorf(uv.x));
+  int y = static_cast<int>(floorf(uv.y));
+
+  if (voxel_center_camera.z > 0 ||
+    x < 0 || x >= depth_map.width() || y < 0 || y >= depth_map.height()) {
+    return false;
+  }
+
+  float image_depth = depth_map[{ x, y }];
+  if (image_depth < depth_min_max.x || image_depth > depth_min_max.y) {
+    return false;
+  }
+
+  // Compute the signed distance between the voxel center and the surface
+  // observation.
+  //
+  // Note that we flip the sign on z to get "depth", where positive numbers
+  // are in front of the camera.
+  //
+  // The sign convention of the distance field is so that voxels in front of
+  // the surface is positive (and voxels behind are negative).
+  float voxel_center_depth = -voxel_center_camera.z;
+  float d = image_depth - voxel_center_depth;
+
+  // The angle between the surface normal and the ray towards the camera.
+  // Normals are oriented towards the camera, so cos_theta > 0.
+  float cos_theta = 1.0f;
+  if (x < normal_map.width() && y < normal_map.height()) {
+    auto normal = normal_map[{ x, y }];
+    if (normal.w > 0) {
+      float3 to_camera = -normalize(voxel_center_camera);
+      cos_theta = dot(make_float3(normal.x, normal.y, normal.z), to_camera);
+    }
+  }
+  float sigma = noise_model.Sigma(image_depth, cos_theta);
+  float truncation = noise_model.Truncation(sigma, min_truncation,
+    max_tsdf_value);
+
+  // Now integrate data in carefully:
+  // Consider 3 cases:
+  // d < -truncation: the voxel is behind the observation and out of the
+  //   truncation region. Therefore, do nothing.
+  // d \in [-truncation, 0]: the voxel is behind the observation and
+  //   within the truncation region. Integrate.
+  // d > 0: the voxel is in front of the observation. Integrate... but if
+  //   the voxel is really far in front, we don't want to put in a large
+  //   value. Instead, clamp it to truncation.
+  if (d < -truncation) {
+    return false;
+  }
+  *dz = fminf(d, truncation);
+  *weight = noise_model.Weight(sigma);
+  return true;
+}
+
+#endif  // FUSE_VOXEL_CUH
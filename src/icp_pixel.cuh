@@ -0,0 +1,176 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef ICP_PIXEL_CUH
+#define ICP_PIXEL_CUH
+
+#include <cmath>
+
+#include <helper_math.h>
+
+#include "libcgt/cuda/float4x4.h"
+
+#include "camera_math.cuh"
+#include "icp_least_squares_data.h"
+
+// What ICPPixel() did with a model pixel.
+enum class ICPPixelResult {
+  // The raycast has no surface at the pixel.
+  NO_MODEL_POINT,
+  // The model point projects outside of the incoming frame's guard band, or
+  // is behind the camera.
+  OUT_OF_VIEW,
+  // The incoming frame has no depth or normal where it projects.
+  NO_INCOMING_POINT,
+  // The points are more than max_distance_for_match apart.
+  TOO_FAR,
+  // The normals differ by more than min_dot_product_for_match.
+  NORMALS_DISAGREE,
+  // The pair was added to output.
+  MATCHED
+};
+
+// The work ICPKernel does for one pixel of the raycast model, also called by
+// the host benchmark so that both associate and weigh points identically:
+// project the model point into the incoming frame at the current pose
+// estimate and, if the point there matches it, write the point-to-plane
+// terms of the pair to output.
+//
+// depth_map, normal_map: the incoming frame, indexed by { x, y } with width()
+//   and height(), e.g. KernelArray2D on the device and Array2DReadView on the
+//   host. Normals must have x, y, z and w members.
+// output: must be zero-initialized. Only written if MATCHED is returned.
+template <typename DepthMap, typename NormalMap>
+__inline__ __device__ __host__
+ICPPixelResult ICPPixel(float4 flpp, float2 depth_min_max,
+  float4x4 model_from_world, float4x4 model_from_current,
+  float4x4 current_from_model, const DepthMap& depth_map,
+  const NormalMap& normal_map, float4 dst_point_world4,
+  float4 dst_normal_world4, int src_image_guard_band_pixels,
+  float max_distance_for_match, float min_dot_product_for_match,
+  ICPLeastSquaresData* output) {
+  // TODO: weighting function parameters
+  // Reject data association if position differs by more than eps1
+  // and normal dot product more than eps2?
+  if (dst_point_world4.w == 0 || dst_normal_world4.w == 0) {
+    return ICPPixelResult::NO_MODEL_POINT;
+  }
+
+  float3 dst_point_world = make_float3(dst_point_world4);
+  float3 dst_normal_world = make_float3(dst_normal_world4);
+
+  float3 dst_point_model = transformPoint(model_from_world, dst_point_world);
+  float3 dst_normal_model = transformVector(model_from_world, dst_normal_world);
+
+  // Project dst_point into current pose estimate to see if it associates.
+  float3 dst_point_current = transformPoint(current_from_model, dst_point_model);
+  float3 xy = PixelFromCamera(dst_point_current, flpp);
+  int2 dst_xy_current = {
+    static_cast<int>(floorf(xy.x)),
+    static_cast<int>(floorf(xy.y))
+  };
+
+  // If the point is in front of the camera, then dst_point_current.z < 0.
+  const int guard = src_image_guard_band_pixels;
+  if (dst_xy_current.x < guard ||
+    dst_xy_current.x >= depth_map.width() - guard ||
+    dst_xy_current.y < guard ||
+    dst_xy_current.y >= depth_map.height() - guard ||
+    dst_point_current.z > 0) {
+    return ICPPixelResult::OUT_OF_VIEW;
+  }
+
+  float src_depth = depth_map[{ dst_xy_current.x, dst_xy_current.y }];
+  auto src_normal_current4 =
+    normal_map[{ dst_xy_current.x, dst_xy_current.y }];
+
+  if (src_depth < depth_min_max.x || src_depth > depth_min_max.y ||
+    src_normal_current4.w == 0) {
+    return ICPPixelResult::NO_INCOMING_POINT;
+  }
+
+  // Unproject src pixel into camera coordinates and then into model camera
+  // coordinates.
+  float3 src_point_current = CameraFromPixel(dst_xy_current, src_depth, flpp);
+  float3 src_point_model = transformPoint(model_from_current,
+    src_point_current);
+  float3 src_normal_model = transformVector(model_from_current,
+    make_float3(src_normal_current4.x, src_normal_current4.y,
+      src_normal_current4.z));
+
+  // TODO(jiawen): write a parameterized weight function which accepts points,
+  // including 0.
+  float3 delta = dst_point_model - src_point_model;
+  if (length(delta) > max_distance_for_match) {
+    return ICPPixelResult::TOO_FAR;
+  }
+
+  if (dot(src_normal_model, dst_normal_model) < min_dot_product_for_match) {
+    return ICPPixelResult::NORMALS_DISAGREE;
+  }
+
+  // Declare sample as valid.
+  output->num_samples = 1;
+
+  float3 c = cross(src_point_model, dst_normal_model);
+  float r = dot(delta, dst_normal_model);
+
+  output->a[ 0] = c.x * c.x;
+  output->a[ 1] = c.y * c.x;
+  output->a[ 2] = c.z * c.x;
+  output->a[ 3] = dst_normal_model.x * c.x;
+  output->a[ 4] = dst_normal_model.y * c.x;
+  output->a[ 5] = dst_normal_model.z * c.x;
+
+  output->a[ 6] = c.y * c.y;
+  output->a[ 7] = c.z * c.y;
+  output->a[ 8] = dst_normal_model.x * c.y;
+  output->a[ 9] = dst_normal_model.y * c.y;
+  output->a[10] = dst_normal_model.z * c.y;
+
+  output->a[11] = c.z * c.z;
+  output->a[12] = dst_normal_model.x * c.z;
+  output->a[13] = dst_normal_model.y * c.z;
+  output->a[14] = dst_normal_model.z * c.z;
+
+  output->a[15] = dst_normal_model.x * dst_normal_model.x;
+  output->a[16] = dst_normal_model.y * dst_normal_model.x;
+  output->a[17] = dst_normal_model.z * dst_normal_model.x;
+
+  output->a[18] = dst_normal_model.y * dst_normal_model.y;
+  output->a[19] = dst_normal_model.z * dst_normal_model.y;
+
+  output->a[20] = dst_normal_model.z * dst_normal_model.z;
+
+  output->b[0] = c.x * r;
+  output->b[1] = c.y * r;
+  output->b[2] = c.z * r;
+  output->b[3] = dst_normal_model.x * r;
+  output->b[4] = dst_normal_model.y * r;
+  output->b[5] = dst_normal_model.z * r;
+
+  // Weight the sample by the confidence of the incoming normal (see
+  // DepthProcessor::NormalEstimator). It is 1 for forward difference normals.
+  float weight = src_normal_current4.w;
+  for (int i = 0; i < 21; ++i) {
+    output->a[i] *= weight;
+  }
+  for (int i = 0; i < 6; ++i) {
+    output->b[i] *= weight;
+  }
+  output->squared_residual = weight * r * r;
+
+  return ICPPixelResult::MATCHED;
+}
+
+#endif  // ICP_PIXEL_CUH
@@ -13,10 +13,59 @@
 // limitations under the License.
 #include "input_buffer.h"
 
+#include "libcgt/core/common/ArrayUtils.h"
+#include "libcgt/core/imageproc/Swizzle.h"
+
+using libcgt::core::arrayutils::copy;
+using libcgt::core::arrayutils::flipY;
+using libcgt::core::imageproc::RGBToBGR;
+
+// The derived color buffers are allocated on first use.
 InputBuffer::InputBuffer(const Vector2i& color_resolution,
   const Vector2i& depth_resolution) :
-  color_bgr_ydown(color_resolution),
-  color_rgb(color_resolution),
-  depth_meters(depth_resolution) {
+  color_rgb_ydown(color_resolution),
+  depth_meters(depth_resolution),
+  depth_mm(depth_resolution) {
+
+}
+
+void InputBuffer::ColorUpdated() {
+  color_rgb_valid_ = false;
+  color_bgr_ydown_valid_ = false;
+  color_gray_ydown_valid_ = false;
+}
+
+Array2DReadView<uint8x3> InputBuffer::ColorRGB() {
+  if (!color_rgb_valid_) {
+    color_rgb_.resize(color_rgb_ydown.size());
+    copy<uint8x3>(color_rgb_ydown, flipY(color_rgb_.writeView()));
+    color_rgb_valid_ = true;
+  }
+  return color_rgb_;
+}
+
+Array2DReadView<uint8x3> InputBuffer::ColorBGRYDown() {
+  if (!color_bgr_ydown_valid_) {
+    color_bgr_ydown_.resize(color_rgb_ydown.size());
+    RGBToBGR(color_rgb_ydown, color_bgr_ydown_.writeView());
+    color_bgr_ydown_valid_ = true;
+  }
+  return color_bgr_ydown_;
+}
 
+Array2DReadView<uint8_t> InputBuffer::ColorGrayYDown() {
+  if (!color_gray_ydown_valid_) {
+    color_gray_ydown_.resize(color_rgb_ydown.size());
+    for (int y = 0; y < color_rgb_ydown.height(); ++y) {
+      const uint8x3* src = color_rgb_ydown.rowPointer(y);
+      uint8_t* dst = color_gray_ydown_.rowPointer(y);
+      for (int x = 0; x < color_rgb_ydown.width(); ++x) {
+        // BT.601 luma in 8-bit fixed point, as in cv::cvtColor.
+        dst[x] = static_cast<uint8_t>(
+          (77 * src[x].x + 150 * src[x].y + 29 * src[x].z + 128) >> 8);
+      }
+    }
+    color_gray_ydown_valid_ = true;
+  }
+  return color_gray_ydown_;
 }
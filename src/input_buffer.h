@@ -19,6 +19,14 @@
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/core/vecmath/Vector2i.h"
 
+// The latest frame from an RgbdInput.
+//
+// Color is stored once, as delivered by the camera. Derived forms (flipped,
+// swizzled, grayscale) are computed on first use after each
+// ColorUpdated() and cached, so that consumers pay only for the conversions
+// they need: a depth-only run never converts color at all.
+//
+// Not thread safe: the accessors write their caches.
 struct InputBuffer {
 
   InputBuffer(const Vector2i& color_resolution,
@@ -30,12 +38,38 @@ struct InputBuffer {
   int depth_frame_index = 0;
   int64_t depth_timestamp_ns = 0LL;
 
-  // This buffer is y-down for OpenCV only.
-  Array2D<uint8x3> color_bgr_ydown;
+  // The canonical color frame: RGB, y-down, as delivered by the camera.
+  // Call ColorUpdated() after writing it.
+  Array2D<uint8x3> color_rgb_ydown;
 
   // These buffers are y-up for processing and GL.
-  Array2D<uint8x3> color_rgb;
   Array2D<float> depth_meters; // depth in meters
+
+  // Raw depth in millimeters, y-up, as delivered by the camera. Only valid
+  // if depth_mm_valid: some sources provide depth in meters directly.
+  Array2D<uint16_t> depth_mm;
+  bool depth_mm_valid = false;
+
+  // Invalidate the views derived from color_rgb_ydown.
+  void ColorUpdated();
+
+  // RGB, y-up, for processing and GL.
+  Array2DReadView<uint8x3> ColorRGB();
+
+  // BGR, y-down, for OpenCV.
+  Array2DReadView<uint8x3> ColorBGRYDown();
+
+  // Luma, y-down, for marker detection.
+  Array2DReadView<uint8_t> ColorGrayYDown();
+
+ private:
+
+  Array2D<uint8x3> color_rgb_;
+  Array2D<uint8x3> color_bgr_ydown_;
+  Array2D<uint8_t> color_gray_ydown_;
+  bool color_rgb_valid_ = false;
+  bool color_bgr_ydown_valid_ = false;
+  bool color_gray_ydown_valid_ = false;
 };
 
 #endif  // INPUT_BUFFER_H
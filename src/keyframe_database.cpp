@@ -0,0 +1,170 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "keyframe_database.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+
+KeyframeDatabase::KeyframeDatabase(const Vector2i& depth_resolution,
+  const Range1f& depth_range, int num_ferns, int num_tests_per_fern,
+  uint32_t seed) :
+  small_resolution_{ depth_resolution.x / kDownsampleFactor,
+    depth_resolution.y / kDownsampleFactor },
+  depth_range_(depth_range),
+  num_ferns_(num_ferns),
+  num_tests_per_fern_(num_tests_per_fern) {
+  assert(num_ferns > 0);
+  assert(num_tests_per_fern > 0 && num_tests_per_fern <= 8);
+  assert(small_resolution_.x > 0 && small_resolution_.y > 0);
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> x_dist(0, small_resolution_.x - 1);
+  std::uniform_int_distribution<int> y_dist(0, small_resolution_.y - 1);
+  std::uniform_real_distribution<float> threshold_dist(
+    depth_range.left(), depth_range.right());
+
+  tests_.resize(num_ferns_ * num_tests_per_fern_);
+  for (FernTest& test : tests_) {
+    test.xy = { x_dist(rng), y_dist(rng) };
+    test.threshold = threshold_dist(rng);
+  }
+
+  inverted_index_.resize(num_ferns_ * NumCodesPerFern());
+}
+
+void KeyframeDatabase::Clear() {
+  keyframes_.clear();
+  for (auto& list : inverted_index_) {
+    list.clear();
+  }
+}
+
+int KeyframeDatabase::NumKeyframes() const {
+  return static_cast<int>(keyframes_.size());
+}
+
+const KeyframeDatabase::Keyframe& KeyframeDatabase::GetKeyframe(
+  int keyframe_index) const {
+  return keyframes_[keyframe_index];
+}
+
+bool KeyframeDatabase::MaybeAddKeyframe(Array2DReadView<float> depth_meters,
+  const PoseFrame& pose) {
+  Keyframe keyframe;
+  keyframe.pose = pose;
+  keyframe.depth_meters.resize(small_resolution_);
+  Downsample(depth_meters, keyframe.depth_meters.writeView());
+  keyframe.codes = Encode(keyframe.depth_meters.readView());
+
+  // Reject the keyframe if it looks too much like one we already have.
+  std::vector<int> num_matching = CountMatchingCodes(keyframe.codes);
+  for (int count : num_matching) {
+    float dissimilarity = 1.0f - static_cast<float>(count) / num_ferns_;
+    if (dissimilarity < kMinDissimilarityForNewKeyframe) {
+      return false;
+    }
+  }
+
+  int keyframe_index = NumKeyframes();
+  for (int f = 0; f < num_ferns_; ++f) {
+    inverted_index_[f * NumCodesPerFern() + keyframe.codes[f]].push_back(
+      keyframe_index);
+  }
+  keyframes_.push_back(std::move(keyframe));
+  return true;
+}
+
+std::vector<KeyframeDatabase::Match> KeyframeDatabase::FindSimilar(
+  Array2DReadView<float> depth_meters, int max_matches) const {
+  std::vector<Match> matches;
+  if (keyframes_.empty() || max_matches <= 0) {
+    return matches;
+  }
+
+  Array2D<float> small_depth_meters(small_resolution_);
+  Downsample(depth_meters, small_depth_meters.writeView());
+  std::vector<int> num_matching =
+    CountMatchingCodes(Encode(small_depth_meters.readView()));
+
+  matches.resize(num_matching.size());
+  for (size_t i = 0; i < num_matching.size(); ++i) {
+    matches[i].keyframe_index = static_cast<int>(i);
+    matches[i].dissimilarity =
+      1.0f - static_cast<float>(num_matching[i]) / num_ferns_;
+  }
+
+  int num_output = std::min(max_matches, static_cast<int>(matches.size()));
+  std::partial_sort(matches.begin(), matches.begin() + num_output,
+    matches.end(),
+    [](const Match& lhs, const Match& rhs) {
+      return lhs.dissimilarity < rhs.dissimilarity;
+    });
+  matches.resize(num_output);
+  return matches;
+}
+
+void KeyframeDatabase::Downsample(Array2DReadView<float> depth_meters,
+  Array2DWriteView<float> small_depth_meters) const {
+  for (int y = 0; y < small_depth_meters.height(); ++y) {
+    for (int x = 0; x < small_depth_meters.width(); ++x) {
+      float sum = 0.0f;
+      int count = 0;
+      for (int dy = 0; dy < kDownsampleFactor; ++dy) {
+        for (int dx = 0; dx < kDownsampleFactor; ++dx) {
+          float z = depth_meters[{ kDownsampleFactor * x + dx,
+            kDownsampleFactor * y + dy }];
+          if (z >= depth_range_.left() && z <= depth_range_.right()) {
+            sum += z;
+            ++count;
+          }
+        }
+      }
+      small_depth_meters[{ x, y }] = count > 0 ? sum / count : 0.0f;
+    }
+  }
+}
+
+std::vector<uint8_t> KeyframeDatabase::Encode(
+  Array2DReadView<float> small_depth_meters) const {
+  std::vector<uint8_t> codes(num_ferns_);
+  for (int f = 0; f < num_ferns_; ++f) {
+    uint8_t code = 0;
+    for (int t = 0; t < num_tests_per_fern_; ++t) {
+      const FernTest& test = tests_[f * num_tests_per_fern_ + t];
+      // Invalid samples are 0 and therefore always fail the test.
+      if (small_depth_meters[test.xy] >= test.threshold) {
+        code |= (1 << t);
+      }
+    }
+    codes[f] = code;
+  }
+  return codes;
+}
+
+std::vector<int> KeyframeDatabase::CountMatchingCodes(
+  const std::vector<uint8_t>& codes) const {
+  std::vector<int> num_matching(keyframes_.size(), 0);
+  for (int f = 0; f < num_ferns_; ++f) {
+    for (int keyframe_index :
+      inverted_index_[f * NumCodesPerFern() + codes[f]]) {
+      ++num_matching[keyframe_index];
+    }
+  }
+  return num_matching;
+}
+
+int KeyframeDatabase::NumCodesPerFern() const {
+  return 1 << num_tests_per_fern_;
+}
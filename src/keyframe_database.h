@@ -0,0 +1,126 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef KEYFRAME_DATABASE_H
+#define KEYFRAME_DATABASE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+
+#include "pose_frame.h"
+
+// A store of keyframes used to relocalize the depth camera after ICP loses
+// track, following "Real-Time RGB-D Camera Relocalization"
+// [Glocker et al. 2013].
+//
+// Each keyframe holds a heavily downsampled copy of its depth map, its pose,
+// and a compact descriptor: a set of randomized ferns. Each fern is a small
+// number of binary tests of the form "depth at pixel p >= threshold", packed
+// into a code. The dissimilarity between two frames is the fraction of ferns
+// whose codes differ.
+class KeyframeDatabase {
+ public:
+
+  static constexpr int kDefaultNumFerns = 500;
+  static constexpr int kDefaultNumTestsPerFern = 4;
+  static constexpr int kDownsampleFactor = 8;
+
+  struct Keyframe {
+    PoseFrame pose;
+
+    // Depth in meters, downsampled by kDownsampleFactor. y-up.
+    Array2D<float> depth_meters;
+
+    // One code per fern.
+    std::vector<uint8_t> codes;
+  };
+
+  struct Match {
+    int keyframe_index = -1;
+    // In [0, 1]. 0 means every fern code is identical.
+    float dissimilarity = 1.0f;
+  };
+
+  // depth_resolution: the full resolution of incoming depth maps.
+  // depth_range: valid depth values, in meters. Fern thresholds are drawn
+  //   uniformly from this range.
+  // num_ferns, num_tests_per_fern: descriptor size. num_tests_per_fern must
+  //   be at most 8.
+  // seed: for drawing the random tests, so that a database is reproducible.
+  KeyframeDatabase(const Vector2i& depth_resolution,
+    const Range1f& depth_range,
+    int num_ferns = kDefaultNumFerns,
+    int num_tests_per_fern = kDefaultNumTestsPerFern,
+    uint32_t seed = 0);
+
+  void Clear();
+
+  int NumKeyframes() const;
+
+  const Keyframe& GetKeyframe(int keyframe_index) const;
+
+  // Encode depth_meters (full resolution, y-up) and add it as a keyframe with
+  // the given pose if it is sufficiently different from every existing
+  // keyframe. Returns true if a keyframe was added.
+  bool MaybeAddKeyframe(Array2DReadView<float> depth_meters,
+    const PoseFrame& pose);
+
+  // Returns up to max_matches keyframes most similar to depth_meters (full
+  // resolution, y-up), sorted by increasing dissimilarity.
+  std::vector<Match> FindSimilar(Array2DReadView<float> depth_meters,
+    int max_matches) const;
+
+ private:
+
+  struct FernTest {
+    Vector2i xy;
+    float threshold;
+  };
+
+  // Block-average the valid samples of depth_meters into small_depth_meters.
+  void Downsample(Array2DReadView<float> depth_meters,
+    Array2DWriteView<float> small_depth_meters) const;
+
+  std::vector<uint8_t> Encode(
+    Array2DReadView<float> small_depth_meters) const;
+
+  // For every keyframe, count the number of ferns whose code matches codes.
+  std::vector<int> CountMatchingCodes(
+    const std::vector<uint8_t>& codes) const;
+
+  int NumCodesPerFern() const;
+
+  const Vector2i small_resolution_;
+  const Range1f depth_range_;
+  const int num_ferns_;
+  const int num_tests_per_fern_;
+
+  // A new keyframe is only added if its dissimilarity to every existing
+  // keyframe is at least this large.
+  const float kMinDissimilarityForNewKeyframe = 0.2f;
+
+  // num_ferns_ * num_tests_per_fern_ tests, fern-major.
+  std::vector<FernTest> tests_;
+
+  // For fern f and code c, inverted_index_[f * NumCodesPerFern() + c] is the
+  // list of keyframes that have code c at fern f.
+  std::vector<std::vector<int>> inverted_index_;
+
+  std::vector<Keyframe> keyframes_;
+};
+
+#endif  // KEYFRAME_DATABASE_H
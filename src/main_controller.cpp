@@ -22,6 +22,7 @@
 #include "libcgt/camera_wrappers/PoseStream.h"
 
 #include "control_widget.h"
+#include "frame_synchronizer.h"
 #include "main_widget.h"
 #include "pose_utils.h"
 #include "rgbd_input.h"
@@ -79,16 +80,19 @@ void MainController::OnReadInput() {
       read_input_timer_->stop();
     }
   } else if (FLAGS_mode == "multi_static") {
-    for (int i = 0; i < static_cast<int>(inputs_.size()); ++i) {
-      bool color_updated;
-      bool depth_updated;
-      inputs_[i].read(&(msc_pipeline_->GetInputBuffer(i)),
-        &color_updated, &depth_updated);
-      if (color_updated || depth_updated) {
-        msc_pipeline_->NotifyInputUpdated(i, color_updated, depth_updated);
-      } else if (FLAGS_sm_input_type == "file") {
-        read_input_timer_->stop();
-      }
+    std::vector<InputBuffer*> buffers;
+    for (int i = 0; i < msc_pipeline_->NumCameras(); ++i) {
+      buffers.push_back(&(msc_pipeline_->GetInputBuffer(i)));
+    }
+    // Only fuse framesets whose depth frames were taken together.
+    std::vector<bool> color_updated;
+    if (!frame_synchronizer_->Next(buffers, &color_updated)) {
+      read_input_timer_->stop();
+      frame_synchronizer_->PrintStats();
+      return;
+    }
+    for (int i = 0; i < msc_pipeline_->NumCameras(); ++i) {
+      msc_pipeline_->NotifyInputUpdated(i, color_updated[i], true);
     }
 
     //if(depth_updated) {
@@ -126,6 +130,8 @@ void MainController::OnResetClicked() {
 
 void MainController::OnSaveMeshClicked(QString filename) {
   if (FLAGS_mode == "single_moving") {
+    pipeline_->FlushBrickStore();
+    pipeline_->MergeSubmaps();
     TriangleMesh mesh = pipeline_->Triangulate();
     bool succeeded = mesh.saveOBJ(filename.toStdString());
     if (!succeeded) {
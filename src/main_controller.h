@@ -21,6 +21,7 @@
 #include "multi_static_camera_pipeline.h"
 
 class ControlWidget;
+class FrameSynchronizer;
 class MainWidget;
 class QTimer;
 class RgbdInput;
@@ -35,7 +36,7 @@ class MainController : public QObject {
      ControlWidget* control_widget, MainWidget* main_widget);
 
    // HACK
-   std::vector<RgbdInput> inputs_;
+   FrameSynchronizer* frame_synchronizer_ = nullptr;
    MultiStaticCameraPipeline* msc_pipeline_ = nullptr;
 
  public slots:
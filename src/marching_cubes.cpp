@@ -13,6 +13,7 @@
 // limitations under the License.
 #include "marching_cubes.h"
 
+#include <cstdio>
 #include <unordered_map>
 
 #include "libcgt/core/common/ArrayUtils.h"
@@ -527,10 +528,12 @@ void PolygonalizeCell(Vector3f grid_positions[8], Vector3f grid_normals[8],
 
 // TODO(jiawen): do a version without normals
 // TODO(jiawen): cull voxels with weight < eps.
-void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
+template <typename Layout>
+void MarchingCubes(HostTSDFGridView<Layout> grid, float max_tsdf_value,
   const SimilarityTransform& world_from_grid,
   vector<Vector3f>& positions_list_out,
-  vector<Vector3f>& normals_list_out) {
+  vector<Vector3f>& normals_list_out,
+  bool print_progress) {
   const float iso_level = 0.0f;
   const float min_sdf_diff = 1e-3f;
   positions_list_out.clear();
@@ -538,9 +541,11 @@ void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
 
   // TODO(jiawen): version without normals is -1 instead of -2.
   for (int z = 0; z < grid.depth() - 2; ++z) {
-    printf("Running marching cubes... z = %d of %d\n", z, grid.depth() - 1);
-    printf("\t# vertices = %lld, # normals = %lld\n",
-      positions_list_out.size(), normals_list_out.size());
+    if (print_progress) {
+      printf("Running marching cubes... z = %d of %d\n", z, grid.depth() - 1);
+      printf("\t# vertices = %lld, # normals = %lld\n",
+        positions_list_out.size(), normals_list_out.size());
+    }
     for (int y = 0; y < grid.height() - 2; ++y) {
       for (int x = 0; x < grid.width() - 2; ++x) {
         Vector3f positions[8];
@@ -627,10 +632,26 @@ void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
     }
   }
 
-  printf("Marching cubes generated %lld vertices, %lld normals\n",
-    positions_list_out.size(), normals_list_out.size());
+  if (print_progress) {
+    printf("Marching cubes generated %lld vertices, %lld normals\n",
+      positions_list_out.size(), normals_list_out.size());
+  }
 }
 
+template void MarchingCubes<LinearVoxelLayout>(
+  HostTSDFGridView<LinearVoxelLayout> grid, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_list_out,
+  vector<Vector3f>& normals_list_out,
+  bool print_progress);
+
+template void MarchingCubes<BrickVoxelLayout>(
+  HostTSDFGridView<BrickVoxelLayout> grid, float max_tsdf_value,
+  const SimilarityTransform& world_from_grid,
+  vector<Vector3f>& positions_list_out,
+  vector<Vector3f>& normals_list_out,
+  bool print_progress);
+
 struct Vector3fHash {
   std::size_t operator()(const Vector3f& v) const {
     return ((std::hash<float>()(v.x)
@@ -22,13 +22,25 @@
 #include "libcgt/core/geometry/TriangleMesh.h"
 
 #include "tsdf.h"
+#include "voxel_layout.h"
+
+// A host view of a TSDF grid stored in Layout order.
+template <typename Layout>
+using HostTSDFGridView =
+  VoxelGridView<const TSDF, Layout, Array3DReadView<TSDF>>;
 
 // Run the marching cubes algorithm on the regular grid TSDF.
 // Generates a triangle list of positions and normals.
-void MarchingCubes(Array3DReadView<TSDF> grid, float max_tsdf_value,
+//
+// If print_progress is true, prints progress after each slice.
+//
+// Instantiated for LinearVoxelLayout and BrickVoxelLayout.
+template <typename Layout>
+void MarchingCubes(HostTSDFGridView<Layout> grid, float max_tsdf_value,
   const libcgt::core::vecmath::SimilarityTransform& world_from_grid,
   std::vector<Vector3f>& triangle_list_positions_out,
-  std::vector<Vector3f>& triangle_list_normals_out);
+  std::vector<Vector3f>& triangle_list_normals_out,
+  bool print_progress = true);
 
 TriangleMesh ConstructMarchingCubesMesh(
   const std::vector<Vector3f>& triangle_list_positions);
@@ -13,44 +13,55 @@
 // limitations under the License.
 #include "multi_static_camera_pipeline.h"
 
+#include <cassert>
+
 #include <gflags/gflags.h>
 
+#include <cuda_runtime.h>
 #include <vector_functions.h>
 
 #include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/cuda/VecmathConversions.h"
 #include "libcgt/cuda/VectorFunctions.h"
 
-using libcgt::core::arrayutils::cast;
+#include "trace_recorder.h"
+
 using libcgt::core::cameras::Intrinsics;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DECLARE_bool(adaptive_raycast);
+DECLARE_bool(fused_depth_preprocessing);
 
 MultiStaticCameraPipeline::MultiStaticCameraPipeline(
   const std::vector<RGBDCameraParameters>& camera_params,
   const std::vector<EuclideanTransform>& depth_camera_poses_cfw,
   const Vector3i& grid_resolution,
   const SimilarityTransform& world_from_grid,
-  float max_tsdf_value) :
+  float max_tsdf_value,
+  int num_preprocessing_threads) :
   regular_grid_(grid_resolution, world_from_grid, max_tsdf_value),
 
   camera_params_(camera_params),
   depth_camera_poses_cfw_(depth_camera_poses_cfw),
 
-  depth_processor_(camera_params[0].depth.intrinsics,
-                   camera_params[0].depth.depth_range) {
+  preprocessors_(num_preprocessing_threads > 0 ?
+    num_preprocessing_threads : static_cast<int>(camera_params.size())) {
+  // FuseMultiple() fuses every camera in one kernel.
+  assert(camera_params.size() <= RegularGridTSDF::kMaxFuseMultipleCameras);
 
   for (size_t i = 0; i < camera_params.size(); ++i) {
+    depth_processors_.emplace_back(new DepthProcessor(
+      camera_params[i].depth.intrinsics, camera_params[i].depth.depth_range));
+    depth_mm_.emplace_back(camera_params[i].depth.resolution);
     depth_meters_.emplace_back(camera_params[i].depth.resolution);
-    depth_camera_undistort_maps_.emplace_back(
+    depth_camera_undistort_remaps_.emplace_back(
       camera_params[i].depth.resolution);
     undistorted_depth_meters_.emplace_back(camera_params[i].depth.resolution);
     input_buffers_.emplace_back(camera_params[i].color.resolution,
                                 camera_params[i].depth.resolution);
 
-    copy(cast<float2>(camera_params[i].depth.undistortion_map.readView()),
-      depth_camera_undistort_maps_[i]);
+    copy(camera_params[i].depth.undistortion_remap.readView(),
+      depth_camera_undistort_remaps_[i]);
   }
 }
 
@@ -79,20 +90,24 @@ void MultiStaticCameraPipeline::Reset() {
 void MultiStaticCameraPipeline::NotifyInputUpdated(int camera_index,
                                                    bool color_updated,
                                                    bool depth_updated) {
-  copy(input_buffers_[camera_index].depth_meters.readView(),
-    depth_meters_[camera_index]);
-
-  depth_processor_.Undistort(
-    depth_meters_[camera_index], depth_camera_undistort_maps_[camera_index],
-    undistorted_depth_meters_[camera_index]);
+  if (!depth_updated) {
+    return;
+  }
+  TraceFrame trace_frame = TraceRecorder::CurrentFrame();
+  preprocessors_.Enqueue([this, camera_index, trace_frame] {
+    TraceRecorder::SetCurrentFrame(trace_frame);
+    Preprocess(camera_index);
+  });
 }
 
 InputBuffer& MultiStaticCameraPipeline::GetInputBuffer(int camera_index) {
+  WaitForPreprocessing();
   return input_buffers_[camera_index];
 }
 
 const DeviceArray2D<float>& MultiStaticCameraPipeline::GetUndistortedDepthMap(
   int camera_index) {
+  WaitForPreprocessing();
   return undistorted_depth_meters_[camera_index];
 }
 
@@ -108,6 +123,8 @@ PerspectiveCamera MultiStaticCameraPipeline::GetDepthCamera(
 }
 
 void MultiStaticCameraPipeline::Fuse() {
+  WaitForPreprocessing();
+
   // Right now, fuse them all, time aligned.
   // sweep over all the ones that are ready.
 
@@ -121,13 +138,15 @@ void MultiStaticCameraPipeline::Fuse() {
     regular_grid_.Fuse(
       flpp, camera_params_[i].depth.depth_range,
       depth_camera_poses_cfw_[i].asMatrix(),
-      undistorted_depth_meters_[i]
+      undistorted_depth_meters_[i], camera_params_[i].depth_noise_model
     );
   }
 }
 
 void MultiStaticCameraPipeline::FuseMultiple() {
-  std::vector<CalibratedPosedDepthCamera> c(3);
+  WaitForPreprocessing();
+
+  std::vector<CalibratedPosedDepthCamera> c(depth_meters_.size());
   for (size_t i = 0; i < depth_meters_.size(); ++i) {
     c[i].flpp = make_float4(
       make_float2(camera_params_[i].depth.intrinsics.focalLength),
@@ -139,6 +158,7 @@ void MultiStaticCameraPipeline::FuseMultiple() {
     c[i].camera_from_world = make_float4x4(
       depth_camera_poses_cfw_[i].asMatrix()
     );
+    c[i].noise_model = camera_params_[i].depth_noise_model;
   }
 
   regular_grid_.FuseMultiple(c, undistorted_depth_meters_);
@@ -181,3 +201,33 @@ TriangleMesh MultiStaticCameraPipeline::Triangulate(
 
   return mesh;
 }
+
+void MultiStaticCameraPipeline::WaitForPreprocessing() {
+  ScopedTrace trace("MultiStaticCameraPipeline::WaitForPreprocessing");
+  preprocessors_.Wait();
+}
+
+void MultiStaticCameraPipeline::Preprocess(int camera_index) {
+  ScopedTrace trace("MultiStaticCameraPipeline::Preprocess");
+  // Each worker thread has its own default stream (we build with
+  // --default-stream per-thread), so cameras' copies and kernels overlap.
+  const InputBuffer& input_buffer = input_buffers_[camera_index];
+  DepthProcessor& depth_processor = *(depth_processors_[camera_index]);
+  if (FLAGS_fused_depth_preprocessing && input_buffer.depth_mm_valid) {
+    // Convert and undistort in one pass, straight from millimeters.
+    copy(input_buffer.depth_mm.readView(), depth_mm_[camera_index]);
+    DepthProcessor::PreprocessBuffers outputs;
+    outputs.depth_meters = &(undistorted_depth_meters_[camera_index]);
+    depth_processor.Preprocess(depth_mm_[camera_index],
+      &(depth_camera_undistort_remaps_[camera_index]), outputs);
+  } else {
+    copy(input_buffer.depth_meters.readView(), depth_meters_[camera_index]);
+
+    depth_processor.Undistort(
+      depth_meters_[camera_index],
+      depth_camera_undistort_remaps_[camera_index],
+      undistorted_depth_meters_[camera_index]);
+  }
+  // Finish on the GPU before fusion reads the result on another stream.
+  cudaStreamSynchronize(cudaStreamPerThread);
+}
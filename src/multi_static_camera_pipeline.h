@@ -14,6 +14,9 @@
 #ifndef MULTI_STATIC_CAMERA_PIPELINE_H
 #define MULTI_STATIC_CAMERA_PIPELINE_H
 
+#include <memory>
+#include <vector>
+
 #include "libcgt/core/cameras/PerspectiveCamera.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
 #include "libcgt/core/vecmath/Vector2i.h"
@@ -30,6 +33,7 @@
 #include "projective_point_plane_icp.h"
 #include "regular_grid_tsdf.h"
 #include "rgbd_camera_parameters.h"
+#include "thread_pool.h"
 
 class MultiStaticCameraPipeline {
 
@@ -38,12 +42,15 @@ class MultiStaticCameraPipeline {
 
  public:
 
+  // Cameras are preprocessed on num_preprocessing_threads worker threads,
+  // or one per camera if it is 0.
   MultiStaticCameraPipeline(
     const std::vector<RGBDCameraParameters>& camera_params,
     const std::vector<EuclideanTransform>& depth_camera_poses_cfw,
     const Vector3i& grid_resolution,
     const SimilarityTransform& world_from_grid,
-    float max_tsdf_value);
+    float max_tsdf_value,
+    int num_preprocessing_threads = 0);
 
   int NumCameras() const;
 
@@ -55,6 +62,12 @@ class MultiStaticCameraPipeline {
 
   void Reset();
 
+  // Starts converting and undistorting camera_index's depth frame on a
+  // worker thread, then returns. The cameras of a frameset are preprocessed
+  // concurrently, and Fuse() and FuseMultiple() wait for all of them.
+  //
+  // The input buffer must not be modified until then. GetInputBuffer()
+  // waits, so a buffer obtained after this call is safe to write.
   void NotifyInputUpdated(int camera_index,
     bool color_updated, bool depth_updated);
 
@@ -82,6 +95,8 @@ class MultiStaticCameraPipeline {
   std::vector<InputBuffer> input_buffers_;
 
   // ----- Intermediate buffers -----
+  // Incoming raw depth frame in millimeters, if the input provides it.
+  std::vector<DeviceArray2D<uint16_t>> depth_mm_;
   // Incoming raw depth frame in meters.
   std::vector<DeviceArray2D<float>> depth_meters_;
   // Incoming raw depth, undistorted.
@@ -91,12 +106,23 @@ class MultiStaticCameraPipeline {
   RegularGridTSDF regular_grid_;
 
   // ----- Processors -----
-  DepthProcessor depth_processor_;
+  // One per camera, so that cameras can be preprocessed concurrently.
+  std::vector<std::unique_ptr<DepthProcessor>> depth_processors_;
 
   // ----- Constants -----
   const std::vector<EuclideanTransform> depth_camera_poses_cfw_;
   const std::vector<RGBDCameraParameters> camera_params_;
-  std::vector<DeviceArray2D<float2>> depth_camera_undistort_maps_;
+  // From CameraParameters::undistortion_remap.
+  std::vector<DeviceArray2D<uint32_t>> depth_camera_undistort_remaps_;
+
+  // Blocks until every NotifyInputUpdated() has finished, on the host and
+  // on the device.
+  void WaitForPreprocessing();
+
+  void Preprocess(int camera_index);
+
+  // Last, so that it is drained before the buffers it writes are destroyed.
+  ThreadPool preprocessors_;
 };
 
 #endif  // MULTI_STATIC_CAMERA_PIPELINE_H
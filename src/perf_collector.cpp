@@ -0,0 +1,313 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "perf_collector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <gflags/gflags.h>
+
+#include "third_party/pystring/pystring.h"
+
+DECLARE_bool(collect_perf);
+
+namespace {
+  // Values below 2^kSubBucketBits nanoseconds get a bucket each. Above that,
+  // each power of two gets kSubBucketCount / 2 buckets.
+  constexpr int kSubBucketBits = 7;
+  constexpr int kSubBucketCount = 1 << kSubBucketBits;
+  constexpr int kSubBucketHalfCount = kSubBucketCount / 2;
+  // The number of powers of two above the linear range.
+  constexpr int kMaxShift = 40;
+  constexpr int kNumBuckets = kSubBucketCount + kMaxShift * kSubBucketHalfCount;
+  constexpr uint64_t kMaxNanoseconds =
+    (uint64_t(kSubBucketCount) << kMaxShift) - 1;
+
+  int FloorLog2(uint64_t x) {
+    int log2 = 0;
+    while (x >>= 1) {
+      ++log2;
+    }
+    return log2;
+  }
+
+  // Quote s as a JSON string.
+  std::string JSONString(const std::string& s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+      }
+      quoted += c;
+    }
+    return quoted + "\"";
+  }
+}
+
+LatencyHistogram::LatencyHistogram() :
+  counts_(kNumBuckets, 0) {
+}
+
+void LatencyHistogram::Record(double milliseconds) {
+  milliseconds = std::max(milliseconds, 0.0);
+  uint64_t nanoseconds = static_cast<uint64_t>(std::min(
+    std::round(milliseconds * 1e6), static_cast<double>(kMaxNanoseconds)));
+  ++counts_[BucketIndex(nanoseconds)];
+
+  if (count_ == 0) {
+    min_ms_ = milliseconds;
+    max_ms_ = milliseconds;
+  } else {
+    min_ms_ = std::min(min_ms_, milliseconds);
+    max_ms_ = std::max(max_ms_, milliseconds);
+  }
+  sum_ms_ += milliseconds;
+  ++count_;
+}
+
+int64_t LatencyHistogram::Count() const {
+  return count_;
+}
+
+double LatencyHistogram::MeanMilliseconds() const {
+  return count_ > 0 ? sum_ms_ / count_ : 0.0;
+}
+
+double LatencyHistogram::MinMilliseconds() const {
+  return min_ms_;
+}
+
+double LatencyHistogram::MaxMilliseconds() const {
+  return max_ms_;
+}
+
+double LatencyHistogram::PercentileMilliseconds(double p) const {
+  if (count_ == 0) {
+    return 0.0;
+  }
+
+  p = std::min(std::max(p, 0.0), 100.0);
+  int64_t rank = std::max(static_cast<int64_t>(
+    std::ceil(p / 100.0 * count_)), int64_t(1));
+  int64_t cumulative = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    cumulative += counts_[i];
+    if (cumulative >= rank) {
+      // The bucket's midpoint can fall outside of the samples' range.
+      return std::min(std::max(BucketValue(i) * 1e-6, min_ms_), max_ms_);
+    }
+  }
+  return max_ms_;
+}
+
+// static
+int LatencyHistogram::BucketIndex(uint64_t nanoseconds) {
+  if (nanoseconds < kSubBucketCount) {
+    return static_cast<int>(nanoseconds);
+  }
+  // nanoseconds is in [2^(shift + kSubBucketBits - 1),
+  // 2^(shift + kSubBucketBits)), and the buckets there are 2^shift wide.
+  int shift = FloorLog2(nanoseconds) - (kSubBucketBits - 1);
+  int sub_bucket = static_cast<int>(nanoseconds >> shift) -
+    kSubBucketHalfCount;
+  return kSubBucketCount + (shift - 1) * kSubBucketHalfCount + sub_bucket;
+}
+
+// static
+double LatencyHistogram::BucketValue(int index) {
+  if (index < kSubBucketCount) {
+    return index;
+  }
+  int shift = (index - kSubBucketCount) / kSubBucketHalfCount + 1;
+  int sub_bucket = (index - kSubBucketCount) % kSubBucketHalfCount +
+    kSubBucketHalfCount;
+  uint64_t lower = uint64_t(sub_bucket) << shift;
+  return lower + 0.5 * (uint64_t(1) << shift);
+}
+
+// static
+PerfCollector& PerfCollector::Instance() {
+  static PerfCollector instance;
+  return instance;
+}
+
+// static
+bool PerfCollector::Enabled() {
+  return FLAGS_collect_perf;
+}
+
+void PerfCollector::RecordLatency(const std::string& stage,
+  double milliseconds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_[stage].Record(milliseconds);
+}
+
+void PerfCollector::AddCount(const std::string& counter, int64_t n) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[counter] += n;
+}
+
+bool PerfCollector::Stats(const std::string& stage,
+  StageStats* stats_out) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr = stages_.find(stage);
+  if (itr == stages_.end()) {
+    return false;
+  }
+  *stats_out = ComputeStats(itr->second);
+  return true;
+}
+
+int64_t PerfCollector::Count(const std::string& counter) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr = counters_.find(counter);
+  return itr != counters_.end() ? itr->second : 0;
+}
+
+std::vector<std::string> PerfCollector::StageNames() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> names;
+  for (const auto& stage : stages_) {
+    names.push_back(stage.first);
+  }
+  return names;
+}
+
+std::vector<std::string> PerfCollector::CounterNames() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> names;
+  for (const auto& counter : counters_) {
+    names.push_back(counter.first);
+  }
+  return names;
+}
+
+void PerfCollector::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_.clear();
+  counters_.clear();
+}
+
+void PerfCollector::Print() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& stage : stages_) {
+    StageStats stats = ComputeStats(stage.second);
+    printf("%s: n = %lld, mean = %f ms, p50 = %f ms, p95 = %f ms, "
+      "p99 = %f ms, max = %f ms\n",
+      stage.first.c_str(), static_cast<long long>(stats.count),
+      stats.mean_ms, stats.p50_ms, stats.p95_ms, stats.p99_ms, stats.max_ms);
+  }
+  for (const auto& counter : counters_) {
+    printf("%s: %lld\n", counter.first.c_str(),
+      static_cast<long long>(counter.second));
+  }
+}
+
+bool PerfCollector::WriteJSON(const std::string& filename) const {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing.\n", filename.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  fprintf(fp, "{\n  \"stages\": {");
+  const char* separator = "\n";
+  for (const auto& stage : stages_) {
+    StageStats stats = ComputeStats(stage.second);
+    fprintf(fp, "%s    %s: { \"count\": %lld, \"mean_ms\": %f, "
+      "\"min_ms\": %f, \"p50_ms\": %f, \"p95_ms\": %f, \"p99_ms\": %f, "
+      "\"max_ms\": %f }",
+      separator, JSONString(stage.first).c_str(),
+      static_cast<long long>(stats.count), stats.mean_ms, stats.min_ms,
+      stats.p50_ms, stats.p95_ms, stats.p99_ms, stats.max_ms);
+    separator = ",\n";
+  }
+  fprintf(fp, "\n  },\n  \"counters\": {");
+  separator = "\n";
+  for (const auto& counter : counters_) {
+    fprintf(fp, "%s    %s: %lld", separator,
+      JSONString(counter.first).c_str(),
+      static_cast<long long>(counter.second));
+    separator = ",\n";
+  }
+  fprintf(fp, "\n  }\n}\n");
+
+  bool succeeded = !ferror(fp);
+  fclose(fp);
+  return succeeded;
+}
+
+bool PerfCollector::WriteCSV(const std::string& filename) const {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing.\n", filename.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  fprintf(fp, "type,name,count,mean_ms,min_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+  for (const auto& stage : stages_) {
+    StageStats stats = ComputeStats(stage.second);
+    fprintf(fp, "stage,%s,%lld,%f,%f,%f,%f,%f,%f\n", stage.first.c_str(),
+      static_cast<long long>(stats.count), stats.mean_ms, stats.min_ms,
+      stats.p50_ms, stats.p95_ms, stats.p99_ms, stats.max_ms);
+  }
+  for (const auto& counter : counters_) {
+    fprintf(fp, "counter,%s,%lld,,,,,,\n", counter.first.c_str(),
+      static_cast<long long>(counter.second));
+  }
+
+  bool succeeded = !ferror(fp);
+  fclose(fp);
+  return succeeded;
+}
+
+bool PerfCollector::Write(const std::string& filename) const {
+  if (pystring::endswith(pystring::lower(filename), ".csv")) {
+    return WriteCSV(filename);
+  }
+  return WriteJSON(filename);
+}
+
+// static
+PerfCollector::StageStats PerfCollector::ComputeStats(
+  const LatencyHistogram& histogram) {
+  StageStats stats;
+  stats.count = histogram.Count();
+  stats.mean_ms = histogram.MeanMilliseconds();
+  stats.min_ms = histogram.MinMilliseconds();
+  stats.max_ms = histogram.MaxMilliseconds();
+  stats.p50_ms = histogram.PercentileMilliseconds(50);
+  stats.p95_ms = histogram.PercentileMilliseconds(95);
+  stats.p99_ms = histogram.PercentileMilliseconds(99);
+  return stats;
+}
+
+ScopedPerfTimer::ScopedPerfTimer(const char* stage) :
+  stage_(stage),
+  enabled_(PerfCollector::Enabled()) {
+  if (enabled_) {
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+ScopedPerfTimer::~ScopedPerfTimer() {
+  if (enabled_) {
+    auto end = std::chrono::steady_clock::now();
+    PerfCollector::Instance().RecordLatency(stage_,
+      std::chrono::duration<double, std::milli>(end - start_).count());
+  }
+}
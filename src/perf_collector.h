@@ -0,0 +1,142 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef PERF_COLLECTOR_H
+#define PERF_COLLECTOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A histogram of latencies with log-linear buckets, as in HdrHistogram:
+// each power of two is split into 64 linear buckets, so that percentiles are
+// accurate to within 1% of the value from 1 ns to over a day, in a fixed
+// 21 KB of counts.
+class LatencyHistogram {
+ public:
+
+  LatencyHistogram();
+
+  void Record(double milliseconds);
+
+  int64_t Count() const;
+  double MeanMilliseconds() const;
+  double MinMilliseconds() const;
+  double MaxMilliseconds() const;
+
+  // The latency at or below which p percent of the samples fall. p is in
+  // [0, 100]. 0 if there are no samples.
+  double PercentileMilliseconds(double p) const;
+
+ private:
+
+  static int BucketIndex(uint64_t nanoseconds);
+  // The midpoint of a bucket's range, in nanoseconds.
+  static double BucketValue(int index);
+
+  std::vector<int64_t> counts_;
+  int64_t count_ = 0;
+  double sum_ms_ = 0.0;
+  double min_ms_ = 0.0;
+  double max_ms_ = 0.0;
+};
+
+// Collects named latency stages and counters from anywhere in the program.
+// All methods are thread safe.
+//
+// Stages and counters are only recorded with --collect_perf (see Enabled()),
+// since timing GPU work requires synchronizing with it. They can be queried
+// at any time, and written out as JSON or CSV.
+class PerfCollector {
+ public:
+
+  struct StageStats {
+    int64_t count = 0;
+    double mean_ms = 0.0;
+    double min_ms = 0.0;
+    double max_ms = 0.0;
+    double p50_ms = 0.0;
+    double p95_ms = 0.0;
+    double p99_ms = 0.0;
+  };
+
+  static PerfCollector& Instance();
+
+  // Whether --collect_perf is set. Callers should check it before timing
+  // anything that needs a synchronization.
+  static bool Enabled();
+
+  void RecordLatency(const std::string& stage, double milliseconds);
+  void AddCount(const std::string& counter, int64_t n);
+
+  // Returns false if nothing was recorded for stage.
+  bool Stats(const std::string& stage, StageStats* stats_out) const;
+  // 0 if nothing was added to counter.
+  int64_t Count(const std::string& counter) const;
+
+  // Sorted by name.
+  std::vector<std::string> StageNames() const;
+  std::vector<std::string> CounterNames() const;
+
+  void Reset();
+
+  // Print every stage and counter to stdout.
+  void Print() const;
+
+  // Write every stage and counter to filename. Returns false on failure.
+  //
+  // JSON: an object with a "stages" object of StageStats, by name, and a
+  // "counters" object of values, by name.
+  // CSV: one row per stage or counter, with columns
+  // type,name,count,mean_ms,min_ms,p50_ms,p95_ms,p99_ms,max_ms. A counter's
+  // value is in the count column.
+  bool WriteJSON(const std::string& filename) const;
+  bool WriteCSV(const std::string& filename) const;
+
+  // WriteCSV() if filename ends in ".csv", WriteJSON() otherwise.
+  bool Write(const std::string& filename) const;
+
+ private:
+
+  PerfCollector() = default;
+
+  static StageStats ComputeStats(const LatencyHistogram& histogram);
+
+  mutable std::mutex mutex_;
+  std::map<std::string, LatencyHistogram> stages_;
+  std::map<std::string, int64_t> counters_;
+};
+
+// Records the wall clock time between its construction and destruction as a
+// stage, if PerfCollector::Enabled(). For GPU work, time with an Event
+// instead: kernel launches return immediately.
+class ScopedPerfTimer {
+ public:
+
+  explicit ScopedPerfTimer(const char* stage);
+  ~ScopedPerfTimer();
+
+  ScopedPerfTimer(const ScopedPerfTimer& copy) = delete;
+  ScopedPerfTimer& operator = (const ScopedPerfTimer& copy) = delete;
+
+ private:
+
+  const char* stage_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // PERF_COLLECTOR_H
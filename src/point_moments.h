@@ -0,0 +1,147 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef POINT_MOMENTS_H
+#define POINT_MOMENTS_H
+
+#include <cmath>
+
+#include <cuda_runtime.h>
+
+// Zeroth, first and second moments of a set of 3D points:
+// count, sum(p), and the 6 unique entries of sum(p p^T).
+//
+// Sums of moments are moments, so these can be accumulated into an integral
+// image and a windowed covariance read back in O(1). They are stored in
+// double precision: an integral image of single precision moments loses
+// most of its significant digits by the bottom right corner.
+struct PointMoments {
+  static constexpr int kNumMoments = 10;
+  // Padded to a multiple of 4 doubles so that SIMD code can process a whole
+  // PointMoments with full-width loads.
+  static constexpr int kPaddedNumMoments = 12;
+
+  // count, x, y, z, xx, xy, xz, yy, yz, zz, padding.
+  double m[kPaddedNumMoments];
+};
+
+__inline__ __host__ __device__
+PointMoments MakePointMoments(float x, float y, float z) {
+  return PointMoments{ {
+    1.0, x, y, z,
+    static_cast<double>(x) * x, static_cast<double>(x) * y,
+    static_cast<double>(x) * z, static_cast<double>(y) * y,
+    static_cast<double>(y) * z, static_cast<double>(z) * z,
+    0.0, 0.0
+  } };
+}
+
+// Fit a plane to the points summarized by moments using PCA: the normal is
+// the eigenvector of the covariance matrix with the smallest eigenvalue.
+//
+// Returns false if there are fewer than min_count points or the covariance
+// is degenerate. Otherwise, writes:
+// - normal_out: unit normal, oriented towards the camera at the origin.
+// - confidence_out: planarity in (0, 1], equal to 1 - 3 * lambda_0 /
+//   (lambda_0 + lambda_1 + lambda_2). 1 means the points lie exactly on a
+//   plane and 0 means they are isotropic.
+__inline__ __host__ __device__
+bool NormalFromMoments(const PointMoments& moments, int min_count,
+  float normal_out[3], float* confidence_out) {
+  const double* m = moments.m;
+  double n = m[0];
+  if (n < min_count || n < 3) {
+    return false;
+  }
+
+  // Covariance. The subtraction must be done in double precision, but the
+  // result is small and well conditioned, so the rest is in single
+  // precision.
+  double inv_n = 1.0 / n;
+  double mean_x = m[1] * inv_n;
+  double mean_y = m[2] * inv_n;
+  double mean_z = m[3] * inv_n;
+  float a00 = static_cast<float>(m[4] * inv_n - mean_x * mean_x);
+  float a01 = static_cast<float>(m[5] * inv_n - mean_x * mean_y);
+  float a02 = static_cast<float>(m[6] * inv_n - mean_x * mean_z);
+  float a11 = static_cast<float>(m[7] * inv_n - mean_y * mean_y);
+  float a12 = static_cast<float>(m[8] * inv_n - mean_y * mean_z);
+  float a22 = static_cast<float>(m[9] * inv_n - mean_z * mean_z);
+
+  // Eigenvalues of a symmetric 3x3 matrix in closed form
+  // [Smith 1961, "Eigenvalues of a symmetric 3 x 3 matrix"].
+  float p1 = a01 * a01 + a02 * a02 + a12 * a12;
+  float q = (a00 + a11 + a22) / 3.0f;
+  float b00 = a00 - q;
+  float b11 = a11 - q;
+  float b22 = a22 - q;
+  float p2 = b00 * b00 + b11 * b11 + b22 * b22 + 2.0f * p1;
+  if (!(p2 > 0.0f) || !(q > 0.0f)) {
+    return false;
+  }
+  float p = sqrtf(p2 / 6.0f);
+  float det_b = b00 * (b11 * b22 - a12 * a12) -
+    a01 * (a01 * b22 - a12 * a02) +
+    a02 * (a01 * a12 - b11 * a02);
+  float r = fminf(fmaxf(det_b / (2.0f * p * p * p), -1.0f), 1.0f);
+  float phi = acosf(r) / 3.0f;
+  // lambda_0 <= lambda_1 <= lambda_2, summing to 3q.
+  float lambda_0 =
+    q + 2.0f * p * cosf(phi + 2.0f * static_cast<float>(M_PI) / 3.0f);
+
+  // The eigenvector is orthogonal to the rows of A - lambda_0 I. Take the
+  // best conditioned cross product of two rows.
+  float r0[3] = { a00 - lambda_0, a01, a02 };
+  float r1[3] = { a01, a11 - lambda_0, a12 };
+  float r2[3] = { a02, a12, a22 - lambda_0 };
+  float c01[3] = { r0[1] * r1[2] - r0[2] * r1[1],
+    r0[2] * r1[0] - r0[0] * r1[2], r0[0] * r1[1] - r0[1] * r1[0] };
+  float c02[3] = { r0[1] * r2[2] - r0[2] * r2[1],
+    r0[2] * r2[0] - r0[0] * r2[2], r0[0] * r2[1] - r0[1] * r2[0] };
+  float c12[3] = { r1[1] * r2[2] - r1[2] * r2[1],
+    r1[2] * r2[0] - r1[0] * r2[2], r1[0] * r2[1] - r1[1] * r2[0] };
+  float d01 = c01[0] * c01[0] + c01[1] * c01[1] + c01[2] * c01[2];
+  float d02 = c02[0] * c02[0] + c02[1] * c02[1] + c02[2] * c02[2];
+  float d12 = c12[0] * c12[0] + c12[1] * c12[1] + c12[2] * c12[2];
+  const float* c = c01;
+  float d = d01;
+  if (d02 > d) {
+    c = c02;
+    d = d02;
+  }
+  if (d12 > d) {
+    c = c12;
+    d = d12;
+  }
+  if (!(d > 0.0f)) {
+    return false;
+  }
+
+  // Orient towards the camera: dot(normal, mean) < 0.
+  float scale = 1.0f / sqrtf(d);
+  if (c[0] * mean_x + c[1] * mean_y + c[2] * mean_z > 0.0) {
+    scale = -scale;
+  }
+  normal_out[0] = c[0] * scale;
+  normal_out[1] = c[1] * scale;
+  normal_out[2] = c[2] * scale;
+
+  float planarity = 1.0f - fmaxf(lambda_0, 0.0f) / q;
+  if (!(planarity > 0.0f)) {
+    return false;
+  }
+  *confidence_out = fminf(planarity, 1.0f);
+  return true;
+}
+
+#endif  // POINT_MOMENTS_H
@@ -0,0 +1,369 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "pose_graph.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+#include "third_party/Eigen/Eigen/Dense"
+#include "third_party/Eigen/Eigen/Geometry"
+#include "third_party/Eigen/Eigen/Sparse"
+
+using libcgt::core::vecmath::EuclideanTransform;
+
+namespace {
+
+using Vector6d = Eigen::Matrix<double, 6, 1>;
+using Matrix6d = Eigen::Matrix<double, 6, 6>;
+
+// Stop iterating once no node moves by more than this (radians or meters).
+constexpr double kConvergenceThreshold = 1e-6;
+
+// Added to the diagonal of the normal equations so that nodes without
+// constraints do not make them singular.
+constexpr double kDamping = 1e-9;
+
+// A rigid transform in double precision.
+struct Pose {
+  Eigen::Matrix3d rotation = Eigen::Matrix3d::Identity();
+  Eigen::Vector3d translation = Eigen::Vector3d::Zero();
+};
+
+Pose FromEuclideanTransform(const EuclideanTransform& e) {
+  Pose p;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      p.rotation(i, j) = e.rotation(i, j);
+    }
+    p.translation(i) = e.translation[i];
+  }
+  return p;
+}
+
+EuclideanTransform ToEuclideanTransform(const Pose& p) {
+  EuclideanTransform e;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      e.rotation(i, j) = static_cast<float>(p.rotation(i, j));
+    }
+    e.translation[i] = static_cast<float>(p.translation(i));
+  }
+  return e;
+}
+
+Pose operator * (const Pose& a, const Pose& b) {
+  Pose p;
+  p.rotation = a.rotation * b.rotation;
+  p.translation = a.rotation * b.translation + a.translation;
+  return p;
+}
+
+Pose Inverse(const Pose& a) {
+  Pose p;
+  p.rotation = a.rotation.transpose();
+  p.translation = -(p.rotation * a.translation);
+  return p;
+}
+
+// The residual of a pose that should be the identity: its rotation as an
+// axis-angle vector, followed by its translation.
+Vector6d Log(const Pose& a) {
+  Eigen::AngleAxisd axis_angle(a.rotation);
+  Vector6d r;
+  r.head<3>() = axis_angle.angle() * axis_angle.axis();
+  r.tail<3>() = a.translation;
+  return r;
+}
+
+// Left-multiply a by the rotation exp(xi.head<3>()) and translate it by
+// xi.tail<3>(). The inverse of Log() to first order.
+Pose ExpLeft(const Vector6d& xi, const Pose& a) {
+  Eigen::Vector3d omega = xi.head<3>();
+  double angle = omega.norm();
+  Eigen::Matrix3d r = Eigen::Matrix3d::Identity();
+  if (angle > 0) {
+    r = Eigen::AngleAxisd(angle, omega / angle).toRotationMatrix();
+  }
+
+  Pose p;
+  // Re-orthonormalize to keep round-off from accumulating.
+  p.rotation = Eigen::Quaterniond(r * a.rotation).normalized()
+    .toRotationMatrix();
+  p.translation = r * a.translation + xi.tail<3>();
+  return p;
+}
+
+// How a left perturbation xi of a pose moves to exp(Adjoint(t) * xi) when
+// the pose is premultiplied by t.
+Matrix6d Adjoint(const Pose& t) {
+  Eigen::Matrix3d t_cross;
+  t_cross <<
+    0, -t.translation.z(), t.translation.y(),
+    t.translation.z(), 0, -t.translation.x(),
+    -t.translation.y(), t.translation.x(), 0;
+
+  Matrix6d ad = Matrix6d::Zero();
+  ad.block<3, 3>(0, 0) = t.rotation;
+  ad.block<3, 3>(3, 0) = t_cross * t.rotation;
+  ad.block<3, 3>(3, 3) = t.rotation;
+  return ad;
+}
+
+}  // namespace
+
+int PoseGraph::AddNode(const EuclideanTransform& camera_from_world) {
+  camera_from_world_.push_back(camera_from_world);
+  return static_cast<int>(camera_from_world_.size()) - 1;
+}
+
+int PoseGraph::NumNodes() const {
+  return static_cast<int>(camera_from_world_.size());
+}
+
+const EuclideanTransform& PoseGraph::CameraFromWorld(int node) const {
+  return camera_from_world_[node];
+}
+
+void PoseGraph::SetCameraFromWorld(int node,
+  const EuclideanTransform& camera_from_world) {
+  camera_from_world_[node] = camera_from_world;
+}
+
+void PoseGraph::AddRelativeConstraint(int a, int b,
+  const EuclideanTransform& a_from_b, float weight) {
+  assert(a >= 0 && a < NumNodes());
+  assert(b >= 0 && b < NumNodes());
+  relative_constraints_.push_back({ a, b, a_from_b, weight });
+}
+
+void PoseGraph::AddAbsoluteConstraint(int node,
+  const EuclideanTransform& camera_from_world, float weight) {
+  assert(node >= 0 && node < NumNodes());
+  absolute_constraints_.push_back({ node, camera_from_world, weight });
+}
+
+int PoseGraph::NumRelativeConstraints() const {
+  return static_cast<int>(relative_constraints_.size());
+}
+
+int PoseGraph::NumAbsoluteConstraints() const {
+  return static_cast<int>(absolute_constraints_.size());
+}
+
+PoseGraph::OptimizeResult PoseGraph::Optimize(int max_iterations) {
+  OptimizeResult result;
+  const int num_nodes = NumNodes();
+  if (num_nodes == 0) {
+    result.valid = true;
+    return result;
+  }
+
+  // Optimize world_from_camera, perturbed on the left in world space.
+  std::vector<Pose> world_from_camera(num_nodes);
+  for (int i = 0; i < num_nodes; ++i) {
+    world_from_camera[i] =
+      Inverse(FromEuclideanTransform(camera_from_world_[i]));
+  }
+
+  // Each free node's first variable, or -1 if it is held fixed.
+  std::vector<int> variable(num_nodes);
+  int num_variables = 0;
+  for (int i = 0; i < num_nodes; ++i) {
+    if (i == 0 && absolute_constraints_.empty()) {
+      variable[i] = -1;
+    } else {
+      variable[i] = num_variables;
+      num_variables += 6;
+    }
+  }
+
+  // Accumulates each constraint's residual and, if triplets is not null,
+  // its contribution to the normal equations. Returns the total error.
+  auto linearize = [&](std::vector<Eigen::Triplet<double>>* triplets,
+    Eigen::VectorXd* rhs) {
+    double error = 0.0;
+
+    // Up to two nodes per constraint.
+    auto accumulate = [&](const Vector6d& r, double weight,
+      const int nodes[2], const Matrix6d jacobians[2], int num_terms) {
+      error += weight * r.squaredNorm();
+      if (triplets == nullptr) {
+        return;
+      }
+      for (int p = 0; p < num_terms; ++p) {
+        int vp = variable[nodes[p]];
+        if (vp < 0) {
+          continue;
+        }
+        rhs->segment<6>(vp) -= weight * jacobians[p].transpose() * r;
+        for (int q = 0; q < num_terms; ++q) {
+          int vq = variable[nodes[q]];
+          if (vq < 0) {
+            continue;
+          }
+          Matrix6d block = weight * jacobians[p].transpose() * jacobians[q];
+          for (int i = 0; i < 6; ++i) {
+            for (int j = 0; j < 6; ++j) {
+              triplets->emplace_back(vp + i, vq + j, block(i, j));
+            }
+          }
+        }
+      }
+    };
+
+    for (const RelativeConstraint& c : relative_constraints_) {
+      // error = inverse(a_from_b) * camera_a_from_world * world_from_camera_b
+      Pose x = Inverse(FromEuclideanTransform(c.a_from_b)) *
+        Inverse(world_from_camera[c.a]);
+      Vector6d r = Log(x * world_from_camera[c.b]);
+      Matrix6d j_b = Adjoint(x);
+      const int nodes[2] = { c.a, c.b };
+      const Matrix6d jacobians[2] = { -j_b, j_b };
+      accumulate(r, c.weight, nodes, jacobians, 2);
+    }
+
+    for (const AbsoluteConstraint& c : absolute_constraints_) {
+      // error = measured camera_from_world * world_from_camera
+      Pose x = FromEuclideanTransform(c.camera_from_world);
+      Vector6d r = Log(x * world_from_camera[c.node]);
+      const int nodes[2] = { c.node, c.node };
+      const Matrix6d jacobians[2] = { Adjoint(x), Matrix6d::Zero() };
+      accumulate(r, c.weight, nodes, jacobians, 1);
+    }
+
+    return error;
+  };
+
+  result.initial_error = linearize(nullptr, nullptr);
+  result.final_error = result.initial_error;
+  if (num_variables == 0) {
+    result.valid = true;
+    return result;
+  }
+
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+  for (int iteration = 0; iteration < max_iterations; ++iteration) {
+    std::vector<Eigen::Triplet<double>> triplets;
+    Eigen::VectorXd rhs = Eigen::VectorXd::Zero(num_variables);
+    linearize(&triplets, &rhs);
+    for (int i = 0; i < num_variables; ++i) {
+      triplets.emplace_back(i, i, kDamping);
+    }
+
+    // Duplicate triplets are summed.
+    Eigen::SparseMatrix<double> lhs(num_variables, num_variables);
+    lhs.setFromTriplets(triplets.begin(), triplets.end());
+
+    // The sparsity pattern only changes when constraints are added, but
+    // analyzing it is cheap next to the factorization.
+    solver.compute(lhs);
+    if (solver.info() != Eigen::Success) {
+      fprintf(stderr, "Pose graph: factorization failed.\n");
+      return result;
+    }
+    Eigen::VectorXd delta = solver.solve(rhs);
+    if (solver.info() != Eigen::Success) {
+      fprintf(stderr, "Pose graph: solve failed.\n");
+      return result;
+    }
+
+    for (int i = 0; i < num_nodes; ++i) {
+      if (variable[i] >= 0) {
+        world_from_camera[i] = ExpLeft(delta.segment<6>(variable[i]),
+          world_from_camera[i]);
+      }
+    }
+    result.num_iterations = iteration + 1;
+
+    if (delta.lpNorm<Eigen::Infinity>() < kConvergenceThreshold) {
+      break;
+    }
+  }
+
+  for (int i = 0; i < num_nodes; ++i) {
+    camera_from_world_[i] =
+      ToEuclideanTransform(Inverse(world_from_camera[i]));
+  }
+  result.final_error = linearize(nullptr, nullptr);
+  result.valid = true;
+  return result;
+}
+
+PoseGraphOptimizer::PoseGraphOptimizer() :
+  thread_(&PoseGraphOptimizer::OptimizeLoop, this) {
+}
+
+PoseGraphOptimizer::~PoseGraphOptimizer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+bool PoseGraphOptimizer::Submit(const PoseGraph& graph) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::IDLE) {
+      return false;
+    }
+    graph_ = graph;
+    state_ = State::SUBMITTED;
+  }
+  cv_.notify_all();
+  return true;
+}
+
+bool PoseGraphOptimizer::TryGetResult(PoseGraph* graph_out,
+  PoseGraph::OptimizeResult* result_out) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (state_ != State::DONE) {
+    return false;
+  }
+  *graph_out = std::move(graph_);
+  *result_out = result_;
+  graph_ = PoseGraph();
+  state_ = State::IDLE;
+  return true;
+}
+
+void PoseGraphOptimizer::Clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return state_ != State::SUBMITTED; });
+  graph_ = PoseGraph();
+  state_ = State::IDLE;
+}
+
+void PoseGraphOptimizer::OptimizeLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] {
+      return stopping_ || state_ == State::SUBMITTED;
+    });
+    if (stopping_) {
+      return;
+    }
+
+    // The graph is not touched by the other methods while SUBMITTED.
+    lock.unlock();
+    PoseGraph::OptimizeResult result = graph_.Optimize();
+    lock.lock();
+
+    result_ = result;
+    state_ = State::DONE;
+    cv_.notify_all();
+  }
+}
@@ -0,0 +1,140 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef POSE_GRAPH_H
+#define POSE_GRAPH_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+
+// A graph of camera poses (nodes) tied together by relative pose
+// measurements between pairs of nodes, such as ICP between keyframes, and
+// absolute pose measurements of single nodes, such as fiducial detections.
+//
+// Optimize() finds the poses that best agree with every measurement in the
+// least squares sense, using Gauss-Newton on SE(3) with a sparse Cholesky
+// factorization of the normal equations.
+//
+// Poses are camera_from_world, as in PoseFrame.
+class PoseGraph {
+ public:
+
+  using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
+
+  struct OptimizeResult {
+    bool valid = false;
+    int num_iterations = 0;
+    // Weighted sum of squared residuals before and after.
+    double initial_error = 0.0;
+    double final_error = 0.0;
+  };
+
+  // Adds a node with the initial estimate camera_from_world. Returns its
+  // index.
+  int AddNode(const EuclideanTransform& camera_from_world);
+
+  int NumNodes() const;
+
+  const EuclideanTransform& CameraFromWorld(int node) const;
+  void SetCameraFromWorld(int node,
+    const EuclideanTransform& camera_from_world);
+
+  // A measurement of node b relative to node a:
+  // a_from_b = camera_a_from_world * inverse(camera_b_from_world).
+  // weight: the inverse variance of each of the 6 residual terms (radians
+  //   and meters).
+  void AddRelativeConstraint(int a, int b,
+    const EuclideanTransform& a_from_b, float weight = 1.0f);
+
+  // A measurement of node's pose.
+  void AddAbsoluteConstraint(int node,
+    const EuclideanTransform& camera_from_world, float weight = 1.0f);
+
+  int NumRelativeConstraints() const;
+  int NumAbsoluteConstraints() const;
+
+  // Optimize every node's pose in place. If there are no absolute
+  // constraints, node 0 is held fixed to anchor the graph.
+  OptimizeResult Optimize(int max_iterations = 10);
+
+ private:
+
+  struct RelativeConstraint {
+    int a;
+    int b;
+    EuclideanTransform a_from_b;
+    float weight;
+  };
+
+  struct AbsoluteConstraint {
+    int node;
+    EuclideanTransform camera_from_world;
+    float weight;
+  };
+
+  std::vector<EuclideanTransform> camera_from_world_;
+  std::vector<RelativeConstraint> relative_constraints_;
+  std::vector<AbsoluteConstraint> absolute_constraints_;
+};
+
+// Runs PoseGraph::Optimize() on a background thread, so that the caller
+// never waits for it.
+class PoseGraphOptimizer {
+ public:
+
+  PoseGraphOptimizer();
+  ~PoseGraphOptimizer();
+
+  PoseGraphOptimizer(const PoseGraphOptimizer& copy) = delete;
+  PoseGraphOptimizer& operator = (const PoseGraphOptimizer& copy) = delete;
+
+  // Start optimizing a copy of graph. Returns false and does nothing if the
+  // previous optimization is still running or its result has not been
+  // collected with TryGetResult().
+  bool Submit(const PoseGraph& graph);
+
+  // If an optimization has finished, moves the optimized graph into
+  // graph_out, writes its statistics into result_out, and returns true.
+  // Otherwise, returns false.
+  bool TryGetResult(PoseGraph* graph_out,
+    PoseGraph::OptimizeResult* result_out);
+
+  // Waits for any running optimization and discards its result.
+  void Clear();
+
+ private:
+
+  void OptimizeLoop();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  enum class State {
+    IDLE,
+    SUBMITTED,
+    DONE
+  };
+  State state_ = State::IDLE;
+  bool stopping_ = false;
+
+  PoseGraph graph_;
+  PoseGraph::OptimizeResult result_;
+
+  std::thread thread_;
+};
+
+#endif  // POSE_GRAPH_H
@@ -13,26 +13,21 @@
 // limitations under the License.
 #include "projective_point_plane_icp.h"
 
-#include <chrono>
-
 #include <helper_math.h>
 
 #include <thrust/execution_policy.h>
 #include <thrust/reduce.h>
 
 #include "libcgt/core/vecmath/Quat4f.h"
-#include "libcgt/core/time/TimeUtils.h"
 #include "libcgt/cuda/Event.h"
 #include "libcgt/cuda/MathUtils.h"
-#include "libcgt/cuda/Rect2i.h"
 #include "libcgt/cuda/ThreadMath.cuh"
 #include "libcgt/cuda/VecmathConversions.h"
 
-#include "camera_math.cuh"
+#include "icp_pixel.cuh"
+#include "perf_collector.h"
+#include "trace_recorder.h"
 
-using libcgt::cuda::contains;
-using libcgt::cuda::math::floorToInt;
-using libcgt::cuda::Rect2i;
 using libcgt::cuda::threadmath::threadSubscript2DGlobal;
 using libcgt::core::vecmath::EuclideanTransform;
 
@@ -71,120 +66,37 @@ void ICPKernel(
   float min_dot_product_for_match,
   KernelArray2D<ICPLeastSquaresData> icp_data_out,
   KernelArray2D<uchar4> debug_vis_out) {
-  // TODO: weighting function parameters
-  // Reject data association if position differs by more than eps1
-  // and normal dot product more than eps2?
-
   int2 dst_xy = threadSubscript2DGlobal();
   ICPLeastSquaresData output = {};
-  uchar4 debug_output = {};
-
-  float4 dst_point_world4 = world_points[dst_xy];
-  float4 dst_normal_world4 = world_normals[dst_xy];
-
-  if (dst_point_world4.w == 0 || dst_normal_world4.w == 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = debug_output;
-    return;
-  }
-
-  float3 dst_point_world = make_float3(dst_point_world4);
-  float3 dst_normal_world = make_float3(dst_normal_world4);
-
-  float3 dst_point_model = transformPoint(model_from_world, dst_point_world);
-  float3 dst_normal_model = transformVector(model_from_world, dst_normal_world);
 
-  // Project dst_point into current pose estimate to see if it associates.
-  float3 dst_point_current = transformPoint(current_from_model, dst_point_model);
-  int2 dst_xy_current = floorToInt(make_float2(PixelFromCamera(
-    dst_point_current, flpp)));
+  ICPPixelResult result = ICPPixel(flpp, depth_min_max, model_from_world,
+    model_from_current, current_from_model, depth_map, normal_map,
+    world_points[dst_xy], world_normals[dst_xy], src_image_guard_band_pixels,
+    max_distance_for_match, min_dot_product_for_match, &output);
 
-  Rect2i valid_rect = inset(Rect2i(depth_map.size()),
-    src_image_guard_band_pixels);
-  // If the point is in front of the camera, then dst_point_current.z < 0.
-  if (!contains(valid_rect, dst_xy_current) || dst_point_current.z > 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 255, 0, 0, 255 };
-    return;
-  }
-
-  float src_depth = depth_map[dst_xy_current];
-  float4 src_normal_current4 = normal_map[dst_xy_current];
-
-  if (src_depth < depth_min_max.x || src_depth > depth_min_max.y ||
-    src_normal_current4.w == 0) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 0, 255, 0, 255 };
-    return;
-  }
-
-  // Unproject src pixel into camera coordinates and then into model camera
-  // coordinates.
-  float3 src_point_current = CameraFromPixel(dst_xy_current, src_depth, flpp);
-  float3 src_point_model = transformPoint(model_from_current,
-    src_point_current);
-  float3 src_normal_model = transformVector(model_from_current,
-    make_float3(src_normal_current4));
-
-  // TODO(jiawen): write a parameterized weight function which accepts points,
-  // including 0.
-  float3 delta = dst_point_model - src_point_model;
-  if (length(delta) > max_distance_for_match) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 0, 0, 255, 255 };
-    return;
-  }
-
-  if (dot(src_normal_model, dst_normal_model) < min_dot_product_for_match) {
-    icp_data_out[dst_xy] = output;
-    debug_vis_out[dst_xy] = uchar4{ 255, 255, 0, 255 };
-    return;
+  uchar4 debug_output = {};
+  switch (result) {
+  case ICPPixelResult::NO_MODEL_POINT:
+    break;
+  case ICPPixelResult::OUT_OF_VIEW:
+    debug_output = uchar4{ 255, 0, 0, 255 };
+    break;
+  case ICPPixelResult::NO_INCOMING_POINT:
+    debug_output = uchar4{ 0, 255, 0, 255 };
+    break;
+  case ICPPixelResult::TOO_FAR:
+    debug_output = uchar4{ 0, 0, 255, 255 };
+    break;
+  case ICPPixelResult::NORMALS_DISAGREE:
+    debug_output = uchar4{ 255, 255, 0, 255 };
+    break;
+  case ICPPixelResult::MATCHED:
+    debug_output = uchar4{ 255, 255, 255, 255 };
+    break;
   }
 
-  // Declare sample as valid.
-  output.num_samples = 1;
-
-  float3 c = cross(src_point_model, dst_normal_model);
-  float r = dot(delta, dst_normal_model);
-
-  output.a[ 0] = c.x * c.x;
-  output.a[ 1] = c.y * c.x;
-  output.a[ 2] = c.z * c.x;
-  output.a[ 3] = dst_normal_model.x * c.x;
-  output.a[ 4] = dst_normal_model.y * c.x;
-  output.a[ 5] = dst_normal_model.z * c.x;
-
-  output.a[ 6] = c.y * c.y;
-  output.a[ 7] = c.z * c.y;
-  output.a[ 8] = dst_normal_model.x * c.y;
-  output.a[ 9] = dst_normal_model.y * c.y;
-  output.a[10] = dst_normal_model.z * c.y;
-
-  output.a[11] = c.z * c.z;
-  output.a[12] = dst_normal_model.x * c.z;
-  output.a[13] = dst_normal_model.y * c.z;
-  output.a[14] = dst_normal_model.z * c.z;
-
-  output.a[15] = dst_normal_model.x * dst_normal_model.x;
-  output.a[16] = dst_normal_model.y * dst_normal_model.x;
-  output.a[17] = dst_normal_model.z * dst_normal_model.x;
-
-  output.a[18] = dst_normal_model.y * dst_normal_model.y;
-  output.a[19] = dst_normal_model.z * dst_normal_model.y;
-
-  output.a[20] = dst_normal_model.z * dst_normal_model.z;
-
-  output.b[0] = c.x * r;
-  output.b[1] = c.y * r;
-  output.b[2] = c.z * r;
-  output.b[3] = dst_normal_model.x * r;
-  output.b[4] = dst_normal_model.y * r;
-  output.b[5] = dst_normal_model.z * r;
-
-  output.squared_residual = r * r;
-
   icp_data_out[dst_xy] = output;
-  debug_vis_out[dst_xy] = uchar4{ 255, 255, 255, 255 };
+  debug_vis_out[dst_xy] = debug_output;
 }
 
 Matrix4f rigidTransformationFromApprox(float x[6]) {
@@ -231,7 +143,9 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
   DeviceArray2D<float4>& world_points,
   DeviceArray2D<float4>& world_normals,
   DeviceArray2D<uchar4>& debug_vis) {
-  auto t0 = std::chrono::high_resolution_clock::now();
+  ScopedPerfTimer timer("ProjectivePointPlaneICP::EstimatePose");
+  ScopedTrace trace("ICP");
+  const bool collect_perf = PerfCollector::Enabled();
 
   dim3 block_dim(16, 16, 1);
   dim3 grid_dim = libcgt::cuda::math::numBins2D(
@@ -247,6 +161,8 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
     inverse(world_from_camera).asMatrix());
   Matrix4f model_from_current = Matrix4f::identity();
   for (int i = 0; i < kNumIterations; ++i) {
+    // The reduction synchronizes, so the event covers the kernel.
+    ScopedTrace iteration_trace("ICP iteration");
     Matrix4f current_from_model =
       Matrix4f::inverseEuclidean(model_from_current);
 
@@ -273,9 +189,11 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
     ICPLeastSquaresData sum =
       thrust::reduce(thrust::device, begin, end, zero, Plus());
 
-    printf("ICP iteration %d (after assoc, before solve)\n"
-      "num_samples = %d, squared_residual = %f\n",
-      i, sum.num_samples, sum.squared_residual);
+    if (collect_perf) {
+      PerfCollector& perf = PerfCollector::Instance();
+      perf.AddCount("icp_iterations", 1);
+      perf.AddCount("icp_samples", sum.num_samples);
+    }
 
     if (sum.num_samples < kMinNumSamples) {
       result.valid = false;
@@ -311,8 +229,5 @@ ProjectivePointPlaneICP::Result ProjectivePointPlaneICP::EstimatePose(
   result.world_from_camera = EuclideanTransform::fromMatrix(
     Matrix4f::inverseEuclidean(camera_from_world));
 
-  auto t1 = std::chrono::high_resolution_clock::now();
-  printf("ICP took %lld ms\n", libcgt::core::time::dtMS(t0, t1));
-
   return result;
 }
@@ -44,6 +44,8 @@ class ProjectivePointPlaneICP {
   ProjectivePointPlaneICP(const Vector2i& depth_resolution,
     const Intrinsics& depth_intrinsics, const Range1f& depth_range);
 
+  // incoming_normals.w is used as a per-sample weight: 0 means no normal
+  // and the sample is skipped.
   __host__
   Result EstimatePose(
     DeviceArray2D<float>& incoming_depth,
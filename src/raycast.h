@@ -24,7 +24,7 @@
 #include "regular_grid_tsdf.h"
 
 __global__
-void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void RaycastKernel(ConstTSDFGridView regular_grid,
   float4x4 grid_from_world, // in meters
   float4x4 world_from_grid, // in meters
   float max_tsdf_value,
@@ -32,11 +32,12 @@ void RaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float4x4 world_from_camera, // camera pose
   float3 eye_world, // camera eye in world coords
   KernelArray2D<float4> world_depth_out,
-  KernelArray2D<float4> world_normal_out
+  KernelArray2D<float4> world_normal_out,
+  unsigned int* num_hits // if not null, incremented for each hit
 );
 
 __global__
-void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
+void AdaptiveRaycastKernel(ConstTSDFGridView regular_grid,
   float4x4 grid_from_world, // in meters
   float4x4 world_from_grid, // in meters
   float max_tsdf_value,
@@ -45,7 +46,21 @@ void AdaptiveRaycastKernel(KernelArray3D<const TSDF> regular_grid,
   float4x4 world_from_camera, // camera pose
   float3 eye_world, // camera eye in world coords
   KernelArray2D<float4> world_depth_out,
-  KernelArray2D<float4> world_normal_out
+  KernelArray2D<float4> world_normal_out,
+  unsigned int* num_hits // if not null, incremented for each hit
+);
+
+// Merge the raycast of a finer TSDF into that of a coarser one covering the
+// same region. A pixel takes the finer point and normal if the finer ray hit
+// a surface, unless the coarser ray hit one more than tolerance (in meters)
+// closer to the eye, e.g., outside the finer grid.
+__global__
+void MergeRaycastKernel(KernelArray2D<const float4> fine_world_points,
+  KernelArray2D<const float4> fine_world_normals,
+  float3 eye_world,
+  float tolerance,
+  KernelArray2D<float4> world_points,
+  KernelArray2D<float4> world_normals
 );
 
 #endif // RAYCAST_H
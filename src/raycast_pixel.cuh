@@ -0,0 +1,282 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef RAYCAST_PIXEL_CUH
+#define RAYCAST_PIXEL_CUH
+
+#include <cmath>
+
+#include <helper_math.h>
+
+#include "libcgt/cuda/float4x4.h"
+
+#include "camera_math.cuh"
+
+// The per-pixel work of RaycastKernel and AdaptiveRaycastKernel, also called
+// by the host benchmark so that both raycast identically.
+//
+// GridView is a VoxelGridView of TSDF: ConstTSDFGridView on the device or
+// one over an Array3DReadView on the host.
+
+// Distance, in voxels, kept from the faces of the grid's bounding box at
+// the ends of a ray.
+constexpr float kRaycastTEpsilon = 2.0f;
+// Step size, in voxels, and the minimum step of the adaptive raycast.
+constexpr float kRaycastTStepSize = 1.0f;
+
+// Trilinearly samples a regular grid of TSDF values at a particular grid
+// coordinate.
+//
+// We use the conventions that voxel centers have half-integer coordinates.
+// grid_point.x must be at least 0.5 and less than width - 0.5. Likewise for y
+// and z.
+//
+// Returns (0, 0) if any samples are invalid.
+template <typename GridView>
+__inline__ __device__ __host__
+float2 TrilinearSample(const GridView& regular_grid,
+  float3 grid_coords, float max_tsdf_value) {
+  // For trilinear interpolation, the valid range is between [0.5, size - 0.5].
+  int3 size = regular_grid.size();
+  if (grid_coords.x < 0.5f || grid_coords.x >= size.x - 0.5f ||
+    grid_coords.y < 0.5f || grid_coords.y >= size.y - 0.5f ||
+    grid_coords.z < 0.5f || grid_coords.z >= size.z - 0.5f) {
+    return{ 0.0f, 0.0f };
+  }
+
+  float3 integer_grid_coords = grid_coords - make_float3(0.5f);
+  int3 p_000 = {
+    static_cast<int>(floorf(integer_grid_coords.x)),
+    static_cast<int>(floorf(integer_grid_coords.y)),
+    static_cast<int>(floorf(integer_grid_coords.z))
+  };
+  float3 t = fracf(integer_grid_coords);
+  int3 p_100 = { p_000.x + 1, p_000.y,     p_000.z     };
+  int3 p_010 = { p_000.x    , p_000.y + 1, p_000.z     };
+  int3 p_110 = { p_000.x + 1, p_000.y + 1, p_000.z     };
+  int3 p_001 = { p_000.x    , p_000.y    , p_000.z + 1 };
+  int3 p_101 = { p_000.x + 1, p_000.y    , p_000.z + 1 };
+  int3 p_011 = { p_000.x    , p_000.y + 1, p_000.z + 1 };
+  int3 p_111 = { p_000.x + 1, p_000.y + 1, p_000.z + 1 };
+
+  const auto& v_000 = regular_grid[p_000];
+  const auto& v_100 = regular_grid[p_100];
+  const auto& v_010 = regular_grid[p_010];
+  const auto& v_110 = regular_grid[p_110];
+  const auto& v_001 = regular_grid[p_001];
+  const auto& v_101 = regular_grid[p_101];
+  const auto& v_011 = regular_grid[p_011];
+  const auto& v_111 = regular_grid[p_111];
+
+  // TODO(jiawen): can save a branch by multiplying by weight, or maybe storing
+  // pre-multiplied.
+  if (v_000.Weight() == 0 || v_100.Weight() == 0 ||
+    v_010.Weight() == 0 || v_110.Weight() == 0 ||
+    v_001.Weight() == 0 || v_101.Weight() == 0 ||
+    v_011.Weight() == 0 || v_111.Weight() == 0) {
+    return{ 0.0f, 0.0f };
+  }
+
+  // Trilerp, ignoring weights.
+  // TODO(jiawen): what would a weighted average mean?
+  float d_000 = v_000.Distance(max_tsdf_value);
+  float d_100 = v_100.Distance(max_tsdf_value);
+  float d_010 = v_010.Distance(max_tsdf_value);
+  float d_110 = v_110.Distance(max_tsdf_value);
+  float d_001 = v_001.Distance(max_tsdf_value);
+  float d_101 = v_101.Distance(max_tsdf_value);
+  float d_011 = v_011.Distance(max_tsdf_value);
+  float d_111 = v_111.Distance(max_tsdf_value);
+
+  // Lerp in x.
+  float d_l00 = lerp(d_000, d_100, t.x);
+  float d_l10 = lerp(d_010, d_110, t.x);
+  float d_l01 = lerp(d_001, d_101, t.x);
+  float d_l11 = lerp(d_011, d_111, t.x);
+
+  // Lerp in y.
+  float d_ll0 = lerp(d_l00, d_l10, t.y);
+  float d_ll1 = lerp(d_l01, d_l11, t.y);
+
+  // Lerp in z.
+  return { lerp(d_ll0, d_ll1, t.z), 1.0f };
+}
+
+// Trilinearly samples the grid at grid_coords and its three neighbors to
+// estimate the surface normal at grid_coords using forward differences.
+//
+// Returns (0, 0, 0, 0) if any samples are invalid.
+//
+// TODO(jiawen): optimized version without checks?
+template <typename GridView>
+__inline__ __device__ __host__
+float4 TrilinearSampleNormal(const GridView& regular_grid,
+  float3 grid_coords, float max_tsdf_value) {
+  float3 dx3 = { 1, 0, 0 };
+  float3 dy3 = { 0, 1, 0 };
+  float3 dz3 = { 0, 0, 1 };
+
+  // For each trilerp, if any of the 8 samples are invalid, it will return
+  // (0, 0).
+  // TODO(jiawen): can optimize this by realizing that a lot of samples are
+  // redundant between the trilinear samples.
+  float2 d_000 = TrilinearSample(regular_grid, grid_coords, max_tsdf_value);
+  float2 d_100 = TrilinearSample(regular_grid, grid_coords + dx3,
+    max_tsdf_value);
+  float2 d_010 = TrilinearSample(regular_grid, grid_coords + dy3,
+    max_tsdf_value);
+  float2 d_001 = TrilinearSample(regular_grid, grid_coords + dz3,
+    max_tsdf_value);
+
+  float4 normal_out = {};
+
+  float3 normal = {
+    d_100.x - d_000.x,
+    d_010.x - d_000.x,
+    d_001.x - d_000.x,
+  };
+
+  // Return (0, 0, 0, 0) if any trilinear samples are invalid or the normal is
+  // invalid.
+  float len = length(normal);
+  if (len > 0 && d_000.y > 0 && d_100.y > 0 && d_010.y > 0 && d_001.y > 0) {
+    normal_out = make_float4(normal / len, 1.0f);
+  }
+
+  return normal_out;
+}
+
+// Intersect the line origin + t * dir with the box [0, size]. Returns false
+// if they do not intersect.
+__inline__ __device__ __host__
+bool IntersectGridBounds(float3 origin, float3 dir, int3 size,
+  float* t_near, float* t_far) {
+  float3 t0 = -origin / dir;
+  float3 t1 = (make_float3(size) - origin) / dir;
+  float3 t_min = fminf(t0, t1);
+  float3 t_max = fmaxf(t0, t1);
+  *t_near = fmaxf(fmaxf(t_min.x, t_min.y), t_min.z);
+  *t_far = fminf(fminf(t_max.x, t_max.y), t_max.z);
+  return *t_near <= *t_far;
+}
+
+// Cast the ray through pixel xy of a camera with intrinsics flpp, posed at
+// world_from_camera with its eye at eye_world, and march it through
+// regular_grid until it crosses the surface from positive to negative.
+//
+// voxels_per_meter: if positive, the step size is the sampled distance, but
+//   at least kRaycastTStepSize (AdaptiveRaycastKernel). Otherwise, rays
+//   march kRaycastTStepSize at a time (RaycastKernel).
+//
+// Returns true if the ray hit the surface, setting world_point to the hit
+// and world_normal to its normal, which has w = 0 if it could not be
+// estimated. Otherwise, both are set to 0.
+template <typename GridView>
+__inline__ __device__ __host__
+bool RaycastPixel(const GridView& regular_grid, float4x4 grid_from_world,
+  float4x4 world_from_grid, float max_tsdf_value, float voxels_per_meter,
+  float4 flpp, float4x4 world_from_camera, float3 eye_world, int2 xy,
+  float4* world_point, float4* world_normal) {
+  *world_point = {};
+  *world_normal = {};
+
+  float3 dir_grid = normalize(transformVector(grid_from_world,
+    transformVector(world_from_camera, CameraDirectionFromPixel(xy, flpp))));
+
+  // TODO(jiawen): make this a method, or pass it in directly
+  float3 eye_grid = transformPoint(grid_from_world, eye_world);
+
+  // Pick a starting point: intersect the ray with the grid bounding box.
+  float t_near;
+  float t_far;
+  // TODO(jiawen): intersect with a grid that's 1 voxel smaller.
+  if (!IntersectGridBounds(eye_grid, dir_grid, regular_grid.size(),
+    &t_near, &t_far)) {
+    return false;
+  }
+
+  // If the near starting point is behind the eye, clamp it to the eye.
+  // If it's in front of the eye, then start there.
+  // But we don't want to start directly on a face, so add epsilon to it.
+  float t_start = fmaxf(0, t_near) + kRaycastTEpsilon;
+
+  // Likewise, the end point should not be on a face.
+  float t_end = fmaxf(0, t_far) - kRaycastTEpsilon;
+
+  // Iterate until we exit, or found a surface.
+  bool found_surface = false;
+
+  float prev_t = t_start;
+  float2 prev_sdf = {};
+
+  float curr_t = t_start;
+  float2 curr_sdf = TrilinearSample(regular_grid,
+    eye_grid + curr_t * dir_grid, max_tsdf_value);
+
+  while (curr_t + kRaycastTStepSize < t_end) {
+    prev_t = curr_t;
+    prev_sdf = curr_sdf;
+
+    float step_size = kRaycastTStepSize;
+    if (voxels_per_meter > 0) {
+      // If the SDF is valid, then use it as the step size. Otherwise, use
+      // max_tsdf_value.
+      step_size = fmaxf(kRaycastTStepSize, voxels_per_meter *
+        (prev_sdf.y > 0 ? prev_sdf.x : max_tsdf_value));
+    }
+
+    curr_t = prev_t + step_size;
+    curr_sdf = TrilinearSample(regular_grid, eye_grid + curr_t * dir_grid,
+      max_tsdf_value);
+
+    // Both samples are valid, and it's a positive to negative zero crossing.
+    if (prev_sdf.y > 0 && curr_sdf.y > 0 &&
+      prev_sdf.x > 0 && curr_sdf.x < 0) {
+      found_surface = true;
+      break;
+    }
+  }
+
+  if (!found_surface) {
+    return false;
+  }
+
+  // How far should I interpolate between the SDF values?
+  float alpha = prev_sdf.x / (prev_sdf.x - curr_sdf.x);
+
+  // Use it to lerp t itself to get a better estimate of the zero crossing.
+  float t_at_surface = lerp(prev_t, curr_t, alpha);
+
+  float3 surface_point_grid = eye_grid + t_at_surface * dir_grid;
+
+  // Convert to world space.
+  // TODO(jiawen): make this a method
+  *world_point = make_float4(
+    transformPoint(world_from_grid, surface_point_grid), 1.0f);
+  float4 grid_normal = TrilinearSampleNormal(regular_grid,
+    surface_point_grid, max_tsdf_value);
+  if (grid_normal.w > 0) {
+    // TODO(jiawen): We store *world* distances in the grid (the fact that
+    // it's fixed-point is beside the point). Therefore, when we take its
+    // gradient, the normal is in world units. But world_from_grid is a
+    // similarity transformation yielding world units from grid units.
+    // Therefore, in this case, we hack it by normalizing again, but really,
+    // all you need is the rotational part.
+    *world_normal = make_float4(
+      normalize(transformVector(world_from_grid, make_float3(grid_normal))),
+      1.0f);
+  }
+  return true;
+}
+
+#endif  // RAYCAST_PIXEL_CUH
@@ -11,6 +11,7 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <memory>
 #include <string>
 
 #include <gflags/gflags.h>
@@ -22,12 +23,16 @@
 #include "third_party/pystring/pystring.h"
 
 #include "../pose_frame.h"
+#include "../perf_collector.h"
 #include "../pose_utils.h"
 #include "../regular_grid_tsdf.h"
 #include "../rgbd_camera_parameters.h"
 
 // Options.
 DEFINE_bool(collect_perf, false, "Collect performance statistics.");
+DEFINE_string(perf_output, "", "With --collect_perf, write per-stage latency "
+  "percentiles and counters to this file on exit: CSV if it ends in .csv, "
+  "JSON otherwise.");
 
 // Inputs.
 DEFINE_string(tsdf3d, "", "Input TSDF");
@@ -54,7 +59,6 @@ using libcgt::core::arrayutils::cast;
 using libcgt::core::arrayutils::flipY;
 using libcgt::core::stringPrintf;
 using libcgt::core::vecmath::EuclideanTransform;
-using libcgt::core::vecmath::SimilarityTransform;
 using pystring::os::path::join;
 
 struct TimestampedPose {
@@ -83,6 +87,11 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (FLAGS_perf_output != "" && !FLAGS_collect_perf) {
+    fprintf(stderr, "perf_output requires collect_perf.\n");
+    return 1;
+  }
+
   // Load intrinsics.
   CameraParameters camera_params;
   if (!LoadCameraParameters(FLAGS_intrinsics, &camera_params)) {
@@ -90,12 +99,9 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // TODO: implement load as a free function without a dummy constructor.
-  // currently, we're stuck at 512^3!.
-  Vector3i resolution{512};
-  RegularGridTSDF tsdf(resolution, SimilarityTransform{});
-
-  if (!tsdf.Load(FLAGS_tsdf3d)) {
+  std::unique_ptr<RegularGridTSDF> tsdf =
+    RegularGridTSDF::LoadFromFile(FLAGS_tsdf3d);
+  if (tsdf == nullptr) {
     fprintf(stderr, "Error loading TSDF3D from %s\n.",
       FLAGS_tsdf3d.c_str());
     return 1;
@@ -139,7 +145,7 @@ int main(int argc, char* argv[]) {
     printf("Raycasting frame %zu of %zu\n", i, camera_path.size());
 
     const auto& pose = camera_path[i];
-    tsdf.Raycast(flpp, inverse(pose.camera_from_world).asMatrix(),
+    tsdf->Raycast(flpp, inverse(pose.camera_from_world).asMatrix(),
       world_points, world_normals);
 
     if (FLAGS_output_world_points || FLAGS_output_depth) {
@@ -162,5 +168,13 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (FLAGS_collect_perf) {
+    PerfCollector::Instance().Print();
+    if (FLAGS_perf_output != "" &&
+      !PerfCollector::Instance().Write(FLAGS_perf_output)) {
+      return 1;
+    }
+  }
+
   return 0;
 }
@@ -13,13 +13,22 @@
 // limitations under the License.
 #include "regular_grid_fusion_pipeline.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <utility>
+#include <vector>
 
 #include <gflags/gflags.h>
 
 #include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/core/imageproc/ColorMap.h"
 
+#include "perf_collector.h"
+#include "trace_recorder.h"
+
 using libcgt::core::arrayutils::flipYInPlace;
 using libcgt::core::cameras::Intrinsics;
 using libcgt::core::vecmath::inverse;
@@ -27,6 +36,16 @@ using libcgt::core::vecmath::EuclideanTransform;
 using libcgt::core::vecmath::SimilarityTransform;
 
 DECLARE_bool(adaptive_raycast);
+DECLARE_bool(fused_depth_preprocessing);
+DECLARE_string(normal_estimator);
+DECLARE_string(rolling_volume_dir);
+DECLARE_int32(brick_cache_mb);
+DECLARE_int32(tsdf_cascade_levels);
+DECLARE_bool(pose_graph);
+DECLARE_int32(submap_resolution);
+DECLARE_int32(fusion_workers);
+DECLARE_int32(max_submaps);
+DECLARE_bool(aruco_roi_tracking);
 
 namespace {
 
@@ -52,13 +71,25 @@ std::vector<PoseFrame>::const_iterator FindPoseFrame(
   });
 }
 
+// The distance between the centers of two cameras, and the angle of the
+// rotation between them.
+void PoseDistance(const EuclideanTransform& a_from_world,
+  const EuclideanTransform& b_from_world,
+  float* translation, float* rotation) {
+  EuclideanTransform a_from_b = a_from_world * inverse(b_from_world);
+  *translation = a_from_b.translation.norm();
+  float cos_angle = 0.5f * (a_from_b.rotation(0, 0) +
+    a_from_b.rotation(1, 1) + a_from_b.rotation(2, 2) - 1.0f);
+  *rotation = acosf(std::min(std::max(cos_angle, -1.0f), 1.0f));
+}
+
 }
 
 RegularGridFusionPipeline::RegularGridFusionPipeline(
   const RGBDCameraParameters& camera_params,
-  const Vector3i& grid_resolution,
-  const SimilarityTransform& world_from_grid,
+  const TSDFVolumeSpec& volume,
   const PoseEstimatorOptions& pose_estimator_options) :
+  depth_mm_(camera_params.depth.resolution),
   depth_meters_(camera_params.depth.resolution),
   smoothed_depth_meters_(camera_params.depth.resolution),
   incoming_camera_normals_(camera_params.depth.resolution),
@@ -69,7 +100,8 @@ RegularGridFusionPipeline::RegularGridFusionPipeline(
   input_buffer_(camera_params.color.resolution,
                 camera_params.depth.resolution),
 
-  regular_grid_(grid_resolution, world_from_grid),
+  regular_grid_(volume),
+  tsdf_cascade_(&regular_grid_, FLAGS_tsdf_cascade_levels),
 
   camera_params_(camera_params),
   depth_intrinsics_flpp_{
@@ -79,19 +111,42 @@ RegularGridFusionPipeline::RegularGridFusionPipeline(
   depth_range_(camera_params.depth.depth_range),
 
   depth_processor_(camera_params.depth.intrinsics,
-    camera_params.depth.depth_range),
+    camera_params.depth.depth_range,
+    DepthProcessor::BilateralKernel::FAST_APPROXIMATE,
+    FLAGS_normal_estimator == "covariance" ?
+      DepthProcessor::NormalEstimator::COVARIANCE :
+      DepthProcessor::NormalEstimator::FORWARD_DIFFERENCE),
 
   pose_estimator_options_(pose_estimator_options),
 
   icp_(camera_params.depth.resolution, camera_params.depth.intrinsics,
        camera_params.depth.depth_range),
 
+  keyframe_database_(camera_params.depth.resolution,
+    camera_params.depth.depth_range),
+
   aruco_single_marker_fiducial_(SingleMarkerFiducial::kDefaultSideLength,
     kSingleMarkerFiducialId),
   aruco_pose_estimator_(aruco_single_marker_fiducial_, camera_params.color,
     kArucoDetectorParamsFilename),
   aruco_vis_(camera_params.color.resolution) {
   // TODO: CheckPoseEstimatorOptions().
+  if (FLAGS_rolling_volume_dir != "") {
+    brick_store_.reset(new BrickStore(FLAGS_rolling_volume_dir,
+      static_cast<size_t>(FLAGS_brick_cache_mb) << 20));
+  }
+  if (FLAGS_submap_resolution > 0) {
+    submaps_.reset(new SubmapCollection(Vector3i(FLAGS_submap_resolution),
+      regular_grid_.VoxelSize(), FLAGS_fusion_workers,
+      FLAGS_max_submaps));
+  }
+  if (FLAGS_pose_graph && submaps_ == nullptr) {
+    reintegration_depth_mm_.resize(camera_params.depth.resolution);
+    reintegration_depth_meters_.resize(camera_params.depth.resolution);
+    reintegration_smoothed_depth_meters_.resize(
+      camera_params.depth.resolution);
+    reintegration_normals_.resize(camera_params.depth.resolution);
+  }
 }
 
 bool RegularGridFusionPipeline::LoadTSDF3D(const std::string& filename) {
@@ -107,7 +162,24 @@ void RegularGridFusionPipeline::Reset() {
   last_raycast_pose_ = {};
   pose_history_.clear();
   is_first_depth_frame_ = true;
-  regular_grid_.Reset();
+  keyframe_database_.Clear();
+  pose_graph_optimizer_.Clear();
+  pose_graph_ = PoseGraph();
+  pose_graph_dirty_ = false;
+  raycast_pending_ = false;
+  fused_frames_.clear();
+  reintegration_queue_.clear();
+  reintegration_pending_ = false;
+  submap_anchors_.clear();
+  last_aruco_pose_ = {};
+  last_aruco_result_ = {};
+  if (submaps_ != nullptr) {
+    submaps_->Clear();
+  }
+  if (brick_store_ != nullptr) {
+    brick_store_->Clear();
+  }
+  tsdf_cascade_.Reset();
 }
 
 const RGBDCameraParameters&
@@ -151,6 +223,9 @@ PerspectiveCamera RegularGridFusionPipeline::DepthCamera() const {
 }
 
 void RegularGridFusionPipeline::NotifyColorUpdated() {
+  TraceRecorder::SetCurrentFrame(TraceFrame(input_buffer_.color_frame_index,
+    input_buffer_.color_timestamp_ns));
+  ScopedTrace trace("NotifyColorUpdated");
   PipelineDataType data_changed = PipelineDataType::INPUT_COLOR;
 
   bool pose_updated = false;
@@ -186,18 +261,35 @@ void RegularGridFusionPipeline::NotifyColorUpdated() {
 }
 
 void RegularGridFusionPipeline::NotifyDepthUpdated() {
+  TraceRecorder::SetCurrentFrame(TraceFrame(input_buffer_.depth_frame_index,
+    input_buffer_.depth_timestamp_ns));
+  ScopedTrace trace("NotifyDepthUpdated", true);
+
   // TODO: protect visualization buffers with a mutex
   PipelineDataType data_changed = PipelineDataType::INPUT_DEPTH;
 
-  copy(input_buffer_.depth_meters.readView(), depth_meters_);
-  depth_processor_.Smooth(depth_meters_, smoothed_depth_meters_);
-  depth_processor_.EstimateNormals(smoothed_depth_meters_,
-                                    incoming_camera_normals_);
+  PreprocessDepth(
+    input_buffer_.depth_mm_valid ?
+      input_buffer_.depth_mm.readView() : Array2DReadView<uint16_t>(),
+    input_buffer_.depth_meters.readView(),
+    depth_mm_, depth_meters_, smoothed_depth_meters_,
+    incoming_camera_normals_);
   data_changed |= PipelineDataType::SMOOTHED_DEPTH;
 
   bool pose_updated = false;
   PoseEstimationMethod method = pose_estimator_options_.method;
 
+  if (raycast_pending_) {
+    // With precomputed poses, the raycast is only displayed: skip it rather
+    // than wait for fusion.
+    if (method != PoseEstimationMethod::PRECOMPUTED) {
+      Raycast();
+      data_changed |= PipelineDataType::RAYCAST_NORMALS;
+    } else if (TryRaycast()) {
+      data_changed |= PipelineDataType::RAYCAST_NORMALS;
+    }
+  }
+
   if (method == PoseEstimationMethod::PRECOMPUTED) {
     auto itr = FindPoseFrame(pose_estimator_options_.precomputed_path,
       input_buffer_.depth_timestamp_ns);
@@ -245,12 +337,22 @@ void RegularGridFusionPipeline::NotifyDepthUpdated() {
       data_changed |= PipelineDataType::CAMERA_POSE;
       is_first_depth_frame_ = false;
       pose_updated = true;
-    } else if (UpdatePoseWithDepthCamera(&pose_frame)) {
+    } else if (UpdatePoseWithDepthCamera(&pose_frame) ||
+      (num_successive_failures_ >= kMinFailuresBeforeRelocalization &&
+        RelocalizeWithDepthCamera(&pose_frame))) {
       pose_history_.push_back(pose_frame);
       data_changed |= PipelineDataType::CAMERA_POSE;
       data_changed |= PipelineDataType::POSE_ESTIMATION_VIS;
       pose_updated = true;
     }
+
+    if (pose_updated) {
+      num_successive_failures_ = 0;
+      keyframe_database_.MaybeAddKeyframe(input_buffer_.depth_meters,
+        pose_history_.back());
+    } else {
+      ++num_successive_failures_;
+    }
   } else if (method == PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP) {
     // In COLOR+DEPTH_ICP mode, if we get depth frames without an absolute pose
     // estimate from color tracking, UpdatePoseWithDepthCamera() will fail
@@ -266,10 +368,21 @@ void RegularGridFusionPipeline::NotifyDepthUpdated() {
   }
 
   if (pose_updated) {
+    ScrollTSDF();
     Fuse();
-    Raycast();
+    if (FLAGS_pose_graph && (method == PoseEstimationMethod::DEPTH_ICP ||
+      method == PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP)) {
+      UpdatePoseGraph();
+    }
     data_changed |= PipelineDataType::TSDF;
-    data_changed |= PipelineDataType::RAYCAST_NORMALS;
+    // Submaps fuse asynchronously. Raycasting waits for the fusion, so put
+    // it off until the next frame needs it, after its preprocessing.
+    if (submaps_ != nullptr) {
+      raycast_pending_ = true;
+    } else {
+      Raycast();
+      data_changed |= PipelineDataType::RAYCAST_NORMALS;
+    }
   }
 
   if (data_changed != PipelineDataType::NONE) {
@@ -304,9 +417,13 @@ bool RegularGridFusionPipeline::UpdatePoseWithColorCamera()
     PoseEstimationMethod::COLOR_ARUCO ||
     pose_estimator_options_.method ==
     PoseEstimationMethod::COLOR_ARUCO_AND_DEPTH_ICP);
-  ArucoPoseEstimator::Result result =
-    aruco_pose_estimator_.EstimatePose(input_buffer_.color_bgr_ydown,
+  ScopedTrace trace("ArUco");
+  ArucoPoseEstimator::Result result = FLAGS_aruco_roi_tracking ?
+    aruco_pose_estimator_.TrackPose(input_buffer_.ColorBGRYDown(),
+      last_aruco_result_, aruco_vis_) :
+    aruco_pose_estimator_.EstimatePose(input_buffer_.ColorBGRYDown(),
       aruco_vis_);
+  last_aruco_result_ = result;
 
   if (result.valid) {
     PoseFrame pose_frame;
@@ -318,6 +435,7 @@ bool RegularGridFusionPipeline::UpdatePoseWithColorCamera()
         pose_frame.color_camera_from_world);
 
     pose_history_.push_back(pose_frame);
+    last_aruco_pose_ = pose_frame;
   }
 
   // Flip visualization upside down.
@@ -359,31 +477,410 @@ bool RegularGridFusionPipeline::UpdatePoseWithDepthCamera(
   return icp_result.valid;
 }
 
+bool RegularGridFusionPipeline::RelocalizeWithDepthCamera(
+  PoseFrame* pose_frame_out) {
+  const PoseFrame last_tracked_pose = last_raycast_pose_;
+  std::vector<KeyframeDatabase::Match> matches =
+    keyframe_database_.FindSimilar(input_buffer_.depth_meters,
+      kNumRelocalizationCandidates);
+
+  for (const KeyframeDatabase::Match& match : matches) {
+    const PoseFrame& candidate =
+      keyframe_database_.GetKeyframe(match.keyframe_index).pose;
+
+    // ICP's translation and rotation limits reject candidates that are not
+    // close to the true pose.
+    RaycastFromPose(candidate);
+    if (UpdatePoseWithDepthCamera(pose_frame_out)) {
+      return true;
+    }
+  }
+
+  // Keep tracking against the last tracked pose, not the last candidate,
+  // which may be arbitrarily far from it.
+  RaycastFromPose(last_tracked_pose);
+  return false;
+}
+
 // TODO: use distortion model.
 void RegularGridFusionPipeline::Fuse() {
-  regular_grid_.Fuse(
+  ScopedTrace trace("Fuse", true);
+  if (submaps_ != nullptr) {
+    const EuclideanTransform& camera_from_world =
+      pose_history_.back().depth_camera_from_world;
+    float center_depth = GridCenterDepth();
+    if (!submaps_->ActivateSubmapNear(camera_from_world, center_depth)) {
+      int submap = submaps_->AddSubmap(inverse(camera_from_world),
+        center_depth);
+      printf("Started submap %d at frame %d.\n", submap,
+        pose_history_.back().frame_index);
+    }
+    submaps_->Fuse(
+      depth_intrinsics_flpp_, camera_params_.depth.depth_range,
+      camera_from_world.asMatrix(),
+      depth_meters_, camera_params_.depth_noise_model,
+      &incoming_camera_normals_
+    );
+    return;
+  }
+
+  tsdf_cascade_.Fuse(
     depth_intrinsics_flpp_, camera_params_.depth.depth_range,
     pose_history_.back().depth_camera_from_world.asMatrix(),
-    depth_meters_
+    depth_meters_, camera_params_.depth_noise_model,
+    &incoming_camera_normals_
   );
 }
 
 void RegularGridFusionPipeline::Raycast() {
-  last_raycast_pose_ = pose_history_.back();
+  raycast_pending_ = false;
+  RaycastFromPose(pose_history_.back());
+}
 
-  if (FLAGS_adaptive_raycast) {
-    regular_grid_.AdaptiveRaycast(
-      depth_intrinsics_flpp_,
-      inverse(last_raycast_pose_.depth_camera_from_world).asMatrix(),
-      world_points_, world_normals_
-    );
+bool RegularGridFusionPipeline::TryRaycast() {
+  if (submaps_ != nullptr && submaps_->IsFusing()) {
+    return false;
+  }
+  Raycast();
+  return true;
+}
+
+void RegularGridFusionPipeline::ScrollTSDF() {
+  if (brick_store_ == nullptr) {
+    return;
+  }
+  ScopedTrace trace("ScrollTSDF", true);
+
+  float target_depth = GridCenterDepth();
+  Matrix4f world_from_camera =
+    inverse(pose_history_.back().depth_camera_from_world).asMatrix();
+  Vector4f target_world = world_from_camera * Vector4f(0, 0, -target_depth, 1);
+
+  if (tsdf_cascade_.Recenter(target_world.xyz, kMaxScrollOffsetBricks,
+    brick_store_.get()) && PerfCollector::Enabled()) {
+    PerfCollector::Instance().AddCount("tsdf_scrolls", 1);
+  }
+
+  // Fetch the stored bricks the camera is looking at before the grid
+  // scrolls onto them. The frustum is approximated by its eye and far
+  // corners.
+  const Intrinsics& intrinsics = camera_params_.depth.intrinsics;
+  Vector2f resolution(camera_params_.depth.resolution);
+  float far = depth_range_.right();
+  std::vector<Vector3f> frustum_world = {
+    (world_from_camera * Vector4f(0, 0, 0, 1)).xyz
+  };
+  for (int corner = 0; corner < 4; ++corner) {
+    Vector2f pixel((corner & 1) * resolution.x, (corner >> 1) * resolution.y);
+    Vector2f xy = far * (pixel - intrinsics.principalPoint) /
+      intrinsics.focalLength;
+    frustum_world.push_back(
+      (world_from_camera * Vector4f(xy.x, xy.y, -far, 1)).xyz);
+  }
+  regular_grid_.Prefetch(frustum_world, kPrefetchMarginBricks,
+    brick_store_.get());
+}
+
+void RegularGridFusionPipeline::PreprocessDepth(
+  Array2DReadView<uint16_t> host_depth_mm,
+  Array2DReadView<float> host_depth_meters,
+  DeviceArray2D<uint16_t>& depth_mm,
+  DeviceArray2D<float>& depth_meters,
+  DeviceArray2D<float>& smoothed_depth_meters,
+  DeviceArray2D<float4>& normals) {
+  ScopedTrace trace("PreprocessDepth", true);
+  if (FLAGS_fused_depth_preprocessing && host_depth_mm.notNull()) {
+    copy(host_depth_mm, depth_mm);
+    DepthProcessor::PreprocessBuffers outputs;
+    outputs.depth_meters = &depth_meters;
+    outputs.smoothed_depth = &smoothed_depth_meters;
+    outputs.normals = &normals;
+    depth_processor_.Preprocess(depth_mm, nullptr, outputs);
+  } else {
+    copy(host_depth_meters, depth_meters);
+    depth_processor_.Smooth(depth_meters, smoothed_depth_meters);
+    depth_processor_.EstimateNormals(smoothed_depth_meters, normals);
+  }
+}
+
+void RegularGridFusionPipeline::UpdatePoseGraph() {
+  ScopedTrace trace("UpdatePoseGraph", true);
+  const int num_nodes = pose_graph_.NumNodes();
+  MaybeAddPoseGraphNode();
+
+  // Keep the input so that the frame can be preprocessed and fused again.
+  const PoseFrame& pose = pose_history_.back();
+  FusedFrame frame;
+  frame.pose_index = static_cast<int>(pose_history_.size()) - 1;
+  frame.node = pose_graph_.NumNodes() - 1;
+  frame.keyframe = pose_graph_.NumNodes() > num_nodes;
+  frame.camera_from_node = pose.depth_camera_from_world *
+    inverse(pose_graph_.CameraFromWorld(frame.node));
+  frame.fused_camera_from_world = pose.depth_camera_from_world;
+  if (submaps_ != nullptr) {
+    // Submaps started since the last node move with it.
+    while (static_cast<int>(submap_anchors_.size()) <
+      submaps_->NumSubmaps()) {
+      int submap = static_cast<int>(submap_anchors_.size());
+      submap_anchors_.push_back({ frame.node,
+        inverse(submaps_->WorldFromAnchor(submap)) *
+          inverse(pose_graph_.CameraFromWorld(frame.node)) });
+    }
+  } else if (FLAGS_fused_depth_preprocessing &&
+    input_buffer_.depth_mm_valid) {
+    frame.depth_mm.resize(input_buffer_.depth_mm.size());
+    libcgt::core::arrayutils::copy(input_buffer_.depth_mm.readView(),
+      frame.depth_mm.writeView());
   } else {
-    regular_grid_.Raycast(
+    frame.depth_meters.resize(input_buffer_.depth_meters.size());
+    libcgt::core::arrayutils::copy(input_buffer_.depth_meters.readView(),
+      frame.depth_meters.writeView());
+  }
+  fused_frames_.push_back(std::move(frame));
+
+  // Bound the memory held for re-integration.
+  int oldest_in_window =
+    static_cast<int>(fused_frames_.size()) - 1 - kReintegrationWindowFrames;
+  if (oldest_in_window >= 0 && !fused_frames_[oldest_in_window].keyframe) {
+    fused_frames_[oldest_in_window].depth_mm = Array2D<uint16_t>();
+    fused_frames_[oldest_in_window].depth_meters = Array2D<float>();
+  }
+
+  // If the optimizer is still busy, try again on the next frame.
+  if (pose_graph_dirty_ && pose_graph_optimizer_.Submit(pose_graph_)) {
+    pose_graph_dirty_ = false;
+  }
+
+  PoseGraph optimized;
+  PoseGraph::OptimizeResult result;
+  if (pose_graph_optimizer_.TryGetResult(&optimized, &result) &&
+    result.valid) {
+    printf("Pose graph: %d nodes, error %f --> %f after %d iterations.\n",
+      optimized.NumNodes(), result.initial_error, result.final_error,
+      result.num_iterations);
+    ApplyOptimizedPoseGraph(optimized);
+  }
+
+  // Frames beyond the last queue that still need to move.
+  if (reintegration_queue_.empty() && reintegration_pending_) {
+    QueueReintegrations();
+  }
+  int num_reintegrated = 0;
+  while (num_reintegrated < kMaxReintegrationsPerFrame &&
+    !reintegration_queue_.empty()) {
+    FusedFrame& queued_frame = fused_frames_[reintegration_queue_.front()];
+    reintegration_queue_.pop_front();
+    // Its input may have left the window since it was queued.
+    if (queued_frame.HasInput()) {
+      Reintegrate(queued_frame);
+      ++num_reintegrated;
+    }
+  }
+}
+
+void RegularGridFusionPipeline::MaybeAddPoseGraphNode() {
+  const PoseFrame& pose = pose_history_.back();
+  const EuclideanTransform& camera_from_world = pose.depth_camera_from_world;
+  int previous_node = pose_graph_.NumNodes() - 1;
+  if (previous_node >= 0) {
+    float translation;
+    float rotation;
+    PoseDistance(camera_from_world,
+      pose_graph_.CameraFromWorld(previous_node), &translation, &rotation);
+    if (translation < kPoseGraphNodeMinTranslation &&
+      rotation < kPoseGraphNodeMinRotation) {
+      return;
+    }
+  }
+
+  // Odometry: tracking is consistent with the current estimates.
+  int node = pose_graph_.AddNode(camera_from_world);
+  if (previous_node >= 0) {
+    pose_graph_.AddRelativeConstraint(previous_node, node,
+      pose_graph_.CameraFromWorld(previous_node) *
+        inverse(camera_from_world));
+  }
+
+  if (last_aruco_pose_.timestamp_ns != 0 &&
+    std::llabs(pose.timestamp_ns - last_aruco_pose_.timestamp_ns) <=
+      kMaxArucoConstraintAgeNs) {
+    pose_graph_.AddAbsoluteConstraint(node,
+      last_aruco_pose_.depth_camera_from_world, kArucoConstraintWeight);
+    pose_graph_dirty_ = true;
+  }
+
+  // Loop closure: find the closest node that is old enough.
+  int loop_node = -1;
+  float loop_translation = kLoopClosureMaxTranslation;
+  for (int i = 0; i + kLoopClosureMinNodeAge < node; ++i) {
+    float translation;
+    float rotation;
+    PoseDistance(camera_from_world, pose_graph_.CameraFromWorld(i),
+      &translation, &rotation);
+    if (translation < loop_translation &&
+      rotation < kLoopClosureMaxRotation) {
+      loop_node = i;
+      loop_translation = translation;
+    }
+  }
+  if (loop_node < 0) {
+    return;
+  }
+
+  // Verify it by tracking the latest frame against the model as seen from
+  // the old node. The caller raycasts from the latest pose again.
+  PoseFrame loop_pose = pose;
+  loop_pose.depth_camera_from_world = pose_graph_.CameraFromWorld(loop_node);
+  loop_pose.color_camera_from_world =
+    camera_params_.ConvertToColorCameraFromWorld(
+      loop_pose.depth_camera_from_world);
+  RaycastFromPose(loop_pose);
+  PoseFrame closed_pose;
+  if (UpdatePoseWithDepthCamera(&closed_pose)) {
+    printf("Pose graph: closed a loop from node %d to node %d.\n",
+      node, loop_node);
+    pose_graph_.AddRelativeConstraint(loop_node, node,
+      loop_pose.depth_camera_from_world *
+        inverse(closed_pose.depth_camera_from_world));
+    pose_graph_dirty_ = true;
+  }
+}
+
+void RegularGridFusionPipeline::ApplyOptimizedPoseGraph(
+  const PoseGraph& optimized) {
+  // Nodes added since the graph was submitted move rigidly with the newest
+  // optimized node: camera_from_world * correction.
+  int newest = optimized.NumNodes() - 1;
+  EuclideanTransform correction =
+    inverse(pose_graph_.CameraFromWorld(newest)) *
+    optimized.CameraFromWorld(newest);
+  for (int i = 0; i < pose_graph_.NumNodes(); ++i) {
+    pose_graph_.SetCameraFromWorld(i, i <= newest ?
+      optimized.CameraFromWorld(i) :
+      pose_graph_.CameraFromWorld(i) * correction);
+  }
+
+  for (int i = 0; i < static_cast<int>(fused_frames_.size()); ++i) {
+    FusedFrame& frame = fused_frames_[i];
+    EuclideanTransform camera_from_world =
+      frame.camera_from_node * pose_graph_.CameraFromWorld(frame.node);
+
+    PoseFrame& pose = pose_history_[frame.pose_index];
+    pose.depth_camera_from_world = camera_from_world;
+    pose.color_camera_from_world =
+      camera_params_.ConvertToColorCameraFromWorld(camera_from_world);
+  }
+  if (submaps_ == nullptr) {
+    QueueReintegrations();
+  }
+
+  for (int i = 0; i < static_cast<int>(submap_anchors_.size()); ++i) {
+    const SubmapAnchor& anchor = submap_anchors_[i];
+    submaps_->SetWorldFromAnchor(i, inverse(anchor.anchor_from_node *
+      pose_graph_.CameraFromWorld(anchor.node)));
+  }
+}
+
+void RegularGridFusionPipeline::QueueReintegrations() {
+  // (How far it moved in units of the thresholds, frame index).
+  std::vector<std::pair<float, int>> candidates;
+  for (int i = 0; i < static_cast<int>(fused_frames_.size()); ++i) {
+    const FusedFrame& frame = fused_frames_[i];
+    if (!frame.HasInput()) {
+      continue;
+    }
+    float translation;
+    float rotation;
+    PoseDistance(frame.camera_from_node *
+      pose_graph_.CameraFromWorld(frame.node), frame.fused_camera_from_world,
+      &translation, &rotation);
+    float priority = std::max(translation / kReintegrationMinTranslation,
+      rotation / kReintegrationMinRotation);
+    if (priority >= 1.0f) {
+      candidates.emplace_back(priority, i);
+    }
+  }
+
+  size_t queue_size = std::min(candidates.size(),
+    static_cast<size_t>(kMaxReintegrationQueueSize));
+  std::partial_sort(candidates.begin(), candidates.begin() + queue_size,
+    candidates.end(), std::greater<std::pair<float, int>>());
+  reintegration_queue_.clear();
+  reintegration_pending_ = false;
+  for (size_t i = 0; i < queue_size; ++i) {
+    reintegration_queue_.push_back(candidates[i].second);
+  }
+  reintegration_pending_ = candidates.size() > queue_size;
+}
+
+void RegularGridFusionPipeline::Reintegrate(FusedFrame& frame) {
+  EuclideanTransform camera_from_world =
+    frame.camera_from_node * pose_graph_.CameraFromWorld(frame.node);
+
+  // Preprocessing is deterministic, so this reproduces the depth and normals
+  // the frame was fused with.
+  PreprocessDepth(frame.depth_mm.readView(), frame.depth_meters.readView(),
+    reintegration_depth_mm_, reintegration_depth_meters_,
+    reintegration_smoothed_depth_meters_, reintegration_normals_);
+
+  tsdf_cascade_.Defuse(
+    depth_intrinsics_flpp_, camera_params_.depth.depth_range,
+    frame.fused_camera_from_world.asMatrix(),
+    reintegration_depth_meters_, camera_params_.depth_noise_model,
+    &reintegration_normals_
+  );
+  tsdf_cascade_.Fuse(
+    depth_intrinsics_flpp_, camera_params_.depth.depth_range,
+    camera_from_world.asMatrix(),
+    reintegration_depth_meters_, camera_params_.depth_noise_model,
+    &reintegration_normals_
+  );
+  frame.fused_camera_from_world = camera_from_world;
+}
+
+float RegularGridFusionPipeline::GridCenterDepth() const {
+  Vector3f side_lengths = submaps_ != nullptr ?
+    regular_grid_.VoxelSize() *
+      Vector3f(static_cast<float>(FLAGS_submap_resolution)) :
+    regular_grid_.SideLengths();
+  return std::min(
+    0.5f * (depth_range_.left() + depth_range_.right()),
+    0.5f * std::min({ side_lengths.x, side_lengths.y, side_lengths.z }));
+}
+
+void RegularGridFusionPipeline::FlushBrickStore() {
+  if (brick_store_ != nullptr) {
+    regular_grid_.StoreResidentBricks(brick_store_.get());
+  }
+}
+
+void RegularGridFusionPipeline::MergeSubmaps() {
+  if (submaps_ != nullptr) {
+    regular_grid_.Reset();
+    submaps_->Merge(&regular_grid_);
+  }
+}
+
+void RegularGridFusionPipeline::RaycastFromPose(const PoseFrame& pose) {
+  ScopedTrace trace("Raycast", true);
+  last_raycast_pose_ = pose;
+
+  if (submaps_ != nullptr) {
+    submaps_->Raycast(
       depth_intrinsics_flpp_,
       inverse(last_raycast_pose_.depth_camera_from_world).asMatrix(),
+      FLAGS_adaptive_raycast,
       world_points_, world_normals_
     );
+    return;
   }
+
+  tsdf_cascade_.Raycast(
+    depth_intrinsics_flpp_,
+    inverse(last_raycast_pose_.depth_camera_from_world).asMatrix(),
+    FLAGS_adaptive_raycast,
+    world_points_, world_normals_
+  );
 }
 
 void RegularGridFusionPipeline::Raycast(const PerspectiveCamera& camera,
@@ -392,23 +889,29 @@ void RegularGridFusionPipeline::Raycast(const PerspectiveCamera& camera,
   Intrinsics intrinsics = camera.intrinsics(Vector2f(world_points.size()));
   Vector4f flpp{intrinsics.focalLength, intrinsics.principalPoint};
 
-  if (FLAGS_adaptive_raycast) {
-    regular_grid_.AdaptiveRaycast(
-      flpp,
-      camera.worldFromCamera().asMatrix(),
-      world_points, world_normals
-    );
-  } else {
-    regular_grid_.Raycast(
+  if (submaps_ != nullptr) {
+    submaps_->Raycast(
       flpp,
       camera.worldFromCamera().asMatrix(),
+      FLAGS_adaptive_raycast,
       world_points, world_normals
     );
+    return;
   }
+
+  tsdf_cascade_.Raycast(
+    flpp,
+    camera.worldFromCamera().asMatrix(),
+    FLAGS_adaptive_raycast,
+    world_points, world_normals
+  );
 }
 
 TriangleMesh RegularGridFusionPipeline::Triangulate() const {
-  return regular_grid_.Triangulate();
+  if (brick_store_ != nullptr) {
+    return regular_grid_.Triangulate(brick_store_.get());
+  }
+  return tsdf_cascade_.Triangulate();
 }
 
 const std::vector<PoseFrame>&
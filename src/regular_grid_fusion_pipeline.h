@@ -14,6 +14,9 @@
 #ifndef REGULAR_GRID_FUSION_PIPELINE_H
 #define REGULAR_GRID_FUSION_PIPELINE_H
 
+#include <deque>
+#include <memory>
+
 #include <QObject>
 
 #include "libcgt/core/cameras/PerspectiveCamera.h"
@@ -26,14 +29,20 @@
 #include "aruco/aruco_pose_estimator.h"
 #include "aruco/cube_fiducial.h"
 #include "aruco/single_marker_fiducial.h"
+#include "brick_store.h"
 #include "regular_grid_tsdf.h"
 #include "rgbd_camera_parameters.h"
 #include "depth_processor.h"
 #include "input_buffer.h"
+#include "keyframe_database.h"
 #include "pipeline_data_type.h"
 #include "pose_estimation_method.h"
 #include "pose_frame.h"
+#include "pose_graph.h"
 #include "projective_point_plane_icp.h"
+#include "submap_collection.h"
+#include "tsdf_cascade.h"
+#include "tsdf_volume_spec.h"
 
 struct PoseEstimatorOptions {
   PoseEstimationMethod method =
@@ -56,10 +65,10 @@ class RegularGridFusionPipeline : public QObject {
 
  public:
 
+  // volume: the geometry of the TSDF grid. It must already be placed.
   RegularGridFusionPipeline(
     const RGBDCameraParameters& camera_params,
-    const Vector3i& grid_resolution,
-    const SimilarityTransform& world_from_grid,
+    const TSDFVolumeSpec& volume,
     const PoseEstimatorOptions& pose_estimator_options);
 
   // TODO: refactor this.
@@ -105,12 +114,26 @@ class RegularGridFusionPipeline : public QObject {
   // grid from the current pose.
   void Raycast();
 
+  // Raycast(), unless submaps are still fusing into the grid it would
+  // raycast. Returns whether it raycast.
+  bool TryRaycast();
+
   void Raycast(const PerspectiveCamera& camera,
                DeviceArray2D<float4>& world_points,
                DeviceArray2D<float4>& world_normals);
 
+  // If the TSDF grid is rolling, triangulates the entire scan, including
+  // bricks that have scrolled out of the grid.
   TriangleMesh Triangulate() const;
 
+  // If the TSDF grid is rolling, write the bricks still in it to the brick
+  // store, so that the store holds the entire scan.
+  void FlushBrickStore();
+
+  // If fusing into submaps, reset the TSDF grid and blend every submap into
+  // it, so that Triangulate() and SaveTSDF3D() cover the entire scan.
+  void MergeSubmaps();
+
   // Returns CameraFromworld.
   const std::vector<PoseFrame>& PoseHistory() const;
 
@@ -141,10 +164,60 @@ class RegularGridFusionPipeline : public QObject {
    // result in pose_frame_out. Otherwise, returns false.
    bool UpdatePoseWithDepthCamera(PoseFrame* pose_frame_out);
 
+   // After ICP has lost track, try to recover the depth camera pose by
+   // looking up keyframes similar to the latest depth frame, raycasting the
+   // model from each candidate keyframe's pose, and verifying it with ICP.
+   // If one of them succeeds, returns true and writes the result in
+   // pose_frame_out. Otherwise, raycasts from the last tracked pose again
+   // and returns false.
+   bool RelocalizeWithDepthCamera(PoseFrame* pose_frame_out);
+
+   // Update world_points_ and world_normals_ by raycasting the latest regular
+   // grid from pose, and record it as last_raycast_pose_.
+   void RaycastFromPose(const PoseFrame& pose);
+
+   // If the TSDF grid is rolling, scroll it so that it stays centered on the
+   // region in front of the latest depth camera pose.
+   void ScrollTSDF();
+
+   // How far in front of the camera the TSDF grid, or a new submap, is
+   // centered: the middle of the depth range, or half the grid's shortest
+   // side if that is closer.
+   float GridCenterDepth() const;
+
+   // Upload a depth frame and preprocess it into the given buffers. Uses
+   // host_depth_mm if it is not null and --fused_depth_preprocessing is set,
+   // host_depth_meters otherwise.
+   void PreprocessDepth(Array2DReadView<uint16_t> host_depth_mm,
+     Array2DReadView<float> host_depth_meters,
+     DeviceArray2D<uint16_t>& depth_mm,
+     DeviceArray2D<float>& depth_meters,
+     DeviceArray2D<float>& smoothed_depth_meters,
+     DeviceArray2D<float4>& normals);
+
+   // With --pose_graph, called after the latest depth frame is fused:
+   // extends the pose graph, records the frame for re-integration, starts an
+   // optimization if there are new constraints, applies a finished one, and
+   // re-integrates a few of the frames it moved, most moved first.
+   void UpdatePoseGraph();
+
+   // If the latest pose is far enough from the last node, add it to the
+   // pose graph with an odometry constraint to the previous node, a loop
+   // closure constraint to a nearby older node if ICP can verify one, and an
+   // absolute constraint if ArUco saw the fiducial at about the same time.
+   void MaybeAddPoseGraphNode();
+
+   // Move every node, fused frame, and pose_history_ entry that moves with
+   // them to its optimized pose, and queue the fused frames that moved for
+   // re-integration.
+   void ApplyOptimizedPoseGraph(const PoseGraph& optimized);
+
   // CPU input buffers.
   InputBuffer input_buffer_;
 
   // ----- Input copied to the GPU -----
+  // Incoming raw depth frame in millimeters, if the input provides it.
+  DeviceArray2D<uint16_t> depth_mm_;
   // Incoming depth frame in meters.
   DeviceArray2D<float> depth_meters_;
 
@@ -162,16 +235,137 @@ class RegularGridFusionPipeline : public QObject {
   PoseFrame last_raycast_pose_ = {};
   DeviceArray2D<float4> world_points_;
   DeviceArray2D<float4> world_normals_;
+  // Whether they are behind the latest pose and fused frame. Only with
+  // submaps, see NotifyDepthUpdated().
+  bool raycast_pending_ = false;
 
   DepthProcessor depth_processor_;
 
   RegularGridTSDF regular_grid_;
+  // regular_grid_ and, if there is more than one level, coarser levels for
+  // the far field.
+  TSDFCascade tsdf_cascade_;
+
+  // If not null, regular_grid_ is a rolling window that follows the camera,
+  // and bricks that scroll out of it are kept here.
+  std::unique_ptr<BrickStore> brick_store_;
+  // How far, in bricks, the region in front of the camera can drift from the
+  // center of the grid before it scrolls.
+  const int kMaxScrollOffsetBricks = 4;
+  // How far beyond the grid, in bricks, to prefetch stored bricks.
+  const int kPrefetchMarginBricks = 8;
+
+  // If not null, frames are fused into submaps instead of regular_grid_,
+  // which only holds the result of MergeSubmaps().
+  std::unique_ptr<SubmapCollection> submaps_;
+
+  // ----- Pose graph (--pose_graph) -----
+
+  // A fused depth frame, kept to re-fuse it when the pose graph moves it.
+  struct FusedFrame {
+    // Index into pose_history_.
+    int pose_index;
+
+    // The pose graph node the frame moves with, and its pose relative to it:
+    // camera_from_world * inverse(the node's camera_from_world).
+    int node;
+    EuclideanTransform camera_from_node;
+
+    // The pose it is currently fused with.
+    EuclideanTransform fused_camera_from_world;
+
+    // The first frame of its node. Keyframes keep their input for good.
+    bool keyframe = false;
+
+    // The input as it arrived, as passed to PreprocessDepth(). depth_mm is
+    // empty if the frame was preprocessed from depth_meters and vice versa.
+    // Both are empty with submaps, which move instead of being re-fused, and
+    // once a frame that is not a keyframe leaves the last
+    // kReintegrationWindowFrames frames. Such frames stay where they were
+    // fused.
+    Array2D<uint16_t> depth_mm;
+    Array2D<float> depth_meters;
+
+    bool HasInput() const {
+      return depth_mm.readView().notNull() ||
+        depth_meters.readView().notNull();
+    }
+  };
+
+  // De-integrate frame from its fused pose and integrate it at the pose of
+  // its node.
+  void Reintegrate(FusedFrame& frame);
+
+  // Rebuild reintegration_queue_ from the frames that moved the most since
+  // they were fused.
+  void QueueReintegrations();
+
+  PoseGraph pose_graph_;
+  PoseGraphOptimizer pose_graph_optimizer_;
+  // Whether pose_graph_ has constraints that have not been submitted.
+  bool pose_graph_dirty_ = false;
+  std::vector<FusedFrame> fused_frames_;
+  // Indices into fused_frames_, the frame that moved the most first.
+  std::deque<int> reintegration_queue_;
+  // Whether more frames moved than fit in reintegration_queue_.
+  bool reintegration_pending_ = false;
+  // Each submap's pose graph node, and its anchor relative to it:
+  // anchor_from_world * inverse(the node's camera_from_world).
+  struct SubmapAnchor {
+    int node;
+    EuclideanTransform anchor_from_node;
+  };
+  std::vector<SubmapAnchor> submap_anchors_;
+  // The latest ArUco pose, for absolute constraints.
+  PoseFrame last_aruco_pose_ = {};
+  // The previous frame's ArUco estimate, valid or not, for tracking.
+  ArucoPoseEstimator::Result last_aruco_result_;
+
+  // Scratch buffers to preprocess frames for re-integration.
+  DeviceArray2D<uint16_t> reintegration_depth_mm_;
+  DeviceArray2D<float> reintegration_depth_meters_;
+  DeviceArray2D<float> reintegration_smoothed_depth_meters_;
+  DeviceArray2D<float4> reintegration_normals_;
+
+  // A pose becomes a node when it is this far from the last node, in
+  // meters or radians.
+  const float kPoseGraphNodeMinTranslation = 0.1f;
+  const float kPoseGraphNodeMinRotation = 0.2f;
+  // Loop closures are only attempted with nodes at least this many nodes
+  // older, within this distance and angle.
+  const int kLoopClosureMinNodeAge = 10;
+  const float kLoopClosureMaxTranslation = 0.5f;
+  const float kLoopClosureMaxRotation = 0.5f;
+  // An ArUco pose at most this old is an absolute constraint on a new node.
+  const int64_t kMaxArucoConstraintAgeNs = 50000000;
+  // ArUco poses are noisier than ICP.
+  const float kArucoConstraintWeight = 0.1f;
+  // Frames that moved by less than this, in meters or radians, are not
+  // re-integrated: small corrections are within the truncation band.
+  const float kReintegrationMinTranslation = 0.01f;
+  const float kReintegrationMinRotation = 0.01f;
+  // Re-integration runs on the fusion thread, so it is limited to this many
+  // frames per incoming frame, out of at most kMaxReintegrationQueueSize
+  // queued after each optimization.
+  const int kMaxReintegrationsPerFrame = 2;
+  const int kMaxReintegrationQueueSize = 64;
+  // Frames other than keyframes keep their input for re-integration only
+  // while they are among this many most recent frames.
+  const int kReintegrationWindowFrames = 90;
 
   // TODO: consider removing this.
   const int kMaxSuccessiveFailuresBeforeReset = 1000;
   int num_successive_failures_ = 0;
   ProjectivePointPlaneICP icp_;
 
+  // Keyframes from successfully tracked depth frames, used for
+  // relocalization in DEPTH_ICP mode.
+  const int kNumRelocalizationCandidates = 3;
+  // Relocalization costs a raycast and an ICP per candidate, so it is only
+  // attempted once ICP has failed on this many frames in a row.
+  const int kMinFailuresBeforeRelocalization = 3;
+  KeyframeDatabase keyframe_database_;
+
   CubeFiducial aruco_cube_fiducial_;
   SingleMarkerFiducial aruco_single_marker_fiducial_;
   ArucoPoseEstimator aruco_pose_estimator_;
@@ -13,9 +13,11 @@
 // limitations under the License.
 #include "regular_grid_tsdf.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 
-#include <gflags/gflags.h>
+#include <thrust/device_vector.h>
 
 #include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/core/io/BinaryFileInputStream.h"
@@ -26,14 +28,93 @@
 
 #include "fuse.h"
 #include "marching_cubes.h"
+#include "perf_collector.h"
 #include "raycast.h"
+#include "scroll.h"
 
 using libcgt::core::arrayutils::flatten;
 using libcgt::core::vecmath::SimilarityTransform;
 using libcgt::core::vecmath::inverse;
 using libcgt::cuda::Event;
 
-DECLARE_bool(collect_perf);
+namespace {
+  // The narrowest truncation band a sample can have, in voxels. Any less and
+  // the surface would fall between samples.
+  constexpr float kMinTruncationVoxels = 2.0f;
+
+  // Version 1: 16-bit distance, 16-bit weight.
+  // Version 2: adds the number of bits in the distance and the weight after
+  //   max_tsdf_value.
+  constexpr int32_t kTSDF3DVersion = 2;
+
+  // Read a grid of SrcTSDF voxels from in and convert it to the compiled
+  // TSDF format, saturating weights.
+  template <typename SrcTSDF>
+  void ReadAndConvertTSDFGrid(BinaryFileInputStream& in,
+    float max_tsdf_value, Array3DWriteView<TSDF> dst) {
+    Array3D<SrcTSDF> src(dst.size());
+    in.readArray(flatten(src.writeView()));
+    for (int z = 0; z < dst.size().z; ++z) {
+      for (int y = 0; y < dst.size().y; ++y) {
+        for (int x = 0; x < dst.size().x; ++x) {
+          float2 dw = src[{x, y, z}].Get(max_tsdf_value);
+          dst[{x, y, z}] = TSDF(dw.x, dw.y, max_tsdf_value);
+        }
+      }
+    }
+  }
+
+  // Copy a grid in x-fastest order into storage in VoxelLayout order,
+  // cyclically shifted by origin.
+  void CopyToStorageOrder(Array3DReadView<TSDF> src, int3 origin,
+    Array3DWriteView<TSDF> storage) {
+    VoxelGridView<TSDF, VoxelLayout, Array3DWriteView<TSDF>> dst(
+      storage, make_int3(src.size()), origin);
+    for (int z = 0; z < src.size().z; ++z) {
+      for (int y = 0; y < src.size().y; ++y) {
+        for (int x = 0; x < src.size().x; ++x) {
+          dst[{x, y, z}] = src[{x, y, z}];
+        }
+      }
+    }
+  }
+
+  // Copy a grid stored in VoxelLayout order, cyclically shifted by origin,
+  // into x-fastest order.
+  void CopyFromStorageOrder(Array3DReadView<TSDF> storage, int3 origin,
+    Array3DWriteView<TSDF> dst) {
+    VoxelGridView<const TSDF, VoxelLayout, Array3DReadView<TSDF>> src(
+      storage, make_int3(dst.size()), origin);
+    for (int z = 0; z < dst.size().z; ++z) {
+      for (int y = 0; y < dst.size().y; ++y) {
+        for (int x = 0; x < dst.size().x; ++x) {
+          dst[{x, y, z}] = src[{x, y, z}];
+        }
+      }
+    }
+  }
+
+  // a mod n, in [0, n).
+  int PositiveMod(int a, int n) {
+    int r = a % n;
+    return r < 0 ? r + n : r;
+  }
+
+  // The subscript of brick b in a box of bricks of the given size, where
+  // bricks are numbered x-fastest.
+  Vector3i SlabBrick(int b, const Vector3i& slab_size) {
+    return{ b % slab_size.x,
+      (b / slab_size.x) % slab_size.y,
+      b / (slab_size.x * slab_size.y) };
+  }
+
+  bool IsObserved(const TSDF* brick) {
+    return std::any_of(brick, brick + BrickStore::kBrickVolume,
+      [](const TSDF& voxel) {
+        return voxel.weight_ > 0;
+      });
+  }
+}
 
 // VoxelSize() = world_from_grid_.scale.
 RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
@@ -43,19 +124,68 @@ RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
 
 RegularGridTSDF::RegularGridTSDF(const Vector3i& resolution,
   const SimilarityTransform& world_from_grid, float max_tsdf_value) :
-  device_grid_(resolution),
+  resolution_(resolution),
+  device_grid_(VoxelLayout::StorageSize(resolution)),
+  origin_(0),
+  world_from_volume_(world_from_grid),
   world_from_grid_(world_from_grid),
   grid_from_world_(inverse(world_from_grid)),
   max_tsdf_value_(max_tsdf_value) {
+  assert(VoxelLayout::IsValidResolution(resolution));
   assert(VoxelSize() > 0);
   assert(max_tsdf_value > 0);
 
   Reset();
 }
 
+RegularGridTSDF::RegularGridTSDF(const TSDFVolumeSpec& spec) :
+  RegularGridTSDF(spec.resolution, spec.WorldFromGrid(),
+    spec.MaxTSDFValue()) {
+}
+
+RegularGridTSDF::RegularGridTSDF() :
+  resolution_(0),
+  origin_(0),
+  max_tsdf_value_(0) {
+}
+
+// static
+std::unique_ptr<RegularGridTSDF> RegularGridTSDF::LoadFromFile(
+  const std::string& filename) {
+  std::unique_ptr<RegularGridTSDF> tsdf(new RegularGridTSDF);
+  if (!tsdf->Load(filename)) {
+    return nullptr;
+  }
+  return tsdf;
+}
+
+RegularGridTSDF::GridView RegularGridTSDF::WriteView() {
+  return GridView(device_grid_.writeView(), make_int3(resolution_),
+    make_int3(StorageOrigin()));
+}
+
+RegularGridTSDF::ConstGridView RegularGridTSDF::ReadView() const {
+  return ConstGridView(device_grid_.readView(), make_int3(resolution_),
+    make_int3(StorageOrigin()));
+}
+
+Vector3i RegularGridTSDF::StorageOrigin() const {
+  return{ PositiveMod(origin_.x, resolution_.x),
+    PositiveMod(origin_.y, resolution_.y),
+    PositiveMod(origin_.z, resolution_.z) };
+}
+
+void RegularGridTSDF::UpdateTransforms() {
+  world_from_grid_ =
+    world_from_volume_ * SimilarityTransform(Vector3f(origin_));
+  grid_from_world_ = inverse(world_from_grid_);
+}
+
 void RegularGridTSDF::Reset() {
   TSDF empty(0, 0, max_tsdf_value_);
   device_grid_.fill(empty);
+  origin_ = Vector3i(0);
+  UpdateTransforms();
 }
 
 const SimilarityTransform& RegularGridTSDF::GridFromWorld() const {
@@ -66,12 +196,18 @@ const SimilarityTransform& RegularGridTSDF::WorldFromGrid() const {
   return world_from_grid_;
 }
 
+void RegularGridTSDF::Transform(
+  const SimilarityTransform& new_world_from_old_world) {
+  world_from_volume_ = new_world_from_old_world * world_from_volume_;
+  UpdateTransforms();
+}
+
 Box3f RegularGridTSDF::BoundingBox() const {
-  return Box3f(device_grid_.size());
+  return Box3f(resolution_);
 }
 
 Vector3i RegularGridTSDF::Resolution() const {
-  return device_grid_.size();
+  return resolution_;
 }
 
 float RegularGridTSDF::VoxelSize() const {
@@ -82,85 +218,138 @@ Vector3f RegularGridTSDF::SideLengths() const {
   return VoxelSize() * Resolution();
 }
 
+float RegularGridTSDF::MaxTSDFValue() const {
+  return max_tsdf_value_;
+}
+
 void RegularGridTSDF::Fuse(const Vector4f& depth_camera_flpp,
   const Range1f& depth_range,
   const Matrix4f& camera_from_world,
-  const DeviceArray2D<float>& depth_data) {
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals) {
+  Integrate(depth_camera_flpp, depth_range, camera_from_world, depth_data,
+    noise_model, depth_camera_normals, false);
+}
+
+void RegularGridTSDF::Defuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_range,
+  const Matrix4f& camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals) {
+  Integrate(depth_camera_flpp, depth_range, camera_from_world, depth_data,
+    noise_model, depth_camera_normals, true);
+}
+
+void RegularGridTSDF::Integrate(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_range,
+  const Matrix4f& camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals,
+  bool deintegrate) {
 
   dim3 block_dim(16, 16, 1);
   dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { device_grid_.width(), device_grid_.height() },
+    { resolution_.x, resolution_.y },
     block_dim
   );
 
-  // TODO: move these into class or use Performance Collector class.
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
+  // Only count updated voxels when collecting: it costs an atomic per
+  // thread and a read back.
+  const bool collect_perf = PerfCollector::Enabled();
+  thrust::device_vector<unsigned long long> num_voxels_updated(
+    collect_perf ? 1 : 0, 0);
   Event e;
 
-  if (FLAGS_collect_perf) {
+  if (collect_perf) {
     e.recordStart();
   }
 
   FuseKernel<<<grid_dim, block_dim>>>(
     make_float4x4(world_from_grid_.asMatrix()),
     max_tsdf_value_,
+    kMinTruncationVoxels * VoxelSize(),
     make_float4(depth_camera_flpp),
     make_float2(depth_range.left(), depth_range.right()),
     make_float4x4(camera_from_world),
+    noise_model,
     depth_data.readView(),
-    device_grid_.writeView());
-
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
-
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+    depth_camera_normals != nullptr ?
+      depth_camera_normals->readView() : KernelArray2D<const float4>(),
+    deintegrate,
+    collect_perf ?
+      thrust::raw_pointer_cast(num_voxels_updated.data()) : nullptr,
+    WriteView());
+
+  if (collect_perf) {
+    PerfCollector& perf = PerfCollector::Instance();
+    perf.RecordLatency(
+      deintegrate ? "RegularGridTSDF::Defuse" : "RegularGridTSDF::Fuse",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+    perf.AddCount("voxels_updated",
+      static_cast<int64_t>(num_voxels_updated[0]));
+  }
+}
 
-    printf("Fuse() took: %f ms\n", msElapsed);
+void RegularGridTSDF::FuseGrid(const RegularGridTSDF& source) {
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { resolution_.x, resolution_.y },
+    block_dim
+  );
 
-    printf("%d average: %f\n", nIterationsTotal, msTotal / nIterationsTotal);
-    printf("3x average: %f\n", 3.0f * msTotal / nIterationsTotal);
-  }
+  FuseGridKernel<<<grid_dim, block_dim>>>(
+    make_float4x4((source.GridFromWorld() * world_from_grid_).asMatrix()),
+    source.MaxTSDFValue(),
+    source.ReadView(),
+    max_tsdf_value_,
+    WriteView());
 }
 
 void RegularGridTSDF::FuseMultiple(
   const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
   const std::vector<DeviceArray2D<float>>& depth_maps) {
+  assert(depth_cameras.size() == depth_maps.size());
+  assert(depth_cameras.size() <= kMaxFuseMultipleCameras);
+  FuseMultipleCameras cameras = {};
+  cameras.num_cameras = static_cast<int>(depth_cameras.size());
+  for (int i = 0; i < cameras.num_cameras; ++i) {
+    cameras.depth_cameras[i] = depth_cameras[i];
+    cameras.depth_maps[i] = depth_maps[i].readView();
+  }
+
   dim3 block_dim(16, 16, 1);
   dim3 grid_dim = libcgt::cuda::math::numBins2D(
-    { device_grid_.width(), device_grid_.height() },
+    { resolution_.x, resolution_.y },
     block_dim
   );
 
-  // TODO: move these into class or use Performance Collector class.
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
+  const bool collect_perf = PerfCollector::Enabled();
+  thrust::device_vector<unsigned long long> num_voxels_updated(
+    collect_perf ? 1 : 0, 0);
   Event e;
 
-  if (FLAGS_collect_perf) {
+  if (collect_perf) {
     e.recordStart();
   }
 
   FuseMultipleKernel<<<grid_dim, block_dim>>>(
     make_float4x4(world_from_grid_.asMatrix()),
     max_tsdf_value_,
-    depth_cameras[0],
-    depth_cameras[1],
-    depth_cameras[2],
-    depth_maps[0].readView(),
-    depth_maps[1].readView(),
-    depth_maps[2].readView(),
-    device_grid_.writeView());
-
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
-
-    msTotal += msElapsed;
-    ++nIterationsTotal;
-
-    printf("FuseMultiple() took: %f ms, %d-run average: %f\n",
-      msElapsed, nIterationsTotal, msTotal / nIterationsTotal);
+    kMinTruncationVoxels * VoxelSize(),
+    cameras,
+    collect_perf ?
+      thrust::raw_pointer_cast(num_voxels_updated.data()) : nullptr,
+    WriteView());
+
+  if (collect_perf) {
+    PerfCollector& perf = PerfCollector::Instance();
+    perf.RecordLatency("RegularGridTSDF::FuseMultiple",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+    perf.AddCount("voxels_updated",
+      static_cast<int64_t>(num_voxels_updated[0]));
   }
 }
 
@@ -177,16 +366,16 @@ void RegularGridTSDF::AdaptiveRaycast(const Vector4f& depth_camera_flpp,
   Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
   float voxels_per_meter = 1.0f / VoxelSize();
 
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
+  const bool collect_perf = PerfCollector::Enabled();
+  thrust::device_vector<unsigned int> num_hits(collect_perf ? 1 : 0, 0);
   Event e;
 
-  if (FLAGS_collect_perf) {
+  if (collect_perf) {
     e.recordStart();
   }
 
   AdaptiveRaycastKernel<<<grid_dim, block_dim>>>(
-    device_grid_.readView(),
+    ReadView(),
     make_float4x4(grid_from_world_.asMatrix()),
     make_float4x4(world_from_grid_.asMatrix()),
     max_tsdf_value_,
@@ -195,21 +384,17 @@ void RegularGridTSDF::AdaptiveRaycast(const Vector4f& depth_camera_flpp,
     make_float4x4(world_from_camera),
     make_float3(eye.xyz),
     world_points_out.writeView(),
-    world_normals_out.writeView()
+    world_normals_out.writeView(),
+    collect_perf ? thrust::raw_pointer_cast(num_hits.data()) : nullptr
   );
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
-
-    msTotal += msElapsed;
-    ++nIterationsTotal;
-
-    printf("AdaptiveRaycastKernel took: %f ms\n", msElapsed);
-
-    printf("%d run average: %f ms\n",
-      nIterationsTotal, msTotal / nIterationsTotal);
-    printf("resolution: %d x %d\n", world_points_out.width(),
-      world_points_out.height());
+  if (collect_perf) {
+    PerfCollector& perf = PerfCollector::Instance();
+    perf.RecordLatency("RegularGridTSDF::AdaptiveRaycast",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+    perf.AddCount("rays_cast",
+      world_points_out.width() * world_points_out.height());
+    perf.AddCount("rays_hit", num_hits[0]);
   }
 }
 
@@ -226,16 +411,16 @@ void RegularGridTSDF::Raycast(const Vector4f& depth_camera_flpp,
 
   Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
 
-  static float msTotal = 0.0f;
-  static int nIterationsTotal = 0;
+  const bool collect_perf = PerfCollector::Enabled();
+  thrust::device_vector<unsigned int> num_hits(collect_perf ? 1 : 0, 0);
   Event e;
 
-  if (FLAGS_collect_perf) {
+  if (collect_perf) {
     e.recordStart();
   }
 
   RaycastKernel<<<grid_dim, block_dim>>>(
-    device_grid_.readView(),
+    ReadView(),
     make_float4x4(grid_from_world_.asMatrix()),
     make_float4x4(world_from_grid_.asMatrix()),
     max_tsdf_value_,
@@ -243,36 +428,308 @@ void RegularGridTSDF::Raycast(const Vector4f& depth_camera_flpp,
     make_float4x4(world_from_camera),
     make_float3(eye.xyz),
     world_points_out.writeView(),
-    world_normals_out.writeView()
+    world_normals_out.writeView(),
+    collect_perf ? thrust::raw_pointer_cast(num_hits.data()) : nullptr
   );
 
-  if (FLAGS_collect_perf) {
-    float msElapsed = e.recordStopSyncAndGetMillisecondsElapsed();
+  if (collect_perf) {
+    PerfCollector& perf = PerfCollector::Instance();
+    perf.RecordLatency("RegularGridTSDF::Raycast",
+      e.recordStopSyncAndGetMillisecondsElapsed());
+    perf.AddCount("rays_cast",
+      world_points_out.width() * world_points_out.height());
+    perf.AddCount("rays_hit", num_hits[0]);
+  }
+}
+
+TriangleMesh RegularGridTSDF::Triangulate() const {
+  Array3D<TSDF> host_storage(device_grid_.size());
+  copy(device_grid_, host_storage.writeView());
 
-    msTotal += msElapsed;
-    ++nIterationsTotal;
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+  MarchingCubes(
+    VoxelGridView<const TSDF, VoxelLayout, Array3DReadView<TSDF>>(
+      host_storage.readView(), make_int3(resolution_),
+      make_int3(StorageOrigin())),
+    max_tsdf_value_, world_from_grid_, positions, normals);
 
-    printf("RaycastKernel took: %f ms\n", msElapsed);
+  return ConstructMarchingCubesMesh(positions, normals);
+}
 
-    printf("%d run average: %f ms\n",
-      nIterationsTotal, msTotal / nIterationsTotal);
-    printf("resolution: %d x %d\n", world_points_out.width(),
-      world_points_out.height());
+Array3D<TSDF> RegularGridTSDF::CopyToHost() const {
+  Array3D<TSDF> storage(device_grid_.size());
+  copy(device_grid_, storage.writeView());
+  Array3D<TSDF> data(resolution_);
+  CopyFromStorageOrder(storage.readView(), make_int3(StorageOrigin()),
+    data.writeView());
+  return data;
+}
+
+Vector3i RegularGridTSDF::Origin() const {
+  return origin_;
+}
+
+void RegularGridTSDF::Scroll(const Vector3i& brick_delta,
+  BrickStore* store) {
+  assert(BrickVoxelLayout::IsValidResolution(resolution_));
+  for (int axis = 0; axis < 3; ++axis) {
+    if (brick_delta[axis] != 0) {
+      ScrollAxis(axis, brick_delta[axis], store);
+    }
   }
 }
 
-TriangleMesh RegularGridTSDF::Triangulate() const {
-  Array3D<TSDF> host_grid(Resolution());
-  copy(device_grid_, host_grid.writeView());
+void RegularGridTSDF::ScrollAxis(int axis, int brick_delta,
+  BrickStore* store) {
+  const int kBrickSize = BrickStore::kBrickSize;
+  const Vector3i num_bricks(resolution_.x / kBrickSize,
+    resolution_.y / kBrickSize, resolution_.z / kBrickSize);
+
+  // The slab that leaves the window and the slab that enters it occupy the
+  // same storage. If the window moves by its own size or more, every brick
+  // is replaced.
+  int thickness = std::min(std::abs(brick_delta), num_bricks[axis]);
+  Vector3i slab_size = num_bricks;
+  slab_size[axis] = thickness;
+
+  Vector3i leaving(0);
+  if (brick_delta < 0) {
+    leaving[axis] = num_bricks[axis] - thickness;
+  }
+  StoreSlab(leaving, slab_size, store);
+
+  origin_[axis] += kBrickSize * brick_delta;
+  UpdateTransforms();
+
+  Vector3i entering(0);
+  if (brick_delta > 0) {
+    entering[axis] = num_bricks[axis] - thickness;
+  }
+  LoadSlab(entering, slab_size, store);
+}
+
+bool RegularGridTSDF::Recenter(const Vector3f& world_point,
+  int max_offset_bricks, BrickStore* store) {
+  const float kBrickSize = static_cast<float>(BrickStore::kBrickSize);
+  Vector3f grid_point = transformPoint(grid_from_world_, world_point);
+
+  Vector3i brick_delta(0);
+  for (int axis = 0; axis < 3; ++axis) {
+    float offset_bricks =
+      (grid_point[axis] - 0.5f * resolution_[axis]) / kBrickSize;
+    if (fabsf(offset_bricks) > max_offset_bricks) {
+      brick_delta[axis] = static_cast<int>(roundf(offset_bricks));
+    }
+  }
+
+  if (brick_delta == Vector3i(0)) {
+    return false;
+  }
+  Scroll(brick_delta, store);
+  return true;
+}
+
+void RegularGridTSDF::StoreResidentBricks(BrickStore* store) const {
+  assert(BrickVoxelLayout::IsValidResolution(resolution_));
+  const int kBrickSize = BrickStore::kBrickSize;
+  // One layer at a time, to bound the size of the staging buffers.
+  Vector3i layer_size(resolution_.x / kBrickSize,
+    resolution_.y / kBrickSize, 1);
+  for (int z = 0; z < resolution_.z / kBrickSize; ++z) {
+    StoreSlab({ 0, 0, z }, layer_size, store);
+  }
+}
+
+void RegularGridTSDF::Prefetch(const std::vector<Vector3f>& world_points,
+  int margin_bricks, BrickStore* store) const {
+  if (world_points.empty()) {
+    return;
+  }
+
+  const int kBrickSize = BrickStore::kBrickSize;
+  const Vector3i num_bricks(resolution_.x / kBrickSize,
+    resolution_.y / kBrickSize, resolution_.z / kBrickSize);
+
+  // The bounding box of world_points, in bricks relative to the window,
+  // clamped to the margin.
+  Vector3i box_min = num_bricks + Vector3i(margin_bricks);
+  Vector3i box_max = Vector3i(-margin_bricks - 1);
+  for (const Vector3f& p : world_points) {
+    Vector3f grid_point = transformPoint(grid_from_world_, p);
+    for (int axis = 0; axis < 3; ++axis) {
+      int brick = static_cast<int>(floorf(grid_point[axis] / kBrickSize));
+      brick = std::min(std::max(brick, -margin_bricks),
+        num_bricks[axis] + margin_bricks - 1);
+      box_min[axis] = std::min(box_min[axis], brick);
+      box_max[axis] = std::max(box_max[axis], brick);
+    }
+  }
+
+  // Bucket the bricks outside the window by how far outside they are.
+  std::vector<std::vector<Vector3i>> rings(margin_bricks + 1);
+  Vector3i first_brick(origin_.x / kBrickSize, origin_.y / kBrickSize,
+    origin_.z / kBrickSize);
+  for (int z = box_min.z; z <= box_max.z; ++z) {
+    for (int y = box_min.y; y <= box_max.y; ++y) {
+      for (int x = box_min.x; x <= box_max.x; ++x) {
+        Vector3i brick(x, y, z);
+        int distance = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+          distance = std::max(distance, std::max(-brick[axis],
+            brick[axis] - num_bricks[axis] + 1));
+        }
+        if (distance > 0) {
+          rings[distance].push_back(first_brick + brick);
+        }
+      }
+    }
+  }
+
+  std::vector<Vector3i> bricks;
+  for (const std::vector<Vector3i>& ring : rings) {
+    bricks.insert(bricks.end(), ring.begin(), ring.end());
+  }
+  store->Prefetch(bricks);
+}
 
+TriangleMesh RegularGridTSDF::Triangulate(BrickStore* store) const {
+  StoreResidentBricks(store);
+
+  const int kBrickSize = BrickStore::kBrickSize;
+  const int kBrickVolume = BrickStore::kBrickVolume;
+  // MarchingCubes reads two voxels past each cell, so each brick is
+  // triangulated with an apron from its neighbors in +x, +y, and +z.
+  const int kBlockSize = kBrickSize + 2;
+
+  // Visit bricks in z, y, x order so that neighbors are likely cached.
+  std::vector<Vector3i> bricks = store->Bricks();
+  std::sort(bricks.begin(), bricks.end(),
+    [](const Vector3i& a, const Vector3i& b) {
+      if (a.z != b.z) {
+        return a.z < b.z;
+      }
+      if (a.y != b.y) {
+        return a.y < b.y;
+      }
+      return a.x < b.x;
+    });
+
+  const TSDF empty(0, 0, max_tsdf_value_);
+  Array3D<TSDF> block(Vector3i(kBlockSize));
+  std::vector<TSDF> neighbor(kBrickVolume);
   std::vector<Vector3f> positions;
   std::vector<Vector3f> normals;
-  MarchingCubes(host_grid, max_tsdf_value_, world_from_grid_,
-    positions, normals);
+  std::vector<Vector3f> brick_positions;
+  std::vector<Vector3f> brick_normals;
+
+  for (size_t i = 0; i < bricks.size(); ++i) {
+    const Vector3i& brick = bricks[i];
+    for (int z = 0; z < kBlockSize; ++z) {
+      for (int y = 0; y < kBlockSize; ++y) {
+        for (int x = 0; x < kBlockSize; ++x) {
+          block[{x, y, z}] = empty;
+        }
+      }
+    }
+
+    for (int dz = 0; dz < 2; ++dz) {
+      for (int dy = 0; dy < 2; ++dy) {
+        for (int dx = 0; dx < 2; ++dx) {
+          if (!store->Read(brick + Vector3i(dx, dy, dz), neighbor.data())) {
+            continue;
+          }
+          Vector3i block_origin = kBrickSize * Vector3i(dx, dy, dz);
+          for (int z = 0; z < kBrickSize && block_origin.z + z < kBlockSize;
+            ++z) {
+            for (int y = 0;
+              y < kBrickSize && block_origin.y + y < kBlockSize; ++y) {
+              for (int x = 0;
+                x < kBrickSize && block_origin.x + x < kBlockSize; ++x) {
+                block[block_origin + Vector3i(x, y, z)] =
+                  neighbor[x + kBrickSize * (y + kBrickSize * z)];
+              }
+            }
+          }
+        }
+      }
+    }
+
+    MarchingCubes(
+      HostTSDFGridView<LinearVoxelLayout>(block.readView(),
+        make_int3(block.size())),
+      max_tsdf_value_,
+      world_from_volume_ * SimilarityTransform(Vector3f(kBrickSize * brick)),
+      brick_positions, brick_normals, false);
+    positions.insert(positions.end(),
+      brick_positions.begin(), brick_positions.end());
+    normals.insert(normals.end(), brick_normals.begin(), brick_normals.end());
+  }
+
+  if (PerfCollector::Enabled()) {
+    PerfCollector& perf = PerfCollector::Instance();
+    perf.AddCount("triangulated_bricks", static_cast<int64_t>(bricks.size()));
+    perf.AddCount("triangulated_vertices",
+      static_cast<int64_t>(positions.size()));
+  }
 
   return ConstructMarchingCubesMesh(positions, normals);
 }
 
+void RegularGridTSDF::StoreSlab(const Vector3i& slab_origin,
+  const Vector3i& slab_size, BrickStore* store) const {
+  if (store == nullptr) {
+    return;
+  }
+
+  const int kBrickSize = BrickStore::kBrickSize;
+  const int kBrickVolume = BrickStore::kBrickVolume;
+  int num_bricks = slab_size.x * slab_size.y * slab_size.z;
+
+  DeviceArray2D<TSDF> device_bricks({ kBrickVolume, num_bricks });
+  GatherBricksKernel<<<num_bricks, dim3(kBrickSize, kBrickSize, kBrickSize)>>>(
+    ReadView(), make_int3(slab_origin), make_int3(slab_size),
+    device_bricks.writeView());
+
+  Array2D<TSDF> bricks(device_bricks.size());
+  copy(device_bricks, bricks.writeView());
+
+  Vector3i first_brick(origin_.x / kBrickSize, origin_.y / kBrickSize,
+    origin_.z / kBrickSize);
+  for (int b = 0; b < num_bricks; ++b) {
+    const TSDF* voxels = bricks.rowPointer(b);
+    if (IsObserved(voxels)) {
+      store->Write(first_brick + slab_origin + SlabBrick(b, slab_size),
+        voxels);
+    }
+  }
+}
+
+void RegularGridTSDF::LoadSlab(const Vector3i& slab_origin,
+  const Vector3i& slab_size, BrickStore* store) {
+  const int kBrickSize = BrickStore::kBrickSize;
+  const int kBrickVolume = BrickStore::kBrickVolume;
+  int num_bricks = slab_size.x * slab_size.y * slab_size.z;
+
+  TSDF empty(0, 0, max_tsdf_value_);
+  Array2D<TSDF> bricks({ kBrickVolume, num_bricks });
+  Vector3i first_brick(origin_.x / kBrickSize, origin_.y / kBrickSize,
+    origin_.z / kBrickSize);
+  for (int b = 0; b < num_bricks; ++b) {
+    TSDF* voxels = bricks.rowPointer(b);
+    if (store == nullptr || !store->Read(
+      first_brick + slab_origin + SlabBrick(b, slab_size), voxels)) {
+      std::fill(voxels, voxels + kBrickVolume, empty);
+    }
+  }
+
+  DeviceArray2D<TSDF> device_bricks(bricks.size());
+  copy(bricks.readView(), device_bricks);
+  ScatterBricksKernel<<<num_bricks, dim3(kBrickSize, kBrickSize, kBrickSize)>>>(
+    device_bricks.readView(), make_int3(slab_origin), make_int3(slab_size),
+    WriteView());
+}
+
 bool RegularGridTSDF::Load(const std::string& filename) {
   // TODO: validate input at each step..
   BinaryFileInputStream in(filename);
@@ -287,9 +744,20 @@ bool RegularGridTSDF::Load(const std::string& filename) {
 
   int32_t version;
   in.read(version);
+  if (version < 1 || version > kTSDF3DVersion) {
+    fprintf(stderr, "%s: unsupported tsdf3d version %d.\n",
+      filename.c_str(), version);
+    return false;
+  }
 
   Vector3i resolution;
   in.read(resolution);
+  if (!VoxelLayout::IsValidResolution(resolution)) {
+    fprintf(stderr, "%s: resolution %d x %d x %d is not valid for the %s "
+      "voxel layout.\n", filename.c_str(), resolution.x, resolution.y,
+      resolution.z, VoxelLayout::Name());
+    return false;
+  }
 
   Matrix4f world_from_grid_matrix;
   in.read(world_from_grid_matrix);
@@ -297,13 +765,48 @@ bool RegularGridTSDF::Load(const std::string& filename) {
   float max_tsdf_value;
   in.read(max_tsdf_value);
 
-  Array3D<TSDF> data(resolution);
-  in.readArray(flatten(data.writeView()));
+  int32_t distance_bits = 16;
+  int32_t weight_bits = 16;
+  if (version >= 2) {
+    in.read(distance_bits);
+    in.read(weight_bits);
+  }
 
-  world_from_grid_ = SimilarityTransform::fromMatrix(world_from_grid_matrix);
-  grid_from_world_ = inverse(world_from_grid_);
+  // Files in a different voxel format are converted on load.
+  const int32_t kDistanceBits = 8 * sizeof(TSDF::DistanceType);
+  const int32_t kWeightBits = 8 * sizeof(TSDF::WeightType);
+  Array3D<TSDF> data(resolution);
+  if (distance_bits == kDistanceBits && weight_bits == kWeightBits) {
+    in.readArray(flatten(data.writeView()));
+  } else if (distance_bits == 8 && weight_bits == 8) {
+    ReadAndConvertTSDFGrid<BasicTSDF<uint8_t, uint8_t, 255>>(
+      in, max_tsdf_value, data.writeView());
+  } else if (distance_bits == 16 && weight_bits == 8) {
+    ReadAndConvertTSDFGrid<BasicTSDF<uint16_t, uint8_t, 255>>(
+      in, max_tsdf_value, data.writeView());
+  } else if (distance_bits == 16 && weight_bits == 16) {
+    ReadAndConvertTSDFGrid<BasicTSDF<uint16_t, uint16_t, 65535>>(
+      in, max_tsdf_value, data.writeView());
+  } else {
+    fprintf(stderr, "%s: unsupported voxel format: %d-bit distance, "
+      "%d-bit weight.\n", filename.c_str(), distance_bits, weight_bits);
+    return false;
+  }
 
-  copy(data.readView(), device_grid_);
+  // The loaded grid becomes the volume, with the window at its origin.
+  world_from_volume_ =
+    SimilarityTransform::fromMatrix(world_from_grid_matrix);
+  origin_ = Vector3i(0);
+  UpdateTransforms();
+
+  resolution_ = resolution;
+  Array3D<TSDF> storage(VoxelLayout::StorageSize(resolution));
+  CopyToStorageOrder(data.readView(), make_int3(StorageOrigin()),
+    storage.writeView());
+  if (device_grid_.size() != storage.size()) {
+    device_grid_.resize(storage.size());
+  }
+  copy(storage.readView(), device_grid_);
 
   max_tsdf_value_ = max_tsdf_value;
 
@@ -316,17 +819,17 @@ bool RegularGridTSDF::Save(const std::string& filename) const {
 
   // TODO: check that the stream is valid.
 
-  // Write magic header: 'tsdf3d1'.
+  // Write magic header: 'tsdf3d' and version.
   out.write('t');
   out.write('s');
   out.write('d');
   out.write('f');
   out.write('3');
   out.write('d');
-  out.write<int32_t>(1);
+  out.write<int32_t>(kTSDF3DVersion);
 
   // Write resolution: x, y, z.
-  out.write(device_grid_.size());
+  out.write(resolution_);
 
   // Write world from grid transformation as a 4x4 float32 matrix,
   // stored column major.
@@ -335,9 +838,12 @@ bool RegularGridTSDF::Save(const std::string& filename) const {
   // Write max tsdf value.
   out.write(max_tsdf_value_);
 
-  // Write data.
-  Array3D<TSDF> data(device_grid_.size());
-  copy(device_grid_, data.writeView());
+  // Write voxel format: bits per distance and weight.
+  out.write<int32_t>(8 * sizeof(TSDF::DistanceType));
+  out.write<int32_t>(8 * sizeof(TSDF::WeightType));
+
+  // Write data, in x-fastest order regardless of VoxelLayout.
+  Array3D<TSDF> data = CopyToHost();
   out.writeArray(flatten(data.readView()));
 
   return out.close();
@@ -14,6 +14,7 @@
 #ifndef REGULAR_GRID_TSDF_H
 #define REGULAR_GRID_TSDF_H
 
+#include "libcgt/core/common/Array3D.h"
 #include "libcgt/core/geometry/TriangleMesh.h"
 #include "libcgt/core/vecmath/Box3f.h"
 #include "libcgt/core/vecmath/Matrix4f.h"
@@ -25,21 +26,37 @@
 #include "libcgt/cuda/DeviceArray2D.h"
 #include "libcgt/cuda/DeviceArray3D.h"
 
+#include "brick_store.h"
 #include "calibrated_posed_depth_camera.h"
+#include "depth_noise_model.h"
+#include <memory>
 #include <vector>
 #include "tsdf.h"
+#include "tsdf_volume_spec.h"
+#include "voxel_layout.h"
+
+// Device views of a TSDF grid stored in VoxelLayout order.
+using TSDFGridView = VoxelGridView<TSDF, VoxelLayout, KernelArray3D<TSDF>>;
+using ConstTSDFGridView =
+  VoxelGridView<const TSDF, VoxelLayout, KernelArray3D<const TSDF>>;
 
 class RegularGridTSDF {
 
   using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+  using GridView = TSDFGridView;
+  using ConstGridView = ConstTSDFGridView;
 
 public:
 
+  // The most depth cameras FuseMultiple() fuses in one pass.
+  static constexpr int kMaxFuseMultipleCameras = 8;
+
   // Same as RegularGridTSDF(resolution, world_from_grid, 4 * VoxelSize()).
   RegularGridTSDF(const Vector3i& resolution,
     const SimilarityTransform& world_from_grid);
 
-  // resolution: number of voxels in each direction.
+  // resolution: number of voxels in each direction. Must be valid for
+  //   VoxelLayout.
   // world_from_grid: transform mapping grid indices to world coordinates
   //   world_from_grid.scale is the side length of one (cubical) voxel in world
   //   units.
@@ -49,13 +66,44 @@ public:
     const SimilarityTransform& world_from_grid,
     float max_tsdf_value);
 
+  // Same as RegularGridTSDF(spec.resolution, spec.WorldFromGrid(),
+  // spec.MaxTSDFValue()).
+  explicit RegularGridTSDF(const TSDFVolumeSpec& spec);
+
+  // Load a grid saved with Save(), at the resolution it was saved with.
+  // Returns null on failure.
+  static std::unique_ptr<RegularGridTSDF> LoadFromFile(
+    const std::string& filename);
+
   void Reset();
 
+  // Each depth sample is truncated and weighted according to noise_model.
+  // If depth_camera_normals is not null, it must have the same size as
+  // depth_data and is used for the noise model's view angle term.
   void Fuse(const Vector4f& depth_camera_flpp,  // Depth camera intrinsics.
     const Range1f& depth_camera_range,          // Depth camera range.
     const Matrix4f& depth_camera_from_world,    // Depth camera pose.
-    const DeviceArray2D<float>& depth_data);    // Depth frame, in meters.
+    const DeviceArray2D<float>& depth_data,     // Depth frame, in meters.
+    const DepthNoiseModel& noise_model = DepthNoiseModel(),
+    const DeviceArray2D<float4>* depth_camera_normals = nullptr);
 
+  // Undoes Fuse() with the same arguments, e.g. to move a frame to a new
+  // pose. Voxels whose weight saturated in between are only approximately
+  // restored.
+  void Defuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model = DepthNoiseModel(),
+    const DeviceArray2D<float4>* depth_camera_normals = nullptr);
+
+  // Blend every observed voxel of source into this grid (see
+  // FuseGridKernel). The grids may have different resolutions and poses.
+  void FuseGrid(const RegularGridTSDF& source);
+
+  // Fuse depth_maps[i], seen by depth_cameras[i], for every camera in one
+  // sweep over the grid (see FuseMultipleKernel). There must be at most
+  // kMaxFuseMultipleCameras cameras.
   void FuseMultiple(
     const std::vector<CalibratedPosedDepthCamera>& depth_cameras,
     const std::vector<DeviceArray2D<float>>& depth_maps);
@@ -78,6 +126,11 @@ public:
   // grid coordinates [0, resolution]^3 (in samples).
   const SimilarityTransform& WorldFromGrid() const;
 
+  // Move the grid rigidly without changing its voxels: the world
+  // coordinates of every voxel are premultiplied by
+  // new_world_from_old_world.
+  void Transform(const SimilarityTransform& new_world_from_old_world);
+
   // (0, 0, 0) --> Resolution().
   Box3f BoundingBox() const;
 
@@ -91,19 +144,112 @@ public:
   // Equivalent to VoxelSize() * Resolution().
   Vector3f SideLengths() const;
 
+  // The representable range of the TSDF: [-MaxTSDFValue(), MaxTSDFValue()].
+  float MaxTSDFValue() const;
+
   TriangleMesh Triangulate() const;
 
+  // Copy the window to the host, in x-fastest order regardless of
+  // VoxelLayout.
+  Array3D<TSDF> CopyToHost() const;
+
+  // Rolling volume.
+  //
+  // The grid is a window onto an unbounded volume: the grid it was
+  // constructed (or loaded) as, extended in every direction. The window
+  // moves in whole 8^3 bricks. Its storage is cyclic, so voxels that stay
+  // inside the window are not moved. Scrolling requires a resolution that
+  // is a multiple of 8 along each axis.
+
+  // The subscript, in the volume, of voxel (0, 0, 0) of the window. A
+  // multiple of 8.
+  Vector3i Origin() const;
+
+  // Move the window by brick_delta bricks. Bricks that leave the window are
+  // written to store if any of their voxels was observed. Bricks that enter
+  // it are read from store if present, and are empty otherwise. If store is
+  // null, bricks that leave are discarded.
+  void Scroll(const Vector3i& brick_delta, BrickStore* store);
+
+  // Along each axis where world_point is more than max_offset_bricks away
+  // from the center of the window, scroll so that it is at the center.
+  // Returns whether the window moved.
+  bool Recenter(const Vector3f& world_point, int max_offset_bricks,
+    BrickStore* store);
+
+  // Write every observed brick in the window to store. Call this at the end
+  // of a scan so that store holds all of it.
+  void StoreResidentBricks(BrickStore* store) const;
+
+  // Ask store to prefetch the bricks that are outside the window, but
+  // within margin_bricks of it, and that overlap the bounding box of
+  // world_points (e.g., the corners of a camera frustum). Bricks closer to
+  // the window are fetched first.
+  void Prefetch(const std::vector<Vector3f>& world_points, int margin_bricks,
+    BrickStore* store) const;
+
+  // Triangulate the entire volume, one brick at a time: the window and
+  // every brick in store. Only a brick and its neighbors are in memory at
+  // once, so the volume can be much larger than memory. Writes the window to
+  // store first.
+  TriangleMesh Triangulate(BrickStore* store) const;
+
+  // Replace this grid with one saved with Save(). The resolution may
+  // differ from this grid's.
   bool Load(const std::string& filename);
   bool Save(const std::string& filename) const;
 
 private:
 
+  // An empty grid, with no storage, for LoadFromFile().
+  RegularGridTSDF();
+
+  GridView WriteView();
+  ConstGridView ReadView() const;
+
+  // Fuse() if deintegrate is false, Defuse() otherwise.
+  void Integrate(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model,
+    const DeviceArray2D<float4>* depth_camera_normals,
+    bool deintegrate);
+
+  // Where voxel (0, 0, 0) of the window is stored: origin_ mod resolution_.
+  Vector3i StorageOrigin() const;
+
+  // Recompute world_from_grid_ and grid_from_world_ from origin_.
+  void UpdateTransforms();
+
+  void ScrollAxis(int axis, int brick_delta, BrickStore* store);
+
+  // Copy the bricks [slab_origin, slab_origin + slab_size) of the window
+  // (in bricks) to or from store.
+  void StoreSlab(const Vector3i& slab_origin, const Vector3i& slab_size,
+    BrickStore* store) const;
+  void LoadSlab(const Vector3i& slab_origin, const Vector3i& slab_size,
+    BrickStore* store);
+
+  Vector3i resolution_;
+
+  // The subscript of the window in the volume, and the volume's transform.
+  Vector3i origin_;
+  SimilarityTransform world_from_volume_;
+
+  // The window's transforms: world_from_volume_ after a translation by
+  // origin_.
   SimilarityTransform grid_from_world_;
   SimilarityTransform world_from_grid_;
 
+  // Voxels in VoxelLayout order, cyclically shifted by StorageOrigin(). Its
+  // size is VoxelLayout::StorageSize(resolution_).
   DeviceArray3D<TSDF> device_grid_;
 
-  // TODO: this should be dynamic, and is a function of the noise model.
+  // The representable range of the TSDF, and the widest truncation band a
+  // sample can have. The truncation of each sample is determined by the
+  // depth camera's noise model, but is never narrower than a couple of
+  // voxels.
   float max_tsdf_value_;
 };
 
@@ -13,12 +13,17 @@
 // limitations under the License.
 #include "rgbd_camera_parameters.h"
 
+#include <cstdio>
+#include <fstream>
+
 #include "libcgt/core/io/PortableFloatMapIO.h"
 #include "libcgt/core/vecmath/EuclideanTransform.h"
 #include "libcgt/opencv_interop/Calib3d.h"
 #include "libcgt/opencv_interop/VecmathUtils.h"
 #include <third_party/pystring/pystring.h>
 
+#include "undistort_remap.h"
+
 using namespace pystring;
 using namespace libcgt::core::vecmath;
 
@@ -54,6 +59,14 @@ CameraParameters LoadCameraIntrinsics(const cv::FileStorage& fs,
 	return params;
 }
 
+// Read node into value if it is present. Otherwise, leave value alone.
+template <typename T>
+void ReadOptional(const cv::FileNode& node, T* value) {
+  if (!node.empty()) {
+    node >> *value;
+  }
+}
+
 }  // namespace
 
 EuclideanTransform LoadEuclideanTransform(const cv::FileStorage& fs,
@@ -114,6 +127,43 @@ bool LoadCameraParameters(const std::string& yaml,
 	return params;
 }
 
+bool LoadDepthNoiseModel(const std::string& yaml, DepthNoiseModel* model) {
+  cv::FileStorage fs(yaml, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+
+  std::string type;
+  fs["type"] >> type;
+  DepthNoiseModel m = DepthNoiseModel::KinectV1();
+  if (type == "constant") {
+    m.type = DepthNoiseModel::Type::CONSTANT;
+  } else if (type == "quadratic" || type == "kinect_v1") {
+    m.type = DepthNoiseModel::Type::QUADRATIC;
+  } else {
+    fprintf(stderr, "%s: invalid noise model type: \"%s\"\n",
+      yaml.c_str(), type.c_str());
+    return false;
+  }
+
+  ReadOptional(fs["sigma_0"], &m.sigma_0);
+  ReadOptional(fs["sigma_1"], &m.sigma_1);
+  ReadOptional(fs["z_0"], &m.z_0);
+  ReadOptional(fs["sigma_angle"], &m.sigma_angle);
+  ReadOptional(fs["truncation_sigmas"], &m.truncation_sigmas);
+  ReadOptional(fs["max_sample_weight"], &m.max_sample_weight);
+
+  if (!(m.sigma_0 > 0) || !(m.truncation_sigmas > 0) ||
+    m.max_sample_weight < 1) {
+    fprintf(stderr, "%s: sigma_0 and truncation_sigmas must be positive "
+      "and max_sample_weight must be at least 1.\n", yaml.c_str());
+    return false;
+  }
+
+  *model = m;
+  return true;
+}
+
 bool LoadRGBDCameraParameters(const std::string& dir,
   RGBDCameraParameters* params) {
 	cv::FileStorage fs(
@@ -138,6 +188,8 @@ bool LoadRGBDCameraParameters(const std::string& dir,
     return false;
   }
 	params->depth.undistortion_map = res.rg;
+  params->depth.undistortion_remap = CompileUndistortRemap(
+    params->depth.undistortion_map.readView(), params->depth.resolution);
 
 	params->color_from_depth = LoadEuclideanTransform(fs, "colorFromDepth_gl");
 	params->depth_from_color = LoadEuclideanTransform(fs, "depthFromColor_gl");
@@ -147,6 +199,15 @@ bool LoadRGBDCameraParameters(const std::string& dir,
 	params->depth.depth_range = Range1f::fromMinMax(0.8f, 4.0f);
 	params->color.depth_range = params->depth.depth_range;
 
+  std::string noise_model_yaml = os::path::join(dir, "depth_noise_model.yaml");
+  if (std::ifstream(noise_model_yaml).good()) {
+    if (!LoadDepthNoiseModel(noise_model_yaml, &params->depth_noise_model)) {
+      return false;
+    }
+  } else {
+    params->depth_noise_model = DepthNoiseModel();
+  }
+
   return true;
 }
 
@@ -22,6 +22,8 @@
 
 #include <opencv2/core/persistence.hpp>
 
+#include "depth_noise_model.h"
+
 struct CameraParameters {
   using Intrinsics = libcgt::core::cameras::Intrinsics;
 
@@ -30,6 +32,9 @@ struct CameraParameters {
   Intrinsics intrinsics;
   std::vector<float> dist_coeffs;
   Array2D<Vector2f> undistortion_map; // y axis points up.
+  // undistortion_map compiled by CompileUndistortRemap(), for depth cameras
+  // only. y axis points up.
+  Array2D<uint32_t> undistortion_remap;
 
   Intrinsics undistorted_intrinsics;
 
@@ -47,7 +52,8 @@ struct RGBDCameraParameters {
   EuclideanTransform depth_from_color;  // In meters.
   EuclideanTransform color_from_depth;  // In meters.
 
-  // TODO: Add a noise model.
+  // Noise model of the depth camera.
+  DepthNoiseModel depth_noise_model;
 
   // Using the known extrinsic calibration between the color and depth
   // cameras, convert a depth camera_from_world pose to a color
@@ -69,6 +75,16 @@ struct RGBDCameraParameters {
 bool LoadCameraParameters(const std::string& yaml,
   CameraParameters* params);
 
+// Load a DepthNoiseModel from a .yaml file with the keys:
+// type: "constant", "quadratic", or "kinect_v1" (required). "kinect_v1" is
+//   DepthNoiseModel::KinectV1(), the quadratic model with its defaults.
+// sigma_0, sigma_1, z_0, sigma_angle, truncation_sigmas, max_sample_weight:
+//   optional. Missing values default to those of DepthNoiseModel::KinectV1().
+//
+// On success, populates model and returns true.
+// Otherwise, returns false.
+bool LoadDepthNoiseModel(const std::string& yaml, DepthNoiseModel* model);
+
 // Load a RGBDCameraParameters from a directory containing:
 // <dir>/stereo_calibration.yaml,
 // <dir>/color_undistort_map_gl.pfm2
@@ -77,6 +93,13 @@ bool LoadCameraParameters(const std::string& yaml,
 // prefixes for the intrinsics. Also reads "colorFromDepth_gl" and
 // "depthFromColor_gl" for extrinsics.
 //
+// The depth undistortion map is also compiled into depth.undistortion_remap.
+//
+// If <dir>/depth_noise_model.yaml exists, the depth noise model is loaded
+// from it with LoadDepthNoiseModel(). Otherwise, it is the constant model:
+// every sample is truncated at max_tsdf_value and has weight 1. Opt into
+// the Kinect v1 model with "type: kinect_v1".
+//
 // On success, populates params and returns true.
 // Otherwise, returns false.
 bool LoadRGBDCameraParameters(const std::string& dir,
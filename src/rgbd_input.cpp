@@ -15,24 +15,23 @@
 
 #include <cassert>
 
-#include "libcgt/camera_wrappers/Kinect1x/KinectUtils.h"
 #include "libcgt/camera_wrappers/PixelFormat.h"
 #include "libcgt/core/common/ArrayUtils.h"
 #include "libcgt/core/imageproc/ColorMap.h"
-#include "libcgt/core/imageproc/Swizzle.h"
 
+#include "compressed_rgbd_stream.h"
+#include "depth_decode.h"
 #include "input_buffer.h"
 
 using libcgt::camera_wrappers::PixelFormat;
 using libcgt::camera_wrappers::RGBDInputStream;
-using libcgt::camera_wrappers::kinect1x::rawDepthMapToMeters;
 using libcgt::core::arrayutils::copy;
-using libcgt::core::arrayutils::flipY;
 using libcgt::core::imageproc::linearRemapToLuminance;
-using libcgt::core::imageproc::RGBToBGR;
 
-RgbdInput::RgbdInput(InputType input_type, const char* filename) :
-  input_type_(input_type) {
+RgbdInput::RgbdInput(InputType input_type, const char* filename,
+  const Range1f& depth_range) :
+  input_type_(input_type),
+  depth_range_(depth_range) {
   if (input_type == InputType::OPENNI2) {
     std::vector<libcgt::camera_wrappers::StreamConfig> config;
     config.emplace_back(
@@ -52,12 +51,21 @@ RgbdInput::RgbdInput(InputType input_type, const char* filename) :
     openni2_frame_.depth = openni2_buffer_depth_.writeView();
     openni2_camera_->start();
   } else if (input_type == InputType::FILE) {
-    file_input_stream_ = std::make_unique<RGBDInputStream>(filename);
+    // Compressed streams are decoded ahead of read() on other threads.
+    if (CompressedRgbdInputStream::IsCompressedRgbd(filename)) {
+      compressed_input_stream_ =
+        std::make_unique<CompressedRgbdInputStream>(filename);
+    } else {
+      file_input_stream_ = std::make_unique<RGBDInputStream>(filename);
+    }
+    const std::vector<StreamMetadata>& all_metadata =
+      compressed_input_stream_ != nullptr ?
+      compressed_input_stream_->Metadata() : file_input_stream_->metadata();
 
     // Find the rgb stream.
     // TODO: take a dependency on cpp11-range
-    for(int i = 0; i < file_input_stream_->metadata().size(); ++i) {
-      const auto& metadata = file_input_stream_->metadata()[i];
+    for(int i = 0; i < all_metadata.size(); ++i) {
+      const auto& metadata = all_metadata[i];
       if(metadata.type == StreamType::COLOR &&
         metadata.format ==  PixelFormat::RGB_U888) {
         color_stream_id_ = i;
@@ -68,8 +76,8 @@ RgbdInput::RgbdInput(InputType input_type, const char* filename) :
 
     // Find the depth stream.
     // TODO: take a dependency on cpp11-range
-    for (int i = 0; i < file_input_stream_->metadata().size(); ++i) {
-      const auto& metadata = file_input_stream_->metadata()[i];
+    for (int i = 0; i < all_metadata.size(); ++i) {
+      const auto& metadata = all_metadata[i];
       if (metadata.type == StreamType::DEPTH) {
         raw_depth_stream_id_ = i;
         depth_metadata_ = metadata;
@@ -105,18 +113,18 @@ void RgbdInput::read(InputBuffer* buffer,
 
     bool succeeded = openni2_camera_->pollOne(openni2_frame_);
     if (openni2_frame_.colorUpdated) {
-      // Copy the buffer, flipping it upside down for OpenGL.
-      copy<uint8x3>(openni2_frame_.color, flipY(buffer->color_rgb.writeView()));
-      // Convert RGB to BGR for OpenCV.
-      RGBToBGR(openni2_frame_.color, buffer->color_bgr_ydown.writeView());
+      // Copy once: consumers derive the flipped and swizzled views lazily.
+      copy<uint8x3>(openni2_frame_.color, buffer->color_rgb_ydown.writeView());
+      buffer->ColorUpdated();
       buffer->color_timestamp_ns = openni2_frame_.colorTimestampNS;
       buffer->color_frame_index = openni2_frame_.colorFrameNumber;
       *rgb_updated = openni2_frame_.colorUpdated;
     }
 
     if (openni2_frame_.depthUpdated) {
-      rawDepthMapToMeters(openni2_frame_.depth, buffer->depth_meters,
-        false, true);
+      DecodeDepthMillimeters(openni2_frame_.depth, true, depth_range_,
+        buffer->depth_meters, buffer->depth_mm);
+      buffer->depth_mm_valid = true;
       buffer->depth_timestamp_ns = openni2_frame_.depthTimestampNS;
       buffer->depth_frame_index = openni2_frame_.depthFrameNumber;
       *depth_updated = openni2_frame_.depthUpdated;
@@ -126,24 +134,29 @@ void RgbdInput::read(InputBuffer* buffer,
     uint32_t stream_id;
     int64_t timestamp_ns;
     int32_t frame_index;
-    Array1DReadView<uint8_t> src = file_input_stream_->read(
-      stream_id, frame_index, timestamp_ns);
+    Array1DReadView<uint8_t> src;
+    if (compressed_input_stream_ != nullptr) {
+      if (compressed_input_stream_->Read(&compressed_frame_)) {
+        stream_id = compressed_frame_.stream_id;
+        frame_index = compressed_frame_.frame_index;
+        timestamp_ns = compressed_frame_.timestamp_ns;
+        src = Array1DReadView<uint8_t>(compressed_frame_.data.data(),
+          compressed_frame_.data.size());
+      }
+    } else {
+      src = file_input_stream_->read(stream_id, frame_index, timestamp_ns);
+    }
 
     if (src.notNull()) {
       if (stream_id == color_stream_id_) {
         Array2DReadView<uint8x3> src_rgb(
           src.pointer(), color_metadata_.size);
-        // Copy the buffer, flipping it upside down for OpenGL.
-        copy<uint8x3>(src_rgb, flipY(buffer->color_rgb.writeView()));
-        // Convert RGB to BGR for OpenCV.
-        RGBToBGR(src_rgb, buffer->color_bgr_ydown.writeView());
+        // Copy once: consumers derive the flipped and swizzled views lazily.
+        copy<uint8x3>(src_rgb, buffer->color_rgb_ydown.writeView());
+        buffer->ColorUpdated();
         buffer->color_timestamp_ns = timestamp_ns;
         buffer->color_frame_index = frame_index;
-
-        //RGBToBGR(src_rgb, buffer->color_bgr_ydown.writeView());
-        //bool succeeded = copy(src_rgb, flipY(buffer->color_rgb.writeView()));
         *rgb_updated = true;
-        // *rgb_updated = succeeded;
       } else if (stream_id == raw_depth_stream_id_ ) {
         buffer->depth_timestamp_ns = timestamp_ns;
         buffer->depth_frame_index = frame_index;
@@ -151,14 +164,17 @@ void RgbdInput::read(InputBuffer* buffer,
         if (depth_metadata_.format == PixelFormat::DEPTH_MM_U16) {
           Array2DReadView<uint16_t> src_depth(src.pointer(),
             depth_metadata_.size);
-          rawDepthMapToMeters(src_depth, buffer->depth_meters,
-            false);
+          DecodeDepthMillimeters(src_depth, true, depth_range_,
+            buffer->depth_meters, buffer->depth_mm);
+          buffer->depth_mm_valid = true;
           *depth_updated = true;
         } else if(depth_metadata_.format == PixelFormat::DEPTH_M_F32) {
           Array2DReadView<float> src_depth(src.pointer(),
             depth_metadata_.size);
-          bool succeeded = copy(src_depth, buffer->depth_meters.writeView());
-          *depth_updated = succeeded;
+          DecodeDepthMeters(src_depth, false, depth_range_,
+            buffer->depth_meters);
+          buffer->depth_mm_valid = false;
+          *depth_updated = true;
         }
       }
     }
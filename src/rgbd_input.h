@@ -15,13 +15,17 @@
 #define RGBD_INPUT_H
 
 #include <cstdint>
+#include <limits>
 #include <memory>
 
 #include "libcgt/core/common/Array2D.h"
 #include "libcgt/core/common/BasicTypes.h"
+#include "libcgt/core/vecmath/Range1f.h"
 #include "libcgt/camera_wrappers/RGBDStream.h"
 #include "libcgt/camera_wrappers/OpenNI2/OpenNI2Camera.h"
 
+#include "compressed_rgbd_stream.h"
+
 // TODO(jiawen): Figure out a way to forward declare RGBDInputStream.
 
 struct InputBuffer;
@@ -40,15 +44,20 @@ public:
   };
 
   RgbdInput() = default;
-  RgbdInput(InputType input_type, const char* filename);
+
+  // Depth samples outside of depth_range (in meters) are read as 0. Pass the
+  // depth camera's range (CameraParameters::depth_range) so that samples the
+  // camera cannot measure are dropped before they reach the pipeline.
+  RgbdInput(InputType input_type, const char* filename,
+    const Range1f& depth_range);
 
   Vector2i colorSize() const;
   Vector2i depthSize() const;
 
-  // Read one frame. If rgb_updated is set to true, then buffer->color_rgb
-  // will be updated. Likewise, if depth_updated is set to true, then
-  // buffer->depth_meters will be updated. Both might be set to false, in which
-  // case the read failed.
+  // Read one frame. If rgb_updated is set to true, then
+  // buffer->color_rgb_ydown will be updated. Likewise, if depth_updated is
+  // set to true, then buffer->depth_meters will be updated. Both might be set
+  // to false, in which case the read failed.
   //
   // TODO: return a status struct, indicating if end of file is reached.
   void read(InputBuffer* buffer, bool* rgb_updated, bool* depth_updated);
@@ -68,11 +77,19 @@ private:
 
   std::unique_ptr<RGBDInputStream> file_input_stream_;
 
+  // Used instead of file_input_stream_ for compressed (.rgbdz) files.
+  std::unique_ptr<CompressedRgbdInputStream> compressed_input_stream_;
+  // Owns the data of the last frame read from compressed_input_stream_.
+  CompressedRgbdInputStream::Frame compressed_frame_;
+
   int color_stream_id_ = -1;
   StreamMetadata color_metadata_;
 
   int raw_depth_stream_id_ = -1;
   StreamMetadata depth_metadata_;
+
+  Range1f depth_range_ =
+    Range1f::fromMinMax(0.0f, std::numeric_limits<float>::max());
 };
 
 #endif  // RGBD_INPUT_H
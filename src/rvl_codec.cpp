@@ -0,0 +1,215 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "rvl_codec.h"
+
+#include <cstring>
+
+namespace {
+
+// Appends 4-bit nibbles, most significant first, to 32-bit words.
+class NibbleWriter {
+ public:
+
+  explicit NibbleWriter(std::vector<uint32_t>* words) :
+    words_(words) {
+  }
+
+  // Each nibble holds 3 bits of value, least significant first, and a
+  // continuation bit.
+  void WriteVLE(uint32_t value) {
+    do {
+      uint32_t nibble = value & 0x7;
+      value >>= 3;
+      if (value != 0) {
+        nibble |= 0x8;
+      }
+      word_ = (word_ << 4) | nibble;
+      if (++num_nibbles_ == 8) {
+        words_->push_back(word_);
+        word_ = 0;
+        num_nibbles_ = 0;
+      }
+    } while (value != 0);
+  }
+
+  void Flush() {
+    if (num_nibbles_ > 0) {
+      words_->push_back(word_ << (4 * (8 - num_nibbles_)));
+      word_ = 0;
+      num_nibbles_ = 0;
+    }
+  }
+
+ private:
+
+  std::vector<uint32_t>* words_;
+  uint32_t word_ = 0;
+  int num_nibbles_ = 0;
+};
+
+class NibbleReader {
+ public:
+
+  NibbleReader(const uint8_t* bytes, size_t num_words) :
+    bytes_(bytes),
+    num_words_(num_words) {
+  }
+
+  // Returns false if the input runs out or the value overflows.
+  bool ReadVLE(uint32_t* value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 3) {
+      if (num_nibbles_ == 0) {
+        if (next_word_ == num_words_) {
+          return false;
+        }
+        // The words may not be aligned within the frame buffer.
+        memcpy(&word_, bytes_ + 4 * next_word_, sizeof(word_));
+        ++next_word_;
+        num_nibbles_ = 8;
+      }
+      uint32_t nibble = word_ >> 28;
+      word_ <<= 4;
+      --num_nibbles_;
+
+      result |= (nibble & 0x7) << shift;
+      if ((nibble & 0x8) == 0) {
+        *value = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+
+  const uint8_t* bytes_;
+  const size_t num_words_;
+  size_t next_word_ = 0;
+  uint32_t word_ = 0;
+  int num_nibbles_ = 0;
+};
+
+}  // namespace
+
+void RvlEncode(Array2DReadView<uint16_t> depth,
+  std::vector<uint8_t>* encoded) {
+  std::vector<uint32_t> words;
+  // Typical depth maps compress to well under half of their raw size.
+  words.reserve(depth.numElements() / 4);
+  NibbleWriter writer(&words);
+
+  const int width = depth.width();
+  const int height = depth.height();
+  int x = 0;
+  int y = 0;
+  auto at_end = [&] { return y == height; };
+  auto current = [&] { return depth.rowPointer(y)[x]; };
+  auto advance = [&] {
+    if (++x == width) {
+      x = 0;
+      ++y;
+    }
+  };
+
+  int previous = 0;
+  while (!at_end()) {
+    uint32_t num_zeros = 0;
+    for (; !at_end() && current() == 0; advance()) {
+      ++num_zeros;
+    }
+    writer.WriteVLE(num_zeros);
+
+    // Count the run of nonzeros without consuming it.
+    uint32_t num_nonzeros = 0;
+    {
+      int run_x = x;
+      int run_y = y;
+      while (run_y < height && depth.rowPointer(run_y)[run_x] != 0) {
+        ++num_nonzeros;
+        if (++run_x == width) {
+          run_x = 0;
+          ++run_y;
+        }
+      }
+    }
+    writer.WriteVLE(num_nonzeros);
+
+    for (uint32_t i = 0; i < num_nonzeros; ++i, advance()) {
+      int value = current();
+      int delta = value - previous;
+      // Zigzag: small magnitudes of either sign get small codes.
+      writer.WriteVLE(static_cast<uint32_t>((delta << 1) ^ (delta >> 31)));
+      previous = value;
+    }
+  }
+  writer.Flush();
+
+  encoded->resize(words.size() * sizeof(uint32_t));
+  if (!words.empty()) {
+    memcpy(encoded->data(), words.data(), encoded->size());
+  }
+}
+
+bool RvlDecode(const uint8_t* encoded, size_t num_bytes,
+  Array2DWriteView<uint16_t> depth) {
+  if (num_bytes % sizeof(uint32_t) != 0) {
+    return false;
+  }
+  NibbleReader reader(encoded, num_bytes / sizeof(uint32_t));
+
+  const int width = depth.width();
+  int64_t remaining = static_cast<int64_t>(depth.numElements());
+  int x = 0;
+  int y = 0;
+  auto write = [&](uint16_t value) {
+    depth.rowPointer(y)[x] = value;
+    if (++x == width) {
+      x = 0;
+      ++y;
+    }
+  };
+
+  int previous = 0;
+  while (remaining > 0) {
+    uint32_t num_zeros;
+    uint32_t num_nonzeros;
+    if (!reader.ReadVLE(&num_zeros) || num_zeros > remaining) {
+      return false;
+    }
+    remaining -= num_zeros;
+    for (uint32_t i = 0; i < num_zeros; ++i) {
+      write(0);
+    }
+
+    if (!reader.ReadVLE(&num_nonzeros) || num_nonzeros > remaining) {
+      return false;
+    }
+    remaining -= num_nonzeros;
+    for (uint32_t i = 0; i < num_nonzeros; ++i) {
+      uint32_t zigzag;
+      if (!reader.ReadVLE(&zigzag)) {
+        return false;
+      }
+      int delta = static_cast<int>(zigzag >> 1) ^ -static_cast<int>(zigzag & 1);
+      int value = previous + delta;
+      if (value <= 0 || value > 0xffff) {
+        return false;
+      }
+      write(static_cast<uint16_t>(value));
+      previous = value;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,38 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef RVL_CODEC_H
+#define RVL_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "libcgt/core/common/Array2D.h"
+
+// Lossless compression for 16-bit depth maps: run length encoding of zeros
+// (invalid pixels) and variable length encoding of the zigzagged deltas
+// between consecutive valid pixels, in 3-bit nibbles packed into 32-bit
+// words. From Wilson, "Fast Lossless Depth Image Compression", ISS 2017.
+//
+// Pixels are visited in row-major order; runs continue across rows.
+
+// Replaces the contents of encoded.
+void RvlEncode(Array2DReadView<uint16_t> depth, std::vector<uint8_t>* encoded);
+
+// depth must be the size of the encoded image. Returns false if encoded is
+// truncated or does not describe exactly depth.numElements() pixels.
+bool RvlDecode(const uint8_t* encoded, size_t num_bytes,
+  Array2DWriteView<uint16_t> depth);
+
+#endif  // RVL_CODEC_H
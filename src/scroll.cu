@@ -0,0 +1,57 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "scroll.h"
+
+namespace {
+  constexpr int kBrickSize = BrickVoxelLayout::kBrickSize;
+
+  // The grid subscript of this thread's voxel in brick b of the slab.
+  __inline__ __device__
+  int3 SlabVoxel(int b, int3 slab_origin, int3 slab_size) {
+    int3 brick = make_int3(
+      b % slab_size.x,
+      (b / slab_size.x) % slab_size.y,
+      b / (slab_size.x * slab_size.y));
+    return make_int3(
+      kBrickSize * (slab_origin.x + brick.x) + threadIdx.x,
+      kBrickSize * (slab_origin.y + brick.y) + threadIdx.y,
+      kBrickSize * (slab_origin.z + brick.z) + threadIdx.z);
+  }
+
+  // The index of this thread's voxel within its brick.
+  __inline__ __device__
+  int BrickVoxelIndex() {
+    return threadIdx.x + kBrickSize * (threadIdx.y + kBrickSize * threadIdx.z);
+  }
+}
+
+__global__
+void GatherBricksKernel(ConstTSDFGridView regular_grid,
+  int3 slab_origin,
+  int3 slab_size,
+  KernelArray2D<TSDF> bricks) {
+  int b = blockIdx.x;
+  int3 xyz = SlabVoxel(b, slab_origin, slab_size);
+  bricks[{ BrickVoxelIndex(), b }] = regular_grid[xyz];
+}
+
+__global__
+void ScatterBricksKernel(KernelArray2D<const TSDF> bricks,
+  int3 slab_origin,
+  int3 slab_size,
+  TSDFGridView regular_grid) {
+  int b = blockIdx.x;
+  int3 xyz = SlabVoxel(b, slab_origin, slab_size);
+  regular_grid[xyz] = bricks[{ BrickVoxelIndex(), b }];
+}
@@ -0,0 +1,44 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef SCROLL_H
+#define SCROLL_H
+
+#include <vector_types.h>
+
+#include "libcgt/cuda/KernelArray2D.h"
+
+#include "regular_grid_tsdf.h"
+
+// Copy a box of 8^3 bricks between a grid and a packed array of bricks, one
+// brick per row, each stored x-fastest.
+//
+// slab_origin: the first brick of the box, in bricks.
+// slab_size: the number of bricks in the box along each axis.
+// bricks: slab_size.x * slab_size.y * slab_size.z rows of 512 voxels. Row b
+//   holds brick slab_origin + (b % sx, (b / sx) % sy, b / (sx * sy)).
+//
+// Launch with one block of 8x8x8 threads per brick.
+__global__
+void GatherBricksKernel(ConstTSDFGridView regular_grid,
+  int3 slab_origin,
+  int3 slab_size,
+  KernelArray2D<TSDF> bricks);
+
+__global__
+void ScatterBricksKernel(KernelArray2D<const TSDF> bricks,
+  int3 slab_origin,
+  int3 slab_size,
+  TSDFGridView regular_grid);
+
+#endif // SCROLL_H
@@ -16,6 +16,7 @@
 #include "libcgt/core/common/ArrayUtils.h"
 
 #include "regular_grid_fusion_pipeline.h"
+#include "trace_recorder.h"
 
 using libcgt::core::arrayutils::copy;
 using libcgt::cuda::gl::Texture2D;
@@ -174,50 +175,57 @@ void SingleMovingCameraGLState::Render(const PerspectiveCamera& free_camera) {
 
   // Update buffers.
   InputBuffer& input_buffer = pipeline_->GetInputBuffer();
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::INPUT_COLOR)) {
-    printf("Updating color input vis\n");
-    color_texture_.set(input_buffer.color_rgb);
-  }
-
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::POSE_ESTIMATION_VIS)) {
-    printf("Updating color pose estimation vis\n");
-    color_tracking_vis_texture_.set(
-      pipeline_->GetColorPoseEstimatorVisualization(),
-      GLImageFormat::BGR);
-  }
+  TraceRecorder::SetCurrentFrame(TraceFrame(input_buffer.depth_frame_index,
+    input_buffer.depth_timestamp_ns));
+  ScopedTrace render_trace("Render");
+  {
+    // Copies from the pipeline into GL textures.
+    ScopedTrace upload_trace("Upload");
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::INPUT_COLOR)) {
+      printf("Updating color input vis\n");
+      color_texture_.set(input_buffer.ColorRGB());
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::INPUT_DEPTH)) {
-    depth_texture_.set(input_buffer.depth_meters);
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::POSE_ESTIMATION_VIS)) {
+      printf("Updating color pose estimation vis\n");
+      color_tracking_vis_texture_.set(
+        pipeline_->GetColorPoseEstimatorVisualization(),
+        GLImageFormat::BGR);
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::SMOOTHED_DEPTH)) {
-    auto mr0 = smoothed_depth_tex_.map();
-    copy(pipeline_->SmoothedDepthMeters(), mr0.array());
-    auto mr1 = smoothed_incoming_normals_tex_.map();
-    copy(pipeline_->SmoothedIncomingNormals(), mr1.array());
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::INPUT_DEPTH)) {
+      depth_texture_.set(input_buffer.depth_meters);
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::CAMERA_POSE)) {
-    {
-      auto mr = pose_estimation_vis_tex_.map();
-      copy(pipeline_->PoseEstimationVisualization(), mr.array());
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::SMOOTHED_DEPTH)) {
+      auto mr0 = smoothed_depth_tex_.map();
+      copy(pipeline_->SmoothedDepthMeters(), mr0.array());
+      auto mr1 = smoothed_incoming_normals_tex_.map();
+      copy(pipeline_->SmoothedIncomingNormals(), mr1.array());
     }
 
-    tracked_rgb_camera_.updatePositions(
-      pipeline_->ColorCamera());
-    tracked_depth_camera_.updatePositions(
-      pipeline_->DepthCamera());
-  }
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::CAMERA_POSE)) {
+      {
+        auto mr = pose_estimation_vis_tex_.map();
+        copy(pipeline_->PoseEstimationVisualization(), mr.array());
+      }
+
+      tracked_rgb_camera_.updatePositions(
+        pipeline_->ColorCamera());
+      tracked_depth_camera_.updatePositions(
+        pipeline_->DepthCamera());
+    }
 
-  if (notZero(
-    changed_pipeline_data_type_ & PipelineDataType::RAYCAST_NORMALS)) {
-    auto mr = raycasted_normals_tex_.map();
-    copy(pipeline_->RaycastNormals(), mr.array());
+    if (notZero(
+      changed_pipeline_data_type_ & PipelineDataType::RAYCAST_NORMALS)) {
+      auto mr = raycasted_normals_tex_.map();
+      copy(pipeline_->RaycastNormals(), mr.array());
+    }
   }
 
   DrawInputsAndIntermediates();
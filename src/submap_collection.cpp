@@ -0,0 +1,254 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "submap_collection.h"
+
+#include <algorithm>
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+
+#include "trace_recorder.h"
+
+using libcgt::core::vecmath::inverse;
+using libcgt::core::vecmath::transformPoint;
+using libcgt::core::vecmath::EuclideanTransform;
+using libcgt::core::vecmath::SimilarityTransform;
+
+SubmapCollection::SubmapCollection(const Vector3i& resolution,
+  float voxel_size, int num_workers, int max_submaps) :
+  resolution_(resolution),
+  voxel_size_(voxel_size),
+  max_submaps_(max_submaps),
+  workers_(num_workers) {
+}
+
+SubmapCollection::~SubmapCollection() {
+  Wait();
+}
+
+int SubmapCollection::NumSubmaps() const {
+  return static_cast<int>(submaps_.size());
+}
+
+int SubmapCollection::ActiveSubmap() const {
+  return active_;
+}
+
+int SubmapCollection::AddSubmap(const EuclideanTransform& world_from_anchor,
+  float center_depth) {
+  std::unique_ptr<Submap> submap(new Submap);
+  submap->world_from_anchor = world_from_anchor;
+  submap->anchor_center = Vector3f(0, 0, -center_depth);
+
+  // The camera looks down -z.
+  SimilarityTransform world_from_grid =
+    SimilarityTransform(world_from_anchor) *
+    SimilarityTransform(submap->anchor_center) *
+    SimilarityTransform(voxel_size_) *
+    SimilarityTransform(-0.5f * Vector3f(resolution_));
+  submap->tsdf.reset(new RegularGridTSDF(resolution_, world_from_grid));
+
+  submaps_.push_back(std::move(submap));
+  active_ = NumSubmaps() - 1;
+  return active_;
+}
+
+bool SubmapCollection::ActivateSubmapNear(
+  const EuclideanTransform& camera_from_world, float center_depth) {
+  if (submaps_.empty()) {
+    return false;
+  }
+
+  Vector3f target_world = transformPoint(inverse(camera_from_world),
+    Vector3f(0, 0, -center_depth));
+  float max_distance = 0.25f * voxel_size_ *
+    std::min({ resolution_.x, resolution_.y, resolution_.z });
+  if ((target_world - CenterWorld(*(submaps_[active_]))).norm() <=
+    max_distance) {
+    return true;
+  }
+
+  int nearest = -1;
+  float nearest_distance = 0.0f;
+  for (int i = 0; i < NumSubmaps(); ++i) {
+    float distance = (target_world - CenterWorld(*(submaps_[i]))).norm();
+    if (nearest < 0 || distance < nearest_distance) {
+      nearest = i;
+      nearest_distance = distance;
+    }
+  }
+  if (nearest_distance > max_distance && NumSubmaps() < max_submaps_) {
+    return false;
+  }
+  active_ = nearest;
+  return true;
+}
+
+const EuclideanTransform& SubmapCollection::WorldFromAnchor(
+  int submap) const {
+  return submaps_[submap]->world_from_anchor;
+}
+
+void SubmapCollection::SetWorldFromAnchor(int submap,
+  const EuclideanTransform& world_from_anchor) {
+  Submap* s = submaps_[submap].get();
+  WaitForSubmap(s);
+  s->tsdf->Transform(SimilarityTransform(
+    world_from_anchor * inverse(s->world_from_anchor)));
+  s->world_from_anchor = world_from_anchor;
+}
+
+void SubmapCollection::Fuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_camera_range,
+  const Matrix4f& depth_camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals) {
+  if (submaps_.empty()) {
+    return;
+  }
+
+  Frame* frame = AcquireFrame();
+  if (frame->depth.size() != depth_data.size()) {
+    frame->depth.resize(depth_data.size());
+  }
+  copy(depth_data, frame->depth);
+  bool has_normals = depth_camera_normals != nullptr;
+  if (has_normals) {
+    if (frame->normals.size() != depth_camera_normals->size()) {
+      frame->normals.resize(depth_camera_normals->size());
+    }
+    copy(*depth_camera_normals, frame->normals);
+  }
+  // The copies are on this thread's stream, but the job runs on a worker's:
+  // finish them before the worker reads the frame.
+  cudaStreamSynchronize(cudaStreamPerThread);
+
+  Submap* submap = submaps_[active_].get();
+  TraceFrame trace_frame = TraceRecorder::CurrentFrame();
+  Enqueue(submap, [=] {
+    TraceRecorder::SetCurrentFrame(trace_frame);
+    ScopedTrace trace("SubmapCollection::Fuse");
+    submap->tsdf->Fuse(depth_camera_flpp, depth_camera_range,
+      depth_camera_from_world, frame->depth, noise_model,
+      has_normals ? &(frame->normals) : nullptr);
+    // Finish on the GPU before the frame is reused or the submap read.
+    cudaStreamSynchronize(cudaStreamPerThread);
+    ReleaseFrame(frame);
+  });
+}
+
+void SubmapCollection::Raycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  bool adaptive,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out) {
+  if (submaps_.empty()) {
+    return;
+  }
+
+  Submap* submap = submaps_[active_].get();
+  WaitForSubmap(submap);
+  if (adaptive) {
+    submap->tsdf->AdaptiveRaycast(camera_flpp, world_from_camera,
+      world_points_out, world_normals_out);
+  } else {
+    submap->tsdf->Raycast(camera_flpp, world_from_camera,
+      world_points_out, world_normals_out);
+  }
+}
+
+bool SubmapCollection::IsFusing() const {
+  if (submaps_.empty()) {
+    return false;
+  }
+  const Submap& submap = *(submaps_[active_]);
+  std::lock_guard<std::mutex> lock(submap.mutex);
+  return submap.draining;
+}
+
+void SubmapCollection::Wait() {
+  workers_.Wait();
+}
+
+void SubmapCollection::Merge(RegularGridTSDF* grid) {
+  Wait();
+  for (const auto& submap : submaps_) {
+    grid->FuseGrid(*(submap->tsdf));
+  }
+}
+
+void SubmapCollection::Clear() {
+  Wait();
+  submaps_.clear();
+  active_ = -1;
+}
+
+// static
+Vector3f SubmapCollection::CenterWorld(const Submap& submap) {
+  return transformPoint(submap.world_from_anchor, submap.anchor_center);
+}
+
+void SubmapCollection::Enqueue(Submap* submap, std::function<void()> job) {
+  bool start_draining;
+  {
+    std::lock_guard<std::mutex> lock(submap->mutex);
+    submap->pending.push_back(std::move(job));
+    start_draining = !submap->draining;
+    submap->draining = true;
+  }
+  if (start_draining) {
+    workers_.Enqueue([this, submap] { Drain(submap); });
+  }
+}
+
+void SubmapCollection::Drain(Submap* submap) {
+  std::unique_lock<std::mutex> lock(submap->mutex);
+  while (!submap->pending.empty()) {
+    std::function<void()> job = std::move(submap->pending.front());
+    submap->pending.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+  submap->draining = false;
+  submap->idle_cv.notify_all();
+}
+
+void SubmapCollection::WaitForSubmap(Submap* submap) {
+  std::unique_lock<std::mutex> lock(submap->mutex);
+  submap->idle_cv.wait(lock, [submap] { return !submap->draining; });
+}
+
+SubmapCollection::Frame* SubmapCollection::AcquireFrame() {
+  std::unique_lock<std::mutex> lock(frames_mutex_);
+  if (free_frames_.empty() &&
+    static_cast<int>(frames_.size()) < kMaxQueuedFrames) {
+    frames_.emplace_back(new Frame);
+    return frames_.back().get();
+  }
+  frame_released_cv_.wait(lock, [this] { return !free_frames_.empty(); });
+  Frame* frame = free_frames_.back();
+  free_frames_.pop_back();
+  return frame;
+}
+
+void SubmapCollection::ReleaseFrame(Frame* frame) {
+  {
+    std::lock_guard<std::mutex> lock(frames_mutex_);
+    free_frames_.push_back(frame);
+  }
+  frame_released_cv_.notify_one();
+}
@@ -0,0 +1,181 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef SUBMAP_COLLECTION_H
+#define SUBMAP_COLLECTION_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "depth_noise_model.h"
+#include "regular_grid_tsdf.h"
+#include "thread_pool.h"
+
+// A scan split into submaps: spatially bounded TSDFs, each anchored to the
+// camera pose it was started from. Frames are fused into the active submap.
+// When the camera moves on, an existing submap that covers the new view is
+// reactivated before a new one is started, and there are at most
+// max_submaps of them.
+//
+// Fusion is asynchronous. Each submap fuses its frames in order, but
+// different submaps fuse concurrently on a pool of worker threads. A
+// submap's grid moves rigidly with its anchor, so correcting an anchor's
+// pose (e.g., after a loop closure) does not re-fuse any voxels. Merge()
+// blends every submap into one grid for output.
+//
+// Not thread safe: call every method from the same thread.
+class SubmapCollection {
+ public:
+
+  using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
+
+  // resolution, voxel_size: of each submap's grid.
+  // num_workers: the number of submaps that can fuse concurrently.
+  // max_submaps: once there are this many, the nearest one is reused.
+  SubmapCollection(const Vector3i& resolution, float voxel_size,
+    int num_workers, int max_submaps);
+  ~SubmapCollection();
+
+  int NumSubmaps() const;
+
+  // The submap that Fuse() writes to, or -1 if there is none.
+  int ActiveSubmap() const;
+
+  // Start a new submap and make it active. Its grid is axis aligned with
+  // the anchor camera and centered center_depth meters in front of it.
+  // Returns its index.
+  int AddSubmap(const EuclideanTransform& world_from_anchor,
+    float center_depth);
+
+  // Make a submap that covers the point center_depth meters in front of the
+  // camera active: the active submap if its center is within a quarter of
+  // the shortest side length of the point, otherwise the submap whose
+  // center is nearest to it, if that is within the same distance or there
+  // are already max_submaps. Returns false if the caller should AddSubmap()
+  // instead.
+  bool ActivateSubmapNear(const EuclideanTransform& camera_from_world,
+    float center_depth);
+
+  const EuclideanTransform& WorldFromAnchor(int submap) const;
+
+  // Move submap rigidly so that its anchor is world_from_anchor. Waits for
+  // the frames queued for it.
+  void SetWorldFromAnchor(int submap,
+    const EuclideanTransform& world_from_anchor);
+
+  // Queue a frame for fusion into the active submap and return. Same
+  // arguments as RegularGridTSDF::Fuse(). depth_data and
+  // depth_camera_normals are copied, so the caller may overwrite them.
+  // Blocks if too many frames are already queued.
+  void Fuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model,
+    const DeviceArray2D<float4>* depth_camera_normals);
+
+  // Wait for the frames queued for the active submap, then raycast it. To
+  // overlap fusion with other work, raycast as late as possible after
+  // Fuse().
+  // adaptive: use RegularGridTSDF::AdaptiveRaycast() instead of Raycast().
+  void Raycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    bool adaptive,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out);
+
+  // Whether frames are queued for the active submap.
+  bool IsFusing() const;
+
+  // Wait for every queued frame.
+  void Wait();
+
+  // Wait, then blend every submap into grid (see
+  // RegularGridTSDF::FuseGrid()). grid is not reset first.
+  void Merge(RegularGridTSDF* grid);
+
+  // Wait, then delete every submap.
+  void Clear();
+
+ private:
+
+  // The maximum number of frames queued across all submaps.
+  static constexpr int kMaxQueuedFrames = 8;
+
+  struct Submap {
+    std::unique_ptr<RegularGridTSDF> tsdf;
+    EuclideanTransform world_from_anchor;
+    // The center of the grid, in the anchor's frame.
+    Vector3f anchor_center;
+
+    // Guards the fields below.
+    mutable std::mutex mutex;
+    // Signaled when the submap stops draining.
+    std::condition_variable idle_cv;
+    // Fusion jobs, in order.
+    std::deque<std::function<void()>> pending;
+    // Whether a worker is running Drain() on it.
+    bool draining = false;
+  };
+
+  // A copy of one frame's input.
+  struct Frame {
+    DeviceArray2D<float> depth;
+    DeviceArray2D<float4> normals;
+  };
+
+  // Append a job to submap's queue, and have a worker drain it if none is.
+  void Enqueue(Submap* submap, std::function<void()> job);
+
+  // Runs on a worker: run submap's jobs until there are none.
+  void Drain(Submap* submap);
+
+  void WaitForSubmap(Submap* submap);
+
+  // Take a free frame, allocating one if there are fewer than
+  // kMaxQueuedFrames, and waiting for one otherwise.
+  Frame* AcquireFrame();
+  void ReleaseFrame(Frame* frame);
+
+  // The center of submap's grid, in world space.
+  static Vector3f CenterWorld(const Submap& submap);
+
+  const Vector3i resolution_;
+  const float voxel_size_;
+  const int max_submaps_;
+
+  std::vector<std::unique_ptr<Submap>> submaps_;
+  int active_ = -1;
+
+  std::mutex frames_mutex_;
+  std::condition_variable frame_released_cv_;
+  std::vector<std::unique_ptr<Frame>> frames_;
+  std::vector<Frame*> free_frames_;
+
+  // Last, so that it is destroyed, finishing every job, before the rest.
+  ThreadPool workers_;
+};
+
+#endif  // SUBMAP_COLLECTION_H
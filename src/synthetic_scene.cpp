@@ -0,0 +1,238 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "synthetic_scene.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Sphere tracing stops when the distance to the surface is below this, in
+// meters.
+constexpr float kHitEpsilon = 1e-4f;
+constexpr int kMaxSphereTracingSteps = 256;
+
+// Camera motion per frame.
+constexpr float kOrbitRadiansPerFrame = 0.05f;
+constexpr float kRoomRadiansPerFrame = 0.035f;
+
+float SphereDistance(float3 p, float3 center, float radius) {
+  return length(p - center) - radius;
+}
+
+float BoxDistance(float3 p, float3 center, float3 half_size) {
+  float3 q = fabs(p - center) - half_size;
+  return length(fmaxf(q, make_float3(0.0f))) +
+    std::min(std::max(q.x, std::max(q.y, q.z)), 0.0f);
+}
+
+// A box rotated by angle radians about the y axis through its center.
+float RotatedBoxDistance(float3 p, float3 center, float3 half_size,
+  float angle) {
+  float3 d = p - center;
+  float c = cosf(angle);
+  float s = sinf(angle);
+  float3 local = make_float3(c * d.x - s * d.z, d.y, s * d.x + c * d.z);
+  return BoxDistance(local, make_float3(0.0f), half_size);
+}
+
+}  // namespace
+
+RigidTransform RigidTransform::Inverse() const {
+  RigidTransform inverse;
+  inverse.x_axis = make_float3(x_axis.x, y_axis.x, z_axis.x);
+  inverse.y_axis = make_float3(x_axis.y, y_axis.y, z_axis.y);
+  inverse.z_axis = make_float3(x_axis.z, y_axis.z, z_axis.z);
+  inverse.origin = -inverse.TransformVector(origin);
+  return inverse;
+}
+
+float RigidTransform::Angle() const {
+  float trace = x_axis.x + y_axis.y + z_axis.z;
+  return acosf(std::min(std::max(0.5f * (trace - 1.0f), -1.0f), 1.0f));
+}
+
+Matrix4f RigidTransform::AsMatrix() const {
+  Matrix4f m = Matrix4f::identity();
+  m.setRow(0, Vector4f{ x_axis.x, y_axis.x, z_axis.x, origin.x });
+  m.setRow(1, Vector4f{ x_axis.y, y_axis.y, z_axis.y, origin.y });
+  m.setRow(2, Vector4f{ x_axis.z, y_axis.z, z_axis.z, origin.z });
+  return m;
+}
+
+RigidTransform operator * (const RigidTransform& lhs,
+  const RigidTransform& rhs) {
+  return{ lhs.TransformVector(rhs.x_axis), lhs.TransformVector(rhs.y_axis),
+    lhs.TransformVector(rhs.z_axis), lhs.TransformPoint(rhs.origin) };
+}
+
+RigidTransform LookAt(float3 eye, float3 target) {
+  float3 back = normalize(eye - target);
+  float3 right = normalize(cross(make_float3(0, 1, 0), back));
+  float3 up = cross(back, right);
+  return{ right, up, back, eye };
+}
+
+SyntheticCamera MakeSyntheticCamera(const RigidTransform& world_from_camera,
+  int width, int height) {
+  SyntheticCamera camera;
+  camera.world_from_camera = world_from_camera;
+  camera.focal_length = 0.8f * width;
+  camera.principal_point = make_float2(0.5f * width, 0.5f * height);
+  return camera;
+}
+
+float SyntheticScene::Distance(float3 p) const {
+  switch (type) {
+  case Type::kSphere:
+    return SphereDistance(p, make_float3(0.0f), 0.6f);
+  case Type::kSpheres: {
+    float d = p.y + 0.5f;  // The floor.
+    d = std::min(d, SphereDistance(p, make_float3(0.0f, -0.1f, 0.0f), 0.4f));
+    d = std::min(d,
+      SphereDistance(p, make_float3(0.45f, -0.3f, 0.35f), 0.2f));
+    d = std::min(d,
+      SphereDistance(p, make_float3(-0.5f, -0.25f, 0.3f), 0.25f));
+    d = std::min(d,
+      SphereDistance(p, make_float3(0.15f, 0.45f, -0.4f), 0.18f));
+    return d;
+  }
+  case Type::kBoxes: {
+    float d = p.y + 0.5f;  // The floor.
+    d = std::min(d, BoxDistance(p, make_float3(0.0f, -0.2f, 0.0f),
+      make_float3(0.3f, 0.3f, 0.3f)));
+    d = std::min(d, BoxDistance(p, make_float3(0.5f, -0.35f, 0.4f),
+      make_float3(0.15f, 0.15f, 0.15f)));
+    d = std::min(d, RotatedBoxDistance(p, make_float3(-0.45f, -0.1f, -0.3f),
+      make_float3(0.12f, 0.4f, 0.2f), 0.5f));
+    d = std::min(d, RotatedBoxDistance(p, make_float3(0.35f, 0.25f, -0.1f),
+      make_float3(0.2f, 0.05f, 0.2f), 0.8f));
+    return d;
+  }
+  case Type::kRoom: {
+    // The inside of a 4 x 2.5 x 4 m room, with some furniture.
+    float d = -BoxDistance(p, make_float3(0.0f, 1.25f, 0.0f),
+      make_float3(2.0f, 1.25f, 2.0f));
+    d = std::min(d, BoxDistance(p, make_float3(0.6f, 0.375f, -0.9f),
+      make_float3(0.6f, 0.375f, 0.4f)));
+    d = std::min(d,
+      SphereDistance(p, make_float3(0.6f, 0.95f, -0.9f), 0.2f));
+    d = std::min(d, BoxDistance(p, make_float3(-1.6f, 0.9f, 0.5f),
+      make_float3(0.35f, 0.9f, 0.6f)));
+    d = std::min(d, BoxDistance(p, make_float3(1.3f, 1.25f, 1.3f),
+      make_float3(0.15f, 1.25f, 0.15f)));
+    d = std::min(d, BoxDistance(p, make_float3(-0.7f, 0.25f, -1.2f),
+      make_float3(0.25f, 0.25f, 0.25f)));
+    d = std::min(d,
+      SphereDistance(p, make_float3(0.0f, 0.4f, 0.9f), 0.4f));
+    return d;
+  }
+  }
+  return 0.0f;
+}
+
+RigidTransform SyntheticScene::Orbit(float theta) const {
+  switch (type) {
+  case Type::kSphere:
+    return LookAt(make_float3(1.8f * sinf(theta), 0.3f, 1.8f * cosf(theta)),
+      make_float3(0.0f));
+  case Type::kRoom:
+    // Walk a circle around the middle of the room, looking across it. A
+    // camera facing a single wall would not constrain motion along it.
+    return LookAt(make_float3(1.2f * sinf(theta), 1.6f, 1.2f * cosf(theta)),
+      make_float3(0.0f, 0.5f, 0.0f));
+  default:
+    // Orbit the objects from above.
+    return LookAt(make_float3(1.8f * sinf(theta), 0.6f, 1.8f * cosf(theta)),
+      make_float3(0.0f, -0.2f, 0.0f));
+  }
+}
+
+RigidTransform SyntheticScene::Pose(int i) const {
+  return Orbit(
+    (type == Type::kRoom ? kRoomRadiansPerFrame : kOrbitRadiansPerFrame) * i);
+}
+
+bool MakeSyntheticScene(const std::string& name, SyntheticScene* scene) {
+  scene->name = name;
+  scene->grid_center = make_float3(0.0f);
+  scene->grid_half_extent = 1.0f;
+  if (name == "sphere") {
+    scene->type = SyntheticScene::Type::kSphere;
+  } else if (name == "spheres") {
+    scene->type = SyntheticScene::Type::kSpheres;
+  } else if (name == "boxes") {
+    scene->type = SyntheticScene::Type::kBoxes;
+  } else if (name == "room") {
+    scene->type = SyntheticScene::Type::kRoom;
+    scene->grid_center = make_float3(0.0f, 1.25f, 0.0f);
+    scene->grid_half_extent = 2.1f;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+GaussianNoise::GaussianNoise(uint32_t seed) :
+  engine_(seed) {
+}
+
+float GaussianNoise::Next() {
+  // Box-Muller, with u1 in (0, 1].
+  double u1 = (engine_() + 1.0) / 4294967296.0;
+  double u2 = engine_() / 4294967296.0;
+  return static_cast<float>(
+    sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+Array2D<float> RenderDepth(const SyntheticScene& scene,
+  const SyntheticCamera& camera, int width, int height,
+  const Range1f& depth_range, float noise_stddev, GaussianNoise* noise) {
+  Array2D<float> depth({ width, height });
+  const float3 eye = camera.world_from_camera.origin;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float3 ray = camera.Ray(x, y);
+      // Since ray's camera-space z is -1, depth = t / |ray|.
+      float scale = length(ray);
+      float3 dir = ray / scale;
+      float t = 0.0f;
+      float d = 0.0f;
+      bool hit = false;
+      for (int i = 0; i < kMaxSphereTracingSteps; ++i) {
+        float s = scene.Distance(eye + t * dir);
+        if (s < kHitEpsilon) {
+          hit = true;
+          break;
+        }
+        t += s;
+        if (t > depth_range.right() * scale) {
+          break;
+        }
+      }
+      if (hit) {
+        d = t / scale;
+        if (d >= depth_range.left() && d <= depth_range.right()) {
+          if (noise != nullptr) {
+            d += noise_stddev * d * d * noise->Next();
+          }
+        } else {
+          d = 0.0f;
+        }
+      }
+      depth[{ x, y }] = d;
+    }
+  }
+  return depth;
+}
@@ -0,0 +1,156 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef SYNTHETIC_SCENE_H
+#define SYNTHETIC_SCENE_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+#include <helper_math.h>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+
+// Deterministic synthetic input for the benchmarks: analytic scenes, camera
+// paths through them, and depth frames rendered from them.
+
+// A rigid transformation: the images of the x, y and z axes, and of the
+// origin.
+struct RigidTransform {
+  float3 x_axis;
+  float3 y_axis;
+  float3 z_axis;
+  float3 origin;
+
+  static RigidTransform Identity() {
+    return{ make_float3(1, 0, 0), make_float3(0, 1, 0), make_float3(0, 0, 1),
+      make_float3(0, 0, 0) };
+  }
+
+  float3 TransformVector(float3 v) const {
+    return v.x * x_axis + v.y * y_axis + v.z * z_axis;
+  }
+
+  float3 TransformPoint(float3 p) const {
+    return origin + TransformVector(p);
+  }
+
+  RigidTransform Inverse() const;
+
+  // The rotation angle, in radians.
+  float Angle() const;
+
+  Matrix4f AsMatrix() const;
+};
+
+RigidTransform operator * (const RigidTransform& lhs,
+  const RigidTransform& rhs);
+
+// Camera looking from eye towards target, y up.
+RigidTransform LookAt(float3 eye, float3 target);
+
+// A pinhole camera looking down -z, y up, with half-integer pixel centers,
+// as in camera_math.cuh.
+struct SyntheticCamera {
+  RigidTransform world_from_camera;
+  float focal_length;
+  float2 principal_point;
+
+  // The camera intrinsics as (focal length x, y, principal point x, y).
+  Vector4f Flpp() const {
+    return{ focal_length, focal_length, principal_point.x,
+      principal_point.y };
+  }
+
+  float3 CameraFromPixel(int x, int y, float depth) const {
+    return make_float3(
+      (x + 0.5f - principal_point.x) * depth / focal_length,
+      (y + 0.5f - principal_point.y) * depth / focal_length,
+      -depth);
+  }
+
+  // Ray direction through pixel center xy, in world space, scaled such that
+  // its camera-space z is -1.
+  float3 Ray(int x, int y) const {
+    return world_from_camera.TransformVector(CameraFromPixel(x, y, 1.0f));
+  }
+};
+
+// A camera of a width x height image, with a horizontal field of view of
+// about 64 degrees.
+SyntheticCamera MakeSyntheticCamera(const RigidTransform& world_from_camera,
+  int width, int height);
+
+// An analytic scene: the signed distance to its surface, positive in free
+// space, and a camera path through it.
+struct SyntheticScene {
+  enum class Type {
+    // A single sphere at the origin.
+    kSphere,
+    // Spheres on a floor.
+    kSpheres,
+    // Boxes, some of them rotated, on a floor.
+    kBoxes,
+    // The inside of a room, with some furniture.
+    kRoom
+  };
+
+  std::string name;
+  Type type;
+
+  // An axis aligned cube that bounds the scene, for the TSDF grid.
+  float3 grid_center;
+  float grid_half_extent;
+
+  float Distance(float3 p) const;
+
+  // The camera path is a circle. Orbit() is the world_from_camera of the
+  // camera at angle theta along it, in radians, and Pose(i) is that of
+  // frame i, assuming motion small enough for ICP to track, like a handheld
+  // camera at 30 Hz.
+  RigidTransform Orbit(float theta) const;
+  RigidTransform Pose(int i) const;
+};
+
+// name is sphere, spheres, boxes or room. Returns false if it is none of
+// those.
+bool MakeSyntheticScene(const std::string& name, SyntheticScene* scene);
+
+// Zero-mean, unit variance Gaussian samples that are identical on every
+// platform, unlike std::normal_distribution.
+class GaussianNoise {
+public:
+
+  explicit GaussianNoise(uint32_t seed);
+
+  float Next();
+
+private:
+
+  std::mt19937 engine_;
+};
+
+// Depth (in meters, positive) of the scene seen from camera, rendered by
+// sphere tracing, and 0 where nothing is hit within depth_range.
+//
+// If noise is not null, noise with standard deviation noise_stddev * d^2 is
+// added to each valid pixel of depth d.
+Array2D<float> RenderDepth(const SyntheticScene& scene,
+  const SyntheticCamera& camera, int width, int height,
+  const Range1f& depth_range, float noise_stddev, GaussianNoise* noise);
+
+#endif  // SYNTHETIC_SCENE_H
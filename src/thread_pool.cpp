@@ -0,0 +1,78 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "thread_pool.h"
+
+#include <cassert>
+
+ThreadPool::ThreadPool(int num_threads) {
+  assert(num_threads >= 1);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+int ThreadPool::NumThreads() const {
+  return static_cast<int>(threads_.size());
+}
+
+void ThreadPool::Enqueue(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  task_cv_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this] {
+    return tasks_.empty() && num_running_ == 0;
+  });
+}
+
+void ThreadPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    task_cv_.wait(lock, [this] {
+      return stopping_ || !tasks_.empty();
+    });
+    // Drain the queue before stopping.
+    if (tasks_.empty()) {
+      return;
+    }
+
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    ++num_running_;
+    lock.unlock();
+    task();
+    lock.lock();
+    --num_running_;
+
+    if (tasks_.empty() && num_running_ == 0) {
+      idle_cv_.notify_all();
+    }
+  }
+}
@@ -0,0 +1,62 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run tasks in the order they were
+// enqueued. The destructor finishes every queued task before returning.
+//
+// All methods are thread safe, and tasks may enqueue more tasks.
+class ThreadPool {
+ public:
+
+  // num_threads: at least 1.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool& copy) = delete;
+  ThreadPool& operator = (const ThreadPool& copy) = delete;
+
+  int NumThreads() const;
+
+  void Enqueue(std::function<void()> task);
+
+  // Blocks until the queue is empty and no task is running.
+  void Wait();
+
+ private:
+
+  void WorkerLoop();
+
+  std::mutex mutex_;
+  // Signaled when a task is enqueued or the pool is stopping.
+  std::condition_variable task_cv_;
+  // Signaled when the pool becomes idle.
+  std::condition_variable idle_cv_;
+
+  std::deque<std::function<void()>> tasks_;
+  int num_running_ = 0;
+  bool stopping_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+#endif  // THREAD_POOL_H
@@ -0,0 +1,186 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "trace_recorder.h"
+
+#include <cstdio>
+
+#include <cuda_runtime.h>
+
+namespace {
+  thread_local TraceFrame tls_current_frame;
+}
+
+std::atomic<bool> TraceRecorder::enabled_(false);
+thread_local TraceRecorder::ThreadBuffer*
+  TraceRecorder::current_thread_buffer_ = nullptr;
+
+constexpr int TraceRecorder::ThreadBuffer::kChunkSize;
+constexpr int TraceRecorder::ThreadBuffer::kMaxChunks;
+
+TraceRecorder::ThreadBuffer::ThreadBuffer(int id) :
+  id(id),
+  size(0),
+  num_dropped(0) {
+  for (int i = 0; i < kMaxChunks; ++i) {
+    chunks[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+TraceRecorder::ThreadBuffer::~ThreadBuffer() {
+  for (int i = 0; i < kMaxChunks; ++i) {
+    delete[] chunks[i].load(std::memory_order_relaxed);
+  }
+}
+
+void TraceRecorder::ThreadBuffer::Append(const Event& event) {
+  int64_t index = size.load(std::memory_order_relaxed);
+  int64_t chunk_index = index / kChunkSize;
+  if (chunk_index >= kMaxChunks) {
+    num_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  Event* chunk = chunks[chunk_index].load(std::memory_order_relaxed);
+  if (chunk == nullptr) {
+    chunk = new Event[kChunkSize];
+    chunks[chunk_index].store(chunk, std::memory_order_release);
+  }
+  chunk[index % kChunkSize] = event;
+  size.store(index + 1, std::memory_order_release);
+}
+
+// static
+TraceRecorder& TraceRecorder::Instance() {
+  static TraceRecorder instance;
+  return instance;
+}
+
+TraceRecorder::TraceRecorder() :
+  epoch_(std::chrono::steady_clock::now()) {
+}
+
+// static
+TraceFrame TraceRecorder::CurrentFrame() {
+  return tls_current_frame;
+}
+
+// static
+void TraceRecorder::SetCurrentFrame(const TraceFrame& frame) {
+  tls_current_frame = frame;
+}
+
+void TraceRecorder::Start() {
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void TraceRecorder::Stop() {
+  enabled_.store(false, std::memory_order_relaxed);
+}
+
+void TraceRecorder::SetThreadName(const std::string& name) {
+  ThreadBuffer* buffer = CurrentThreadBuffer();
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer->name = name;
+}
+
+int64_t TraceRecorder::NowNanoseconds() const {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - epoch_).count();
+}
+
+void TraceRecorder::Record(const char* name, int64_t start_ns,
+  int64_t end_ns) {
+  if (!Enabled()) {
+    return;
+  }
+  CurrentThreadBuffer()->Append(
+    Event{ name, start_ns, end_ns - start_ns, tls_current_frame });
+}
+
+bool TraceRecorder::WriteChromeTrace(const std::string& filename) const {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing.\n", filename.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  const char* separator = "";
+  int64_t num_dropped = 0;
+  for (const auto& buffer : buffers_) {
+    std::string thread_name = buffer->name.empty() ?
+      "thread " + std::to_string(buffer->id) : buffer->name;
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+      "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+      separator, buffer->id, thread_name.c_str());
+    separator = ",\n";
+
+    int64_t size = buffer->size.load(std::memory_order_acquire);
+    for (int64_t i = 0; i < size; ++i) {
+      const Event* chunk = buffer->chunks[i / ThreadBuffer::kChunkSize].load(
+        std::memory_order_acquire);
+      const Event& event = chunk[i % ThreadBuffer::kChunkSize];
+      // Times are in microseconds.
+      fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"frame\":%d,\"timestamp_ns\":%lld}}",
+        separator, event.name, buffer->id,
+        event.start_ns * 1e-3, event.duration_ns * 1e-3,
+        event.frame.frame_index,
+        static_cast<long long>(event.frame.timestamp_ns));
+    }
+    num_dropped += buffer->num_dropped.load(std::memory_order_relaxed);
+  }
+  fprintf(fp, "\n]}\n");
+
+  if (num_dropped > 0) {
+    fprintf(stderr, "Trace buffers were full: dropped %lld events.\n",
+      static_cast<long long>(num_dropped));
+  }
+
+  bool succeeded = !ferror(fp);
+  fclose(fp);
+  return succeeded;
+}
+
+TraceRecorder::ThreadBuffer* TraceRecorder::CurrentThreadBuffer() {
+  if (current_thread_buffer_ == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(
+      new ThreadBuffer(static_cast<int>(buffers_.size())));
+    current_thread_buffer_ = buffers_.back().get();
+  }
+  return current_thread_buffer_;
+}
+
+ScopedTrace::ScopedTrace(const char* name, bool synchronize_gpu) :
+  name_(name),
+  synchronize_gpu_(synchronize_gpu),
+  enabled_(TraceRecorder::Enabled()),
+  start_ns_(0) {
+  if (enabled_) {
+    start_ns_ = TraceRecorder::Instance().NowNanoseconds();
+  }
+}
+
+ScopedTrace::~ScopedTrace() {
+  if (enabled_) {
+    if (synchronize_gpu_) {
+      cudaStreamSynchronize(cudaStreamPerThread);
+    }
+    TraceRecorder& recorder = TraceRecorder::Instance();
+    recorder.Record(name_, start_ns_, recorder.NowNanoseconds());
+  }
+}
@@ -0,0 +1,140 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The input frame that trace events are attributed to.
+struct TraceFrame {
+  TraceFrame() = default;
+  TraceFrame(int32_t frame_index, int64_t timestamp_ns) :
+    frame_index(frame_index),
+    timestamp_ns(timestamp_ns) {
+  }
+
+  int32_t frame_index = -1;
+  int64_t timestamp_ns = 0;
+};
+
+// Records a timeline of named events from every thread and writes it in the
+// Chrome trace event format, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) can open.
+//
+// Each thread appends to its own buffer without locking, so recording an
+// event costs a clock read and a few stores. When not started, it costs an
+// atomic load. Each event is tagged with the recording thread's current
+// TraceFrame.
+class TraceRecorder {
+ public:
+
+  static TraceRecorder& Instance();
+
+  // Whether Start() has been called without a matching Stop().
+  static bool Enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // The calling thread's current frame: events that it records are
+  // attributed to it.
+  static TraceFrame CurrentFrame();
+  static void SetCurrentFrame(const TraceFrame& frame);
+
+  // Event times are relative to the first call to Instance().
+  void Start();
+  void Stop();
+
+  // Name the calling thread in the trace.
+  void SetThreadName(const std::string& name);
+
+  // The time on the trace's clock.
+  int64_t NowNanoseconds() const;
+
+  // Record an event on the calling thread's timeline. name must outlive the
+  // recorder (e.g., a string literal). Dropped if not Enabled().
+  void Record(const char* name, int64_t start_ns, int64_t end_ns);
+
+  // Write every event recorded so far. Returns false on failure.
+  bool WriteChromeTrace(const std::string& filename) const;
+
+ private:
+
+  struct Event {
+    const char* name;
+    int64_t start_ns;
+    int64_t duration_ns;
+    TraceFrame frame;
+  };
+
+  // Events recorded by one thread, in fixed size chunks so that they never
+  // move. Only the owning thread appends; size is published with release
+  // semantics so that WriteChromeTrace() can read concurrently.
+  struct ThreadBuffer {
+    static constexpr int kChunkSize = 4096;
+    static constexpr int kMaxChunks = 256;
+
+    ThreadBuffer(int id);
+    ~ThreadBuffer();
+
+    void Append(const Event& event);
+
+    const int id;
+    std::string name;  // Guarded by TraceRecorder::mutex_.
+    std::atomic<Event*> chunks[kMaxChunks];
+    std::atomic<int64_t> size;
+    std::atomic<int64_t> num_dropped;
+  };
+
+  TraceRecorder();
+
+  ThreadBuffer* CurrentThreadBuffer();
+
+  static std::atomic<bool> enabled_;
+  static thread_local ThreadBuffer* current_thread_buffer_;
+
+  const std::chrono::steady_clock::time_point epoch_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records an event from its construction to its destruction, if
+// TraceRecorder::Enabled().
+class ScopedTrace {
+ public:
+
+  // synchronize_gpu: wait for the calling thread's CUDA stream before ending
+  // the event, so that it covers the kernels launched in its scope rather
+  // than just the launches. Only while tracing.
+  explicit ScopedTrace(const char* name, bool synchronize_gpu = false);
+  ~ScopedTrace();
+
+  ScopedTrace(const ScopedTrace& copy) = delete;
+  ScopedTrace& operator = (const ScopedTrace& copy) = delete;
+
+ private:
+
+  const char* name_;
+  bool synchronize_gpu_;
+  bool enabled_;
+  int64_t start_ns_;
+};
+
+#endif  // TRACE_RECORDER_H
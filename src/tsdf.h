@@ -14,24 +14,55 @@
 #ifndef TSDF_H
 #define TSDF_H
 
-#include <vector_types.h>
+#include <cmath>
+#include <cstdint>
 
-class TSDF {
+#include <cuda_runtime.h>
+
+// A TSDF voxel: a truncated signed distance and a weight, each stored as an
+// unsigned fixed-point number.
+//
+// DistanceT: uint8_t or uint16_t. Distances in
+//   [-max_tsdf_value, max_tsdf_value] map linearly to [0, kMaxDistanceCode].
+// WeightT: the same size as DistanceT, since a mixed voxel would be padded
+//   to the size of the larger one. Weights are integers.
+// kMaxWeight: weights saturate at this value. Once saturated, the distance
+//   becomes a running average over the last ~kMaxWeight samples instead of
+//   an average over all of them. Each update moves the distance code by
+//   (incoming - old) * w / (kMaxWeight + w), which on an 8-bit distance is
+//   often less than one code: Update then moves it by one code, so a large
+//   kMaxWeight makes the surface follow new measurements slowly, not stop.
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
+class alignas(2 * sizeof(DistanceT)) BasicTSDF {
 public:
 
-  ushort2 encoded_ = ushort2{ 0, 0 };
+  using DistanceType = DistanceT;
+  using WeightType = WeightT;
+
+  static constexpr unsigned int kMaxDistanceCode =
+    static_cast<DistanceT>(-1);
+  static constexpr unsigned int kMaxWeight = kMaxWeightT;
+
+  static_assert(sizeof(DistanceT) == sizeof(WeightT),
+    "DistanceT and WeightT must have the same size.");
+  static_assert(kMaxWeight > 0 &&
+    kMaxWeight <= static_cast<WeightT>(-1),
+    "kMaxWeight must be representable by WeightT.");
+
+  DistanceT distance_ = 0;
+  WeightT weight_ = 0;
 
   __inline__ __device__ __host__
-  TSDF() = default;
+  BasicTSDF() = default;
 
   __inline__ __device__ __host__
-  TSDF(float d, float w, float max_tsdf_value);
+  BasicTSDF(float d, float w, float max_tsdf_value);
 
   __inline__ __device__ __host__
-  TSDF(const TSDF& copy) = default;
+  BasicTSDF(const BasicTSDF& copy) = default;
 
   __inline__ __device__ __host__
-  TSDF& operator = (const TSDF& copy) = default;
+  BasicTSDF& operator = (const BasicTSDF& copy) = default;
 
   __inline__ __device__ __host__
   float2 Get(float max_tsdf_value) const;
@@ -42,51 +73,165 @@ public:
   __inline__ __device__ __host__
   float Weight() const;
 
+  // w is clamped to [0, kMaxWeight].
   __inline__ __device__ __host__
   void Set(float d, float w, float max_tsdf_value);
 
+  // Blends (incoming_d, incoming_w) into the running average. The blend is
+  // done directly on the fixed-point distance, so the existing value is not
+  // decoded. If the incoming distance rounds to a different code but the
+  // blend would round back to the old one, the distance moves by one code
+  // towards it, so repeated samples always converge to their own code.
   __inline__ __device__ __host__
   void Update(float incoming_d, float incoming_w, float max_tsdf_value);
+
+  // Undoes Update(d, w): takes a sample that was previously blended in back
+  // out of the running average. Exact up to rounding, unless the weight
+  // saturated in between. If no weight is left, the voxel is cleared.
+  __inline__ __device__ __host__
+  void Remove(float d, float w, float max_tsdf_value);
+
+private:
+
+  // Maps a distance in [-max_tsdf_value, max_tsdf_value] to
+  // [0, kMaxDistanceCode], without rounding or clamping.
+  __inline__ __device__ __host__
+  static float DistanceToCode(float d, float max_tsdf_value);
+
+  // Round code to the nearest representable value.
+  __inline__ __device__ __host__
+  static DistanceT RoundCode(float code);
+
+  // Round w to the nearest representable value.
+  __inline__ __device__ __host__
+  static WeightT RoundWeight(float w);
 };
 
+// Select the voxel format at compile time with the CMake option
+// DEPTH_FUSION_TSDF_FORMAT. DEPTH_FUSION_TSDF_MAX_WEIGHT, if defined,
+// overrides the saturation weight. Otherwise, d16w16 saturates at the
+// largest weight it can store, and d8w8 at 32, so that the surface keeps
+// following new measurements at a few frames per code.
+#if defined(DEPTH_FUSION_TSDF_FORMAT_D8W8)
+using TSDFDistanceType = uint8_t;
+using TSDFWeightType = uint8_t;
+constexpr unsigned int kDefaultTSDFMaxWeight = 32;
+#else
+using TSDFDistanceType = uint16_t;
+using TSDFWeightType = uint16_t;
+constexpr unsigned int kDefaultTSDFMaxWeight = 65535;
+#endif
+
+#if defined(DEPTH_FUSION_TSDF_MAX_WEIGHT)
+using TSDF = BasicTSDF<TSDFDistanceType, TSDFWeightType,
+  DEPTH_FUSION_TSDF_MAX_WEIGHT>;
+#else
+using TSDF = BasicTSDF<TSDFDistanceType, TSDFWeightType,
+  kDefaultTSDFMaxWeight>;
+#endif
+
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-TSDF::TSDF(float d, float w, float max_tsdf_value) {
+BasicTSDF<DistanceT, WeightT, kMaxWeightT>::BasicTSDF(float d, float w,
+  float max_tsdf_value) {
   Set(d, w, max_tsdf_value);
 }
 
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-float2 TSDF::Get(float max_tsdf_value) const {
+float2 BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Get(
+  float max_tsdf_value) const {
   return{ Distance(max_tsdf_value), Weight() };
 }
 
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-float TSDF::Distance(float max_tsdf_value) const {
-  return (2 * max_tsdf_value * (encoded_.x / 65535.f)) - max_tsdf_value;
+float BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Distance(
+  float max_tsdf_value) const {
+  const float kInvMaxDistanceCode = 1.0f / kMaxDistanceCode;
+  return (2 * max_tsdf_value * kInvMaxDistanceCode) * distance_ -
+    max_tsdf_value;
 }
 
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-float TSDF::Weight() const {
-  return static_cast<float>(encoded_.y);
+float BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Weight() const {
+  return static_cast<float>(weight_);
 }
 
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-void TSDF::Set(float d, float w, float max_tsdf_value) {
-  encoded_ = {
-    static_cast<unsigned short>((d + max_tsdf_value) / (2 * max_tsdf_value) * 65535),
-    static_cast<unsigned short>(w)
-  };
+void BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Set(float d, float w,
+  float max_tsdf_value) {
+  distance_ = RoundCode(DistanceToCode(d, max_tsdf_value));
+  weight_ = RoundWeight(w);
 }
 
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
 __inline__ __device__ __host__
-void TSDF::Update(float incoming_d, float incoming_w, float max_tsdf_value) {
-  float2 old_tsdf = Get(max_tsdf_value);
-  float old_d = old_tsdf.x;
-  float old_w = old_tsdf.y;
-
+void BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Update(float incoming_d,
+  float incoming_w, float max_tsdf_value) {
+  float old_w = static_cast<float>(weight_);
   float new_w = old_w + incoming_w;
-  float new_d = (old_w * old_d + incoming_w * incoming_d) / new_w;
+  if (!(new_w > 0.0f)) {
+    return;
+  }
+
+  float old_code = static_cast<float>(distance_);
+  float incoming_code = DistanceToCode(incoming_d, max_tsdf_value);
+  DistanceT code = RoundCode(
+    old_code + (incoming_code - old_code) * (incoming_w / new_w));
+  // Near saturation, the step is less than half a code whenever the incoming
+  // code is within about kMaxWeight / 2 codes, and rounding it away would
+  // leave a dead band around the old value.
+  DistanceT target = RoundCode(incoming_code);
+  if (code == distance_ && target != distance_ && incoming_w > 0.0f) {
+    code = static_cast<DistanceT>(
+      target > distance_ ? distance_ + 1 : distance_ - 1);
+  }
+  distance_ = code;
+  weight_ = RoundWeight(new_w);
+}
 
-  Set(new_d, new_w, max_tsdf_value);
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
+__inline__ __device__ __host__
+void BasicTSDF<DistanceT, WeightT, kMaxWeightT>::Remove(float d, float w,
+  float max_tsdf_value) {
+  float old_w = static_cast<float>(weight_);
+  float new_w = old_w - w;
+  if (!(new_w >= 0.5f)) {
+    Set(0.0f, 0.0f, max_tsdf_value);
+    return;
+  }
+
+  // Solve old = (new * new_w + code * w) / old_w for new.
+  float old_code = static_cast<float>(distance_);
+  float code = DistanceToCode(d, max_tsdf_value);
+  distance_ = RoundCode(old_code + (old_code - code) * (w / new_w));
+  weight_ = RoundWeight(new_w);
+}
+
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
+__inline__ __device__ __host__
+float BasicTSDF<DistanceT, WeightT, kMaxWeightT>::DistanceToCode(float d,
+  float max_tsdf_value) {
+  return (d / (2 * max_tsdf_value) + 0.5f) * kMaxDistanceCode;
+}
+
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
+__inline__ __device__ __host__
+DistanceT BasicTSDF<DistanceT, WeightT, kMaxWeightT>::RoundCode(
+  float code) {
+  const float kMaxCode = static_cast<float>(kMaxDistanceCode);
+  return static_cast<DistanceT>(
+    fminf(fmaxf(code + 0.5f, 0.0f), kMaxCode));
+}
+
+template <typename DistanceT, typename WeightT, unsigned int kMaxWeightT>
+__inline__ __device__ __host__
+WeightT BasicTSDF<DistanceT, WeightT, kMaxWeightT>::RoundWeight(float w) {
+  const float kMaxW = static_cast<float>(kMaxWeight);
+  return static_cast<WeightT>(fminf(fmaxf(w + 0.5f, 0.0f), kMaxW));
 }
 
 #endif  // TSDF_H
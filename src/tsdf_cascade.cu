@@ -0,0 +1,248 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tsdf_cascade.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#include "libcgt/cuda/MathUtils.h"
+#include "libcgt/cuda/VecmathConversions.h"
+
+#include "marching_cubes.h"
+#include "raycast.h"
+
+using libcgt::core::vecmath::SimilarityTransform;
+
+namespace {
+  // How far, in voxels of the coarser level, a finer level's hit may be
+  // behind the coarser level's and still win. The two surfaces are
+  // reconstructions of the same geometry at different resolutions.
+  constexpr float kMergeToleranceVoxels = 2.0f;
+
+  // Whether the voxel containing world_point in grid has been observed.
+  bool IsObserved(const Array3D<TSDF>& grid,
+    const SimilarityTransform& grid_from_world, const Vector3f& world_point) {
+    Vector3f p = transformPoint(grid_from_world, world_point);
+    int x = static_cast<int>(floorf(p.x));
+    int y = static_cast<int>(floorf(p.y));
+    int z = static_cast<int>(floorf(p.z));
+    if (x < 0 || y < 0 || z < 0 ||
+      x >= grid.size().x || y >= grid.size().y || z >= grid.size().z) {
+      return false;
+    }
+    return grid[{x, y, z}].Weight() > 0;
+  }
+}
+
+TSDFCascade::TSDFCascade(RegularGridTSDF* finest, int num_levels) :
+  finest_(finest) {
+  assert(num_levels >= 1);
+
+  // Level l scales level 0 by 2^l about its center.
+  const Vector3i resolution = finest->Resolution();
+  const Vector3f center = 0.5f * Vector3f(resolution);
+  for (int level = 1; level < num_levels; ++level) {
+    SimilarityTransform world_from_grid = finest->WorldFromGrid() *
+      SimilarityTransform(center) *
+      SimilarityTransform(static_cast<float>(1 << level)) *
+      SimilarityTransform(-center);
+    coarse_levels_.emplace_back(
+      new RegularGridTSDF(resolution, world_from_grid));
+  }
+}
+
+int TSDFCascade::NumLevels() const {
+  return 1 + static_cast<int>(coarse_levels_.size());
+}
+
+const RegularGridTSDF& TSDFCascade::Level(int level) const {
+  return level == 0 ? *finest_ : *(coarse_levels_[level - 1]);
+}
+
+RegularGridTSDF& TSDFCascade::MutableLevel(int level) {
+  return level == 0 ? *finest_ : *(coarse_levels_[level - 1]);
+}
+
+void TSDFCascade::Reset() {
+  for (int level = 0; level < NumLevels(); ++level) {
+    MutableLevel(level).Reset();
+  }
+}
+
+float TSDFCascade::MaxFusionDepth(int level, float focal_length,
+  const DepthNoiseModel& noise_model) const {
+  if (level == NumLevels() - 1) {
+    return std::numeric_limits<float>::infinity();
+  }
+
+  // A pixel covers depth / focal_length meters.
+  float voxel_size = Level(level).VoxelSize();
+  float max_depth = voxel_size * focal_length;
+
+  // Past z_0, sigma grows as sigma_1 * (z - z_0)^2. If even sigma_0 is
+  // larger than a voxel, only the footprint applies.
+  if (noise_model.type == DepthNoiseModel::Type::QUADRATIC &&
+    voxel_size > noise_model.sigma_0 && noise_model.sigma_1 > 0) {
+    max_depth = std::min(max_depth, noise_model.z_0 +
+      sqrtf((voxel_size - noise_model.sigma_0) / noise_model.sigma_1));
+  }
+  return max_depth;
+}
+
+void TSDFCascade::Fuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_camera_range,
+  const Matrix4f& depth_camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals) {
+  Integrate(depth_camera_flpp, depth_camera_range, depth_camera_from_world,
+    depth_data, noise_model, depth_camera_normals, false);
+}
+
+void TSDFCascade::Defuse(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_camera_range,
+  const Matrix4f& depth_camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals) {
+  Integrate(depth_camera_flpp, depth_camera_range, depth_camera_from_world,
+    depth_data, noise_model, depth_camera_normals, true);
+}
+
+void TSDFCascade::Integrate(const Vector4f& depth_camera_flpp,
+  const Range1f& depth_camera_range,
+  const Matrix4f& depth_camera_from_world,
+  const DeviceArray2D<float>& depth_data,
+  const DepthNoiseModel& noise_model,
+  const DeviceArray2D<float4>* depth_camera_normals,
+  bool deintegrate) {
+  for (int level = 0; level < NumLevels(); ++level) {
+    float max_depth = std::min(depth_camera_range.right(),
+      MaxFusionDepth(level, depth_camera_flpp.x, noise_model));
+    if (max_depth <= depth_camera_range.left()) {
+      continue;
+    }
+    Range1f level_range =
+      Range1f::fromMinMax(depth_camera_range.left(), max_depth);
+    if (deintegrate) {
+      MutableLevel(level).Defuse(depth_camera_flpp, level_range,
+        depth_camera_from_world, depth_data, noise_model,
+        depth_camera_normals);
+    } else {
+      MutableLevel(level).Fuse(depth_camera_flpp, level_range,
+        depth_camera_from_world, depth_data, noise_model,
+        depth_camera_normals);
+    }
+  }
+}
+
+void TSDFCascade::RaycastLevel(int level, const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera, bool adaptive,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out) {
+  if (adaptive) {
+    MutableLevel(level).AdaptiveRaycast(camera_flpp, world_from_camera,
+      world_points_out, world_normals_out);
+  } else {
+    MutableLevel(level).Raycast(camera_flpp, world_from_camera,
+      world_points_out, world_normals_out);
+  }
+}
+
+void TSDFCascade::Raycast(const Vector4f& camera_flpp,
+  const Matrix4f& world_from_camera,
+  bool adaptive,
+  DeviceArray2D<float4>& world_points_out,
+  DeviceArray2D<float4>& world_normals_out) {
+  int coarsest = NumLevels() - 1;
+  RaycastLevel(coarsest, camera_flpp, world_from_camera, adaptive,
+    world_points_out, world_normals_out);
+  if (coarsest == 0) {
+    return;
+  }
+
+  if (level_world_points_.size() != world_points_out.size()) {
+    level_world_points_.resize(world_points_out.size());
+    level_world_normals_.resize(world_points_out.size());
+  }
+
+  dim3 block_dim(16, 16, 1);
+  dim3 grid_dim = libcgt::cuda::math::numBins2D(
+    { world_points_out.width(), world_points_out.height() },
+    block_dim
+  );
+  Vector4f eye = world_from_camera * Vector4f(0, 0, 0, 1);
+
+  for (int level = coarsest - 1; level >= 0; --level) {
+    RaycastLevel(level, camera_flpp, world_from_camera, adaptive,
+      level_world_points_, level_world_normals_);
+    MergeRaycastKernel<<<grid_dim, block_dim>>>(
+      level_world_points_.readView(),
+      level_world_normals_.readView(),
+      make_float3(eye.xyz),
+      kMergeToleranceVoxels * Level(level + 1).VoxelSize(),
+      world_points_out.writeView(),
+      world_normals_out.writeView());
+  }
+}
+
+bool TSDFCascade::Recenter(const Vector3f& world_point,
+  int max_offset_bricks, BrickStore* store) {
+  for (int level = 1; level < NumLevels(); ++level) {
+    MutableLevel(level).Recenter(world_point, max_offset_bricks, nullptr);
+  }
+  return finest_->Recenter(world_point, max_offset_bricks, store);
+}
+
+TriangleMesh TSDFCascade::Triangulate() const {
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+  std::vector<Vector3f> level_positions;
+  std::vector<Vector3f> level_normals;
+
+  // Keep the finer level on the host to cull the coarser level against it.
+  Array3D<TSDF> finer;
+  for (int level = 0; level < NumLevels(); ++level) {
+    const RegularGridTSDF& grid = Level(level);
+    Array3D<TSDF> data = grid.CopyToHost();
+    MarchingCubes(
+      HostTSDFGridView<LinearVoxelLayout>(data.readView(),
+        make_int3(data.size())),
+      grid.MaxTSDFValue(), grid.WorldFromGrid(),
+      level_positions, level_normals);
+
+    // Keep a triangle unless the finer level observed all of its vertices.
+    for (size_t i = 0; i + 2 < level_positions.size(); i += 3) {
+      if (level > 0) {
+        const SimilarityTransform& finer_from_world =
+          Level(level - 1).GridFromWorld();
+        if (IsObserved(finer, finer_from_world, level_positions[i]) &&
+          IsObserved(finer, finer_from_world, level_positions[i + 1]) &&
+          IsObserved(finer, finer_from_world, level_positions[i + 2])) {
+          continue;
+        }
+      }
+      positions.insert(positions.end(),
+        level_positions.begin() + i, level_positions.begin() + i + 3);
+      normals.insert(normals.end(),
+        level_normals.begin() + i, level_normals.begin() + i + 3);
+    }
+
+    finer = std::move(data);
+  }
+
+  return ConstructMarchingCubesMesh(positions, normals);
+}
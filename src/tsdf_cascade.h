@@ -0,0 +1,125 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TSDF_CASCADE_H
+#define TSDF_CASCADE_H
+
+#include <memory>
+#include <vector>
+
+#include "libcgt/core/geometry/TriangleMesh.h"
+#include "libcgt/core/vecmath/Matrix4f.h"
+#include "libcgt/core/vecmath/Range1f.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+#include "libcgt/cuda/DeviceArray2D.h"
+
+#include "brick_store.h"
+#include "depth_noise_model.h"
+#include "regular_grid_tsdf.h"
+
+// A multi-resolution TSDF: a cascade of concentric RegularGridTSDFs of the
+// same resolution, where each level's voxels are twice the size of the
+// previous level's. Level 0 is the finest and covers the smallest region.
+//
+// Each level only fuses depth samples whose noise and pixel footprint it
+// can resolve (see MaxFusionDepth()), so nearby geometry ends up in the fine
+// levels and the far field in the coarse ones. Covering a region 2^L times
+// as wide as level 0 takes L + 1 grids instead of 8^L.
+//
+// Raycasting prefers the finest level that hit a surface. Triangulation
+// drops a coarse level's triangles where the next finer level has observed
+// the volume. The levels' meshes overlap by about a cell at the boundary,
+// which hides cracks, but they are not stitched together.
+class TSDFCascade {
+public:
+
+  // finest: level 0, owned by the caller. The other levels are allocated
+  // with the same resolution and center.
+  // num_levels: the total number of levels, including level 0. At least 1.
+  TSDFCascade(RegularGridTSDF* finest, int num_levels);
+
+  int NumLevels() const;
+  const RegularGridTSDF& Level(int level) const;
+
+  // Resets every level.
+  void Reset();
+
+  // The farthest depth, in meters, that level fuses: where either the
+  // depth noise (if noise_model is not CONSTANT) or the footprint of a
+  // pixel grows larger than a voxel. Infinite for the coarsest level.
+  //
+  // focal_length: the depth camera's focal length, in pixels.
+  float MaxFusionDepth(int level, float focal_length,
+    const DepthNoiseModel& noise_model) const;
+
+  // Same arguments as RegularGridTSDF::Fuse(). Each level fuses the part of
+  // depth_camera_range up to its MaxFusionDepth().
+  void Fuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model,
+    const DeviceArray2D<float4>* depth_camera_normals);
+
+  // Undoes Fuse() with the same arguments (see RegularGridTSDF::Defuse()).
+  void Defuse(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model,
+    const DeviceArray2D<float4>* depth_camera_normals);
+
+  // Raycast every level, coarse to fine, and merge them.
+  // adaptive: use RegularGridTSDF::AdaptiveRaycast() instead of Raycast().
+  void Raycast(const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera,
+    bool adaptive,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out);
+
+  // Recenter every level on world_point (see RegularGridTSDF::Recenter()).
+  // Only level 0 writes to store: the coarse levels discard what scrolls
+  // out. Returns whether level 0 moved.
+  bool Recenter(const Vector3f& world_point, int max_offset_bricks,
+    BrickStore* store);
+
+  TriangleMesh Triangulate() const;
+
+private:
+
+  // Fuse() if deintegrate is false, Defuse() otherwise.
+  void Integrate(const Vector4f& depth_camera_flpp,
+    const Range1f& depth_camera_range,
+    const Matrix4f& depth_camera_from_world,
+    const DeviceArray2D<float>& depth_data,
+    const DepthNoiseModel& noise_model,
+    const DeviceArray2D<float4>* depth_camera_normals,
+    bool deintegrate);
+
+  void RaycastLevel(int level, const Vector4f& camera_flpp,
+    const Matrix4f& world_from_camera, bool adaptive,
+    DeviceArray2D<float4>& world_points_out,
+    DeviceArray2D<float4>& world_normals_out);
+
+  RegularGridTSDF& MutableLevel(int level);
+
+  RegularGridTSDF* finest_;
+  std::vector<std::unique_ptr<RegularGridTSDF>> coarse_levels_;
+
+  // Scratch raycast of one level, merged into the output.
+  DeviceArray2D<float4> level_world_points_;
+  DeviceArray2D<float4> level_world_normals_;
+};
+
+#endif  // TSDF_CASCADE_H
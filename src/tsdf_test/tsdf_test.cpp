@@ -0,0 +1,104 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the fixed-point TSDF voxel formats on the host. Returns nonzero if
+// any check fails.
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+#include "../tsdf.h"
+
+namespace {
+
+constexpr float kMaxTSDFValue = 0.1f;
+
+using D16W16 = BasicTSDF<uint16_t, uint16_t, 65535>;
+using D8W8 = BasicTSDF<uint8_t, uint8_t, 32>;
+
+static_assert(sizeof(D16W16) == 4, "d16w16 must be 4 bytes.");
+static_assert(sizeof(D8W8) == 2, "d8w8 must be 2 bytes.");
+
+// Half of the distance between adjacent codes.
+template <typename T>
+float HalfCode() {
+  return kMaxTSDFValue / T::kMaxDistanceCode;
+}
+
+bool Check(bool condition, const char* name) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", name);
+  }
+  return condition;
+}
+
+// Saturates the weight at distance start, then feeds num_samples samples
+// of distance target. The voxel should end up at target's code.
+template <typename T>
+bool Converges(float start, float target, int num_samples) {
+  T voxel(start, static_cast<float>(T::kMaxWeight), kMaxTSDFValue);
+  for (int i = 0; i < num_samples; ++i) {
+    voxel.Update(target, 1.0f, kMaxTSDFValue);
+  }
+  float d = voxel.Distance(kMaxTSDFValue);
+  if (fabsf(d - target) > HalfCode<T>() * 1.001f) {
+    fprintf(stderr, "%g -> %g: got %g after %d samples\n",
+      start, target, d, num_samples);
+    return false;
+  }
+  return voxel.Weight() == T::kMaxWeight;
+}
+
+// Blends samples in with unit weights: the result should be their average.
+template <typename T>
+bool Averages() {
+  T voxel;
+  const float samples[] = { 0.02f, -0.03f, 0.05f, 0.0f };
+  float sum = 0.0f;
+  for (float d : samples) {
+    voxel.Update(d, 1.0f, kMaxTSDFValue);
+    sum += d;
+  }
+  // Each update rounds, so allow up to one code per sample.
+  float expected = sum / 4;
+  return voxel.Weight() == 4.0f &&
+    fabsf(voxel.Distance(kMaxTSDFValue) - expected) <=
+    4 * 2 * HalfCode<T>();
+}
+
+}  // namespace
+
+int main() {
+  bool ok = true;
+
+  ok &= Check(Averages<D16W16>(), "d16w16 averages");
+  ok &= Check(Averages<D8W8>(), "d8w8 averages");
+
+  // At saturation, each d8w8 update moves the code by less than half a code
+  // whenever the target is within ~16 codes, which used to round away.
+  ok &= Check(Converges<D8W8>(0.0f, 0.05f, 200), "d8w8 converges up");
+  ok &= Check(Converges<D8W8>(0.0f, -0.05f, 200), "d8w8 converges down");
+  ok &= Check(Converges<D8W8>(0.05f, 0.0f, 200), "d8w8 converges to 0");
+
+  // A voxel at its target code stays there.
+  D8W8 voxel(0.05f, 32.0f, kMaxTSDFValue);
+  D8W8 expected = voxel;
+  voxel.Update(0.05f, 1.0f, kMaxTSDFValue);
+  ok &= Check(voxel.distance_ == expected.distance_, "d8w8 stays");
+
+  if (ok) {
+    printf("All TSDF checks passed.\n");
+  }
+  return ok ? 0 : 1;
+}
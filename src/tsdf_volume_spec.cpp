@@ -0,0 +1,166 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tsdf_volume_spec.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <opencv2/core/persistence.hpp>
+#include <third_party/pystring/pystring.h>
+
+#include "voxel_layout.h"
+
+DECLARE_string(volume_config);
+DECLARE_string(volume_resolution);
+DECLARE_double(volume_voxel_size);
+DECLARE_string(volume_origin);
+DECLARE_double(volume_truncation);
+
+namespace {
+
+// Parse a comma-separated list of numbers.
+bool ParseNumbers(const std::string& str, std::vector<double>* values) {
+  std::vector<std::string> tokens;
+  pystring::split(str, tokens, ",");
+  values->clear();
+  for (const std::string& token : tokens) {
+    std::string stripped = pystring::strip(token);
+    char* end;
+    double value = strtod(stripped.c_str(), &end);
+    if (stripped.empty() || *end != '\0') {
+      return false;
+    }
+    values->push_back(value);
+  }
+  return true;
+}
+
+// "n" or "nx,ny,nz".
+bool ParseResolution(const std::string& str, Vector3i* resolution) {
+  std::vector<double> values;
+  if (!ParseNumbers(str, &values)) {
+    return false;
+  }
+  if (values.size() == 1) {
+    *resolution = Vector3i(static_cast<int>(values[0]));
+  } else if (values.size() == 3) {
+    *resolution = Vector3i{ static_cast<int>(values[0]),
+      static_cast<int>(values[1]), static_cast<int>(values[2]) };
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// "x,y,z".
+bool ParseOrigin(const std::string& str, Vector3f* origin) {
+  std::vector<double> values;
+  if (!ParseNumbers(str, &values) || values.size() != 3) {
+    return false;
+  }
+  *origin = Vector3f{ static_cast<float>(values[0]),
+    static_cast<float>(values[1]), static_cast<float>(values[2]) };
+  return true;
+}
+
+bool IsValid(const TSDFVolumeSpec& spec) {
+  return VoxelLayout::IsValidResolution(spec.resolution) &&
+    spec.voxel_size > 0;
+}
+
+}  // namespace
+
+bool LoadTSDFVolumeSpec(const std::string& yaml, TSDFVolumeSpec* spec,
+  bool* has_origin) {
+  cv::FileStorage fs(yaml, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    fprintf(stderr, "Failed to open %s.\n", yaml.c_str());
+    return false;
+  }
+
+  TSDFVolumeSpec s = *spec;
+  cv::FileNode resolution = fs["resolution"];
+  if (resolution.isInt()) {
+    s.resolution = Vector3i(static_cast<int>(resolution));
+  } else if (resolution.isSeq() && resolution.size() == 3) {
+    s.resolution = Vector3i{ static_cast<int>(resolution[0]),
+      static_cast<int>(resolution[1]), static_cast<int>(resolution[2]) };
+  } else if (!resolution.empty()) {
+    fprintf(stderr, "%s: resolution must be an integer or a list of 3.\n",
+      yaml.c_str());
+    return false;
+  }
+
+  if (!fs["voxel_size"].empty()) {
+    fs["voxel_size"] >> s.voxel_size;
+  }
+  if (!fs["max_tsdf_value"].empty()) {
+    fs["max_tsdf_value"] >> s.max_tsdf_value;
+  }
+
+  cv::FileNode origin = fs["origin"];
+  *has_origin = !origin.empty();
+  if (*has_origin) {
+    if (!origin.isSeq() || origin.size() != 3) {
+      fprintf(stderr, "%s: origin must be a list of 3.\n", yaml.c_str());
+      return false;
+    }
+    s.origin = Vector3f{ static_cast<float>(origin[0]),
+      static_cast<float>(origin[1]), static_cast<float>(origin[2]) };
+  }
+
+  *spec = s;
+  return true;
+}
+
+bool GetTSDFVolumeSpecFromFlags(TSDFVolumeSpec* spec, bool* has_origin) {
+  TSDFVolumeSpec s = *spec;
+  *has_origin = false;
+  if (FLAGS_volume_config != "" &&
+    !LoadTSDFVolumeSpec(FLAGS_volume_config, &s, has_origin)) {
+    return false;
+  }
+
+  if (FLAGS_volume_resolution != "" &&
+    !ParseResolution(FLAGS_volume_resolution, &s.resolution)) {
+    fprintf(stderr, "volume_resolution must be \"n\" or \"nx,ny,nz\".\n");
+    return false;
+  }
+  if (FLAGS_volume_voxel_size > 0) {
+    s.voxel_size = static_cast<float>(FLAGS_volume_voxel_size);
+  }
+  if (FLAGS_volume_origin != "") {
+    if (!ParseOrigin(FLAGS_volume_origin, &s.origin)) {
+      fprintf(stderr, "volume_origin must be \"x,y,z\".\n");
+      return false;
+    }
+    *has_origin = true;
+  }
+  if (FLAGS_volume_truncation > 0) {
+    s.max_tsdf_value = static_cast<float>(FLAGS_volume_truncation);
+  }
+
+  if (!IsValid(s)) {
+    fprintf(stderr, "Invalid TSDF volume: %d x %d x %d voxels of %f m. "
+      "The resolution must be valid for the %s voxel layout.\n",
+      s.resolution.x, s.resolution.y, s.resolution.z, s.voxel_size,
+      VoxelLayout::Name());
+    return false;
+  }
+
+  *spec = s;
+  return true;
+}
@@ -0,0 +1,87 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TSDF_VOLUME_SPEC_H
+#define TSDF_VOLUME_SPEC_H
+
+#include <string>
+
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+
+// The geometry of a RegularGridTSDF: how many voxels it has, how large they
+// are, where the grid is, and how far the TSDF extends.
+struct TSDFVolumeSpec {
+  using SimilarityTransform = libcgt::core::vecmath::SimilarityTransform;
+
+  // Number of voxels along each axis. Must be valid for VoxelLayout.
+  Vector3i resolution{ 512 };
+
+  // The side length of one (cubical) voxel, in meters.
+  float voxel_size = 2.0f / 512;
+
+  // World coordinates of the corner of voxel (0, 0, 0), in meters.
+  Vector3f origin{ 0 };
+
+  // The representable range of the TSDF is
+  // [-MaxTSDFValue(), MaxTSDFValue()], in meters. If max_tsdf_value is not
+  // positive, it is 4 voxels, as in RegularGridTSDF.
+  float max_tsdf_value = 0.0f;
+
+  float MaxTSDFValue() const {
+    return max_tsdf_value > 0.0f ? max_tsdf_value : 4 * voxel_size;
+  }
+
+  // Equivalent to voxel_size * resolution.
+  Vector3f SideLengths() const {
+    return voxel_size * Vector3f(resolution);
+  }
+
+  // Maps grid coordinates [0, resolution]^3 to world coordinates.
+  SimilarityTransform WorldFromGrid() const {
+    return SimilarityTransform(origin) * SimilarityTransform(voxel_size);
+  }
+
+  // Set origin so that the point at fraction of the grid's extent along
+  // each axis is at world_point. E.g., fraction (0.5, 0.5, 0.5) centers the
+  // grid on world_point.
+  void Place(const Vector3f& world_point, const Vector3f& fraction) {
+    Vector3f side_lengths = SideLengths();
+    origin = world_point - Vector3f{ fraction.x * side_lengths.x,
+      fraction.y * side_lengths.y, fraction.z * side_lengths.z };
+  }
+};
+
+// Load a TSDFVolumeSpec from a .yaml file with the optional keys:
+// resolution: n, or [nx, ny, nz].
+// voxel_size, max_tsdf_value: in meters.
+// origin: [x, y, z], in meters.
+// Missing keys leave the corresponding fields of spec alone. *has_origin
+// is set to whether origin was present.
+//
+// On success, returns true.
+// Otherwise, prints an error and returns false.
+bool LoadTSDFVolumeSpec(const std::string& yaml, TSDFVolumeSpec* spec,
+  bool* has_origin);
+
+// Override spec with the file given by --volume_config, if any, then with
+// the --volume_* flags that are set, which take precedence. *has_origin is
+// set to whether either gave an origin. If not, the caller should Place()
+// the grid.
+//
+// Returns false, after printing an error, if a value is malformed or the
+// resulting spec is invalid.
+bool GetTSDFVolumeSpecFromFlags(TSDFVolumeSpec* spec, bool* has_origin);
+
+#endif  // TSDF_VOLUME_SPEC_H
@@ -0,0 +1,129 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "undistort_remap.h"
+
+#include <cassert>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+template <typename T>
+float RemapPixel(Array2DReadView<T> src, uint32_t entry) {
+  if (entry == kInvalidRemapEntry) {
+    return 0.0f;
+  }
+  return static_cast<float>(src[{ static_cast<int>(entry & 0xffff),
+    static_cast<int>(entry >> 16) }]);
+}
+
+#if defined(__AVX2__)
+// Element indices into a packed image src_width wide, and a mask of the
+// entries that are not kInvalidRemapEntry.
+inline __m256i RemapIndices(__m256i entries, __m256i src_width,
+  __m256i* valid) {
+  const __m256i low16 = _mm256_set1_epi32(0xffff);
+  *valid = _mm256_xor_si256(
+    _mm256_cmpeq_epi32(entries, _mm256_set1_epi32(-1)),
+    _mm256_set1_epi32(-1));
+  return _mm256_add_epi32(
+    _mm256_mullo_epi32(_mm256_srli_epi32(entries, 16), src_width),
+    _mm256_and_si256(entries, low16));
+}
+#endif
+
+}  // namespace
+
+Array2D<uint32_t> CompileUndistortRemap(
+  Array2DReadView<Vector2f> undistortion_map, const Vector2i& source_size) {
+  assert(source_size.x < 0xffff && source_size.y < 0xffff);
+  Array2D<uint32_t> remap(undistortion_map.size());
+  for (int y = 0; y < undistortion_map.height(); ++y) {
+    const Vector2f* map_row = undistortion_map.rowPointer(y);
+    uint32_t* dst = remap.rowPointer(y);
+    for (int x = 0; x < undistortion_map.width(); ++x) {
+      float src_x = std::floor(map_row[x].x * source_size.x);
+      float src_y = std::floor(map_row[x].y * source_size.y);
+      // Written so that NaN is also out of bounds.
+      if (src_x >= 0.0f && src_x < source_size.x &&
+        src_y >= 0.0f && src_y < source_size.y) {
+        dst[x] = MakeRemapEntry(static_cast<int>(src_x),
+          static_cast<int>(src_y));
+      } else {
+        dst[x] = kInvalidRemapEntry;
+      }
+    }
+  }
+  return remap;
+}
+
+void RemapRow(Array2DReadView<uint16_t> src, const uint32_t* remap,
+  int width, float scale, float* dst) {
+  int x = 0;
+#if defined(__AVX2__)
+  if (src.packed() && src.numElements() > 0) {
+    // There is no 16-bit gather, so gather 32 bits and keep the low half.
+    // Doing so at the last pixel would read past the end of src, so that
+    // pixel is blended in instead.
+    const int* base = reinterpret_cast<const int*>(src.pointer());
+    const int last_index = src.numElements() - 1;
+    const __m256i last = _mm256_set1_epi32(last_index);
+    const __m256i last_value =
+      _mm256_set1_epi32(src.pointer()[last_index]);
+    const __m256i src_width = _mm256_set1_epi32(src.width());
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    const __m256 scale_v = _mm256_set1_ps(scale);
+    for (; x + 8 <= width; x += 8) {
+      __m256i valid;
+      __m256i index = RemapIndices(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(remap + x)), src_width, &valid);
+      __m256i is_last = _mm256_and_si256(
+        _mm256_cmpeq_epi32(index, last), valid);
+      __m256i raw = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+        base, index, _mm256_andnot_si256(is_last, valid), 2);
+      raw = _mm256_blendv_epi8(_mm256_and_si256(raw, low16), last_value,
+        is_last);
+      _mm256_storeu_ps(dst + x,
+        _mm256_mul_ps(_mm256_cvtepi32_ps(raw), scale_v));
+    }
+  }
+#endif
+  for (; x < width; ++x) {
+    dst[x] = scale * RemapPixel(src, remap[x]);
+  }
+}
+
+void RemapRow(Array2DReadView<float> src, const uint32_t* remap,
+  int width, float* dst) {
+  int x = 0;
+#if defined(__AVX2__)
+  if (src.packed()) {
+    const __m256i src_width = _mm256_set1_epi32(src.width());
+    for (; x + 8 <= width; x += 8) {
+      __m256i valid;
+      __m256i index = RemapIndices(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(remap + x)), src_width, &valid);
+      _mm256_storeu_ps(dst + x, _mm256_mask_i32gather_ps(
+        _mm256_setzero_ps(), src.pointer(), index,
+        _mm256_castsi256_ps(valid), 4));
+    }
+  }
+#endif
+  for (; x < width; ++x) {
+    dst[x] = RemapPixel(src, remap[x]);
+  }
+}
@@ -0,0 +1,60 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef UNDISTORT_REMAP_H
+#define UNDISTORT_REMAP_H
+
+#include <cstdint>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/Vector2f.h"
+#include "libcgt/core/vecmath/Vector2i.h"
+
+// A depth undistortion map compiled, when the calibration is loaded, into
+// the nearest source pixel of every output pixel.
+//
+// Entries are 4 bytes instead of the 8 of a float2 map, and are used
+// directly as addresses, so remapping a frame reads half as much map data
+// and does no per-pixel float math. Depth is never interpolated: blending
+// samples across a depth edge creates points that are not on any surface.
+
+// The entry of an output pixel whose source is outside of the input image.
+// Its output is 0, which every consumer treats as invalid.
+constexpr uint32_t kInvalidRemapEntry = 0xffffffffu;
+
+// Source pixel (x, y), with x in the low 16 bits and y in the high 16 bits.
+inline uint32_t MakeRemapEntry(int x, int y) {
+  return static_cast<uint32_t>(x) | (static_cast<uint32_t>(y) << 16);
+}
+
+// undistortion_map is in the format of CameraParameters::undistortion_map:
+// for each output pixel, the normalized coordinates of the input pixel to
+// sample. The source is the input pixel containing that point, as when
+// point sampling a texture. Points outside of the input get
+// kInvalidRemapEntry.
+//
+// source_size must be less than 65535 in each dimension.
+Array2D<uint32_t> CompileUndistortRemap(
+  Array2DReadView<Vector2f> undistortion_map, const Vector2i& source_size);
+
+// Host remap of one output row: dst[x] = scale * src[remap[x]], or 0 where
+// remap[x] is kInvalidRemapEntry. When compiled with AVX2 and src is packed,
+// eight pixels are gathered at a time.
+void RemapRow(Array2DReadView<uint16_t> src, const uint32_t* remap,
+  int width, float scale, float* dst);
+
+// Same, for depth that is already in meters.
+void RemapRow(Array2DReadView<float> src, const uint32_t* remap,
+  int width, float* dst);
+
+#endif  // UNDISTORT_REMAP_H
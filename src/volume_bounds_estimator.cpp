@@ -0,0 +1,276 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "volume_bounds_estimator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+
+#include "input_buffer.h"
+#include "rgbd_input.h"
+#include "tsdf.h"
+#include "undistort_remap.h"
+#include "voxel_layout.h"
+
+using libcgt::core::vecmath::EuclideanTransform;
+using libcgt::core::vecmath::inverse;
+using libcgt::core::vecmath::transformPoint;
+
+namespace {
+
+constexpr int kKeyBits = 21;
+constexpr int64_t kKeyMask = (int64_t(1) << kKeyBits) - 1;
+constexpr int kKeyOffset = 1 << (kKeyBits - 1);
+
+// The smallest n >= min_size that VoxelLayout accepts along an axis.
+int RoundUpToValidSize(int min_size) {
+  int n = std::max(min_size, 1);
+  while (!VoxelLayout::IsValidResolution(Vector3i(n))) {
+    ++n;
+  }
+  return n;
+}
+
+Vector3i ValidResolution(const Vector3f& extent, float voxel_size) {
+  return Vector3i{
+    RoundUpToValidSize(static_cast<int>(std::ceil(extent.x / voxel_size))),
+    RoundUpToValidSize(static_cast<int>(std::ceil(extent.y / voxel_size))),
+    RoundUpToValidSize(static_cast<int>(std::ceil(extent.z / voxel_size)))
+  };
+}
+
+// Device memory used by a grid of this resolution.
+double StorageBytes(const Vector3i& resolution) {
+  Vector3i storage_size = VoxelLayout::StorageSize(resolution);
+  return static_cast<double>(storage_size.x) * storage_size.y *
+    storage_size.z * sizeof(TSDF);
+}
+
+// The range of cells along one axis that holds all but trim samples at each
+// end. samples is (cell coordinate, count) pairs and is sorted.
+void TrimmedRange(std::vector<std::pair<int, int>>* samples, int64_t trim,
+  int* lo, int* hi) {
+  std::sort(samples->begin(), samples->end());
+  int64_t sum = 0;
+  for (auto itr = samples->begin(); itr != samples->end(); ++itr) {
+    sum += itr->second;
+    if (sum > trim) {
+      *lo = itr->first;
+      break;
+    }
+  }
+  sum = 0;
+  for (auto itr = samples->rbegin(); itr != samples->rend(); ++itr) {
+    sum += itr->second;
+    if (sum > trim) {
+      *hi = itr->first;
+      break;
+    }
+  }
+}
+
+}  // namespace
+
+VolumeBoundsEstimator::VolumeBoundsEstimator(const Options& options) :
+  options_(options) {
+  assert(options.cell_size > 0);
+  assert(options.pixel_stride > 0);
+}
+
+void VolumeBoundsEstimator::AddDepthFrame(
+  Array2DReadView<float> depth_meters,
+  Array2DReadView<uint32_t> undistortion_remap, const Vector4f& flpp,
+  const EuclideanTransform& depth_camera_from_world) {
+  const bool undistort = undistortion_remap.notNull();
+  assert(!undistort || undistortion_remap.size() == depth_meters.size());
+
+  const EuclideanTransform world_from_camera =
+    inverse(depth_camera_from_world);
+  const float inv_cell_size = 1.0f / options_.cell_size;
+  const int width = depth_meters.width();
+  row_.resize(width);
+
+  for (int y = 0; y < depth_meters.height(); y += options_.pixel_stride) {
+    const float* row = depth_meters.rowPointer(y);
+    if (undistort) {
+      RemapRow(depth_meters, undistortion_remap.rowPointer(y), width,
+        row_.data());
+      row = row_.data();
+    }
+    for (int x = 0; x < width; x += options_.pixel_stride) {
+      float z = row[x];
+      // Also rejects NaN.
+      if (!(z > 0.0f)) {
+        continue;
+      }
+      // Same as CameraFromPixel() in camera_math.cuh.
+      Vector3f camera_point{
+        z * (x + 0.5f - flpp.z) / flpp.x,
+        z * (y + 0.5f - flpp.w) / flpp.y,
+        -z
+      };
+      Vector3f world_point = transformPoint(world_from_camera, camera_point);
+      Vector3i cell{
+        static_cast<int>(std::floor(world_point.x * inv_cell_size)),
+        static_cast<int>(std::floor(world_point.y * inv_cell_size)),
+        static_cast<int>(std::floor(world_point.z * inv_cell_size))
+      };
+      ++cell_samples_[Key(cell)];
+      ++num_samples_;
+    }
+  }
+  ++num_frames_;
+}
+
+int VolumeBoundsEstimator::NumFrames() const {
+  return num_frames_;
+}
+
+int64_t VolumeBoundsEstimator::NumSamples() const {
+  return num_samples_;
+}
+
+bool VolumeBoundsEstimator::Estimate(size_t memory_budget_bytes,
+  TSDFVolumeSpec* spec) const {
+  // Marginals of the cells that are hit often enough to be surfaces.
+  std::vector<std::pair<int, int>> marginals[3];
+  int64_t num_samples = 0;
+  for (const auto& kv : cell_samples_) {
+    if (kv.second < options_.min_cell_samples) {
+      continue;
+    }
+    Vector3i cell = Cell(kv.first);
+    for (int axis = 0; axis < 3; ++axis) {
+      marginals[axis].emplace_back(cell[axis], kv.second);
+    }
+    num_samples += kv.second;
+  }
+  if (num_samples == 0) {
+    fprintf(stderr, "Volume bounds: no surface found in %d depth frames "
+      "(%lld samples).\n", num_frames_,
+      static_cast<long long>(num_samples_));
+    return false;
+  }
+
+  const int64_t trim = static_cast<int64_t>(
+    0.5 * options_.outlier_fraction * num_samples);
+  Vector3f box_min;
+  Vector3f box_max;
+  for (int axis = 0; axis < 3; ++axis) {
+    int lo = 0;
+    int hi = 0;
+    TrimmedRange(&marginals[axis], trim, &lo, &hi);
+    box_min[axis] = lo * options_.cell_size - options_.padding;
+    box_max[axis] = (hi + 1) * options_.cell_size + options_.padding;
+  }
+  const Vector3f extent = box_max - box_min;
+
+  // The smallest voxels that fit, ignoring rounding, then grow them until
+  // the rounded up resolution fits too.
+  const double budget = static_cast<double>(memory_budget_bytes);
+  if (StorageBytes(Vector3i(RoundUpToValidSize(1))) > budget) {
+    fprintf(stderr, "Volume bounds: memory budget of %zu bytes is too "
+      "small.\n", memory_budget_bytes);
+    return false;
+  }
+  float voxel_size = static_cast<float>(std::cbrt(
+    extent.x * extent.y * extent.z * sizeof(TSDF) / budget));
+  Vector3i resolution = ValidResolution(extent, voxel_size);
+  while (StorageBytes(resolution) > budget) {
+    voxel_size *= 1.01f;
+    resolution = ValidResolution(extent, voxel_size);
+  }
+
+  spec->resolution = resolution;
+  spec->voxel_size = voxel_size;
+  spec->Place(0.5f * (box_min + box_max), Vector3f{ 0.5f });
+
+  printf("Volume bounds: %d depth frames, [%f, %f] x [%f, %f] x [%f, %f] m, "
+    "%d x %d x %d voxels of %f m.\n", num_frames_,
+    box_min.x, box_max.x, box_min.y, box_max.y, box_min.z, box_max.z,
+    resolution.x, resolution.y, resolution.z, voxel_size);
+  return true;
+}
+
+// static
+int64_t VolumeBoundsEstimator::Key(const Vector3i& cell) {
+  return (static_cast<int64_t>(cell.x + kKeyOffset) & kKeyMask) |
+    ((static_cast<int64_t>(cell.y + kKeyOffset) & kKeyMask) << kKeyBits) |
+    ((static_cast<int64_t>(cell.z + kKeyOffset) & kKeyMask) <<
+      (2 * kKeyBits));
+}
+
+// static
+Vector3i VolumeBoundsEstimator::Cell(int64_t key) {
+  return Vector3i{
+    static_cast<int>(key & kKeyMask) - kKeyOffset,
+    static_cast<int>((key >> kKeyBits) & kKeyMask) - kKeyOffset,
+    static_cast<int>((key >> (2 * kKeyBits)) & kKeyMask) - kKeyOffset
+  };
+}
+
+int AddRgbdFileToVolumeBounds(const std::string& rgbd_filename,
+  const CameraParameters& depth_params,
+  const std::function<bool(const InputBuffer& frame,
+    EuclideanTransform* depth_camera_from_world)>& depth_camera_from_world,
+  int max_frames, VolumeBoundsEstimator* estimator) {
+  RgbdInput input(RgbdInput::InputType::FILE, rgbd_filename.c_str(),
+    depth_params.depth_range);
+  InputBuffer buffer(input.colorSize(), depth_params.resolution);
+
+  const Vector4f flpp{ depth_params.intrinsics.focalLength,
+    depth_params.intrinsics.principalPoint };
+  int num_frames = 0;
+  bool color_updated;
+  bool depth_updated;
+  input.read(&buffer, &color_updated, &depth_updated);
+  while ((color_updated || depth_updated) &&
+    (max_frames <= 0 || num_frames < max_frames)) {
+    EuclideanTransform camera_from_world;
+    if (depth_updated && depth_camera_from_world(buffer, &camera_from_world)) {
+      estimator->AddDepthFrame(buffer.depth_meters.readView(),
+        depth_params.undistortion_remap.readView(), flpp, camera_from_world);
+      ++num_frames;
+    }
+    input.read(&buffer, &color_updated, &depth_updated);
+  }
+  return num_frames;
+}
+
+int AddRgbdFileToVolumeBounds(const std::string& rgbd_filename,
+  const CameraParameters& depth_params, const std::vector<PoseFrame>& path,
+  bool match_color_timestamp, int max_frames,
+  VolumeBoundsEstimator* estimator) {
+  // Index the path once. emplace() keeps the first frame of a timestamp.
+  std::unordered_map<int64_t, const PoseFrame*> frame_from_timestamp;
+  frame_from_timestamp.reserve(path.size());
+  for (const PoseFrame& f : path) {
+    frame_from_timestamp.emplace(f.timestamp_ns, &f);
+  }
+
+  return AddRgbdFileToVolumeBounds(rgbd_filename, depth_params,
+    [&](const InputBuffer& frame,
+      EuclideanTransform* depth_camera_from_world) {
+      int64_t timestamp_ns = match_color_timestamp ?
+        frame.color_timestamp_ns : frame.depth_timestamp_ns;
+      auto itr = frame_from_timestamp.find(timestamp_ns);
+      if (itr == frame_from_timestamp.end()) {
+        return false;
+      }
+      *depth_camera_from_world = itr->second->depth_camera_from_world;
+      return true;
+    }, max_frames, estimator);
+}
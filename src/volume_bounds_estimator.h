@@ -0,0 +1,127 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef VOLUME_BOUNDS_ESTIMATOR_H
+#define VOLUME_BOUNDS_ESTIMATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/vecmath/EuclideanTransform.h"
+#include "libcgt/core/vecmath/Vector3f.h"
+#include "libcgt/core/vecmath/Vector3i.h"
+#include "libcgt/core/vecmath/Vector4f.h"
+
+#include "pose_frame.h"
+#include "rgbd_camera_parameters.h"
+#include "tsdf_volume_spec.h"
+
+struct InputBuffer;
+
+// Fits the TSDF grid to the scene before fusion, so that a fixed memory
+// budget buys the finest voxels that still cover everything the cameras see.
+//
+// Depth frames with known poses are unprojected into a sparse histogram of
+// coarse cells. Estimate() takes the bounds of the surface points, trimming
+// a small fraction of them along each axis as outliers, pads them, and
+// picks the smallest voxel size whose grid, which need not be a cube, fits
+// in the budget.
+class VolumeBoundsEstimator {
+ public:
+
+  using EuclideanTransform = libcgt::core::vecmath::EuclideanTransform;
+
+  struct Options {
+    // Side length of a histogram cell, in meters. The bounds are only
+    // accurate to a cell.
+    float cell_size = 0.05f;
+
+    // Unproject every pixel_stride-th pixel in x and y.
+    int pixel_stride = 4;
+
+    // Cells with fewer samples than this are flying pixels or sensor noise
+    // and are ignored.
+    int min_cell_samples = 8;
+
+    // Fraction of the remaining samples that may lie outside of the bounds
+    // along each axis, split evenly between both ends.
+    float outlier_fraction = 0.01f;
+
+    // Added to each side of the bounds, in meters, so that the truncation
+    // band behind the outermost surfaces is kept.
+    float padding = 0.1f;
+  };
+
+  VolumeBoundsEstimator() = default;
+  explicit VolumeBoundsEstimator(const Options& options);
+
+  // depth_meters: y-up, 0 where invalid, as in InputBuffer::depth_meters.
+  // undistortion_remap: from CameraParameters. If null, depth_meters is
+  //   already undistorted.
+  // flpp: intrinsics of the undistorted depth camera.
+  void AddDepthFrame(Array2DReadView<float> depth_meters,
+    Array2DReadView<uint32_t> undistortion_remap, const Vector4f& flpp,
+    const EuclideanTransform& depth_camera_from_world);
+
+  int NumFrames() const;
+  int64_t NumSamples() const;
+
+  // Fit a grid to the samples so far, whose storage is at most
+  // memory_budget_bytes. Sets spec's resolution, voxel_size, and origin and
+  // leaves max_tsdf_value alone.
+  //
+  // Returns false, after printing an error, if there are not enough samples.
+  bool Estimate(size_t memory_budget_bytes, TSDFVolumeSpec* spec) const;
+
+ private:
+
+  // Cell subscripts packed into 21 bits each.
+  static int64_t Key(const Vector3i& cell);
+  static Vector3i Cell(int64_t key);
+
+  Options options_;
+
+  std::unordered_map<int64_t, int> cell_samples_;
+  int num_frames_ = 0;
+  int64_t num_samples_ = 0;
+
+  // Scratch undistorted depth row.
+  std::vector<float> row_;
+};
+
+// Read the .rgbd file rgbd_filename from the start and add its depth frames
+// to estimator, up to max_frames of them (all of them if max_frames <= 0).
+// depth_camera_from_world returns the pose of a frame, or false to skip a
+// frame with no known pose.
+//
+// Returns the number of frames added.
+int AddRgbdFileToVolumeBounds(const std::string& rgbd_filename,
+  const CameraParameters& depth_params,
+  const std::function<bool(const InputBuffer& frame,
+    libcgt::core::vecmath::EuclideanTransform* depth_camera_from_world)>&
+    depth_camera_from_world,
+  int max_frames, VolumeBoundsEstimator* estimator);
+
+// Same, posed by the frames of a precomputed path that have the same depth
+// timestamp, or color timestamp if match_color_timestamp is true.
+int AddRgbdFileToVolumeBounds(const std::string& rgbd_filename,
+  const CameraParameters& depth_params, const std::vector<PoseFrame>& path,
+  bool match_color_timestamp, int max_frames,
+  VolumeBoundsEstimator* estimator);
+
+#endif  // VOLUME_BOUNDS_ESTIMATOR_H
@@ -0,0 +1,181 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef VOXEL_LAYOUT_H
+#define VOXEL_LAYOUT_H
+
+#include <cuda_runtime.h>
+
+#include "libcgt/core/vecmath/Vector3i.h"
+
+// A voxel layout maps the subscript of a voxel in a grid of a given
+// resolution to the subscript where it is stored in a 3D array of size
+// StorageSize(resolution).
+//
+// Both layouts are always available so that they can be compared. The grid
+// used by the fusion pipeline is chosen at compile time: see VoxelLayout
+// below.
+
+// x-fastest linear order: the storage array has the same size as the grid.
+// Stepping in z jumps a full slice.
+struct LinearVoxelLayout {
+  static const char* Name() {
+    return "linear";
+  }
+
+  static bool IsValidResolution(const Vector3i& resolution) {
+    return resolution.x > 0 && resolution.y > 0 && resolution.z > 0;
+  }
+
+  static Vector3i StorageSize(const Vector3i& resolution) {
+    return resolution;
+  }
+
+  __inline__ __host__ __device__
+  static int3 StorageSubscript(int3 xyz, int3 resolution) {
+    return xyz;
+  }
+};
+
+// Voxels are grouped into 8^3 bricks. Each brick is stored x-fastest in one
+// 512-element row of the storage array, so a neighborhood of voxels spans
+// at most a few rows instead of several slices. Bricks are stored
+// x-fastest: row y of slice z holds brick (y, z % bricks_y, z / bricks_y).
+//
+// The grid resolution must be a multiple of 8 along each axis.
+struct BrickVoxelLayout {
+  static constexpr int kLog2BrickSize = 3;
+  static constexpr int kBrickSize = 1 << kLog2BrickSize;
+  static constexpr int kBrickVolume = kBrickSize * kBrickSize * kBrickSize;
+
+  static const char* Name() {
+    return "brick";
+  }
+
+  static bool IsValidResolution(const Vector3i& resolution) {
+    return resolution.x > 0 && resolution.y > 0 && resolution.z > 0 &&
+      resolution.x % kBrickSize == 0 && resolution.y % kBrickSize == 0 &&
+      resolution.z % kBrickSize == 0;
+  }
+
+  static Vector3i StorageSize(const Vector3i& resolution) {
+    return{ kBrickVolume, resolution.x / kBrickSize,
+      (resolution.y / kBrickSize) * (resolution.z / kBrickSize) };
+  }
+
+  __inline__ __host__ __device__
+  static int3 StorageSubscript(int3 xyz, int3 resolution) {
+    const int kMask = kBrickSize - 1;
+    int bricks_y = resolution.y >> kLog2BrickSize;
+    int local = (xyz.x & kMask) |
+      ((xyz.y & kMask) << kLog2BrickSize) |
+      ((xyz.z & kMask) << (2 * kLog2BrickSize));
+    return{ local,
+      xyz.x >> kLog2BrickSize,
+      (xyz.z >> kLog2BrickSize) * bricks_y + (xyz.y >> kLog2BrickSize) };
+  }
+};
+
+#if defined(DEPTH_FUSION_TSDF_LAYOUT_BRICK)
+using VoxelLayout = BrickVoxelLayout;
+#else
+using VoxelLayout = LinearVoxelLayout;
+#endif
+
+// A view of a voxel grid stored in Layout order in a 3D array.
+//
+// The storage may be cyclic: voxel xyz of the view is stored at
+// (xyz + origin) mod resolution. This lets a grid scroll without moving the
+// voxels that stay inside it. For BrickVoxelLayout, origin must be a
+// multiple of the brick size so that bricks stay contiguous.
+//
+// T: the element type, const if the view is read-only.
+// Storage: the 3D array view being indexed: KernelArray3D on the device, or
+//   Array3DReadView / Array3DWriteView on the host.
+template <typename T, typename Layout, typename Storage>
+class VoxelGridView {
+public:
+
+  // origin: each component must be in [0, resolution).
+  __inline__ __host__ __device__
+  VoxelGridView(Storage storage, int3 resolution,
+    int3 origin = int3{ 0, 0, 0 }) :
+    storage_(storage),
+    resolution_(resolution),
+    origin_(origin) {
+  }
+
+  // The grid resolution (not the size of the storage array).
+  __inline__ __host__ __device__
+  int3 size() const {
+    return resolution_;
+  }
+
+  __inline__ __host__ __device__
+  int width() const {
+    return resolution_.x;
+  }
+
+  __inline__ __host__ __device__
+  int height() const {
+    return resolution_.y;
+  }
+
+  __inline__ __host__ __device__
+  int depth() const {
+    return resolution_.z;
+  }
+
+  // Where voxel (0, 0, 0) of the view is stored, as a grid subscript.
+  __inline__ __host__ __device__
+  int3 origin() const {
+    return origin_;
+  }
+
+  // Address of the voxel at xyz, for memory access analysis.
+#ifdef __CUDACC__
+  #pragma hd_warning_disable
+#endif
+  __inline__ __host__ __device__
+  const void* Address(int3 xyz) const {
+    return &((*this)[xyz]);
+  }
+
+#ifdef __CUDACC__
+  #pragma hd_warning_disable
+#endif
+  __inline__ __host__ __device__
+  T& operator [] (int3 xyz) const {
+    int3 s = Layout::StorageSubscript(Wrap(xyz), resolution_);
+    return storage_[{ s.x, s.y, s.z }];
+  }
+
+private:
+
+  // (xyz + origin_) mod resolution_, for xyz in [0, resolution_).
+  __inline__ __host__ __device__
+  int3 Wrap(int3 xyz) const {
+    int x = xyz.x + origin_.x;
+    int y = xyz.y + origin_.y;
+    int z = xyz.z + origin_.z;
+    return{ x < resolution_.x ? x : x - resolution_.x,
+      y < resolution_.y ? y : y - resolution_.y,
+      z < resolution_.z ? z : z - resolution_.z };
+  }
+
+  Storage storage_;
+  int3 resolution_;
+  int3 origin_;
+};
+
+#endif  // VOXEL_LAYOUT_H
@@ -0,0 +1,413 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares voxel layouts on the CPU: throughput and (simulated) cache misses
+// of TSDF fusion, raycasting, and surface extraction on a synthetic scene.
+//
+// The access patterns mirror the GPU kernels: fusion sweeps z for each
+// (x, y) in 16x16 tiles and raycasting marches rays in 16x16 pixel tiles,
+// trilinearly sampling 8 voxels per step.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <helper_math.h>
+
+#include "libcgt/core/common/Array2D.h"
+#include "libcgt/core/common/Array3D.h"
+#include "libcgt/core/vecmath/SimilarityTransform.h"
+
+#include "../marching_cubes.h"
+#include "../synthetic_scene.h"
+#include "../tsdf.h"
+#include "../voxel_layout.h"
+
+using libcgt::core::vecmath::SimilarityTransform;
+
+DEFINE_int32(resolution, 256,
+  "Grid resolution along each axis. Must be a multiple of 8.");
+DEFINE_int32(num_frames, 8, "Number of synthetic depth frames.");
+DEFINE_int32(image_width, 320, "Width of the synthetic depth frames.");
+DEFINE_int32(image_height, 240, "Height of the synthetic depth frames.");
+DEFINE_bool(simulate_cache, true,
+  "Count misses of every voxel access in a simulated two-level cache. "
+  "Slow.");
+DEFINE_int32(l1_kb, 32, "Simulated L1 cache size, in KiB.");
+DEFINE_int32(l2_kb, 1024, "Simulated L2 cache size, in KiB.");
+
+namespace {
+
+// The grid covers [-kHalfExtent, kHalfExtent]^3 meters, the bounds of the
+// "sphere" synthetic scene.
+constexpr float kHalfExtent = 1.0f;
+constexpr float kMinDepth = 0.4f;
+constexpr float kMaxDepth = 4.0f;
+constexpr int kTileSize = 16;
+
+// A set-associative cache with LRU replacement.
+class CacheSimulator {
+public:
+
+  CacheSimulator(int size_bytes, int associativity, int line_size = 64) :
+    associativity_(associativity),
+    line_size_(line_size),
+    num_sets_(std::max(1, size_bytes / (associativity * line_size))),
+    lines_(num_sets_ * associativity, kInvalidLine) {
+  }
+
+  // Returns true on a hit.
+  bool Access(uintptr_t address) {
+    uint64_t line = address / line_size_;
+    uint64_t* set = &(lines_[(line % num_sets_) * associativity_]);
+    // Each set is kept in most to least recently used order.
+    int i = 0;
+    while (i < associativity_ && set[i] != line) {
+      ++i;
+    }
+    bool hit = i < associativity_;
+    if (!hit) {
+      i = associativity_ - 1;
+    }
+    for (; i > 0; --i) {
+      set[i] = set[i - 1];
+    }
+    set[0] = line;
+    return hit;
+  }
+
+private:
+
+  static constexpr uint64_t kInvalidLine = ~0ull;
+
+  const int associativity_;
+  const int line_size_;
+  const int num_sets_;
+  std::vector<uint64_t> lines_;
+};
+
+// Counts voxel accesses and their misses in a simulated L1 and L2.
+class CountingProbe {
+public:
+
+  CountingProbe() :
+    l1_(FLAGS_l1_kb * 1024, 8),
+    l2_(FLAGS_l2_kb * 1024, 16) {
+  }
+
+  void operator () (const void* address) {
+    ++accesses_;
+    uintptr_t a = reinterpret_cast<uintptr_t>(address);
+    if (!l1_.Access(a)) {
+      ++l1_misses_;
+      if (!l2_.Access(a)) {
+        ++l2_misses_;
+      }
+    }
+  }
+
+  int64_t accesses_ = 0;
+  int64_t l1_misses_ = 0;
+  int64_t l2_misses_ = 0;
+
+private:
+
+  CacheSimulator l1_;
+  CacheSimulator l2_;
+};
+
+// Does nothing: used for timing.
+struct NullProbe {
+  void operator () (const void* address) {}
+};
+
+template <typename Layout>
+using HostTSDFGridWriteView =
+  VoxelGridView<TSDF, Layout, Array3DWriteView<TSDF>>;
+
+template <typename Layout, typename Probe>
+void Fuse(HostTSDFGridWriteView<Layout> grid, float voxel_size,
+  float max_tsdf_value, const SyntheticCamera& camera,
+  Array2DReadView<float> depth, Probe& probe) {
+  const RigidTransform camera_from_world = camera.world_from_camera.Inverse();
+  for (int by = 0; by < grid.height(); by += kTileSize) {
+    for (int bx = 0; bx < grid.width(); bx += kTileSize) {
+      for (int k = 0; k < grid.depth(); ++k) {
+        for (int j = by; j < std::min(by + kTileSize, grid.height()); ++j) {
+          for (int i = bx; i < std::min(bx + kTileSize, grid.width()); ++i) {
+            float3 voxel_world = make_float3(
+              (i + 0.5f) * voxel_size - kHalfExtent,
+              (j + 0.5f) * voxel_size - kHalfExtent,
+              (k + 0.5f) * voxel_size - kHalfExtent);
+            float3 voxel_camera = camera_from_world.TransformPoint(voxel_world);
+            if (voxel_camera.z >= 0) {
+              continue;
+            }
+            float voxel_depth = -voxel_camera.z;
+            int x = static_cast<int>(floorf(camera.focal_length *
+              voxel_camera.x / voxel_depth + camera.principal_point.x));
+            int y = static_cast<int>(floorf(camera.focal_length *
+              voxel_camera.y / voxel_depth + camera.principal_point.y));
+            if (x < 0 || x >= depth.width() || y < 0 || y >= depth.height()) {
+              continue;
+            }
+            float image_depth = depth[{ x, y }];
+            if (image_depth < kMinDepth || image_depth > kMaxDepth) {
+              continue;
+            }
+            float dz = image_depth - voxel_depth;
+            if (dz >= -max_tsdf_value) {
+              int3 xyz = make_int3(i, j, k);
+              probe(grid.Address(xyz));
+              grid[xyz].Update(std::min(dz, max_tsdf_value), 1.0f,
+                max_tsdf_value);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Layout, typename Probe>
+float2 TrilinearSample(HostTSDFGridView<Layout> grid, float3 voxel_coords,
+  float max_tsdf_value, Probe& probe) {
+  int3 p = make_int3(static_cast<int>(floorf(voxel_coords.x)),
+    static_cast<int>(floorf(voxel_coords.y)),
+    static_cast<int>(floorf(voxel_coords.z)));
+  if (p.x < 0 || p.y < 0 || p.z < 0 ||
+    p.x + 1 >= grid.width() || p.y + 1 >= grid.height() ||
+    p.z + 1 >= grid.depth()) {
+    return make_float2(0, 0);
+  }
+  float3 t = voxel_coords - make_float3(p);
+
+  float d[8];
+  for (int c = 0; c < 8; ++c) {
+    int3 q = make_int3(p.x + (c & 1), p.y + ((c >> 1) & 1),
+      p.z + ((c >> 2) & 1));
+    probe(grid.Address(q));
+    const TSDF& v = grid[q];
+    if (v.Weight() == 0) {
+      return make_float2(0, 0);
+    }
+    d[c] = v.Distance(max_tsdf_value);
+  }
+  float d_x0 = lerp(lerp(d[0], d[1], t.x), lerp(d[2], d[3], t.x), t.y);
+  float d_x1 = lerp(lerp(d[4], d[5], t.x), lerp(d[6], d[7], t.x), t.y);
+  return make_float2(lerp(d_x0, d_x1, t.z), 1.0f);
+}
+
+// Intersect the ray origin + t * dir, t in [*t_min, *t_max], with the grid's
+// bounding box. Returns false if they do not intersect.
+bool ClipRayToGrid(float3 origin, float3 dir, float* t_min, float* t_max) {
+  const float o[3] = { origin.x, origin.y, origin.z };
+  const float d[3] = { dir.x, dir.y, dir.z };
+  for (int axis = 0; axis < 3; ++axis) {
+    float t0 = (-kHalfExtent - o[axis]) / d[axis];
+    float t1 = (kHalfExtent - o[axis]) / d[axis];
+    *t_min = std::max(*t_min, std::min(t0, t1));
+    *t_max = std::min(*t_max, std::max(t0, t1));
+  }
+  return *t_min < *t_max;
+}
+
+// Returns the number of rays that hit the surface.
+template <typename Layout, typename Probe>
+int Raycast(HostTSDFGridView<Layout> grid, float voxel_size,
+  float max_tsdf_value, const SyntheticCamera& camera, int width, int height,
+  Probe& probe) {
+  int num_hits = 0;
+  const float3 eye = camera.world_from_camera.origin;
+  const float kStep = 0.5f * voxel_size;
+  for (int by = 0; by < height; by += kTileSize) {
+    for (int bx = 0; bx < width; bx += kTileSize) {
+      for (int y = by; y < std::min(by + kTileSize, height); ++y) {
+        for (int x = bx; x < std::min(bx + kTileSize, width); ++x) {
+          float3 dir = normalize(camera.Ray(x, y));
+          float t_min = kMinDepth;
+          float t_max = kMaxDepth;
+          if (!ClipRayToGrid(eye, dir, &t_min, &t_max)) {
+            continue;
+          }
+          float previous_sdf = 0.0f;
+          for (float t = t_min; t < t_max; t += kStep) {
+            float3 world = eye + t * dir;
+            // Voxel centers are at half-integer grid coordinates.
+            float3 voxel_coords =
+              (world + make_float3(kHalfExtent)) / voxel_size -
+              make_float3(0.5f);
+            float2 sdf = TrilinearSample(grid, voxel_coords, max_tsdf_value,
+              probe);
+            if (sdf.y > 0 && previous_sdf > 0 && sdf.x <= 0) {
+              ++num_hits;
+              break;
+            }
+            previous_sdf = sdf.y > 0 ? sdf.x : 0.0f;
+          }
+        }
+      }
+    }
+  }
+  return num_hits;
+}
+
+// Touches the voxels read by MarchingCubes(), in the same order.
+template <typename Layout, typename Probe>
+void ExtractionAccessPattern(HostTSDFGridView<Layout> grid, Probe& probe) {
+  for (int z = 0; z < grid.depth() - 2; ++z) {
+    for (int y = 0; y < grid.height() - 2; ++y) {
+      for (int x = 0; x < grid.width() - 2; ++x) {
+        for (int c = 0; c < 8; ++c) {
+          int3 p = make_int3(x + (c & 1), y + ((c >> 1) & 1),
+            z + ((c >> 2) & 1));
+          probe(grid.Address(p));
+          probe(grid.Address(make_int3(p.x + 1, p.y, p.z)));
+          probe(grid.Address(make_int3(p.x, p.y + 1, p.z)));
+          probe(grid.Address(make_int3(p.x, p.y, p.z + 1)));
+        }
+      }
+    }
+  }
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+void PrintCacheStats(const char* layout, const char* stage,
+  const CountingProbe& probe) {
+  double accesses = static_cast<double>(std::max<int64_t>(probe.accesses_, 1));
+  printf("%-8s %-10s accesses: %12lld, L1 misses/1000: %7.2f, "
+    "L2 misses/1000: %7.2f\n", layout, stage,
+    static_cast<long long>(probe.accesses_),
+    1000.0 * probe.l1_misses_ / accesses,
+    1000.0 * probe.l2_misses_ / accesses);
+}
+
+template <typename Layout>
+void RunBenchmark(const std::vector<SyntheticCamera>& cameras,
+  const std::vector<Array2D<float>>& depth_maps) {
+  const char* name = Layout::Name();
+  Vector3i resolution{ FLAGS_resolution };
+  int3 grid_size = make_int3(resolution.x, resolution.y, resolution.z);
+  float voxel_size = 2.0f * kHalfExtent / FLAGS_resolution;
+  float max_tsdf_value = 4.0f * voxel_size;
+  TSDF empty(0, 0, max_tsdf_value);
+
+  Array3D<TSDF> storage(Layout::StorageSize(resolution), empty);
+  HostTSDFGridWriteView<Layout> grid(storage.writeView(), grid_size);
+  HostTSDFGridView<Layout> read_grid(storage.readView(), grid_size);
+
+  NullProbe null_probe;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    Fuse(grid, voxel_size, max_tsdf_value, cameras[i],
+      depth_maps[i].readView(), null_probe);
+  }
+  printf("%-8s %-10s %10.2f ms / frame\n", name, "fuse",
+    MillisecondsSince(start) / cameras.size());
+
+  int num_hits = 0;
+  start = std::chrono::steady_clock::now();
+  for (const SyntheticCamera& camera : cameras) {
+    num_hits += Raycast(read_grid, voxel_size, max_tsdf_value, camera,
+      FLAGS_image_width, FLAGS_image_height, null_probe);
+  }
+  printf("%-8s %-10s %10.2f ms / frame (%d hits)\n", name, "raycast",
+    MillisecondsSince(start) / cameras.size(), num_hits);
+
+  std::vector<Vector3f> positions;
+  std::vector<Vector3f> normals;
+  start = std::chrono::steady_clock::now();
+  MarchingCubes(read_grid, max_tsdf_value,
+    SimilarityTransform(voxel_size), positions, normals, false);
+  printf("%-8s %-10s %10.2f ms (%zu vertices)\n", name, "extract",
+    MillisecondsSince(start), positions.size());
+
+  if (!FLAGS_simulate_cache) {
+    return;
+  }
+
+  // Start over with a clean grid, so that the fusion stage sees the same
+  // accesses.
+  Array3D<TSDF> probe_storage(Layout::StorageSize(resolution), empty);
+  HostTSDFGridWriteView<Layout> probe_grid(probe_storage.writeView(),
+    grid_size);
+  HostTSDFGridView<Layout> probe_read_grid(probe_storage.readView(),
+    grid_size);
+
+  CountingProbe fuse_probe;
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    Fuse(probe_grid, voxel_size, max_tsdf_value, cameras[i],
+      depth_maps[i].readView(), fuse_probe);
+  }
+  PrintCacheStats(name, "fuse", fuse_probe);
+
+  CountingProbe raycast_probe;
+  for (const SyntheticCamera& camera : cameras) {
+    Raycast(probe_read_grid, voxel_size, max_tsdf_value, camera,
+      FLAGS_image_width, FLAGS_image_height, raycast_probe);
+  }
+  PrintCacheStats(name, "raycast", raycast_probe);
+
+  CountingProbe extract_probe;
+  ExtractionAccessPattern(probe_read_grid, extract_probe);
+  PrintCacheStats(name, "extract", extract_probe);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  Vector3i resolution{ FLAGS_resolution };
+  if (!BrickVoxelLayout::IsValidResolution(resolution)) {
+    fprintf(stderr, "resolution must be a positive multiple of %d.\n",
+      BrickVoxelLayout::kBrickSize);
+    return 1;
+  }
+  if (FLAGS_num_frames < 1 ||
+    FLAGS_image_width < 1 || FLAGS_image_height < 1) {
+    fprintf(stderr, "num_frames, image_width and image_height must be "
+      "positive.\n");
+    return 1;
+  }
+
+  SyntheticScene scene;
+  MakeSyntheticScene("sphere", &scene);
+  std::vector<SyntheticCamera> cameras;
+  std::vector<Array2D<float>> depth_maps;
+  for (int i = 0; i < FLAGS_num_frames; ++i) {
+    // Cameras on a circle around the sphere, looking at its center.
+    float theta = 2.0f * static_cast<float>(M_PI) * i / FLAGS_num_frames;
+    cameras.push_back(MakeSyntheticCamera(scene.Orbit(theta),
+      FLAGS_image_width, FLAGS_image_height));
+    depth_maps.push_back(RenderDepth(scene, cameras.back(),
+      FLAGS_image_width, FLAGS_image_height,
+      Range1f::fromMinMax(kMinDepth, kMaxDepth), 0.0f, nullptr));
+  }
+
+  printf("%d^3 voxels of %zu bytes, %d frames of %d x %d\n",
+    FLAGS_resolution, sizeof(TSDF), FLAGS_num_frames,
+    FLAGS_image_width, FLAGS_image_height);
+  RunBenchmark<LinearVoxelLayout>(cameras, depth_maps);
+  RunBenchmark<BrickVoxelLayout>(cameras, depth_maps);
+
+  return 0;
+}